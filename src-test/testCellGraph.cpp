@@ -0,0 +1,305 @@
+// Tests for the creation of cell graphs from similar pairs
+// and for their persistence.
+
+#include "testUtilities.hpp"
+#include "CellGraph.hpp"
+#include "CellSets.hpp"
+#include "orderPairs.hpp"
+#include "SimilarPairs.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+#include "algorithm.hpp"
+#include "array.hpp"
+#include "map.hpp"
+#include "memory.hpp"
+#include "utility.hpp"
+
+
+
+namespace {
+    const string directoryName = "testCellGraph-data";
+    const string geneSetName = "AllGenes";
+    const CellId cellCount = 2000;
+    const size_t k = 20;
+    const double similarityThreshold = 0.3;
+    const size_t maxConnectivity = 10;
+
+    // The edges of a cell graph, keyed by the global CellIds
+    // of their vertices, with the lower CellId first.
+    typedef map< pair<CellId, CellId>, float> Edges;
+
+    void addEdge(Edges& edges, CellId cellId0, CellId cellId1, float similarity)
+    {
+        CZI_ASSERT(cellId0 != cellId1);
+        edges.insert(make_pair(make_pair(min(cellId0, cellId1), max(cellId0, cellId1)), similarity));
+    }
+
+    Edges getEdges(const CellGraph& graph)
+    {
+        Edges graphEdges;
+        for(CellId v0=0; v0<graph.vertexCount(); v0++) {
+            const CellId* neighbor = graph.neighborsBegin(v0);
+            const float* similarity = graph.similaritiesBegin(v0);
+            for(; neighbor!=graph.neighborsEnd(v0); ++neighbor, ++similarity) {
+                const CellId v1 = *neighbor;
+                if(v1 < v0) {
+                    continue;
+                }
+                const CellId cellId0 = graph.getCellId(v0);
+                const CellId cellId1 = graph.getCellId(v1);
+                CZI_ASSERT(graphEdges.find(make_pair(min(cellId0, cellId1), max(cellId0, cellId1))) == graphEdges.end());
+                addEdge(graphEdges, cellId0, cellId1, *similarity);
+            }
+        }
+        return graphEdges;
+    }
+
+    // The edges created by the CellGraph constructor before it used CompactCellGraph:
+    // cells are processed in order of increasing CellId, and each one
+    // adds an edge for each of its best up to maxConnectivity pairs
+    // with similarity at least similarityThreshold and with the other cell
+    // in the cell set, unless the edge already exists.
+    Edges createReferenceEdges(const CellSet& cellSet, const string& similarPairsName)
+    {
+        const SimilarPairs similarPairs(directoryName, similarPairsName, true);
+        Edges edges;
+        for(const CellId cellId0: cellSet) {
+            const CellId localCellId0 = similarPairs.getLocalCellId(cellId0);
+            if(localCellId0 == invalidCellId) {
+                continue;
+            }
+            size_t n = 0;
+            for(const SimilarPairs::Pair& p: similarPairs[localCellId0]) {
+                if(p.second < similarityThreshold) {
+                    break;
+                }
+                const CellId cellId1 = similarPairs.getGlobalCellId(p.first);
+                if(!std::binary_search(cellSet.begin(), cellSet.end(), cellId1)) {
+                    continue;
+                }
+                addEdge(edges, cellId0, cellId1, p.second);
+                if(++n == maxConnectivity) {
+                    break;
+                }
+            }
+        }
+        return edges;
+    }
+
+    // The edges kept by keepBestEdgesOnly: an edge is kept if it is one
+    // of the best k edges of either of its vertices, ordered by decreasing
+    // similarity and then by increasing CellId of the other vertex.
+    Edges keepBestEdgesOnly(const Edges& edges, size_t bestCount)
+    {
+        map<CellId, vector< pair<CellId, float> > > vertexEdges;
+        for(const auto& p: edges) {
+            vertexEdges[p.first.first].push_back(make_pair(p.first.second, p.second));
+            vertexEdges[p.first.second].push_back(make_pair(p.first.first, p.second));
+        }
+        Edges keptEdges;
+        for(auto& p: vertexEdges) {
+            vector< pair<CellId, float> >& v = p.second;
+            std::sort(v.begin(), v.end(), OrderPairsBySecondGreaterThenByFirstLess< pair<CellId, float> >());
+            for(size_t i=0; i<min(v.size(), bestCount); i++) {
+                addEdge(keptEdges, p.first, v[i].first, v[i].second);
+            }
+        }
+        return keptEdges;
+    }
+
+
+
+    // The graph must have the same edges and edge similarities
+    // as the old construction, regardless of the number of threads,
+    // and keepBestEdgesOnly must keep the same edges as a simple reference.
+    void testCellGraph(const string& cellSetName)
+    {
+        CellSet cellSet;
+        cellSet.accessExisting(directoryName + "/CellSet-" + cellSetName, false);
+        const Edges referenceEdges = createReferenceEdges(cellSet, "Pairs");
+        CZI_ASSERT(!referenceEdges.empty());
+        const Edges referenceBestEdges = keepBestEdgesOnly(referenceEdges, 3);
+        CZI_ASSERT(referenceBestEdges.size() < referenceEdges.size());
+
+        for(const size_t threadCount: {1, 4}) {
+            CellGraph graph(cellSet, directoryName, "Pairs", similarityThreshold, maxConnectivity, threadCount);
+            CZI_ASSERT(graph.vertexCount() == cellSet.size());
+            CZI_ASSERT(getEdges(graph) == referenceEdges);
+            graph.keepBestEdgesOnly(3, threadCount);
+            CZI_ASSERT(graph.vertexCount() == cellSet.size());
+            CZI_ASSERT(getEdges(graph) == referenceBestEdges);
+        }
+    }
+
+
+
+    // Ties between clusters with the same weight must be broken
+    // in favor of the lowest cluster id, regardless of the order
+    // in which the weights are added or updated.
+    void testClusterTable()
+    {
+        ClusterTable table0;
+        table0.addWeight(7, 1.);
+        table0.addWeight(3, 1.);
+        CZI_ASSERT(table0.bestCluster() == 3);
+        table0.addWeight(3, -0.5);
+        CZI_ASSERT(table0.bestCluster() == 7);
+        table0.addWeight(7, -0.5);
+        CZI_ASSERT(table0.bestCluster() == 3);
+
+        ClusterTable table1;
+        table1.addWeight(3, 1.);
+        table1.addWeight(7, 1.);
+        CZI_ASSERT(table1.bestCluster() == 3);
+
+        ClusterTable table2;
+        table2.addWeightQuick(9, 0.5);
+        table2.addWeightQuick(4, 0.5);
+        table2.addWeightQuick(6, 0.25);
+        table2.findBestCluster();
+        CZI_ASSERT(table2.bestCluster() == 4);
+        table2.addWeight(6, 0.25);
+        CZI_ASSERT(table2.bestCluster() == 4);
+    }
+
+
+
+    // The cluster id and position of each vertex of a cell graph, keyed by CellId.
+    typedef map<CellId, pair<uint32_t, array<double, 2> > > VertexProperties;
+    VertexProperties getVertexProperties(const CellGraph& graph)
+    {
+        VertexProperties vertexProperties;
+        for(CellId v=0; v<graph.vertexCount(); v++) {
+            const CellId cellId = graph.getCellId(v);
+            CZI_ASSERT(vertexProperties.find(cellId) == vertexProperties.end());
+            vertexProperties[cellId] = make_pair(graph.clusterId(v), graph.position(v));
+        }
+        return vertexProperties;
+    }
+
+    // A cell graph, as seen from outside the ExpressionMatrix.
+    class StoredGraph {
+    public:
+        string cellSetName;
+        string similarPairsName;
+        double similarityThreshold;
+        size_t maxConnectivity;
+        size_t isolatedRemovedVertexCount;
+        size_t vertexCount;
+        size_t edgeCount;
+        bool layoutWasComputed;
+        Edges edges;
+        VertexProperties vertexProperties;
+
+        StoredGraph(const ExpressionMatrix& expressionMatrix, const string& graphName)
+        {
+            const auto it = expressionMatrix.cellGraphs.find(graphName);
+            CZI_ASSERT(it != expressionMatrix.cellGraphs.end());
+            const CellGraphInformation& graphInformation = it->second.first;
+            const CellGraph& graph = *(it->second.second);
+            cellSetName = graphInformation.cellSetName;
+            similarPairsName = graphInformation.similarPairsName;
+            similarityThreshold = graphInformation.similarityThreshold;
+            maxConnectivity = graphInformation.maxConnectivity;
+            isolatedRemovedVertexCount = graphInformation.isolatedRemovedVertexCount;
+            vertexCount = graphInformation.vertexCount;
+            edgeCount = graphInformation.edgeCount;
+            layoutWasComputed = graph.layoutWasComputed;
+            edges = getEdges(graph);
+            vertexProperties = getVertexProperties(graph);
+            CZI_ASSERT(vertexProperties.size() == vertexCount);
+            CZI_ASSERT(edges.size() == edgeCount);
+        }
+
+        bool operator==(const StoredGraph& that) const
+        {
+            return
+                cellSetName == that.cellSetName &&
+                similarPairsName == that.similarPairsName &&
+                similarityThreshold == that.similarityThreshold &&
+                maxConnectivity == that.maxConnectivity &&
+                isolatedRemovedVertexCount == that.isolatedRemovedVertexCount &&
+                vertexCount == that.vertexCount &&
+                edgeCount == that.edgeCount &&
+                layoutWasComputed == that.layoutWasComputed &&
+                edges == that.edges &&
+                vertexProperties == that.vertexProperties;
+        }
+    };
+
+
+
+    // Create a cell graph and store it, then do clustering
+    // and set the positions of the vertices. The stored graph
+    // is used from then on, so the clusters and positions are also stored.
+    // The layout is not computed, because that requires Graphviz,
+    // so the vertices are given arbitrary positions.
+    // Return the graph as seen after these changes.
+    StoredGraph createAndStoreCellGraph(ExpressionMatrix& expressionMatrix)
+    {
+        expressionMatrix.createCellGraph("Graph", "Subset", "Pairs", similarityThreshold, maxConnectivity, false, 1);
+
+        // The graph does not depend on the number of threads used to create it.
+        expressionMatrix.createCellGraph("Graph4", "Subset", "Pairs", similarityThreshold, maxConnectivity, false, 4);
+        CZI_ASSERT(getEdges(*(expressionMatrix.cellGraphs["Graph"].second)) ==
+            getEdges(*(expressionMatrix.cellGraphs["Graph4"].second)));
+
+        expressionMatrix.cellGraphs["Graph"].second->layoutWasComputed = true;
+
+        // Store it twice, to check that the stored copy is replaced.
+        expressionMatrix.storeCellGraph("Graph");
+        expressionMatrix.storeCellGraph("Graph");
+        const VertexProperties storedVertexProperties =
+            getVertexProperties(*(expressionMatrix.cellGraphs["Graph"].second));
+
+        expressionMatrix.createClusterGraph("Graph", "Clusters", 5, 100, 231, 10, 10, 0.5, 0.9);
+        CellGraph& graph = *(expressionMatrix.cellGraphs["Graph"].second);
+        CZI_ASSERT(graph.getName() == directoryName + "/CellGraph-Graph");
+        for(CellId v=0; v<graph.vertexCount(); v++) {
+            const CellId cellId = graph.getCellId(v);
+            graph.position(v) = {double(cellId), -0.5 * double(cellId)};
+        }
+        CZI_ASSERT(getVertexProperties(graph) != storedVertexProperties);
+        return StoredGraph(expressionMatrix, "Graph");
+    }
+}
+
+
+
+int main()
+{
+    return runTest("testCellGraph", []()
+    {
+        removeDirectory(directoryName);
+        shared_ptr<StoredGraph> storedGraph;
+        {
+            ExpressionMatrix expressionMatrix(directoryName);
+            addRandomCells(expressionMatrix, cellCount, 300, 20, 29);
+            expressionMatrix.findSimilarPairs0(geneSetName, "AllCells", "Pairs", k, similarityThreshold);
+
+            // A cell set that does not contain all the cells of the SimilarPairs object,
+            // so some of the pairs are skipped.
+            vector<CellId> cellIds;
+            for(CellId cellId=0; cellId<cellCount; cellId++) {
+                if(cellId % 3) {
+                    cellIds.push_back(cellId);
+                }
+            }
+            expressionMatrix.createCellSet("Subset", cellIds);
+
+            testClusterTable();
+            testCellGraph("AllCells");
+            testCellGraph("Subset");
+            storedGraph = make_shared<StoredGraph>(createAndStoreCellGraph(expressionMatrix));
+        }
+
+        // The stored graph is accessed again when the directory is reopened.
+        {
+            const ExpressionMatrix expressionMatrix(directoryName);
+            CZI_ASSERT(StoredGraph(expressionMatrix, "Graph") == *storedGraph);
+        }
+        removeDirectory(directoryName);
+    });
+}
@@ -0,0 +1,108 @@
+// Tests for the radix sort of permuted signatures
+// in Charikar::PermutationData::sortSignatures.
+
+#include "testUtilities.hpp"
+#include "charikar.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+#include "algorithm.hpp"
+
+
+
+namespace {
+
+    // Create random signatures. Each word of each signature is masked
+    // with the corresponding entry of wordMasks, so words with few bits
+    // create many identical signatures, and radix sort passes
+    // on digits that are zero for all cells are skipped.
+    Charikar::PermutationData createPermutationData(
+        CellId cellCount,
+        const vector<uint64_t>& wordMasks,
+        uint32_t seed)
+    {
+        std::mt19937_64 random(seed);
+        const size_t wordCount = wordMasks.size();
+        Charikar::PermutationData permutationData(cellCount, wordCount);
+        for(CellId cellId=0; cellId<cellCount; cellId++) {
+            for(size_t i=0; i<wordCount; i++) {
+                permutationData.signatures.data[cellId*wordCount + i] = random() & wordMasks[i];
+            }
+        }
+        return permutationData;
+    }
+
+
+
+    // The sorted signatures, cell ids, and cell positions must be
+    // the same as for std::sort of pairs (signature, CellId).
+    void checkSort(
+        CellId cellCount,
+        const vector<uint64_t>& wordMasks,
+        Charikar::SortData& sortData,
+        size_t threadCount)
+    {
+        Charikar::PermutationData permutationData = createPermutationData(cellCount, wordMasks, cellCount);
+        const size_t wordCount = wordMasks.size();
+
+        // Sort with std::sort, ordering by signature, then by CellId.
+        BitSets signatures = permutationData.signatures;
+        vector< pair<BitSetPointer, CellId> > referencePairs;
+        for(CellId cellId=0; cellId<cellCount; cellId++) {
+            referencePairs.push_back(make_pair(signatures[cellId], cellId));
+        }
+        std::sort(referencePairs.begin(), referencePairs.end(),
+            [](const pair<BitSetPointer, CellId>& x, const pair<BitSetPointer, CellId>& y)
+            {
+                if(x.first < y.first) {
+                    return true;
+                }
+                if(y.first < x.first) {
+                    return false;
+                }
+                return x.second < y.second;
+            });
+
+        permutationData.sortSignatures(sortData, threadCount);
+        CZI_ASSERT(permutationData.cellIds.size() == cellCount);
+        CZI_ASSERT(permutationData.signatures.bitSetCount == cellCount);
+        CZI_ASSERT(permutationData.signatures.data.size() == cellCount * wordCount);
+        for(CellId i=0; i<cellCount; i++) {
+            const pair<BitSetPointer, CellId>& p = referencePairs[i];
+            CZI_ASSERT(permutationData.cellIds[i] == p.second);
+            const BitSetPointer signature = permutationData.signatures[i];
+            CZI_ASSERT(std::equal(signature.begin, signature.end, p.first.begin));
+            CZI_ASSERT(permutationData.cellPositions[p.second] == i);
+        }
+    }
+
+
+
+    void testSortSignatures(CellId cellCount, size_t threadCount)
+    {
+        // The same SortData is reused for all the sorts.
+        Charikar::SortData sortData;
+        const uint64_t all = ~0ULL;
+        checkSort(cellCount, {all}, sortData, threadCount);
+        checkSort(cellCount, {0xf000000000000000ULL}, sortData, threadCount);
+        checkSort(cellCount, {0ULL}, sortData, threadCount);
+        checkSort(cellCount, {0x8000000000000003ULL, 0ULL, all}, sortData, threadCount);
+        checkSort(cellCount/2, {0x00f0000000000000ULL, 0x0101010101010101ULL}, sortData, threadCount);
+    }
+}
+
+
+
+int main()
+{
+    return runTest("testCharikar", []()
+    {
+        const CellId largeCellCount = CellId(Charikar::PermutationData::parallelSortMinCellCount) * 2 + 11;
+        for(const size_t threadCount: {1, 4}) {
+            testSortSignatures(1, threadCount);
+            testSortSignatures(1001, threadCount);
+            testSortSignatures(largeCellCount, threadCount);
+        }
+    });
+}
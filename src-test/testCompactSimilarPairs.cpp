@@ -0,0 +1,157 @@
+// Tests for the compact form of SimilarPairs objects.
+
+#include "testUtilities.hpp"
+#include "CompactSimilarPairs.hpp"
+#include "SimilarPairs.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+#include "algorithm.hpp"
+#include <cmath>
+
+
+
+namespace {
+    const string directoryName = "testCompactSimilarPairs-data";
+    const string geneSetName = "AllGenes";
+    const string cellSetName = "AllCells";
+    const CellId cellCount = 1000;
+    const size_t k = 20;
+
+    // The maximum quantization error of a similarity in [-1, 1]:
+    // half a quantization step, plus the rounding error of a float.
+    const double maxQuantizationError = 1. / 65535. + 1.e-7;
+
+    // Quantization and dequantization of similarities.
+    void testQuantization()
+    {
+        CZI_ASSERT(CompactSimilarPairs::dequantizeSimilarity(0) == -1.f);
+        CZI_ASSERT(CompactSimilarPairs::dequantizeSimilarity(65535) == 1.f);
+        CZI_ASSERT(CompactSimilarPairs::quantizeSimilarity(-1.) == 0);
+        CZI_ASSERT(CompactSimilarPairs::quantizeSimilarity(1.) == 65535);
+
+        // Similarities out of range are clamped.
+        CZI_ASSERT(CompactSimilarPairs::quantizeSimilarity(-1.5) == 0);
+        CZI_ASSERT(CompactSimilarPairs::quantizeSimilarity(1.5) == 65535);
+
+        const size_t n = 1000000;
+        for(size_t i=0; i<=n; i++) {
+            const double similarity = -1. + 2. * double(i) / double(n);
+            const uint16_t q = CompactSimilarPairs::quantizeSimilarity(similarity);
+            const double error = std::abs(CompactSimilarPairs::dequantizeSimilarity(q) - similarity);
+            CZI_ASSERT(error <= maxQuantizationError);
+        }
+    }
+
+
+
+    // The compact form must contain the same pairs as the original,
+    // sorted by CellId, with similarities within the quantization error,
+    // regardless of the number of threads used to create it.
+    void checkCompactSimilarPairs(const string& name)
+    {
+        const SimilarPairs similarPairs(directoryName, name, true);
+        const CompactSimilarPairs compactSimilarPairs(directoryName, name);
+        CZI_ASSERT(compactSimilarPairs.cellCount() == similarPairs.cellCount());
+        CZI_ASSERT(compactSimilarPairs.k() == similarPairs.k());
+        CZI_ASSERT(compactSimilarPairs.getGeneSetName() == similarPairs.getGeneSetName());
+        CZI_ASSERT(compactSimilarPairs.getCellSetName() == similarPairs.getCellSetName());
+        size_t totalSize = 0;
+        for(CellId cellId=0; cellId<similarPairs.cellCount(); cellId++) {
+            vector<SimilarPairs::Pair> expectedPairs(similarPairs.begin(cellId), similarPairs.end(cellId));
+            std::sort(expectedPairs.begin(), expectedPairs.end());
+            CZI_ASSERT(compactSimilarPairs.size(cellId) == expectedPairs.size());
+            const CompactSimilarPairs::Pairs pairs = compactSimilarPairs[cellId];
+            CZI_ASSERT(pairs.size() == expectedPairs.size());
+            size_t i = 0;
+            for(const CompactSimilarPairs::Pair p: pairs) {
+                CZI_ASSERT(i < expectedPairs.size());
+                CZI_ASSERT(p.first == expectedPairs[i].first);
+                CZI_ASSERT(std::abs(p.second - expectedPairs[i].second) <= maxQuantizationError);
+                ++i;
+            }
+            CZI_ASSERT(i == expectedPairs.size());
+            totalSize += i;
+        }
+        CZI_ASSERT(compactSimilarPairs.totalSize() == totalSize);
+    }
+
+
+
+    // Round trip from SimilarPairs to the compact form.
+    // A negative threshold also stores pairs with negative similarity.
+    void testRoundTrip(ExpressionMatrix& expressionMatrix)
+    {
+        expressionMatrix.findSimilarPairs0(geneSetName, cellSetName, "Pairs-1", k, -1.);
+        expressionMatrix.findSimilarPairs0(geneSetName, cellSetName, "Pairs-4", k, -1.);
+        expressionMatrix.compactSimilarPairs("Pairs-1", false, 1);
+        expressionMatrix.compactSimilarPairs("Pairs-4", false, 4);
+        checkCompactSimilarPairs("Pairs-1");
+        checkCompactSimilarPairs("Pairs-4");
+    }
+
+
+
+    // Creating a SimilarPairs object removes the compact form
+    // of a previous SimilarPairs object with the same name.
+    void testStaleCompactForm(ExpressionMatrix& expressionMatrix)
+    {
+        CZI_ASSERT(CompactSimilarPairs::exists(directoryName, "Pairs-1"));
+        expressionMatrix.findSimilarPairs0(geneSetName, cellSetName, "Pairs-1", k/2, 0.5);
+        CZI_ASSERT(!CompactSimilarPairs::exists(directoryName, "Pairs-1"));
+        expressionMatrix.compactSimilarPairs("Pairs-1");
+        checkCompactSimilarPairs("Pairs-1");
+    }
+
+
+
+    // When only the compact form remains, the cell graph, the cluster graph,
+    // and the gene set of the SimilarPairs object are still available,
+    // and functions that need the original form report an error.
+    void testCompactFormOnly(ExpressionMatrix& expressionMatrix)
+    {
+        expressionMatrix.findSimilarPairs0(geneSetName, cellSetName, "Pairs", k, 0.);
+        expressionMatrix.compactSimilarPairs("Pairs", true);
+        CZI_ASSERT(!filesystem::exists(directoryName + "/SimilarPairs-Pairs-Info"));
+        CZI_ASSERT(&expressionMatrix.getSimilarPairsGeneSet("Pairs") ==
+            &expressionMatrix.getGeneSet(geneSetName));
+        const vector<string> geneSetNames = expressionMatrix.geneSetNamesFromSimilarPairsName("Pairs");
+        CZI_ASSERT(std::count(geneSetNames.begin(), geneSetNames.end(), geneSetName) == 1);
+
+        expressionMatrix.createCellGraph("Graph", cellSetName, "Pairs", 0.2, k, false);
+        expressionMatrix.createClusterGraph("Graph", "Clusters", 5, 100, 231, 10, 10, 0.5, 0.9);
+        CZI_ASSERT(!expressionMatrix.getClusterGraphVertices("Clusters").empty());
+
+        // Functions that need the original form must fail with an exception.
+        bool compactFormWasRejected = false;
+        try {
+            expressionMatrix.writeSimilarPairs("Pairs");
+        } catch(const runtime_error&) {
+            compactFormWasRejected = true;
+        }
+        CZI_ASSERT(compactFormWasRejected);
+
+        expressionMatrix.removeSimilarPairs("Pairs");
+        CZI_ASSERT(!CompactSimilarPairs::exists(directoryName, "Pairs"));
+    }
+}
+
+
+
+int main()
+{
+    return runTest("testCompactSimilarPairs", []()
+    {
+        testQuantization();
+        removeDirectory(directoryName);
+        {
+            ExpressionMatrix expressionMatrix(directoryName);
+            addRandomCells(expressionMatrix, cellCount, 300, 10, 23);
+            testRoundTrip(expressionMatrix);
+            testStaleCompactForm(expressionMatrix);
+            testCompactFormOnly(expressionMatrix);
+        }
+        removeDirectory(directoryName);
+    });
+}
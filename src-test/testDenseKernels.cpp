@@ -0,0 +1,66 @@
+// Tests for the dense scalar product kernels.
+
+#include "testUtilities.hpp"
+#include "denseKernels.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+#include <cmath>
+
+
+
+// All kernels must return identical results, for all tile shapes
+// including the partial tiles at the edges, and the results
+// must agree with a scalar computation up to rounding.
+int main()
+{
+    return runTest("testDenseKernels", []()
+    {
+        const size_t vectorCount = 11;
+        const size_t length = 1003;
+        std::mt19937 random(29);
+        std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+        vector< vector<float> > v(vectorCount, vector<float>(length));
+        vector<const float*> x(vectorCount);
+        for(size_t i=0; i<vectorCount; i++) {
+            for(float& f: v[i]) {
+                f = distribution(random);
+            }
+            x[i] = v[i].data();
+        }
+
+        string instructionSetName;
+        DenseKernels::getAccumulateScalarProductsKernel(instructionSetName);
+        cout << "Best instruction set for the dense kernels is " << instructionSetName << endl;
+        const bool avx2IsSupported = (instructionSetName == "AVX2");
+
+        // Try all combinations of numbers of vectors, and two ranges of positions.
+        for(size_t n0=1; n0<=vectorCount; n0++) {
+            for(size_t n1=1; n1<=vectorCount; n1++) {
+                vector<float> rSse(n0*n1, 0.f);
+                vector<float> rAvx2(n0*n1, 0.f);
+                for(const auto& range: {make_pair(size_t(0), size_t(517)), make_pair(size_t(517), length)}) {
+                    DenseKernels::accumulateScalarProductsSse(
+                        x.data(), n0, x.data(), n1, range.first, range.second, rSse.data(), n1);
+                    if(avx2IsSupported) {
+                        DenseKernels::accumulateScalarProductsAvx2(
+                            x.data(), n0, x.data(), n1, range.first, range.second, rAvx2.data(), n1);
+                    }
+                }
+                if(avx2IsSupported) {
+                    CZI_ASSERT(rSse == rAvx2);
+                }
+                for(size_t i=0; i<n0; i++) {
+                    for(size_t j=0; j<n1; j++) {
+                        double expected = 0.;
+                        for(size_t k=0; k<length; k++) {
+                            expected += double(v[i][k]) * double(v[j][k]);
+                        }
+                        CZI_ASSERT(std::abs(double(rSse[i*n1 + j]) - expected) < 1.e-3);
+                    }
+                }
+            }
+        }
+    });
+}
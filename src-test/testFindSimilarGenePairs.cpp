@@ -0,0 +1,100 @@
+// Tests for the functions that find similar gene pairs.
+
+#include "testUtilities.hpp"
+#include "SimilarGenePairs.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+
+
+namespace {
+    const string directoryName = "testFindSimilarGenePairs-data";
+    const string geneSetName = "AllGenes";
+    const string cellSetName = "AllCells";
+    const size_t k = 20;
+    const size_t lshCount = 256;
+    const uint32_t seed = 231;
+
+    // Return the fraction of the pairs in a reference SimilarGenePairs object
+    // that are also present in another SimilarGenePairs object.
+    // The similarities stored by findSimilarGenePairs2 are exact,
+    // so pairs present in both objects must have the same similarity.
+    double computeRecall(const string& referenceName, const string& name)
+    {
+        const SimilarGenePairs referenceSimilarGenePairs(directoryName, referenceName, true);
+        const SimilarGenePairs similarGenePairs(directoryName, name, true);
+        CZI_ASSERT(referenceSimilarGenePairs.geneCount() == similarGenePairs.geneCount());
+        size_t referencePairCount = 0;
+        size_t foundPairCount = 0;
+        for(GeneId geneId=0; geneId<referenceSimilarGenePairs.geneCount(); geneId++) {
+            for(const SimilarGenePairs::Pair& p: referenceSimilarGenePairs[geneId]) {
+                ++referencePairCount;
+                for(const SimilarGenePairs::Pair& q: similarGenePairs[geneId]) {
+                    if(q.first == p.first) {
+                        CZI_ASSERT(q.second == p.second);
+                        ++foundPairCount;
+                    }
+                }
+            }
+        }
+        CZI_ASSERT(referencePairCount > 0);
+        return double(foundPairCount) / double(referencePairCount);
+    }
+
+    // Check that no temporary files were left behind.
+    void checkNoTemporaryFiles()
+    {
+        for(const string& fileName: filesystem::directoryContents(directoryName)) {
+            CZI_ASSERT(fileName.find("/tmp-") == string::npos);
+        }
+    }
+}
+
+
+
+// Recall of findSimilarGenePairs2 against the exact pairs of findSimilarGenePairs1,
+// with the slice length chosen automatically from the similarity threshold
+// and with the longer slice length used previously (ceil(log2(geneCount))).
+// An invalid slice length must be rejected before creating any files.
+int main()
+{
+    return runTest("testFindSimilarGenePairs", []()
+    {
+        removeDirectory(directoryName);
+        {
+            ExpressionMatrix expressionMatrix(directoryName);
+            addRandomCells(expressionMatrix, 3000, 500, 30, 17);
+            for(const double similarityThreshold: {0.2, 0.3}) {
+                const string suffix = "-" + std::to_string(similarityThreshold);
+                expressionMatrix.findSimilarGenePairs1(geneSetName, cellSetName,
+                    NormalizationMethod::L2, "Exact" + suffix, k, similarityThreshold);
+                expressionMatrix.findSimilarGenePairs2(geneSetName, cellSetName,
+                    NormalizationMethod::L2, "Lsh" + suffix, k, similarityThreshold, lshCount, 0, seed);
+                expressionMatrix.findSimilarGenePairs2(geneSetName, cellSetName,
+                    NormalizationMethod::L2, "Lsh9" + suffix, k, similarityThreshold, lshCount, 9, seed);
+                const double recall = computeRecall("Exact" + suffix, "Lsh" + suffix);
+                const double recall9 = computeRecall("Exact" + suffix, "Lsh9" + suffix);
+                const size_t lshSliceLength =
+                    ExpressionMatrix::computeGeneLshSliceLength(similarityThreshold, lshCount, 0.9);
+                cout << "Similarity threshold " << similarityThreshold <<
+                    ": recall " << recall << " with slice length " << lshSliceLength <<
+                    ", " << recall9 << " with slice length 9." << endl;
+                CZI_ASSERT(recall > 0.9);
+                CZI_ASSERT(recall >= recall9);
+            }
+            checkNoTemporaryFiles();
+
+            bool invalidSliceLengthWasAccepted = true;
+            try {
+                expressionMatrix.findSimilarGenePairs2(geneSetName, cellSetName,
+                    NormalizationMethod::L2, "Invalid", k, 0.2, lshCount, 65, seed);
+            } catch(const runtime_error&) {
+                invalidSliceLengthWasAccepted = false;
+            }
+            CZI_ASSERT(!invalidSliceLengthWasAccepted);
+            checkNoTemporaryFiles();
+        }
+        removeDirectory(directoryName);
+    });
+}
@@ -0,0 +1,328 @@
+// Tests for the functions that find similar cell pairs.
+
+#include "testUtilities.hpp"
+#include "ExpressionMatrixSubset.hpp"
+#include "Lsh.hpp"
+#include "orderPairs.hpp"
+#include "SimilarPairs.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+#include "algorithm.hpp"
+#include <cmath>
+#include <functional>
+
+
+
+namespace {
+    const string directoryName = "testFindSimilarPairs-data";
+    const string geneSetName = "AllGenes";
+    const string cellSetName = "AllCells";
+    const CellId cellCount = 3000;
+    const size_t k = 20;
+
+    // Check that two SimilarPairs objects contain exactly the same pairs.
+    void checkEqual(const string& name0, const string& name1)
+    {
+        const SimilarPairs similarPairs0(directoryName, name0, true);
+        const SimilarPairs similarPairs1(directoryName, name1, true);
+        CZI_ASSERT(similarPairs0.cellCount() == similarPairs1.cellCount());
+        for(CellId cellId=0; cellId<similarPairs0.cellCount(); cellId++) {
+            CZI_ASSERT(similarPairs0.size(cellId) == similarPairs1.size(cellId));
+            CZI_ASSERT(std::equal(similarPairs0.begin(cellId), similarPairs0.end(cellId),
+                similarPairs1.begin(cellId)));
+        }
+    }
+
+
+
+    // findSimilarPairs0 must store, for each cell, the best k pairs
+    // by exact similarity, regardless of the number of threads.
+    // The reference is computed by brute force, one pair at a time,
+    // for a sample of the cells. Similarities are compared with a tolerance,
+    // because the two computations accumulate rounding errors differently.
+    void testFindSimilarPairs0(ExpressionMatrix& expressionMatrix)
+    {
+        const double similarityThreshold = 0.2;
+        const double tolerance = 1.e-4;
+        expressionMatrix.findSimilarPairs0(geneSetName, cellSetName, "Exact-1", k, similarityThreshold, 1);
+        expressionMatrix.findSimilarPairs0(geneSetName, cellSetName, "Exact-4", k, similarityThreshold, 4);
+        checkEqual("Exact-1", "Exact-4");
+
+        const SimilarPairs similarPairs(directoryName, "Exact-1", true);
+        vector<double> similarities;
+        for(CellId cellId0=0; cellId0<cellCount; cellId0+=10) {
+            similarities.clear();
+            for(CellId cellId1=0; cellId1<cellCount; cellId1++) {
+                if(cellId1 == cellId0) {
+                    continue;
+                }
+                const double similarity = expressionMatrix.computeCellSimilarity(geneSetName, cellId0, cellId1);
+                if(similarity > similarityThreshold) {
+                    similarities.push_back(similarity);
+                }
+            }
+            std::sort(similarities.begin(), similarities.end(), std::greater<double>());
+            similarities.resize(min(similarities.size(), k));
+
+            // The stored pairs are the best k, in order of decreasing similarity.
+            CZI_ASSERT(similarPairs.size(cellId0) == similarities.size());
+            for(size_t i=0; i<similarities.size(); i++) {
+                const SimilarPairs::Pair& p = similarPairs.begin(cellId0)[i];
+                CZI_ASSERT(p.first != cellId0);
+                CZI_ASSERT(std::abs(p.second - similarities[i]) < tolerance);
+                CZI_ASSERT(std::abs(p.second -
+                    expressionMatrix.computeCellSimilarity(geneSetName, cellId0, p.first)) < tolerance);
+            }
+        }
+    }
+
+
+
+    // findSimilarPairs4 must store, for each cell, the best k pairs
+    // by LSH similarity with ties broken by CellId, regardless of the number of threads.
+    // The reference is computed one pair at a time using an Lsh object
+    // created with the same gene set, cell set, lshCount, and seed.
+    void testFindSimilarPairs4(ExpressionMatrix& expressionMatrix)
+    {
+        const double similarityThreshold = 0.2;
+        const size_t lshCount = 256;
+        const uint32_t seed = 231;
+        expressionMatrix.findSimilarPairs4(geneSetName, cellSetName, "Lsh-1", k,
+            similarityThreshold, lshCount, seed, 1);
+        expressionMatrix.findSimilarPairs4(geneSetName, cellSetName, "Lsh-4", k,
+            similarityThreshold, lshCount, seed, 4);
+        checkEqual("Lsh-1", "Lsh-4");
+
+        // Copy the expression counts, to create the ExpressionMatrixSubset for the reference.
+        ExpressionMatrixSubset::CellExpressionCounts cellExpressionCounts;
+        cellExpressionCounts.createNew(directoryName + "/tmp-CellExpressionCounts");
+        for(CellId cellId=0; cellId<cellCount; cellId++) {
+            const vector< pair<GeneId, float> > counts = expressionMatrix.getCellExpressionCounts(cellId);
+            cellExpressionCounts.appendVector(counts.begin(), counts.end());
+        }
+        const SimilarPairs similarPairs(directoryName, "Lsh-1", true);
+        {
+            ExpressionMatrixSubset expressionMatrixSubset(
+                directoryName + "/tmp-ExpressionMatrixSubset",
+                similarPairs.getGeneSet(), similarPairs.getCellSet(), cellExpressionCounts);
+            Lsh lsh(directoryName + "/tmp-Lsh", expressionMatrixSubset, lshCount, seed);
+
+            size_t mismatchCountEnd = 0;
+            while(mismatchCountEnd<=lshCount && lsh.getSimilarity(mismatchCountEnd) > similarityThreshold) {
+                ++mismatchCountEnd;
+            }
+
+            vector< pair<size_t, CellId> > candidates;
+            vector<SimilarPairs::Pair> expectedPairs;
+            for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+                candidates.clear();
+                for(CellId cellId1=0; cellId1<cellCount; cellId1++) {
+                    if(cellId1 == cellId0) {
+                        continue;
+                    }
+                    const size_t mismatchCount = lsh.computeMismatchCount(cellId0, cellId1);
+                    if(mismatchCount < mismatchCountEnd) {
+                        candidates.push_back(make_pair(mismatchCount, cellId1));
+                    }
+                }
+                std::sort(candidates.begin(), candidates.end());
+                candidates.resize(min(candidates.size(), k));
+                expectedPairs.clear();
+                for(const auto& p: candidates) {
+                    expectedPairs.push_back(SimilarPairs::Pair(p.second,
+                        SimilarPairs::CellSimilarity(lsh.getSimilarity(p.first))));
+                }
+                std::sort(expectedPairs.begin(), expectedPairs.end(),
+                    OrderPairsBySecondGreaterThenByFirstLess<SimilarPairs::Pair>());
+
+                CZI_ASSERT(similarPairs.size(cellId0) == expectedPairs.size());
+                CZI_ASSERT(std::equal(expectedPairs.begin(), expectedPairs.end(),
+                    similarPairs.begin(cellId0)));
+            }
+            lsh.remove();
+        }
+        cellExpressionCounts.remove();
+    }
+
+
+
+    // Check that no temporary files were left behind.
+    void checkNoTemporaryFiles()
+    {
+        for(const string& fileName: filesystem::directoryContents(directoryName)) {
+            CZI_ASSERT(fileName.find("/tmp-") == string::npos);
+        }
+    }
+
+
+
+    // A persistent LshIndex is reused for the same Lsh object,
+    // and rejected after the Lsh object is recreated with a different seed.
+    // Long slices, which are hashed to a number of buckets
+    // comparable to the number of cells, are accepted by findSimilarPairs5.
+    void testLshIndex(ExpressionMatrix& expressionMatrix)
+    {
+        const double similarityThreshold = 0.2;
+        const vector<int> lshSliceLengths = {16, 12};
+        expressionMatrix.computeLshSignatures(geneSetName, cellSetName, "Lsh", 256, 231);
+        expressionMatrix.findSimilarPairs7(geneSetName, cellSetName, "Lsh", "Lsh7-a", k,
+            similarityThreshold, lshSliceLengths, 1000, 16, 0, "Index");
+        expressionMatrix.findSimilarPairs7(geneSetName, cellSetName, "Lsh", "Lsh7-b", k,
+            similarityThreshold, lshSliceLengths, 1000, 16, 0, "Index");
+        checkEqual("Lsh7-a", "Lsh7-b");
+
+        expressionMatrix.computeLshSignatures(geneSetName, cellSetName, "Lsh", 256, 232);
+        bool staleIndexWasUsed = true;
+        try {
+            expressionMatrix.findSimilarPairs7(geneSetName, cellSetName, "Lsh", "Lsh7-c", k,
+                similarityThreshold, lshSliceLengths, 1000, 16, 0, "Index");
+        } catch(const runtime_error&) {
+            staleIndexWasUsed = false;
+        }
+        CZI_ASSERT(!staleIndexWasUsed);
+        expressionMatrix.removeLshIndex("Lsh", "Index");
+
+        expressionMatrix.findSimilarPairs5(geneSetName, cellSetName, "Lsh", "Lsh5", k,
+            similarityThreshold, 40, 0, "");
+        checkNoTemporaryFiles();
+
+        // An Lsh object created before the seed and the signature hash
+        // were stored can still be accessed, and its signature hash
+        // is computed when needed.
+        const string lshName = directoryName + "/Lsh-Lsh";
+        const uint64_t signatureHash = Lsh(lshName).signatureHash();
+        filesystem::remove(lshName + "-SignatureInfo");
+        const Lsh oldLsh(lshName);
+        CZI_ASSERT(oldLsh.seed() == Lsh::unknownSeed);
+        CZI_ASSERT(oldLsh.signatureHash() == signatureHash);
+    }
+
+
+    // Return the fraction of the pairs in a reference SimilarPairs object
+    // that are also present in another SimilarPairs object.
+    double computeRecall(const string& referenceName, const string& name)
+    {
+        const SimilarPairs referenceSimilarPairs(directoryName, referenceName, true);
+        const SimilarPairs similarPairs(directoryName, name, true);
+        size_t referencePairCount = 0;
+        size_t foundPairCount = 0;
+        for(CellId cellId=0; cellId<referenceSimilarPairs.cellCount(); cellId++) {
+            for(const SimilarPairs::Pair& p: referenceSimilarPairs[cellId]) {
+                ++referencePairCount;
+                if(similarPairs.exists(cellId, p.first)) {
+                    ++foundPairCount;
+                }
+            }
+        }
+        CZI_ASSERT(referencePairCount > 0);
+        return double(foundPairCount) / double(referencePairCount);
+    }
+
+
+
+    // Recall of findSimilarPairs7 against the exact pairs of findSimilarPairs0,
+    // without and with multi-probe LSH.
+    // With slices of 12 bits few cell pairs share a bucket,
+    // and multi-probe LSH must recover most of the missing pairs.
+    // For this data set the observed recall is about 0.17 without probing
+    // and 0.62 with 16 probes per table; the thresholds leave some margin.
+    void testLshRecall(ExpressionMatrix& expressionMatrix)
+    {
+        const double similarityThreshold = 0.2;
+        const vector<int> lshSliceLengths = {12};
+        expressionMatrix.findSimilarPairs0(geneSetName, cellSetName, "Exact", k, similarityThreshold);
+        expressionMatrix.computeLshSignatures(geneSetName, cellSetName, "LshWithMargins", 256, 231,
+            0, false, true);
+        expressionMatrix.findSimilarPairs7(geneSetName, cellSetName, "LshWithMargins", "Lsh7", k,
+            similarityThreshold, lshSliceLengths, 1000, 16);
+        expressionMatrix.findSimilarPairs7(geneSetName, cellSetName, "LshWithMargins", "Lsh7-MultiProbe", k,
+            similarityThreshold, lshSliceLengths, 1000, 16, 0, "", 16);
+        const double recall = computeRecall("Exact", "Lsh7");
+        const double multiProbeRecall = computeRecall("Exact", "Lsh7-MultiProbe");
+        cout << "findSimilarPairs7 recall " << recall <<
+            ", with multi-probe LSH " << multiProbeRecall << endl;
+        CZI_ASSERT(recall > 0.1);
+        CZI_ASSERT(multiProbeRecall > 0.5);
+        CZI_ASSERT(multiProbeRecall > recall + 0.3);
+    }
+
+
+
+    // Return true if the function throws a runtime_error.
+    template<class F> bool throwsRuntimeError(const F& f)
+    {
+        try {
+            f();
+        } catch(const runtime_error&) {
+            return true;
+        }
+        return false;
+    }
+
+
+
+    // Recall of findSimilarPairs8 against the exact pairs of findSimilarPairs0.
+    // For this data set it is about 0.64, the same as the recall of the best
+    // findSimilarPairs7 runs: with 256 LSH bits the LSH similarity itself
+    // only ranks about that fraction of the exact pairs in the top k.
+    // A persistent HNSW graph is reused for the same Lsh object and seed,
+    // and rejected for a different seed or after the Lsh object is recreated.
+    // Must run after testLshRecall, which creates the exact pairs.
+    void testHnsw(ExpressionMatrix& expressionMatrix)
+    {
+        const double similarityThreshold = 0.2;
+        expressionMatrix.findSimilarPairs8(geneSetName, cellSetName, "LshWithMargins", "Hnsw-a", k,
+            similarityThreshold, 16, 200, 100, 0, "Graph", 231);
+        expressionMatrix.findSimilarPairs8(geneSetName, cellSetName, "LshWithMargins", "Hnsw-b", k,
+            similarityThreshold, 16, 200, 100, 0, "Graph", 231);
+        checkEqual("Hnsw-a", "Hnsw-b");
+        const double recall = computeRecall("Exact", "Hnsw-a");
+        cout << "findSimilarPairs8 recall " << recall << endl;
+        CZI_ASSERT(recall > 0.5);
+
+        CZI_ASSERT(throwsRuntimeError([&]()
+        {
+            expressionMatrix.findSimilarPairs8(geneSetName, cellSetName, "LshWithMargins", "Hnsw-c", k,
+                similarityThreshold, 16, 200, 100, 0, "Graph", 232);
+        }));
+        expressionMatrix.computeLshSignatures(geneSetName, cellSetName, "LshWithMargins", 256, 232,
+            0, false, true);
+        CZI_ASSERT(throwsRuntimeError([&]()
+        {
+            expressionMatrix.findSimilarPairs8(geneSetName, cellSetName, "LshWithMargins", "Hnsw-c", k,
+                similarityThreshold, 16, 200, 100, 0, "Graph", 231);
+        }));
+        CZI_ASSERT(throwsRuntimeError([&]()
+        {
+            expressionMatrix.findSimilarCellsHnsw("LshWithMargins", "Graph", 0, k);
+        }));
+        expressionMatrix.removeHnswIndex("LshWithMargins", "Graph");
+
+        // A temporary graph is removed when done.
+        expressionMatrix.findSimilarPairs8(geneSetName, cellSetName, "LshWithMargins", "Hnsw-d", k,
+            similarityThreshold);
+        checkNoTemporaryFiles();
+    }
+}
+
+
+
+int main()
+{
+    return runTest("testFindSimilarPairs", []()
+    {
+        removeDirectory(directoryName);
+        {
+            ExpressionMatrix expressionMatrix(directoryName);
+            addRandomCells(expressionMatrix, cellCount, 500, 30, 17);
+            testFindSimilarPairs0(expressionMatrix);
+            testFindSimilarPairs4(expressionMatrix);
+            testLshIndex(expressionMatrix);
+            testLshRecall(expressionMatrix);
+            testHnsw(expressionMatrix);
+        }
+        removeDirectory(directoryName);
+    });
+}
@@ -0,0 +1,73 @@
+// Tests for the gene-major copy of the expression counts.
+
+#include "testUtilities.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+
+
+namespace {
+    const string directoryName = "testGeneExpressionCounts-data";
+    const CellId initialCellCount = 500;
+    const GeneId initialGeneCount = 100;
+
+    // Check that the gene-major copy of the expression counts,
+    // used by getCellsExpressionCount, agrees with the
+    // expression counts stored for each cell.
+    void checkGeneExpressionCounts(const ExpressionMatrix& expressionMatrix)
+    {
+        CZI_ASSERT(expressionMatrix.hasGeneExpressionCounts());
+        vector<CellId> cellIds;
+        for(CellId cellId=0; cellId<expressionMatrix.cellCount(); cellId++) {
+            cellIds.push_back(cellId);
+        }
+        for(GeneId geneId=0; geneId<expressionMatrix.geneCount(); geneId++) {
+            const vector<float> counts = expressionMatrix.getCellsExpressionCount(cellIds, geneId);
+            CZI_ASSERT(counts.size() == cellIds.size());
+            for(const CellId cellId: cellIds) {
+                CZI_ASSERT(counts[cellId] == expressionMatrix.getCellExpressionCount(cellId, geneId));
+            }
+        }
+    }
+}
+
+
+
+// Genes and cells added after the gene-major copy is created
+// must be stored in it, and the ExpressionMatrix must
+// still be accessible when the directory is reopened.
+int main()
+{
+    return runTest("testGeneExpressionCounts", []()
+    {
+        removeDirectory(directoryName);
+        {
+            ExpressionMatrix expressionMatrix(directoryName);
+            addRandomCells(expressionMatrix, initialCellCount, initialGeneCount, 10, 5);
+            expressionMatrix.createGeneExpressionCounts(4);
+            checkGeneExpressionCounts(expressionMatrix);
+
+            // A cell that expresses a new gene and an existing gene,
+            // followed by a gene without expression counts.
+            // The last gene is not followed by a call to addCell,
+            // so addGene must make space for it in the gene-major copy.
+            const vector< pair<string, string> > metaData = {{"CellName", "NewCell"}};
+            const vector< pair<string, float> > expressionCounts =
+                {{"Gene0", 3.f}, {"NewGene0", 7.f}};
+            expressionMatrix.addCell(metaData, expressionCounts);
+            CZI_ASSERT(!expressionMatrix.addGene("NewGene0"));
+            CZI_ASSERT(expressionMatrix.addGene("NewGene1"));
+            checkGeneExpressionCounts(expressionMatrix);
+        }
+        {
+            ExpressionMatrix expressionMatrix(directoryName);
+            CZI_ASSERT(expressionMatrix.cellCount() == initialCellCount + 1);
+            checkGeneExpressionCounts(expressionMatrix);
+            const GeneId geneId = expressionMatrix.geneIdFromString("NewGene0");
+            CZI_ASSERT(expressionMatrix.getCellExpressionCount(initialCellCount, geneId) == 7.f);
+            CZI_ASSERT(expressionMatrix.geneIdFromString("NewGene1") == expressionMatrix.geneCount() - 1);
+        }
+        removeDirectory(directoryName);
+    });
+}
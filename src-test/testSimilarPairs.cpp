@@ -0,0 +1,253 @@
+// Tests for the storage of similar pairs in SimilarPairs.
+
+#include "testUtilities.hpp"
+#include "orderPairs.hpp"
+#include "SimilarPairs.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+#include "algorithm.hpp"
+
+
+
+namespace {
+    const string directoryName = "testSimilarPairs-data";
+    const string geneSetName = "AllGenes";
+    const string cellSetName = "AllCells";
+    const CellId cellCount = 50;
+    const size_t k = 5;
+
+    // The candidate pairs for each cell, in random order.
+    // Similarities are multiples of 1/8, so they are represented exactly
+    // as a CellSimilarity, and there are many ties.
+    // Each candidate is repeated, to exercise the check for duplicates.
+    vector< vector<SimilarPairs::Pair> > createCandidates(uint32_t seed)
+    {
+        std::mt19937 random(seed);
+        vector< vector<SimilarPairs::Pair> > candidates(cellCount);
+        for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+            for(CellId cellId1=0; cellId1<cellCount; cellId1++) {
+                if(cellId1 == cellId0 || (random() % 2)) {
+                    continue;
+                }
+                const SimilarPairs::CellSimilarity similarity = float(random() % 8) / 8.f;
+                candidates[cellId0].push_back(make_pair(cellId1, similarity));
+                candidates[cellId0].push_back(make_pair(cellId1, similarity));
+            }
+            std::shuffle(candidates[cellId0].begin(), candidates[cellId0].end(), random);
+        }
+        return candidates;
+    }
+
+    // The best k pairs for each cell: highest similarity, with ties
+    // broken in favor of the lower CellId, sorted in that order.
+    vector<SimilarPairs::Pair> bestPairs(vector<SimilarPairs::Pair> pairs)
+    {
+        std::sort(pairs.begin(), pairs.end(), OrderPairsBySecondGreaterThenByFirstLess<SimilarPairs::Pair>());
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+        pairs.resize(min(pairs.size(), k));
+        return pairs;
+    }
+
+    void checkBestPairs(
+        const SimilarPairs& similarPairs,
+        CellId cellId,
+        const vector<SimilarPairs::Pair>& candidates)
+    {
+        const vector<SimilarPairs::Pair> expectedPairs = bestPairs(candidates);
+        CZI_ASSERT(similarPairs.size(cellId) == expectedPairs.size());
+        CZI_ASSERT(std::equal(expectedPairs.begin(), expectedPairs.end(), similarPairs.begin(cellId)));
+    }
+
+
+
+    // After sort, the stored pairs must be the best k with ties broken by CellId,
+    // independently of insertion order and of the function used to add them.
+    void testAdd()
+    {
+        const vector< vector<SimilarPairs::Pair> > candidates = createCandidates(3);
+        vector< vector<SimilarPairs::Pair> > uniqueCandidates = candidates;
+        for(auto& v: uniqueCandidates) {
+            std::sort(v.begin(), v.end());
+            v.erase(std::unique(v.begin(), v.end()), v.end());
+        }
+        vector< vector<SimilarPairs::Pair> > reversedCandidates = uniqueCandidates;
+        for(auto& v: reversedCandidates) {
+            std::reverse(v.begin(), v.end());
+        }
+
+        SimilarPairs similarPairs0(directoryName, "Add", geneSetName, cellSetName, k);
+        SimilarPairs similarPairs1(directoryName, "AddNoDuplicateCheck", geneSetName, cellSetName, k);
+        SimilarPairs similarPairs2(directoryName, "AddReversed", geneSetName, cellSetName, k);
+        for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+            for(const SimilarPairs::Pair& p: candidates[cellId0]) {
+                similarPairs0.addUnsymmetric(cellId0, p.first, p.second);
+            }
+            for(const SimilarPairs::Pair& p: uniqueCandidates[cellId0]) {
+                similarPairs1.addUnsymmetricNoDuplicateCheck(cellId0, p.first, p.second);
+            }
+            for(const SimilarPairs::Pair& p: reversedCandidates[cellId0]) {
+                similarPairs2.addUnsymmetricNoDuplicateCheckUsingHeap(cellId0, p.first, p.second);
+            }
+        }
+        similarPairs0.sort();
+        similarPairs1.sort();
+        similarPairs2.sort();
+        for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+            checkBestPairs(similarPairs0, cellId0, candidates[cellId0]);
+            checkBestPairs(similarPairs1, cellId0, candidates[cellId0]);
+            checkBestPairs(similarPairs2, cellId0, candidates[cellId0]);
+        }
+    }
+
+
+
+    // Adding pairs after copy, sort, or addUnsymmetricNoCheck, which store
+    // pairs in an order other than a heap, must still keep the best k.
+    // The stored pairs must also survive closing and reopening.
+    void testAddAfterReordering()
+    {
+        const vector< vector<SimilarPairs::Pair> > candidates = createCandidates(4);
+        {
+            SimilarPairs similarPairs(directoryName, "Reordered", geneSetName, cellSetName, k);
+            for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+                const vector<SimilarPairs::Pair>& v = candidates[cellId0];
+                const size_t n = v.size();
+
+                // Store the first few candidates in a non-heap order.
+                vector<SimilarPairs::Pair> initialPairs = bestPairs(
+                    vector<SimilarPairs::Pair>(v.begin(), v.begin() + n/4));
+                std::reverse(initialPairs.begin(), initialPairs.end());
+                switch(cellId0 % 3) {
+                case 0:
+                    similarPairs.copy(cellId0, initialPairs.data(), initialPairs.data() + initialPairs.size());
+                    break;
+                case 1:
+                    for(const SimilarPairs::Pair& p: initialPairs) {
+                        similarPairs.addUnsymmetricNoCheck(cellId0, p.first, p.second);
+                    }
+                    break;
+                case 2:
+                    for(const SimilarPairs::Pair& p: initialPairs) {
+                        similarPairs.addUnsymmetric(cellId0, p.first, p.second);
+                    }
+                    break;
+                }
+
+                // Add the next quarter. The rest is added after a sort.
+                for(size_t i=n/4; i<n/2; i++) {
+                    similarPairs.addUnsymmetric(cellId0, v[i].first, v[i].second);
+                }
+            }
+            similarPairs.sort();
+            for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+                const vector<SimilarPairs::Pair>& v = candidates[cellId0];
+                for(size_t i=v.size()/2; i<v.size(); i++) {
+                    similarPairs.addUnsymmetric(cellId0, v[i].first, v[i].second);
+                }
+            }
+            similarPairs.sort();
+        }
+
+        const SimilarPairs similarPairs(directoryName, "Reordered", true);
+        CZI_ASSERT(similarPairs.k() == k);
+        CZI_ASSERT(similarPairs.cellCount() == cellCount);
+        for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+            checkBestPairs(similarPairs, cellId0, candidates[cellId0]);
+        }
+    }
+
+
+
+    // Pairs added after reopening an existing object must keep the best k,
+    // even if the stored pairs are not a heap and lowestSimilarityIndex
+    // holds 0, as it can in objects created by older code.
+    void testAddAfterAccess()
+    {
+        const vector< vector<SimilarPairs::Pair> > candidates = createCandidates(5);
+        {
+            SimilarPairs similarPairs(directoryName, "Accessed", geneSetName, cellSetName, k);
+            for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+                const vector<SimilarPairs::Pair>& v = candidates[cellId0];
+                // Best pair first, which is not a heap.
+                const vector<SimilarPairs::Pair> initialPairs = bestPairs(
+                    vector<SimilarPairs::Pair>(v.begin(), v.begin() + v.size()/2));
+                similarPairs.copy(cellId0, initialPairs.data(), initialPairs.data() + initialPairs.size());
+            }
+        }
+
+        // Overwrite lowestSimilarityIndex with 0 for all cells.
+        // This mirrors the layout of SimilarPairs::CellInfo.
+        class CellInfo {
+        public:
+            uint32_t usedCount;
+            uint32_t lowestSimilarityIndex;
+            SimilarPairs::CellSimilarity lowestSimilarity;
+        };
+        {
+            MemoryMapped::Vector<CellInfo> cellInfo;
+            cellInfo.accessExistingReadWrite(directoryName + "/SimilarPairs-Accessed-CellInfo", false);
+            CZI_ASSERT(cellInfo.size() == cellCount);
+            for(CellInfo& info: cellInfo) {
+                info.lowestSimilarityIndex = 0;
+            }
+        }
+
+        SimilarPairs similarPairs(directoryName, "Accessed", false);
+        for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+            const vector<SimilarPairs::Pair>& v = candidates[cellId0];
+            for(size_t i=v.size()/2; i<v.size(); i++) {
+                similarPairs.addUnsymmetric(cellId0, v[i].first, v[i].second);
+            }
+        }
+        similarPairs.sort();
+        for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
+            checkBestPairs(similarPairs, cellId0, candidates[cellId0]);
+        }
+        similarPairs.remove();
+    }
+
+
+
+    // The symmetric add stores the pair for both cells, if it is good enough for each.
+    void testSymmetricAdd()
+    {
+        SimilarPairs similarPairs(directoryName, "Symmetric", geneSetName, cellSetName, 2);
+        similarPairs.add(0, 1, 0.5);
+        similarPairs.add(0, 2, 0.75);
+        similarPairs.add(0, 3, 0.5);    // Tie with (0, 1), which has the lower CellId.
+        similarPairs.add(2, 3, 0.25);
+        similarPairs.add(1, 2, 0.25);   // Tie with (2, 3), which has the higher CellId.
+        similarPairs.sort();
+        const auto check = [&](CellId cellId0, const vector<SimilarPairs::Pair>& expectedPairs)
+        {
+            CZI_ASSERT(similarPairs.size(cellId0) == expectedPairs.size());
+            CZI_ASSERT(std::equal(expectedPairs.begin(), expectedPairs.end(), similarPairs.begin(cellId0)));
+        };
+        check(0, {{2, 0.75f}, {1, 0.5f}});
+        check(1, {{0, 0.5f}, {2, 0.25f}});
+        check(2, {{0, 0.75f}, {1, 0.25f}});
+        check(3, {{0, 0.5f}, {2, 0.25f}});
+        similarPairs.remove();
+    }
+}
+
+
+
+int main()
+{
+    return runTest("testSimilarPairs", []()
+    {
+        removeDirectory(directoryName);
+        {
+            ExpressionMatrix expressionMatrix(directoryName);
+            addRandomCells(expressionMatrix, cellCount, 100, 5, 11);
+        }
+        testAdd();
+        testAddAfterReordering();
+        testAddAfterAccess();
+        testSymmetricAdd();
+        removeDirectory(directoryName);
+    });
+}
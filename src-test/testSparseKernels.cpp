@@ -0,0 +1,146 @@
+// Tests for the sparse scalar product kernels.
+
+#include "testUtilities.hpp"
+#include "sparseKernels.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+#include "algorithm.hpp"
+
+
+
+namespace {
+
+    // A sparse expression vector, stored as (GeneId, count) sorted by GeneId,
+    // and also with gene ids and counts in separate arrays.
+    class SparseVector {
+    public:
+        vector< pair<GeneId, float> > pairs;
+        vector<GeneId> geneIds;
+        vector<float> counts;
+        explicit SparseVector(const vector<GeneId>& geneIdsArgument, std::mt19937& random) :
+            geneIds(geneIdsArgument)
+        {
+            std::uniform_int_distribution<int> countDistribution(1, 1000);
+            for(const GeneId geneId: geneIds) {
+                const float count = float(countDistribution(random)) / 7.f;
+                pairs.push_back(make_pair(geneId, count));
+                counts.push_back(count);
+            }
+        }
+    };
+
+    // The scalar product computed with a scalar merge, the same way
+    // as the kernels: products in single precision, accumulated
+    // in double precision in order of increasing GeneId.
+    double computeScalarProduct(const SparseVector& x0, const SparseVector& x1)
+    {
+        double scalarProduct = 0.;
+        size_t i0 = 0;
+        size_t i1 = 0;
+        while(i0 != x0.pairs.size() && i1 != x1.pairs.size()) {
+            const GeneId geneId0 = x0.pairs[i0].first;
+            const GeneId geneId1 = x1.pairs[i1].first;
+            if(geneId0 < geneId1) {
+                ++i0;
+            } else if(geneId1 < geneId0) {
+                ++i1;
+            } else {
+                scalarProduct += x0.pairs[i0].second * x1.pairs[i1].second;
+                ++i0;
+                ++i1;
+            }
+        }
+        return scalarProduct;
+    }
+
+    // All kernels must return exactly the same result as the scalar merge.
+    void check(const SparseVector& x0, const SparseVector& x1, bool avx2IsSupported)
+    {
+        const double expected = computeScalarProduct(x0, x1);
+        const pair<GeneId, float>* begin0 = x0.pairs.data();
+        const pair<GeneId, float>* end0 = begin0 + x0.pairs.size();
+        const pair<GeneId, float>* begin1 = x1.pairs.data();
+        const pair<GeneId, float>* end1 = begin1 + x1.pairs.size();
+        const size_t n0 = x0.geneIds.size();
+        const size_t n1 = x1.geneIds.size();
+
+        CZI_ASSERT(SparseKernels::computeScalarProductSse(begin0, end0, begin1, end1) == expected);
+        CZI_ASSERT(SparseKernels::computeSplitScalarProductSse(
+            x0.geneIds.data(), x0.counts.data(), n0, x1.geneIds.data(), x1.counts.data(), n1) == expected);
+        if(avx2IsSupported) {
+            CZI_ASSERT(SparseKernels::computeScalarProductAvx2(begin0, end0, begin1, end1) == expected);
+            CZI_ASSERT(SparseKernels::computeSplitScalarProductAvx2(
+                x0.geneIds.data(), x0.counts.data(), n0, x1.geneIds.data(), x1.counts.data(), n1) == expected);
+        }
+        CZI_ASSERT(SparseKernels::computeScalarProduct(begin0, end0, begin1, end1) == expected);
+        CZI_ASSERT(SparseKernels::computeScalarProduct(
+            x0.geneIds.data(), x0.counts.data(), n0, x1.geneIds.data(), x1.counts.data(), n1) == expected);
+    }
+
+    // Return n distinct random gene ids below geneCount, sorted.
+    vector<GeneId> randomGeneIds(size_t n, GeneId geneCount, std::mt19937& random)
+    {
+        vector<GeneId> geneIds(geneCount);
+        for(GeneId geneId=0; geneId<geneCount; geneId++) {
+            geneIds[geneId] = geneId;
+        }
+        std::shuffle(geneIds.begin(), geneIds.end(), random);
+        geneIds.resize(n);
+        std::sort(geneIds.begin(), geneIds.end());
+        return geneIds;
+    }
+}
+
+
+
+// Try all lengths up to a few blocks of the AVX2 kernels, so the lengths
+// include all remainders modulo 4 and 8, with dense and sparse overlaps,
+// and with disjoint and identical inputs.
+int main()
+{
+    return runTest("testSparseKernels", []()
+    {
+        string instructionSetName;
+        SparseKernels::getScalarProductKernel(instructionSetName);
+        cout << "Best instruction set for the sparse kernels is " << instructionSetName << endl;
+        const bool avx2IsSupported = (instructionSetName == "AVX2");
+
+        std::mt19937 random(17);
+        const size_t maxLength = 41;
+        for(size_t n0=0; n0<=maxLength; n0++) {
+            for(size_t n1=0; n1<=maxLength; n1++) {
+
+                // Random gene ids, with many matches and with few matches.
+                for(const GeneId geneCount: {GeneId(2*maxLength), GeneId(20*maxLength)}) {
+                    const SparseVector x0(randomGeneIds(n0, geneCount, random), random);
+                    const SparseVector x1(randomGeneIds(n1, geneCount, random), random);
+                    check(x0, x1, avx2IsSupported);
+                }
+
+                // Disjoint inputs: interleaved, and with all the gene ids
+                // of one vector lower than all the gene ids of the other.
+                vector<GeneId> even;
+                vector<GeneId> odd;
+                vector<GeneId> high;
+                for(size_t i=0; i<n0; i++) {
+                    even.push_back(GeneId(2*i));
+                }
+                for(size_t i=0; i<n1; i++) {
+                    odd.push_back(GeneId(2*i + 1));
+                    high.push_back(GeneId(2*n0 + i));
+                }
+                check(SparseVector(even, random), SparseVector(odd, random), avx2IsSupported);
+                check(SparseVector(even, random), SparseVector(high, random), avx2IsSupported);
+                check(SparseVector(high, random), SparseVector(even, random), avx2IsSupported);
+            }
+
+            // Identical inputs.
+            const SparseVector x(randomGeneIds(n0, GeneId(3*maxLength), random), random);
+            check(x, x, avx2IsSupported);
+            const SparseVector y(x.geneIds, random);
+            check(x, y, avx2IsSupported);
+        }
+    });
+}
@@ -0,0 +1,67 @@
+// Tests for the structure of arrays copy of the cell expression counts.
+
+#include "testUtilities.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace Test;
+
+
+
+namespace {
+    const string directoryName = "testSplitCellExpressionCounts-data";
+    const CellId initialCellCount = 500;
+
+    // Check that the structure of arrays copy of the expression counts
+    // agrees with the expression counts stored for each cell.
+    void checkSplitCellExpressionCounts(const ExpressionMatrix& expressionMatrix)
+    {
+        CZI_ASSERT(expressionMatrix.hasSplitCellExpressionCounts());
+        for(CellId cellId=0; cellId<expressionMatrix.cellCount(); cellId++) {
+            CZI_ASSERT(expressionMatrix.getSplitCellExpressionCounts(cellId) ==
+                expressionMatrix.getCellExpressionCounts(cellId));
+        }
+    }
+}
+
+
+
+// Cells added after the split copy is created must be stored in it,
+// and it must be accessed again when the directory is reopened.
+int main()
+{
+    return runTest("testSplitCellExpressionCounts", []()
+    {
+        removeDirectory(directoryName);
+        {
+            ExpressionMatrix expressionMatrix(directoryName);
+            addRandomCells(expressionMatrix, initialCellCount, 100, 10, 7);
+            CZI_ASSERT(!expressionMatrix.hasSplitCellExpressionCounts());
+            expressionMatrix.createSplitCellExpressionCounts();
+            checkSplitCellExpressionCounts(expressionMatrix);
+
+            // Add cells, including one with a new gene
+            // and one without expression counts.
+            for(int i=0; i<20; i++) {
+                expressionMatrix.addCell(
+                    {{"CellName", "AddedCell" + std::to_string(i)}},
+                    {{"Gene" + std::to_string(3*i), float(i+1)}, {"Gene" + std::to_string(50+i), 0.5f}});
+            }
+            expressionMatrix.addCell({{"CellName", "NewCell"}}, {{"NewGene", 3.f}, {"Gene1", 2.f}});
+            expressionMatrix.addCell({{"CellName", "EmptyCell"}}, {});
+            CZI_ASSERT(expressionMatrix.cellCount() == initialCellCount + 22);
+            checkSplitCellExpressionCounts(expressionMatrix);
+        }
+        {
+            ExpressionMatrix expressionMatrix(directoryName);
+            CZI_ASSERT(expressionMatrix.cellCount() == initialCellCount + 22);
+            checkSplitCellExpressionCounts(expressionMatrix);
+            expressionMatrix.removeSplitCellExpressionCounts();
+            CZI_ASSERT(!expressionMatrix.hasSplitCellExpressionCounts());
+        }
+        {
+            const ExpressionMatrix expressionMatrix(directoryName);
+            CZI_ASSERT(!expressionMatrix.hasSplitCellExpressionCounts());
+        }
+        removeDirectory(directoryName);
+    });
+}
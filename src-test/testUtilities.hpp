@@ -0,0 +1,105 @@
+#ifndef CZI_EXPRESSION_MATRIX2_TEST_UTILITIES_HPP
+#define CZI_EXPRESSION_MATRIX2_TEST_UTILITIES_HPP
+
+// Functions shared by the test programs in this directory.
+// Each test program creates its data in a directory
+// under the current directory, and removes it when done.
+// Checks use CZI_ASSERT, which throws on failure, and runTest
+// converts the exception into a non-zero exit status for ctest.
+
+#include "ExpressionMatrix.hpp"
+#include "CZI_ASSERT.hpp"
+#include "filesystem.hpp"
+#include "iostream.hpp"
+
+#include <random>
+#include <unistd.h>
+#include "string.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace Test {
+
+            // Remove a directory and all the files it contains.
+            inline void removeDirectory(const string& directoryName)
+            {
+                if(!filesystem::exists(directoryName)) {
+                    return;
+                }
+                for(const string& fileName: filesystem::directoryContents(directoryName)) {
+                    filesystem::remove(fileName);
+                }
+                ::rmdir(directoryName.c_str());
+            }
+
+            // Add to an expression matrix cellCount random cells with expression counts
+            // for geneCount genes. The cells belong to clusterCount clusters,
+            // and cells in the same cluster express similar genes,
+            // so each cell has a few much more similar cells.
+            inline void addRandomCells(
+                ExpressionMatrix& expressionMatrix,
+                CellId cellCount,
+                GeneId geneCount,
+                size_t clusterCount,
+                uint32_t seed)
+            {
+                std::mt19937 random(seed);
+                std::uniform_int_distribution<GeneId> geneDistribution(0, geneCount - 1);
+                std::uniform_int_distribution<int> countDistribution(1, 20);
+
+                // The genes preferentially expressed by each cluster.
+                const size_t clusterGeneCount = 30;
+                vector< vector<GeneId> > clusterGenes(clusterCount);
+                for(vector<GeneId>& genes: clusterGenes) {
+                    for(size_t i=0; i<clusterGeneCount; i++) {
+                        genes.push_back(geneDistribution(random));
+                    }
+                }
+
+                for(CellId cellId=0; cellId<cellCount; cellId++) {
+                    const vector<GeneId>& genes = clusterGenes[cellId % clusterCount];
+                    vector< pair<string, float> > expressionCounts;
+                    for(size_t i=0; i<40; i++) {
+                        const GeneId geneId = (random() % 4) ?
+                            genes[random() % clusterGeneCount] : geneDistribution(random);
+                        expressionCounts.push_back(make_pair(
+                            "Gene" + std::to_string(geneId), float(countDistribution(random))));
+                    }
+
+                    // Merge repeated genes.
+                    std::sort(expressionCounts.begin(), expressionCounts.end());
+                    vector< pair<string, float> > mergedExpressionCounts;
+                    for(const auto& p: expressionCounts) {
+                        if(!mergedExpressionCounts.empty() && mergedExpressionCounts.back().first == p.first) {
+                            mergedExpressionCounts.back().second += p.second;
+                        } else {
+                            mergedExpressionCounts.push_back(p);
+                        }
+                    }
+
+                    const vector< pair<string, string> > metaData =
+                        {{"CellName", "Cell" + std::to_string(cellId)}};
+                    expressionMatrix.addCell(metaData, mergedExpressionCounts);
+                }
+            }
+
+            // Run a test function and return the exit status for ctest.
+            template<class F> int runTest(const string& testName, const F& f)
+            {
+                try {
+                    f();
+                } catch(const std::exception& e) {
+                    cout << testName << " failed: " << e.what() << endl;
+                    return 1;
+                }
+                cout << testName << " passed." << endl;
+                return 0;
+            }
+
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef CZI_EXPRESSION_MATRIX2_ALIGNED_ALLOCATOR_HPP
+#define CZI_EXPRESSION_MATRIX2_ALIGNED_ALLOCATOR_HPP
+
+// Allocator that returns memory aligned to a given boundary
+// (by default a 64-byte cache line).
+// Used as in vector<float, AlignedAllocator<float> >
+// for data accessed using aligned SIMD loads.
+
+#include "cstddef.hpp"
+#include <new>
+#include <stdlib.h>
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        template<class T, size_t alignment=64> class AlignedAllocator;
+    }
+}
+
+
+
+template<class T, size_t alignment> class ChanZuckerberg::ExpressionMatrix2::AlignedAllocator {
+public:
+    typedef T value_type;
+
+    template<class U> class rebind {
+    public:
+        typedef AlignedAllocator<U, alignment> other;
+    };
+
+    AlignedAllocator() {}
+    template<class U> AlignedAllocator(const AlignedAllocator<U, alignment>&) {}
+
+    T* allocate(size_t n)
+    {
+        void* p = 0;
+        if(::posix_memalign(&p, alignment, n*sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t)
+    {
+        ::free(p);
+    }
+
+    template<class U> bool operator==(const AlignedAllocator<U, alignment>&) const
+    {
+        return true;
+    }
+    template<class U> bool operator!=(const AlignedAllocator<U, alignment>&) const
+    {
+        return false;
+    }
+};
+
+#endif
@@ -4,17 +4,23 @@
 // if the there is good similarity between the
 // expression vectors of the corresponding cells.
 
+// The graph is stored in compressed sparse row format
+// by the base class CompactCellGraph (see CompactCellGraph.hpp),
+// which also stores the cluster id and position of each vertex.
+// This class adds the vertex properties used for display
+// and the code to compute and display the graph layout.
+
 #ifndef CZI_EXPRESSION_MATRIX2_CELL_GRAPH_HPP
 #define CZI_EXPRESSION_MATRIX2_CELL_GRAPH_HPP
 
+#include "CompactCellGraph.hpp"
 #include "CZI_ASSERT.hpp"
 #include "Ids.hpp"
 #include "orderPairs.hpp"
 
-#include <boost/graph/adjacency_list.hpp>
-
 #include "array.hpp"
 #include "iosfwd.hpp"
+#include <limits>
 #include "map.hpp"
 #include "string.hpp"
 #include "utility.hpp"
@@ -26,29 +32,20 @@ namespace ChanZuckerberg {
     namespace ExpressionMatrix2 {
 
         class CellGraph;
-        class CellGraphVertex;
         class CellGraphVertexInfo;
-        class CellGraphEdge;
         class ClusterTable;
-
-        // The base class for class CellGraph.
-        typedef boost::adjacency_list<
-            boost::listS,
-            boost::listS,
-            boost::undirectedS,
-            CellGraphVertex,
-            CellGraphEdge> CellGraphBaseClass;
-
-        namespace MemoryMapped {
-            template<class T> class Vector;
-        }
     }
 }
 
 
 
 // A class used by label propagation algorithm to keep track
-// of the total weight of each cluster for each vertex.
+// of the total weight of each cluster for each vertex
+// (see CompactCellGraph::labelPropagationClustering).
+// The best cluster is the one with the most weight.
+// Ties are broken in favor of the lowest cluster id,
+// so the best cluster does not depend on the order
+// in which the weights were added.
 class ChanZuckerberg::ExpressionMatrix2::ClusterTable {
 public:
     void addWeight(uint32_t clusterId, float weight);
@@ -64,6 +61,10 @@ private:
 
     uint32_t bestClusterId = std::numeric_limits<uint32_t>::max();
     float bestWeight = -1.;
+
+    // Return true if a cluster with the given weight
+    // is better than the current best cluster.
+    bool isBetter(uint32_t clusterId, float weight) const;
 };
 
 inline void ChanZuckerberg::ExpressionMatrix2::ClusterTable::addWeightQuick(uint32_t clusterId, float weight)
@@ -82,7 +83,7 @@ inline void ChanZuckerberg::ExpressionMatrix2::ClusterTable::addWeight(uint32_t
                     bestWeight = p.second;
                 }
             } else {
-                if(p.second > bestWeight) {
+                if(isBetter(clusterId, p.second)) {
                     bestClusterId = clusterId;
                     bestWeight = p.second;
                 }
@@ -91,7 +92,7 @@ inline void ChanZuckerberg::ExpressionMatrix2::ClusterTable::addWeight(uint32_t
         }
     }
     data.push_back(make_pair(clusterId, weight));
-    if(weight > bestWeight) {
+    if(isBetter(clusterId, weight)) {
         bestClusterId = clusterId;
         bestWeight = weight;
     }
@@ -105,12 +106,16 @@ inline void ChanZuckerberg::ExpressionMatrix2::ClusterTable::findBestCluster()
     bestClusterId = std::numeric_limits<uint32_t>::max();
     bestWeight = -1.;
     for(const pair<uint32_t, float>& p: data) {
-        if(p.second > bestWeight) {
+        if(isBetter(p.first, p.second)) {
             bestWeight = p.second;
             bestClusterId = p.first;
         }
     }
 }
+inline bool ChanZuckerberg::ExpressionMatrix2::ClusterTable::isBetter(uint32_t clusterId, float weight) const
+{
+    return weight > bestWeight || (weight == bestWeight && clusterId < bestClusterId);
+}
 inline void ChanZuckerberg::ExpressionMatrix2::ClusterTable::clear()
 {
     data.clear();
@@ -122,13 +127,11 @@ inline bool ChanZuckerberg::ExpressionMatrix2::ClusterTable::isEmpty() const
 
 
 
-// A vertex of the cell graph.
-// The base class CellGraphVertexInfo is used to communicate with Python.
+// Information about a vertex of the cell graph, used to communicate with Python.
 class ChanZuckerberg::ExpressionMatrix2::CellGraphVertexInfo {
 public:
     CellId cellId = invalidCellId;
     array<double, 2> position;
-    ClusterTable clusterTable;
     double x() const
     {
         return position[0];
@@ -153,67 +156,20 @@ public:
         return cellId==that.cellId && position==that.position;
     }
 };
-class ChanZuckerberg::ExpressionMatrix2::CellGraphVertex : public CellGraphVertexInfo {
-public:
-
-    // Use the base class constructors.
-    using CellGraphVertexInfo::CellGraphVertexInfo;
-
-    // Additional fields not needed in Python.
-    uint32_t group = 0;
-    uint32_t clusterId = 0;
-    string color;
-    double value = 0.;
-};
-
-
-
-// An edge of the cell graph.
-class ChanZuckerberg::ExpressionMatrix2::CellGraphEdge {
+class ChanZuckerberg::ExpressionMatrix2::CellGraph : public CompactCellGraph {
 public:
-    float similarity = -1.;
-
-    CellGraphEdge()
-    {
-    }
-
-    CellGraphEdge(float similarity) :
-        similarity(similarity)
-    {
-    }
-
-    string color;
-};
-
-
-
-class ChanZuckerberg::ExpressionMatrix2::CellGraph : public CellGraphBaseClass {
-public:
-
-    // Use the constructors of the base class.
-    using CellGraphBaseClass::CellGraphBaseClass;
-
-    typedef CellGraph Graph;
-    Graph& graph()
-    {
-        return *this;
-    }
-    const Graph& graph() const
-    {
-        return *this;
-    }
 
     CellGraph(
-        const MemoryMapped::Vector<CellId>& cellSet, // The cell set to be used.
+        const CellSet& cellSet,                      // The cell set to be used.
         const string& directoryName,
-        const string& similarPairsName,           // The name of the SimilarPairs object to be used to create the graph.
+        const string& similarPairsName,              // The name of the SimilarPairs object to be used to create the graph.
         double similarityThreshold,                  // The minimum similarity to create an edge.
-        size_t maxConnectivity                       // The maximum number of neighbors (k of the k-NN graph).
+        size_t maxConnectivity,                      // The maximum number of neighbors (k of the k-NN graph).
+        size_t threadCount = 0                       // The number of threads used to create the graph (0 = use all).
         );
 
-    // Only keep an edge if it is one of the best k edges for either
-    // of the two vertices. This turns the graph into a k-nearest-neighbor graph.
-    void keepBestEdgesOnly(std::size_t k);
+    // Access a graph previously stored in memory mapped files.
+    CellGraph(const string& name, bool allowReadOnly);
 
     // Write in Graphviz format.
     void write(ostream&) const;
@@ -222,31 +178,27 @@ public:
     // Simple graph statistics.
     ostream& writeStatistics(ostream&) const;
 
-    // Remove isolated vertices and returns\ the number of vertices that were removed
+    // Remove isolated vertices and return the number of vertices that were removed
     size_t removeIsolatedVertices();
 
     // Use Graphviz to compute the graph layout and store it in the vertex positions.
     void computeLayout();
     bool layoutWasComputed = false;
 
-    // Clustering using the label propagation algorithm.
-    // The cluster each vertex is assigned to is stored in the clusterId data member of the vertex.
-    void labelPropagationClustering(
-        ostream&,
-        size_t seed,                            // Seed for random number generator.
-        size_t stableIterationCountThreshold,   // Stop after this many iterations without changes.
-        size_t maxIterationCount                // Stop after this many iterations no matter what.
-        );
-
-    // Vertex table, keyed by cell id.
-    map<CellId, vertex_descriptor> vertexTable;
-
-    // Compute minimum and maximum coordinates of all the vertices.
-    void computeCoordinateRange(
-        double& xMin,
-        double& xMax,
-        double& yMin,
-        double& yMax) const;
+    // Vertex properties used for display only.
+    // They are stored in memory, even if the graph is stored in memory mapped files.
+    uint32_t& group(CellId v)
+    {
+        return groups[v];
+    }
+    string& color(CellId v)
+    {
+        return colors[v];
+    }
+    double& value(CellId v)
+    {
+        return values[v];
+    }
 
     // Assign integer colors to groups.
     // The same color can be used for multiple groups, but if two
@@ -276,17 +228,16 @@ public:
         const string& geneSetName   // Used for the cell URL
         ) const;
 
-    class Writer {
-    public:
-        Writer(const Graph&);
-        void operator()(ostream&) const;
-        void operator()(ostream&, vertex_descriptor) const;
-        void operator()(ostream&, edge_descriptor) const;
-        const Graph& graph;
-        double minEdgeSimilarity;
-    };
-};
+private:
 
-#endif
+    // The group, color, and value of each vertex, used for display only.
+    vector<uint32_t> groups;
+    vector<string> colors;
+    vector<double> values;
 
+    // Size the display properties for the current number of vertices,
+    // and set them to their default values.
+    void initializeDisplayProperties();
+};
 
+#endif
@@ -57,16 +57,19 @@ ClusterGraphCreationParameters::ClusterGraphCreationParameters(
 
 
 // Create the ClusterGraph from the CellGraph.
-// This uses the clusterId stored in each CellGraphVertex.
+// This uses the clusterId stored for each vertex of the CellGraph.
 ClusterGraph::ClusterGraph(
     const CellGraph& cellGraph,
     const GeneSet& geneSetArgument)
 {
 
     // Construct the vertices of the ClusterGraph.
-    BGL_FORALL_VERTICES(cv, cellGraph, CellGraph){
-        const CellGraphVertex& cVertex = cellGraph[cv];
-        const uint32_t clusterId = cVertex.clusterId;
+    // Also store the ClusterGraph vertex corresponding to each CellGraph vertex,
+    // so we don't have to look it up again when creating the edges.
+    vector<vertex_descriptor> clusterVertices(cellGraph.vertexCount());
+    for(CellId cv=0; cv<cellGraph.vertexCount(); cv++) {
+        const uint32_t clusterId = cellGraph.clusterId(cv);
+        const CellId cellId = cellGraph.getCellId(cv);
 
         // Look for a vertex for this cluster.
         const auto it = vertexMap.find(clusterId);
@@ -77,7 +80,8 @@ ClusterGraph::ClusterGraph(
             vertexMap.insert(make_pair(clusterId, v));
             ClusterGraphVertex& vertex = (*this)[v];
             vertex.clusterId = clusterId;
-            vertex.cells.push_back(cVertex.cellId);
+            vertex.cells.push_back(cellId);
+            clusterVertices[cv] = v;
         }
 
         // If we already have a vertex for this clusterId, add this cell to that vertex.
@@ -85,32 +89,29 @@ ClusterGraph::ClusterGraph(
             const vertex_descriptor v = it->second;
             ClusterGraphVertex& vertex = (*this)[v];
             CZI_ASSERT(vertex.clusterId == clusterId);
-            vertex.cells.push_back(cVertex.cellId);
+            vertex.cells.push_back(cellId);
+            clusterVertices[cv] = v;
         }
     }
 
 
     // Create the edges by looping over all edges of the CellGraph.
-    BGL_FORALL_EDGES(ce, cellGraph, CellGraph){
-
-        // Find the vertices of this edge.
-        const CellGraph::vertex_descriptor cv0 = source(ce, cellGraph);
-        const CellGraph::vertex_descriptor cv1 = target(ce, cellGraph);
-        const CellGraphVertex& cVertex0 = cellGraph[cv0];
-        const CellGraphVertex& cVertex1 = cellGraph[cv1];
-
-        // Find the corresponding vertices in the ClusterGraph.
-        const auto it0 = vertexMap.find(cVertex0.clusterId);
-        const auto it1 = vertexMap.find(cVertex1.clusterId);
-        CZI_ASSERT(it0 != vertexMap.end());
-        CZI_ASSERT(it1 != vertexMap.end());
-        const vertex_descriptor v0 = it0->second;
-        const vertex_descriptor v1 = it1->second;
-
-        // If the vertices are distinct, add the edge. If the edge already exists, it will not be created,
-        // because we use boost::setS for the edgeList template argument.
-        if(v0 != v1) {
-            add_edge(v0, v1, *this);
+    // Each edge is stored twice in the CellGraph, once for each of its vertices,
+    // so we only look at it from the vertex with the lower vertex id.
+    for(CellId cv0=0; cv0<cellGraph.vertexCount(); cv0++) {
+        const vertex_descriptor v0 = clusterVertices[cv0];
+        for(const CellId* it=cellGraph.neighborsBegin(cv0); it!=cellGraph.neighborsEnd(cv0); ++it) {
+            const CellId cv1 = *it;
+            if(cv1 < cv0) {
+                continue;
+            }
+            const vertex_descriptor v1 = clusterVertices[cv1];
+
+            // If the vertices are distinct, add the edge. If the edge already exists, it will not be created,
+            // because we use boost::setS for the edgeList template argument.
+            if(v0 != v1) {
+                add_edge(v0, v1, *this);
+            }
         }
     }
 
@@ -87,7 +87,9 @@ public:
 
 class ChanZuckerberg::ExpressionMatrix2::ClusterGraphEdge {
 public:
-    double similarity;
+
+    // This is set by ClusterGraph::computeSimilarities.
+    double similarity = -1.;
 };
 
 
@@ -96,7 +98,7 @@ class ChanZuckerberg::ExpressionMatrix2::ClusterGraph : public ClusterGraphBaseC
 public:
 
     // Create the ClusterGraph from the CellGraph.
-    // This uses the clusterId stored in each CellGraphVertex.
+    // This uses the clusterId stored for each vertex of the CellGraph.
     ClusterGraph(const CellGraph&, const GeneSet& geneSet);
 
     // Compute the average gene expression vector of each vertex.
@@ -0,0 +1,687 @@
+// CZI.
+#include "CompactCellGraph.hpp"
+#include "CellGraph.hpp"
+#include "CompactSimilarPairs.hpp"
+#include "CZI_ASSERT.hpp"
+#include "filesystem.hpp"
+#include "iostream.hpp"
+#include "orderPairs.hpp"
+#include "parallelFor.hpp"
+#include "SimilarPairs.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+// Standard libraries.
+#include "algorithm.hpp"
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include "map.hpp"
+#include "memory.hpp"
+#include <random>
+#include "utility.hpp"
+#include "vector.hpp"
+
+
+
+CompactCellGraph::CompactCellGraph(
+    const CellSet& cellSet,
+    const string& directoryName,
+    const string& similarPairsName,
+    double similarityThreshold,
+    size_t maxConnectivity,
+    size_t threadCount,
+    const string& name) :
+    name(name)
+{
+    threadCount = getThreadCount(threadCount);
+    const CellId vertexCount = CellId(cellSet.size());
+    const size_t batchSize = 1000;
+
+    // Access the SimilarPairs object.
+    // If its compact form exists (see CompactSimilarPairs.hpp), it is used instead,
+    // reading the pairs directly from its memory mapped files.
+    shared_ptr<const SimilarPairs> similarPairs;
+    shared_ptr<const CompactSimilarPairs> compactSimilarPairs;
+    if(CompactSimilarPairs::exists(directoryName, similarPairsName)) {
+        compactSimilarPairs = make_shared<const CompactSimilarPairs>(directoryName, similarPairsName);
+    } else {
+        similarPairs = make_shared<const SimilarPairs>(directoryName, similarPairsName, true);
+    }
+    const CellSet& pairsCellSet = similarPairs ?
+        similarPairs->getCellSet() : compactSimilarPairs->getCellSet();
+    const size_t pairsK = similarPairs ? similarPairs->k() : compactSimilarPairs->k();
+
+    // Note that there are two cell sets involved: the cell set to
+    // be used for graph creation and the cell set that was used
+    // to create the SimilarPairs. If we want to make sure not to
+    // lose edges, the former must be a subset of the latter.
+    // However, for flexibility we do not check for this.
+    // Since both cell sets are sorted, we can map local cell ids
+    // of the SimilarPairs object to vertices and vice versa with a single merge.
+    vector<CellId> vertexFromPairs(pairsCellSet.size(), invalidCellId);
+    vector<CellId> pairsFromVertex(vertexCount, invalidCellId);
+    for(CellId v=0, i=0; v<vertexCount && i<pairsCellSet.size(); ) {
+        if(cellSet[v] < pairsCellSet[i]) {
+            ++v;
+        } else if(pairsCellSet[i] < cellSet[v]) {
+            ++i;
+        } else {
+            vertexFromPairs[i] = v;
+            pairsFromVertex[v] = i;
+            ++v;
+            ++i;
+        }
+    }
+
+
+
+    // For each vertex, select the best up to maxConnectivity pairs
+    // with similarity at least equal to similarityThreshold
+    // and with the other cell also in the cell set.
+    // If maxConnectivity is zero, there is no limit other than the k of the SimilarPairs.
+    // Each vertex has a fixed number of slots to store its selected pairs.
+    const size_t slotCount = (maxConnectivity == 0) ? pairsK : min(maxConnectivity, pairsK);
+    vector< pair<CellId, float> > selected(size_t(vertexCount) * slotCount);
+    vector<CellId> selectedCount(vertexCount, 0);
+    parallelFor(vertexCount, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            vector< pair<CellId, float> > candidates;
+            for(CellId v=CellId(begin); v!=CellId(end); ++v) {
+
+                // If the cell set of the SimilarPairs object does not contain this cell,
+                // this vertex does not select any pairs.
+                // This could result in missing some edges in the graph.
+                const CellId localCellId0 = pairsFromVertex[v];
+                if(localCellId0 == invalidCellId) {
+                    continue;
+                }
+                pair<CellId, float>* vertexSelected = selected.data() + size_t(v) * slotCount;
+                CellId& n = selectedCount[v];
+
+                if(similarPairs) {
+
+                    // The similar pairs are sorted by decreasing similarity.
+                    for(const SimilarPairs::Pair& p: (*similarPairs)[localCellId0]) {
+                        const float similarity = p.second;
+                        if(similarity < similarityThreshold) {
+                            break;
+                        }
+                        const CellId v1 = vertexFromPairs[p.first];
+                        if(v1 == invalidCellId || v1 == v) {
+                            continue;
+                        }
+                        vertexSelected[n++] = make_pair(v1, similarity);
+                        if(n == slotCount) {
+                            break;
+                        }
+                    }
+
+                } else {
+
+                    // In the compact form, the pairs are sorted by CellId.
+                    // Gather the ones that qualify, then keep the best ones,
+                    // in the same order used by SimilarPairs::sort.
+                    // The mapping to vertices preserves the order of cell ids.
+                    candidates.clear();
+                    for(const CompactSimilarPairs::Pair p: (*compactSimilarPairs)[localCellId0]) {
+                        if(p.second < similarityThreshold) {
+                            continue;
+                        }
+                        const CellId v1 = vertexFromPairs[p.first];
+                        if(v1 == invalidCellId || v1 == v) {
+                            continue;
+                        }
+                        candidates.push_back(make_pair(v1, p.second));
+                    }
+                    n = CellId(min(candidates.size(), slotCount));
+                    std::partial_sort(candidates.begin(), candidates.begin()+n, candidates.end(),
+                        OrderPairsBySecondGreaterThenByFirstLess< pair<CellId, float> >());
+                    std::copy(candidates.begin(), candidates.begin()+n, vertexSelected);
+                }
+            }
+        });
+
+
+
+    // Symmetrize. Each selected pair is stored for both of its vertices,
+    // in a temporary CSR layout. The number of entries for each vertex is
+    // the number of pairs it selected plus the number of pairs
+    // selected by other vertices with this vertex as the neighbor.
+    // These are counted and then stored using atomic counters,
+    // so their order depends on thread scheduling, but the order is
+    // made deterministic by sorting below.
+    vector< std::atomic<uint64_t> > counters(vertexCount);
+    for(std::atomic<uint64_t>& counter: counters) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    parallelFor(vertexCount, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(CellId v=CellId(begin); v!=CellId(end); ++v) {
+                const pair<CellId, float>* vertexSelected = selected.data() + size_t(v) * slotCount;
+                for(CellId i=0; i<selectedCount[v]; i++) {
+                    counters[vertexSelected[i].first].fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        });
+    vector<uint64_t> entryBegin(vertexCount + 1);
+    entryBegin[0] = 0;
+    for(CellId v=0; v<vertexCount; v++) {
+        const uint64_t n = selectedCount[v] + counters[v].load(std::memory_order_relaxed);
+        entryBegin[v + 1] = entryBegin[v] + n;
+
+        // From now on, the counter is the position of the next entry
+        // selected by a neighbor.
+        counters[v].store(entryBegin[v] + selectedCount[v], std::memory_order_relaxed);
+    }
+    vector<Entry> entries(entryBegin[vertexCount]);
+    parallelFor(vertexCount, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(CellId v=CellId(begin); v!=CellId(end); ++v) {
+                const pair<CellId, float>* vertexSelected = selected.data() + size_t(v) * slotCount;
+                Entry* vertexEntries = entries.data() + entryBegin[v];
+                for(CellId i=0; i<selectedCount[v]; i++) {
+                    const CellId v1 = vertexSelected[i].first;
+                    const float similarity = vertexSelected[i].second;
+                    vertexEntries[i] = Entry{v1, similarity, false};
+                    const uint64_t j = counters[v1].fetch_add(1, std::memory_order_relaxed);
+                    entries[j] = Entry{v, similarity, true};
+                }
+            }
+        });
+    selected.clear();
+    selected.shrink_to_fit();
+
+
+
+    // Sort the entries of each vertex by neighbor and remove duplicates,
+    // which occur when both vertices selected the pair.
+    // In that case the similarity is the one stored for the vertex with the lowest CellId
+    // (which is the one the CellGraph constructor used to create the edge),
+    // so the two copies of the edge are consistent.
+    // The sorted unique entries are moved to the beginning of the range for each vertex,
+    // and their number is stored in selectedCount.
+    parallelFor(vertexCount, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(CellId v=CellId(begin); v!=CellId(end); ++v) {
+                Entry* b = entries.data() + entryBegin[v];
+                Entry* e = entries.data() + entryBegin[v + 1];
+                const auto isPreferred = [v](const Entry& entry)
+                {
+                    return entry.selectedByNeighbor == (entry.neighbor < v);
+                };
+                std::sort(b, e,
+                    [&isPreferred](const Entry& x, const Entry& y)
+                    {
+                        if(x.neighbor != y.neighbor) {
+                            return x.neighbor < y.neighbor;
+                        }
+                        return isPreferred(x) && !isPreferred(y);
+                    });
+                Entry* last = std::unique(b, e,
+                    [](const Entry& x, const Entry& y)
+                    {
+                        return x.neighbor == y.neighbor;
+                    });
+                selectedCount[v] = CellId(last - b);
+            }
+        });
+
+
+
+    // Create the vertices and copy the entries to their final position.
+    uint64_t entryCount = 0;
+    for(CellId v=0; v<vertexCount; v++) {
+        entryCount += selectedCount[v];
+    }
+    createNew(name, vertexCount, entryCount);
+    std::copy(cellSet.begin(), cellSet.end(), cellIds.begin());
+    offsets[0] = 0;
+    for(CellId v=0; v<vertexCount; v++) {
+        offsets[v + 1] = offsets[v] + selectedCount[v];
+    }
+    parallelFor(vertexCount, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(CellId v=CellId(begin); v!=CellId(end); ++v) {
+                const Entry* vertexEntries = entries.data() + entryBegin[v];
+                const uint64_t offset = offsets[v];
+                for(CellId i=0; i<selectedCount[v]; i++) {
+                    neighbors[offset + i] = vertexEntries[i].neighbor;
+                    similarities[offset + i] = vertexEntries[i].similarity;
+                }
+            }
+        });
+}
+
+
+
+// Only keep an edge if it is one of the best k edges for either
+// of the two vertices.
+// First, each vertex marks its best k edges. An edge is then kept
+// if it is marked on either side, which is checked with a binary
+// search in the (sorted) neighbors of the other vertex.
+// Finally, the edges that are kept are compacted
+// with the same two pass approach used in the constructor.
+void CompactCellGraph::keepBestEdgesOnly(size_t k, size_t threadCount)
+{
+    checkWriteAccess();
+    threadCount = getThreadCount(threadCount);
+    const CellId n = vertexCount();
+    const size_t batchSize = 1000;
+
+    // Mark the best k edges of each vertex.
+    vector<uint8_t> isMarked(neighbors.size(), 0);
+    parallelFor(n, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            vector< pair<CellId, float> > v1s;   // (index in the neighbors of v, similarity)
+            for(CellId v=CellId(begin); v!=CellId(end); ++v) {
+                const uint64_t offset = offsets[v];
+                const CellId d = CellId(degree(v));
+                if(d <= k) {
+                    std::fill(isMarked.begin() + offset, isMarked.begin() + offset + d, 1);
+                    continue;
+                }
+                v1s.clear();
+                for(CellId i=0; i<d; i++) {
+                    v1s.push_back(make_pair(i, similarities[offset + i]));
+                }
+
+                // Neighbors are sorted, so ordering by index
+                // also breaks ties by neighbor.
+                std::nth_element(v1s.begin(), v1s.begin() + k, v1s.end(),
+                    OrderPairsBySecondGreaterThenByFirstLess< pair<CellId, float> >());
+                for(size_t i=0; i<k; i++) {
+                    isMarked[offset + v1s[i].first] = 1;
+                }
+            }
+        });
+
+    // Find which edges are kept, and count them for each vertex.
+    vector<uint8_t> isKept(neighbors.size(), 0);
+    vector<CellId> keptCount(n, 0);
+    parallelFor(n, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(CellId v=CellId(begin); v!=CellId(end); ++v) {
+                for(uint64_t j=offsets[v]; j!=offsets[v + 1]; ++j) {
+                    bool keep = isMarked[j];
+                    if(!keep) {
+                        const CellId v1 = neighbors[j];
+                        const CellId* it = std::lower_bound(neighborsBegin(v1), neighborsEnd(v1), v);
+                        CZI_ASSERT(it != neighborsEnd(v1) && *it == v);
+                        keep = isMarked[it - neighbors.begin()];
+                    }
+                    if(keep) {
+                        isKept[j] = 1;
+                        ++keptCount[v];
+                    }
+                }
+            }
+        });
+    isMarked.clear();
+    isMarked.shrink_to_fit();
+
+    // Compact the edges that are kept.
+    vector<uint64_t> newOffsets(n + 1);
+    newOffsets[0] = 0;
+    for(CellId v=0; v<n; v++) {
+        newOffsets[v + 1] = newOffsets[v] + keptCount[v];
+    }
+    vector<CellId> newNeighbors(newOffsets[n]);
+    vector<float> newSimilarities(newOffsets[n]);
+    parallelFor(n, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(CellId v=CellId(begin); v!=CellId(end); ++v) {
+                uint64_t i = newOffsets[v];
+                for(uint64_t j=offsets[v]; j!=offsets[v + 1]; ++j) {
+                    if(isKept[j]) {
+                        newNeighbors[i] = neighbors[j];
+                        newSimilarities[i] = similarities[j];
+                        ++i;
+                    }
+                }
+            }
+        });
+
+    // Store the new edges.
+    std::copy(newOffsets.begin(), newOffsets.end(), offsets.begin());
+    neighbors.resize(newNeighbors.size());
+    std::copy(newNeighbors.begin(), newNeighbors.end(), neighbors.begin());
+    similarities.resize(newSimilarities.size());
+    std::copy(newSimilarities.begin(), newSimilarities.end(), similarities.begin());
+}
+
+
+
+// Remove isolated vertices and return the number of vertices that were removed.
+// Isolated vertices have no entries in the neighbors vector,
+// so the only change there is the renumbering of the remaining vertices.
+size_t CompactCellGraph::removeIsolatedVertices()
+{
+    checkWriteAccess();
+    const CellId oldVertexCount = vertexCount();
+
+    // Find the new vertex id of each vertex that is kept.
+    vector<CellId> newVertexIds(oldVertexCount, invalidCellId);
+    CellId newVertexCount = 0;
+    for(CellId v=0; v<oldVertexCount; v++) {
+        if(degree(v) > 0) {
+            newVertexIds[v] = newVertexCount++;
+        }
+    }
+    if(newVertexCount == oldVertexCount) {
+        return 0;
+    }
+
+    // Move the vertices that are kept.
+    // The new vertex id is never greater than the old one,
+    // so this can be done in place.
+    for(CellId v=0; v<oldVertexCount; v++) {
+        const CellId newV = newVertexIds[v];
+        if(newV == invalidCellId) {
+            continue;
+        }
+        cellIds[newV] = cellIds[v];
+        offsets[newV] = offsets[v];
+        clusterIds[newV] = clusterIds[v];
+        positions[newV] = positions[v];
+    }
+    offsets[newVertexCount] = offsets[oldVertexCount];
+    cellIds.resize(newVertexCount);
+    offsets.resize(newVertexCount + 1);
+    clusterIds.resize(newVertexCount);
+    positions.resize(newVertexCount);
+
+    // Renumber the neighbors. This does not change their order.
+    for(CellId& v: neighbors) {
+        v = newVertexIds[v];
+    }
+
+    return oldVertexCount - newVertexCount;
+}
+
+
+
+// Compute minimum and maximum coordinates of all the vertices.
+void CompactCellGraph::computeCoordinateRange(
+    double& xMin,
+    double& xMax,
+    double& yMin,
+    double& yMax) const
+{
+    xMin = std::numeric_limits<double>::max();
+    xMax = std::numeric_limits<double>::min();
+    yMin = std::numeric_limits<double>::max();
+    yMax = std::numeric_limits<double>::min();
+    for(const array<double, 2>& position: positions) {
+        const double x = position[0];
+        const double y = position[1];
+        xMin = min(xMin, x);
+        xMax = max(xMax, x);
+        yMin = min(yMin, y);
+        yMax = max(yMax, y);
+    }
+}
+
+
+
+// Create a copy of another graph, stored in memory mapped files.
+CompactCellGraph::CompactCellGraph(const CompactCellGraph& that, const string& name) :
+    name(name)
+{
+    CZI_ASSERT(!name.empty());
+    that.cellIds.makeCopy(cellIds, name + "-CellIds");
+    that.offsets.makeCopy(offsets, name + "-Offsets");
+    that.neighbors.makeCopy(neighbors, name + "-Neighbors");
+    that.similarities.makeCopy(similarities, name + "-Similarities");
+    that.clusterIds.makeCopy(clusterIds, name + "-ClusterIds");
+    that.positions.makeCopy(positions, name + "-Positions");
+}
+
+
+
+// Access a graph previously stored in memory mapped files.
+CompactCellGraph::CompactCellGraph(const string& name, bool allowReadOnly) :
+    name(name)
+{
+    cellIds.accessExistingReadWrite(name + "-CellIds", allowReadOnly);
+    offsets.accessExistingReadWrite(name + "-Offsets", allowReadOnly);
+    neighbors.accessExistingReadWrite(name + "-Neighbors", allowReadOnly);
+    similarities.accessExistingReadWrite(name + "-Similarities", allowReadOnly);
+    clusterIds.accessExistingReadWrite(name + "-ClusterIds", allowReadOnly);
+    positions.accessExistingReadWrite(name + "-Positions", allowReadOnly);
+    if(
+        offsets.size() != cellIds.size() + 1 ||
+        clusterIds.size() != cellIds.size() ||
+        positions.size() != cellIds.size() ||
+        similarities.size() != neighbors.size() ||
+        offsets[cellIds.size()] != neighbors.size()) {
+        throw runtime_error("Cell graph " + name + " has vectors of inconsistent length.");
+    }
+}
+
+
+
+// Throw an exception if the graph was accessed read-only.
+void CompactCellGraph::checkWriteAccess() const
+{
+    if(!(
+        cellIds.isOpenWithWriteAccess &&
+        offsets.isOpenWithWriteAccess &&
+        neighbors.isOpenWithWriteAccess &&
+        similarities.isOpenWithWriteAccess &&
+        clusterIds.isOpenWithWriteAccess &&
+        positions.isOpenWithWriteAccess)) {
+        throw runtime_error("Cell graph " + name + " was accessed read-only and cannot be modified.");
+    }
+}
+
+
+
+bool CompactCellGraph::exists(const string& name)
+{
+    return filesystem::exists(name + "-Offsets");
+}
+
+
+
+void CompactCellGraph::remove()
+{
+    cellIds.remove();
+    offsets.remove();
+    neighbors.remove();
+    similarities.remove();
+    clusterIds.remove();
+    positions.remove();
+}
+
+
+
+void CompactCellGraph::createNew(const string& name, CellId vertexCount, uint64_t entryCount)
+{
+    createNew(cellIds, name, "CellIds", vertexCount);
+    createNew(offsets, name, "Offsets", vertexCount + 1);
+    createNew(neighbors, name, "Neighbors", entryCount);
+    createNew(similarities, name, "Similarities", entryCount);
+    createNew(clusterIds, name, "ClusterIds", vertexCount);
+    createNew(positions, name, "Positions", vertexCount);
+    std::fill(clusterIds.begin(), clusterIds.end(), 0);
+    std::fill(positions.begin(), positions.end(), array<double, 2>({0., 0.}));
+}
+template<class T> void CompactCellGraph::createNew(
+    MemoryMapped::Vector<T>& v,
+    const string& name,
+    const string& suffix,
+    size_t n)
+{
+    if(name.empty()) {
+        v.createNewAnonymous(n);
+    } else {
+        v.createNew(name + "-" + suffix, n);
+    }
+}
+
+
+
+// Clustering using the label propagation algorithm.
+// The ClusterTable of each vertex keeps the total similarity of its
+// neighbors in each cluster, and is updated incrementally when
+// a neighbor changes cluster. Ties between clusters are broken
+// in favor of the lowest cluster id (see ClusterTable).
+void CompactCellGraph::labelPropagationClustering(
+    ostream& out,
+    size_t seed,                            // Seed for random number generator.
+    size_t stableIterationCountThreshold,   // Stop after this many iterations without changes.
+    size_t maxIterationCount                // Stop after this many iterations no matter what.
+    )
+{
+    checkWriteAccess();
+    out << timestamp << "Clustering by label propagation begins." << endl;
+    out << "Seed for random number generator is " << seed << "." << endl;
+    out << "Will stop after " << stableIterationCountThreshold << " iterations without changes." << endl;
+    out << "Maximum number of iterations is " << maxIterationCount << "." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+    const CellId n = vertexCount();
+
+    // Set the cluster of each vertex equal to its cell id.
+    for(CellId v=0; v<n; v++) {
+        clusterIds[v] = cellIds[v];
+    }
+
+    // Initialize the ClusterTable of each vertex.
+    vector<ClusterTable> clusterTables(n);
+    for(CellId v0=0; v0<n; v0++) {
+        ClusterTable& clusterTable0 = clusterTables[v0];
+        for(uint64_t j=offsets[v0]; j!=offsets[v0 + 1]; ++j) {
+            clusterTable0.addWeightQuick(clusterIds[neighbors[j]], similarities[j]);
+        }
+        clusterTable0.findBestCluster();
+    }
+
+
+    // Create the random number generator using the specified seed.
+    std::mt19937 randomGenerator(seed);
+
+    // Vector with all the vertices in the graph, in order of increasing cell id.
+    vector<CellId> allVertices(n);
+    for(CellId v=0; v<n; v++) {
+        allVertices[v] = v;
+    }
+
+    // Vector to contain the vertices in the random order to be used at each iteration.
+    vector<CellId> shuffledVertices;
+
+    // Counter of the number of stable iterations
+    // (iterations without changes).
+    size_t stableIterationCount = 0;
+
+
+
+    // Iterate.
+    out << timestamp << "Label propagation iteration begins." << endl;
+    for(size_t iteration=0; iteration<maxIterationCount; iteration++) {
+        const auto t0 = std::chrono::steady_clock::now();
+        size_t changeCount = 0;
+
+        // Create a random shuffle of the vertices, to be used for this iteration.
+        shuffledVertices = allVertices;
+        std::shuffle(shuffledVertices.begin(), shuffledVertices.end(), randomGenerator);
+
+        // Process the vertices in the order determined by the random shuffle.
+        for(const CellId v0: shuffledVertices) {
+            ClusterTable& clusterTable0 = clusterTables[v0];
+            if(clusterTable0.isEmpty()) {
+                continue;
+            }
+
+            // If the cluster is already consistent with the cluster table,
+            // we don't need to do anything.
+            const uint32_t bestClusterId = clusterTable0.bestCluster();
+            uint32_t& clusterId0 = clusterIds[v0];
+            if(clusterId0 == bestClusterId) {
+                continue;
+            }
+
+            // Change the cluster id of vertex0.
+            const uint32_t oldClusterId = clusterId0;
+            clusterId0 = bestClusterId;
+            ++changeCount;
+
+            // Update the cluster table of its neighbors.
+            for(uint64_t j=offsets[v0]; j!=offsets[v0 + 1]; ++j) {
+                ClusterTable& clusterTable1 = clusterTables[neighbors[j]];
+                const float similarity = similarities[j];
+                clusterTable1.addWeight(bestClusterId, similarity);
+                clusterTable1.addWeight(oldClusterId, -similarity);
+            }
+        }
+        const auto t1 = std::chrono::steady_clock::now();
+        const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+        out << "Iteration " << iteration << " took " << t01 << " s, made " << changeCount << " changes." << endl;
+
+        // Update the number of stable iterations (iterations without changes).
+        if(changeCount) {
+            stableIterationCount = 0;
+        } else {
+            ++stableIterationCount;
+        }
+
+        // If we have done enough stable iterations, stop.
+        if(stableIterationCount == stableIterationCountThreshold) {
+            break;
+        }
+    }
+
+
+    if(stableIterationCount == stableIterationCountThreshold) {
+        out << "Terminating because the specified number of stable iterations was achieved." << endl;
+    } else {
+        out << "Terminating because the maximum number of iterations was reached." << endl;
+    }
+
+
+
+    // Compute the size of each cluster.
+    map<uint32_t, size_t> clusterSize;    // Key=clusterId, Value=cluster size
+    for(CellId v=0; v<n; v++) {
+        ++clusterSize[clusterIds[v]];
+    }
+
+
+
+    // Renumber the clusters beginning at 0 and in order of decreasing cluster size.
+    vector< pair<size_t, uint32_t> > clusterSizeVector;   // first:cluster size, second: clusterId
+    for(const auto& p: clusterSize) {
+        clusterSizeVector.push_back(make_pair(p.second, p.first));
+    }
+    sort(clusterSizeVector.begin(), clusterSizeVector.end(), std::greater< pair<size_t, size_t> >());
+    out << "Cluster sizes:";
+    for(size_t newClusterId=0; newClusterId<clusterSizeVector.size(); newClusterId++) {
+        const auto& p = clusterSizeVector[newClusterId];
+        out << " " << p.first;
+    }
+    out << endl;
+    map<uint32_t, uint32_t> clusterMap; // Key: old clusterId. Value: new clusterId.
+    for(uint32_t newClusterId=0; newClusterId<clusterSizeVector.size(); newClusterId++) {
+        const uint32_t oldClusterId = clusterSizeVector[newClusterId].second;
+        clusterMap.insert(make_pair(oldClusterId, newClusterId));
+    }
+
+    // Update the vertices to reflect the new cluster numbering.
+    for(CellId v=0; v<n; v++) {
+        clusterIds[v] = clusterMap[clusterIds[v]];
+    }
+
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    out << timestamp << "Clustering by label propagation completed in " << t01 << " s." << endl;
+}
@@ -0,0 +1,248 @@
+#ifndef CZI_EXPRESSION_MATRIX2_COMPACT_CELL_GRAPH_HPP
+#define CZI_EXPRESSION_MATRIX2_COMPACT_CELL_GRAPH_HPP
+
+
+// Class CompactCellGraph is an undirected cell graph stored in
+// compressed sparse row (CSR) format: for each vertex, the neighbors
+// and the similarities of the corresponding edges are stored
+// contiguously, sorted by neighbor. Each undirected edge
+// is stored twice, once for each of its vertices.
+
+// The vertices are the cells of a cell set, and are identified
+// by their index in the cell set (local cell ids).
+// Because cell sets are sorted, vertices are in order of increasing global CellId.
+// This order is preserved when isolated vertices are removed.
+
+// This uses a few bytes per edge and can be created in parallel.
+// Class CellGraph derives from it and adds the vertex properties
+// used for display and the graph layout (see CellGraph.hpp).
+// It is created from a SimilarPairs object (or its compact form,
+// see CompactSimilarPairs.hpp), selecting edges as follows:
+// for each cell, the best up to maxConnectivity pairs with similarity
+// at least similarityThreshold and with the other cell also in the cell set.
+// The edges are then symmetrized: an edge is created if either of
+// its vertices selected it. If both did, the edge similarity is
+// the one stored for the vertex with the lowest CellId.
+
+// In addition to the edges, the vertices carry properties used by
+// the graph algorithms (cluster ids for label propagation clustering
+// and positions of the graph layout), also stored in contiguous arrays
+// indexed by vertex. The arrays can be stored in anonymous memory
+// or in memory mapped files, in which case the graph
+// persists and can be accessed again later.
+
+// Construction runs in a few passes over the vertices, each on multiple threads:
+// - Select the pairs of each vertex.
+// - Count, for each vertex, the pairs selected by it and the pairs
+//   selected by other vertices that point to it, then store both
+//   kinds of pairs in a temporary CSR layout with these counts.
+// - Sort the pairs of each vertex by neighbor and remove duplicates.
+// - Copy the pairs to their final CSR position.
+
+#include "CellSets.hpp"
+#include "Ids.hpp"
+#include "MemoryMappedVector.hpp"
+
+#include "algorithm.hpp"
+#include "array.hpp"
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "iosfwd.hpp"
+#include "string.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class CompactCellGraph;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::CompactCellGraph {
+public:
+
+    // Create the graph from a SimilarPairs object,
+    // using threadCount threads (0 = use all hardware threads).
+    // If the compact form of the SimilarPairs object exists, it is used.
+    // If name is empty, the graph is stored in anonymous memory.
+    // Otherwise, it is stored in memory mapped files with names
+    // beginning with name, and persists after this object is destroyed.
+    CompactCellGraph(
+        const CellSet& cellSet,             // The cell set to be used.
+        const string& directoryName,
+        const string& similarPairsName,     // The name of the SimilarPairs object to be used to create the graph.
+        double similarityThreshold,         // The minimum similarity to create an edge.
+        size_t maxConnectivity,             // The maximum number of neighbors selected by each vertex.
+        size_t threadCount = 0,
+        const string& name = "");
+
+    // Create a copy of another graph, with the same vertices,
+    // edges, cluster ids, and positions, stored in memory mapped files
+    // with names beginning with name.
+    CompactCellGraph(const CompactCellGraph&, const string& name);
+
+    // Access a graph previously stored in memory mapped files.
+    // If allowReadOnly is true and read-write access is not possible,
+    // the graph is accessed read-only and cannot be modified.
+    CompactCellGraph(const string& name, bool allowReadOnly);
+
+    // Return true if a graph was stored in memory mapped files with the given name.
+    static bool exists(const string& name);
+
+    // Remove the memory mapped files, if any.
+    void remove();
+
+    // Return the name passed in when the graph was created or accessed,
+    // which is empty if the graph is stored in anonymous memory.
+    const string& getName() const
+    {
+        return name;
+    }
+
+    // Disallow C++ copy and assignment.
+    CompactCellGraph(const CompactCellGraph&) = delete;
+    CompactCellGraph& operator=(const CompactCellGraph&) = delete;
+
+    // Only keep an edge if it is one of the best k edges for either
+    // of the two vertices. This turns the graph into a k-nearest-neighbor graph.
+    // The best edges are those with the highest similarity,
+    // with ties broken by neighbor.
+    void keepBestEdgesOnly(size_t k, size_t threadCount = 0);
+
+    // Remove isolated vertices and return the number of vertices that were removed.
+    // The remaining vertices are renumbered, keeping their order.
+    size_t removeIsolatedVertices();
+
+    CellId vertexCount() const
+    {
+        return CellId(cellIds.size());
+    }
+
+    // Return the number of undirected edges.
+    size_t edgeCount() const
+    {
+        return neighbors.size() / 2;
+    }
+
+    // Return the global CellId corresponding to a vertex.
+    CellId getCellId(CellId v) const
+    {
+        return cellIds[v];
+    }
+
+    // Return the vertex corresponding to a global CellId,
+    // or invalidCellId if the cell is not in the graph.
+    CellId getVertex(CellId cellId) const
+    {
+        const CellId* it = std::lower_bound(cellIds.begin(), cellIds.end(), cellId);
+        if(it == cellIds.end() || *it != cellId) {
+            return invalidCellId;
+        } else {
+            return CellId(it - cellIds.begin());
+        }
+    }
+
+    // Access the neighbors of a vertex, sorted by increasing vertex id,
+    // and the similarities of the corresponding edges.
+    size_t degree(CellId v) const
+    {
+        return offsets[v + 1] - offsets[v];
+    }
+    const CellId* neighborsBegin(CellId v) const
+    {
+        return neighbors.begin() + offsets[v];
+    }
+    const CellId* neighborsEnd(CellId v) const
+    {
+        return neighbors.begin() + offsets[v + 1];
+    }
+    const float* similaritiesBegin(CellId v) const
+    {
+        return similarities.begin() + offsets[v];
+    }
+
+    // Vertex properties.
+    uint32_t& clusterId(CellId v)
+    {
+        return clusterIds[v];
+    }
+    uint32_t clusterId(CellId v) const
+    {
+        return clusterIds[v];
+    }
+    array<double, 2>& position(CellId v)
+    {
+        return positions[v];
+    }
+    const array<double, 2>& position(CellId v) const
+    {
+        return positions[v];
+    }
+
+    // Compute minimum and maximum coordinates of all the vertices.
+    void computeCoordinateRange(
+        double& xMin,
+        double& xMax,
+        double& yMin,
+        double& yMax) const;
+
+    // Clustering using the label propagation algorithm.
+    // The cluster each vertex is assigned to is stored in its clusterId.
+    // Each vertex moves to the cluster with the highest total similarity
+    // among its neighbors, with ties broken in favor of the lowest cluster id,
+    // so the clusters only depend on the graph and the seed.
+    void labelPropagationClustering(
+        ostream&,
+        size_t seed,                            // Seed for random number generator.
+        size_t stableIterationCountThreshold,   // Stop after this many iterations without changes.
+        size_t maxIterationCount                // Stop after this many iterations no matter what.
+        );
+
+protected:
+
+    // Throw an exception if the graph was accessed read-only.
+    void checkWriteAccess() const;
+
+private:
+
+    // The name passed in when the graph was created or accessed.
+    string name;
+
+    // The global CellId of each vertex.
+    MemoryMapped::Vector<CellId> cellIds;
+
+    // For each vertex, the index of its first neighbor
+    // in neighbors and similarities. There is an additional entry at the end.
+    MemoryMapped::Vector<uint64_t> offsets;
+
+    // The neighbors of all vertices, and the corresponding similarities.
+    MemoryMapped::Vector<CellId> neighbors;
+    MemoryMapped::Vector<float> similarities;
+
+    // The cluster id and position of each vertex.
+    MemoryMapped::Vector<uint32_t> clusterIds;
+    MemoryMapped::Vector< array<double, 2> > positions;
+
+    // Create the vectors, in anonymous memory if name is empty,
+    // or else in memory mapped files with names beginning with name.
+    void createNew(const string& name, CellId vertexCount, uint64_t entryCount);
+    template<class T> static void createNew(
+        MemoryMapped::Vector<T>&,
+        const string& name,
+        const string& suffix,
+        size_t n);
+
+    // A pair stored for a vertex during construction.
+    // When symmetrizing, a pair selected by vertex v0 with neighbor v1
+    // is stored for both v0 and v1. The flag indicates whether
+    // the pair was selected by the neighbor rather than
+    // by the vertex it is stored for.
+    class Entry {
+    public:
+        CellId neighbor;
+        float similarity;
+        bool selectedByNeighbor;
+    };
+};
+
+#endif
@@ -0,0 +1,186 @@
+// Class CompactSimilarPairs is a compact, read-only form
+// of a SimilarPairs object. See CompactSimilarPairs.hpp for details.
+
+#include "CompactSimilarPairs.hpp"
+#include "filesystem.hpp"
+#include "GeneSet.hpp"
+#include "orderPairs.hpp"
+#include "parallelFor.hpp"
+#include "SimilarPairs.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "vector.hpp"
+
+
+
+// Create the compact form of an existing SimilarPairs object.
+// The neighbors of each cell are encoded in two passes over the cells,
+// each running on multiple threads. The first pass computes the
+// number of bytes needed by each cell, which are then used
+// to fill the table of contents. In the second pass, each thread
+// stores the pairs of the cells it processes in their final position.
+CompactSimilarPairs::CompactSimilarPairs(
+    const string& directoryName,
+    const string& similarPairsName,
+    const SimilarPairs& similarPairs,
+    size_t threadCount)
+{
+    const CellId cellCount = similarPairs.cellCount();
+    const size_t batchSize = 1024;
+
+    // Access the cell set used by the SimilarPairs object.
+    cellSet.accessExisting(directoryName + "/CellSet-" + similarPairs.getCellSetName(), false);
+
+    // Create the info object and fill it in.
+    const string pathBaseName = getPathBaseName(directoryName, similarPairsName);
+    info.createNew(pathBaseName + "Info");
+    info->k = similarPairs.k();
+    info->geneSetName = similarPairs.getGeneSetName();
+    GeneSet geneSet;
+    geneSet.accessExisting(directoryName + "/GeneSet-" + similarPairs.getGeneSetName(), true);
+    info->geneSetHash = geneSet.genes().hash();
+    info->cellSetName = similarPairs.getCellSetName();
+    info->cellSetHash = cellSet.hash();
+
+    // Pass 1: compute the number of bytes needed for the neighbors of each cell.
+    // The pairs of each cell are sorted by CellId.
+    toc.createNew(pathBaseName + "Toc", cellCount + 1);
+    parallelFor(cellCount, batchSize, threadCount,
+        [&](size_t, size_t begin, size_t end)
+        {
+            vector<SimilarPairs::Pair> pairs;
+            for(CellId cellId=CellId(begin); cellId!=CellId(end); cellId++) {
+                pairs.assign(similarPairs.begin(cellId), similarPairs.end(cellId));
+                sort(pairs.begin(), pairs.end(), OrderPairsByFirstOnly<SimilarPairs::Pair>());
+                uint64_t byteCount = 0;
+                CellId previousCellId = 0;
+                for(const SimilarPairs::Pair& p: pairs) {
+                    byteCount += encodedSize(p.first - previousCellId);
+                    previousCellId = p.first;
+                }
+                toc[cellId].neighborBegin = byteCount;
+                toc[cellId].similarityBegin = pairs.size();
+            }
+        });
+
+    // Convert the sizes to positions.
+    uint64_t neighborBegin = 0;
+    uint64_t similarityBegin = 0;
+    for(CellId cellId=0; cellId!=cellCount+1; cellId++) {
+        Toc& t = toc[cellId];
+        const uint64_t byteCount = (cellId == cellCount) ? 0 : t.neighborBegin;
+        const uint64_t pairCount = (cellId == cellCount) ? 0 : t.similarityBegin;
+        t.neighborBegin = neighborBegin;
+        t.similarityBegin = similarityBegin;
+        neighborBegin += byteCount;
+        similarityBegin += pairCount;
+    }
+
+    // Pass 2: store the neighbors and similarities.
+    neighbors.createNew(pathBaseName + "Neighbors", neighborBegin);
+    similarities.createNew(pathBaseName + "Similarities", similarityBegin);
+    parallelFor(cellCount, batchSize, threadCount,
+        [&](size_t, size_t begin, size_t end)
+        {
+            vector<SimilarPairs::Pair> pairs;
+            for(CellId cellId=CellId(begin); cellId!=CellId(end); cellId++) {
+                pairs.assign(similarPairs.begin(cellId), similarPairs.end(cellId));
+                sort(pairs.begin(), pairs.end(), OrderPairsByFirstOnly<SimilarPairs::Pair>());
+                uint8_t* p = neighbors.begin() + toc[cellId].neighborBegin;
+                uint16_t* q = similarities.begin() + toc[cellId].similarityBegin;
+                CellId previousCellId = 0;
+                for(const SimilarPairs::Pair& pair: pairs) {
+                    p = encode(pair.first - previousCellId, p);
+                    *q++ = quantizeSimilarity(pair.second);
+                    previousCellId = pair.first;
+                }
+                CZI_ASSERT(p == neighbors.begin() + toc[cellId + 1].neighborBegin);
+            }
+        });
+}
+
+
+
+// Access an existing CompactSimilarPairs object.
+CompactSimilarPairs::CompactSimilarPairs(
+    const string& directoryName,
+    const string& similarPairsName)
+{
+    const string pathBaseName = getPathBaseName(directoryName, similarPairsName);
+    info.accessExistingReadOnly(pathBaseName + "Info");
+    toc.accessExistingReadOnly(pathBaseName + "Toc");
+    neighbors.accessExistingReadOnly(pathBaseName + "Neighbors");
+    similarities.accessExistingReadOnly(pathBaseName + "Similarities");
+    cellSet.accessExisting(directoryName + "/CellSet-" + string(info->cellSetName), false);
+    GeneSet geneSet;
+    geneSet.accessExisting(directoryName + "/GeneSet-" + string(info->geneSetName), true);
+
+    // Check that all is good.
+    if(geneSet.genes().hash() != info->geneSetHash) {
+        throw runtime_error("Hash for gene set " + string(info->geneSetName) +
+            " is not consistent with the value at the time compact SimilarPairs object " +
+            similarPairsName + " was created.");
+    }
+    if(cellSet.hash() != info->cellSetHash) {
+        throw runtime_error("Hash for cell set " + string(info->cellSetName) +
+            " is not consistent with the value at the time compact SimilarPairs object " +
+            similarPairsName + " was created.");
+    }
+    if(toc.size() != cellSet.size() + 1) {
+        throw runtime_error("Compact SimilarPairs object " +
+            similarPairsName + " has table of contents of inconsistent length.");
+    }
+    if(toc.back().neighborBegin != neighbors.size() ||
+        toc.back().similarityBegin != similarities.size()) {
+        throw runtime_error("Compact SimilarPairs object " +
+            similarPairsName + " has inconsistent table of contents.");
+    }
+}
+
+
+
+// Return true if a CompactSimilarPairs object with the given name exists.
+bool CompactSimilarPairs::exists(
+    const string& directoryName,
+    const string& similarPairsName)
+{
+    return filesystem::exists(getPathBaseName(directoryName, similarPairsName) + "Info");
+}
+
+
+
+// Close and remove the supporting files.
+void CompactSimilarPairs::remove()
+{
+    toc.remove();
+    neighbors.remove();
+    similarities.remove();
+    info.remove();
+}
+
+
+
+// Remove the supporting files of a CompactSimilarPairs object
+// with the given name, if they exist, without accessing it.
+void CompactSimilarPairs::remove(
+    const string& directoryName,
+    const string& similarPairsName)
+{
+    const string pathBaseName = getPathBaseName(directoryName, similarPairsName);
+    for(const char* suffix: {"Toc", "Neighbors", "Similarities", "Info"}) {
+        const string fileName = pathBaseName + suffix;
+        if(filesystem::exists(fileName)) {
+            filesystem::remove(fileName);
+        }
+    }
+}
+
+
+
+string CompactSimilarPairs::getPathBaseName(
+    const string& directoryName,
+    const string& similarPairsName)
+{
+    return directoryName + "/SimilarPairs-" + similarPairsName + "-Compact";
+}
@@ -0,0 +1,316 @@
+#ifndef CZI_EXPRESSION_MATRIX2_COMPACT_SIMILAR_PAIRS_HPP
+#define CZI_EXPRESSION_MATRIX2_COMPACT_SIMILAR_PAIRS_HPP
+
+
+// Class CompactSimilarPairs is a compact, read-only form
+// of a SimilarPairs object, stored in memory mapped files
+// next to the SimilarPairs object and with the same name.
+
+// A SimilarPairs object stores k pairs for every cell,
+// at 8 bytes per pair, even for cells with fewer than k pairs.
+// The compact form only stores the pairs actually used,
+// in a compressed sparse row (CSR) layout:
+// - The neighbors of each cell are sorted by CellId and stored
+//   as variable length integers (7 bits per byte, with the most significant
+//   bit of each byte set if more bytes follow). The first neighbor is stored
+//   as is, and the following ones as the difference with the previous one.
+//   For typical cell sets this uses one or two bytes per pair.
+// - The similarities are quantized to 16 bits, in the same order
+//   as the neighbors. The quantization error is at most 1.6e-5.
+// - A table of contents gives, for each cell, the position of the
+//   first byte of its neighbors and of its first similarity.
+// The total is typically around 4 bytes per stored pair.
+
+// The pairs are accessed directly in the memory mapped files,
+// without copying: CompactSimilarPairs::operator[] returns
+// a lightweight range object whose iterators decode the neighbors on the fly.
+
+// As for SimilarPairs, all cell ids are local to the cell set
+// used by the SimilarPairs object (see the warning in SimilarPairs.hpp).
+
+#include "CellSets.hpp"
+#include "CZI_ASSERT.hpp"
+#include "Ids.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedVector.hpp"
+#include "ShortStaticString.hpp"
+
+#include "algorithm.hpp"
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+#include <cmath>
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class CompactSimilarPairs;
+        class SimilarPairs;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::CompactSimilarPairs {
+public:
+
+    // Create the compact form of an existing SimilarPairs object,
+    // using threadCount threads (0 = use all hardware threads).
+    CompactSimilarPairs(
+        const string& directoryName,
+        const string& similarPairsName,
+        const SimilarPairs&,
+        size_t threadCount = 0);
+
+    // Access an existing CompactSimilarPairs object.
+    CompactSimilarPairs(
+        const string& directoryName,
+        const string& similarPairsName);
+
+    // Return true if a CompactSimilarPairs object with the given name exists.
+    static bool exists(
+        const string& directoryName,
+        const string& similarPairsName);
+
+    // Close and remove the supporting files.
+    void remove();
+
+    // Remove the supporting files of a CompactSimilarPairs object
+    // with the given name, if they exist, without accessing it.
+    // This is used when a SimilarPairs object with the same name is created,
+    // so a stale compact form is never used in place of the new pairs.
+    static void remove(
+        const string& directoryName,
+        const string& similarPairsName);
+
+    // The type used for a single pair. (The first cell is implied).
+    typedef pair<CellId, float> Pair;
+
+    // Quantization of similarities to 16 bits.
+    static uint16_t quantizeSimilarity(double similarity)
+    {
+        const double s = min(1., max(-1., similarity));
+        return uint16_t(std::lround((s + 1.) * quantizationScale));
+    }
+    static float dequantizeSimilarity(uint16_t q)
+    {
+        return float(double(q) / quantizationScale - 1.);
+    }
+
+    // Iterator over the pairs of a cell, sorted by CellId.
+    // It decodes the neighbors as it moves forward.
+    class const_iterator {
+    public:
+        Pair operator*() const
+        {
+            return Pair(cellId, dequantizeSimilarity(*similarity));
+        }
+        const_iterator& operator++()
+        {
+            ++similarity;
+            if(similarity != similarityEnd) {
+                cellId += decode(neighbor);
+            }
+            return *this;
+        }
+        bool operator==(const const_iterator& that) const
+        {
+            return similarity == that.similarity;
+        }
+        bool operator!=(const const_iterator& that) const
+        {
+            return similarity != that.similarity;
+        }
+    private:
+        friend class CompactSimilarPairs;
+        const_iterator(
+            const uint8_t* neighbor,
+            const uint16_t* similarity,
+            const uint16_t* similarityEnd) :
+            neighbor(neighbor),
+            similarity(similarity),
+            similarityEnd(similarityEnd),
+            cellId(0)
+        {
+            if(similarity != similarityEnd) {
+                cellId = decode(this->neighbor);
+            }
+        }
+        const uint8_t* neighbor;    // The next byte to be decoded.
+        const uint16_t* similarity;
+        const uint16_t* similarityEnd;
+        CellId cellId;
+    };
+
+    // The pairs of a cell, sorted by CellId.
+    class Pairs {
+    public:
+        const_iterator begin() const
+        {
+            return beginIterator;
+        }
+        const_iterator end() const
+        {
+            return endIterator;
+        }
+        size_t size() const
+        {
+            return n;
+        }
+        bool empty() const
+        {
+            return n == 0;
+        }
+    private:
+        friend class CompactSimilarPairs;
+        Pairs(const_iterator beginIterator, const_iterator endIterator, size_t n) :
+            beginIterator(beginIterator), endIterator(endIterator), n(n) {}
+        const_iterator beginIterator;
+        const_iterator endIterator;
+        size_t n;
+    };
+    Pairs operator[](CellId cellId) const
+    {
+        const Toc& toc0 = toc[cellId];
+        const Toc& toc1 = toc[cellId + 1];
+        const uint16_t* similarityBegin = similarities.begin() + toc0.similarityBegin;
+        const uint16_t* similarityEnd = similarities.begin() + toc1.similarityBegin;
+        return Pairs(
+            const_iterator(neighbors.begin() + toc0.neighborBegin, similarityBegin, similarityEnd),
+            const_iterator(0, similarityEnd, similarityEnd),
+            similarityEnd - similarityBegin);
+    }
+
+    // Return the number of pairs stored for a cell.
+    size_t size(CellId cellId) const
+    {
+        return toc[cellId + 1].similarityBegin - toc[cellId].similarityBegin;
+    }
+
+    // Return the total number of pairs stored.
+    size_t totalSize() const
+    {
+        return similarities.size();
+    }
+
+    // Return the total number of bytes used by the memory mapped files,
+    // excluding headers.
+    size_t byteCount() const
+    {
+        return
+            toc.size() * sizeof(Toc) +
+            neighbors.size() * sizeof(uint8_t) +
+            similarities.size() * sizeof(uint16_t);
+    }
+
+    // Return k, the maximum number of pairs stored for each cell
+    // in the SimilarPairs object this was created from.
+    size_t k() const
+    {
+        return info->k;
+    }
+
+    CellId cellCount() const
+    {
+        return CellId(cellSet.size());
+    }
+
+    // Conversions between local and global cell ids,
+    // as in SimilarPairs.
+    CellId getGlobalCellId(CellId localCellId) const
+    {
+        CZI_ASSERT(localCellId < cellSet.size());
+        return cellSet[localCellId];
+    }
+    CellId getLocalCellId(CellId globalCellId) const
+    {
+        const auto it = std::lower_bound(cellSet.begin(), cellSet.end(), globalCellId);
+        if(it == cellSet.end() || *it != globalCellId) {
+            return invalidCellId;
+        } else {
+            return CellId(it - cellSet.begin());
+        }
+    }
+
+    const CellSet& getCellSet() const
+    {
+        return cellSet;
+    }
+    string getGeneSetName() const
+    {
+        return info->geneSetName;
+    }
+    string getCellSetName() const
+    {
+        return info->cellSetName;
+    }
+
+private:
+
+    static constexpr double quantizationScale = 32767.5;
+
+    // Small size information stored in a memory mapped object.
+    class Info {
+    public:
+        size_t k;
+        StaticString255 geneSetName;
+        uint64_t geneSetHash;
+        StaticString255 cellSetName;
+        uint64_t cellSetHash;
+    };
+    MemoryMapped::Object<Info> info;
+
+    // The table of contents, indexed by CellId,
+    // with one additional entry at the end.
+    class Toc {
+    public:
+        uint64_t neighborBegin;     // Index in neighbors.
+        uint64_t similarityBegin;   // Index in similarities.
+    };
+    MemoryMapped::Vector<Toc> toc;
+
+    // The neighbors of all cells, delta coded as variable length integers.
+    MemoryMapped::Vector<uint8_t> neighbors;
+
+    // The quantized similarities of all pairs.
+    MemoryMapped::Vector<uint16_t> similarities;
+
+    // The cell set used by the SimilarPairs object.
+    CellSet cellSet;
+
+    static string getPathBaseName(
+        const string& directoryName,
+        const string& similarPairsName);
+
+    // Encode and decode a variable length integer.
+    static size_t encodedSize(CellId x)
+    {
+        size_t n = 1;
+        while(x >= 0x80) {
+            x >>= 7;
+            ++n;
+        }
+        return n;
+    }
+    static uint8_t* encode(CellId x, uint8_t* p)
+    {
+        while(x >= 0x80) {
+            *p++ = uint8_t(x | 0x80);
+            x >>= 7;
+        }
+        *p++ = uint8_t(x);
+        return p;
+    }
+    static CellId decode(const uint8_t*& p)
+    {
+        CellId x = *p & 0x7f;
+        int shift = 7;
+        while(*p++ & 0x80) {
+            x |= CellId(*p & 0x7f) << shift;
+            shift += 7;
+        }
+        return x;
+    }
+};
+
+#endif
@@ -1,10 +1,13 @@
 #include "ExpressionMatrix.hpp"
 #include "CellGraph.hpp"
 #include "ClusterGraph.hpp"
+#include "CompactCellGraph.hpp"
 #include "filesystem.hpp"
+#include "MemoryMappedObject.hpp"
 #include "orderPairs.hpp"
+#include "parallelFor.hpp"
 #include "randIndex.hpp"
-#include "SimilarPairs.hpp"
+#include "sparseKernels.hpp"
 #include "timestamp.hpp"
 #include "tokenize.hpp"
 using namespace ChanZuckerberg;
@@ -120,6 +123,12 @@ void ExpressionMatrix::accessExisting(bool allowReadOnly)
     cellMetaDataValues.accessExistingReadWrite(directoryName + "/" + "CellMetaDataValues", allowReadOnly);
     cellMetaDataNamesUsageCount.accessExistingReadWrite(directoryName + "/" + "CellMetaDataNamesUsageCount", allowReadOnly);
     cellExpressionCounts.accessExistingReadWrite(directoryName + "/" + "CellExpressionCounts", allowReadOnly);
+    if(filesystem::exists(directoryName + "/" + "SplitCellExpressionCounts.toc")) {
+        splitCellExpressionCounts.accessExistingReadWrite(directoryName + "/" + "SplitCellExpressionCounts", allowReadOnly);
+    }
+    if(filesystem::exists(directoryName + "/" + "GeneExpressionCounts.slots")) {
+        geneExpressionCounts.accessExistingReadWrite(directoryName + "/" + "GeneExpressionCounts", allowReadOnly);
+    }
 
     // Access the cell sets.
     cellSets.accessExisting(directoryName, allowReadOnly);
@@ -142,10 +151,15 @@ void ExpressionMatrix::accessExisting(bool allowReadOnly)
         throw runtime_error("Gene set \"AllGenes\" is missing.");
     }
 
+    // Access the cell graphs stored by storeCellGraph.
+    accessStoredCellGraphs(allowReadOnly);
+
     // Sanity checks.
     CZI_ASSERT(cellNames.size() == cells.size());
     CZI_ASSERT(cellMetaData.size() == cells.size());
     CZI_ASSERT(cellExpressionCounts.size() == cells.size());
+    CZI_ASSERT(!splitCellExpressionCounts.isOpen() || splitCellExpressionCounts.size() == cells.size());
+    CZI_ASSERT(!geneExpressionCounts.isOpen() || geneExpressionCounts.size() == geneCount());
     CZI_ASSERT(cellSets.cellSets["AllCells"]->size() == cells.size());
     CZI_ASSERT(cellMetaDataNamesUsageCount.size() == cellMetaDataNames.size());
     CZI_ASSERT(geneSets["AllGenes"].size() == geneCount());
@@ -154,6 +168,221 @@ void ExpressionMatrix::accessExisting(bool allowReadOnly)
 
 
 
+// Create splitCellExpressionCounts from cellExpressionCounts.
+// This is a one time conversion for an existing ExpressionMatrix.
+void ExpressionMatrix::createSplitCellExpressionCounts()
+{
+    if(splitCellExpressionCounts.isOpen()) {
+        throw runtime_error("Split cell expression counts already exist.");
+    }
+    cout << timestamp << "Creating split cell expression counts." << endl;
+    splitCellExpressionCounts.createNew(directoryName + "/" + "SplitCellExpressionCounts");
+    splitCellExpressionCounts.reserve(cellExpressionCounts.size(), cellExpressionCounts.totalSize());
+    for(CellId cellId=0; cellId!=cellExpressionCounts.size(); cellId++) {
+        splitCellExpressionCounts.appendVector(
+            cellExpressionCounts.begin(cellId),
+            cellExpressionCounts.end(cellId));
+    }
+    CZI_ASSERT(splitCellExpressionCounts.size() == cells.size());
+    CZI_ASSERT(splitCellExpressionCounts.totalSize() == cellExpressionCounts.totalSize());
+    cout << timestamp << "Split cell expression counts created." << endl;
+}
+
+
+
+void ExpressionMatrix::removeSplitCellExpressionCounts()
+{
+    if(!splitCellExpressionCounts.isOpen()) {
+        throw runtime_error("Split cell expression counts do not exist.");
+    }
+    splitCellExpressionCounts.remove();
+}
+
+
+
+// Create geneExpressionCounts from cellExpressionCounts.
+// This is a one time conversion for an existing ExpressionMatrix.
+// The cells are divided into one contiguous range for each thread.
+// In a first pass, each thread counts the expression counts
+// for each gene in its range of cells. This determines
+// where each thread stores the counts for each gene,
+// so in the second pass each thread can store the counts
+// for its cells without synchronization, and the counts for
+// each gene end up sorted by CellId.
+void ExpressionMatrix::createGeneExpressionCounts(size_t threadCount)
+{
+    if(geneExpressionCounts.isOpen()) {
+        throw runtime_error("Gene expression counts already exist.");
+    }
+    const CellId cellCount = CellId(cells.size());
+    const GeneId geneCount = this->geneCount();
+    threadCount = getThreadCount(threadCount);
+    const size_t chunkCount = threadCount;
+    const size_t chunkSize = (size_t(cellCount) + chunkCount - 1) / chunkCount;
+    cout << timestamp << "Creating gene expression counts using " << threadCount << " threads." << endl;
+
+    // Pass 1: count the expression counts for each gene, in each range of cells.
+    vector< vector<uint64_t> > chunkCounts(chunkCount, vector<uint64_t>(geneCount, 0));
+    parallelFor(chunkCount, 1, threadCount,
+        [&](size_t threadId, size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t chunk=chunkBegin; chunk!=chunkEnd; chunk++) {
+                vector<uint64_t>& counts = chunkCounts[chunk];
+                const CellId begin = CellId(min(chunk*chunkSize, size_t(cellCount)));
+                const CellId end = CellId(min((chunk+1)*chunkSize, size_t(cellCount)));
+                for(CellId cellId=begin; cellId!=end; cellId++) {
+                    for(const auto& p: cellExpressionCounts[cellId]) {
+                        ++counts[p.first];
+                    }
+                }
+            }
+        });
+
+    // Allocate the gene expression counts. Replace the counts for each range of cells
+    // with the position where that range begins in the counts of each gene.
+    vector<uint64_t> sizes(geneCount, 0);
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        for(size_t chunk=0; chunk!=chunkCount; chunk++) {
+            uint64_t& n = chunkCounts[chunk][geneId];
+            const uint64_t chunkGeneCount = n;
+            n = sizes[geneId];
+            sizes[geneId] += chunkGeneCount;
+        }
+    }
+    geneExpressionCounts.createNew(directoryName + "/" + "GeneExpressionCounts");
+    geneExpressionCounts.initialize(sizes);
+
+    // Pass 2: store the counts.
+    parallelFor(chunkCount, 1, threadCount,
+        [&](size_t threadId, size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t chunk=chunkBegin; chunk!=chunkEnd; chunk++) {
+                vector<uint64_t>& positions = chunkCounts[chunk];
+                const CellId begin = CellId(min(chunk*chunkSize, size_t(cellCount)));
+                const CellId end = CellId(min((chunk+1)*chunkSize, size_t(cellCount)));
+                for(CellId cellId=begin; cellId!=end; cellId++) {
+                    for(const auto& p: cellExpressionCounts[cellId]) {
+                        geneExpressionCounts.begin(p.first)[positions[p.first]++] = make_pair(cellId, p.second);
+                    }
+                }
+            }
+        });
+    CZI_ASSERT(geneExpressionCounts.totalSize() == cellExpressionCounts.totalSize());
+    cout << timestamp << "Gene expression counts created." << endl;
+}
+
+
+
+void ExpressionMatrix::removeGeneExpressionCounts()
+{
+    if(!geneExpressionCounts.isOpen()) {
+        throw runtime_error("Gene expression counts do not exist.");
+    }
+    geneExpressionCounts.remove();
+}
+
+
+
+// Get the non-zero expression counts for a gene, for the cells in a cell set.
+// On return, counts contains pairs (local CellId, count).
+void ExpressionMatrix::getGeneExpressionCounts(
+    GeneId geneId,
+    const CellSet& cellSet,
+    vector< pair<CellId, float> >& counts) const
+{
+    counts.clear();
+    const CellId* cellSetBegin = cellSet.begin();
+    const CellId* cellSetEnd = cellSet.end();
+
+    // If we don't have the gene-major copy of the expression counts,
+    // do a binary search in the expression counts of each cell.
+    if(!geneExpressionCounts.isOpen()) {
+        for(const CellId* it=cellSetBegin; it!=cellSetEnd; ++it) {
+            const float count = getCellExpressionCount(*it, geneId);
+            if(count != 0.) {
+                counts.push_back(make_pair(CellId(it - cellSetBegin), count));
+            }
+        }
+        return;
+    }
+
+    // If the cell set contains all cells, local and global CellIds are the same.
+    const pair<CellId, float>* begin = geneExpressionCounts.begin(geneId);
+    const pair<CellId, float>* end = geneExpressionCounts.end(geneId);
+    if(cellSet.size() == cells.size()) {
+        counts.insert(counts.end(), begin, end);
+        return;
+    }
+
+    // Otherwise, locate each of the cells expressing this gene in the cell set.
+    // The cells are sorted by CellId, so each search can begin
+    // where the previous one ended.
+    const CellId* position = cellSetBegin;
+    for(const pair<CellId, float>* it=begin; it!=end; ++it) {
+        position = std::lower_bound(position, cellSetEnd, it->first);
+        if(position == cellSetEnd) {
+            break;
+        }
+        if(*position == it->first) {
+            counts.push_back(make_pair(CellId(position - cellSetBegin), it->second));
+        }
+    }
+}
+
+
+
+// Get a dense representation of the expression counts for a gene set and cell set,
+// indexed by [localGeneId][localCellId], using geneExpressionCounts.
+// The sums used for normalization only include genes in the gene set,
+// and are accumulated in order of increasing GeneId,
+// as in ExpressionMatrixSubset.
+void ExpressionMatrix::getDenseRepresentationFromGeneExpressionCounts(
+    const GeneSet& geneSet,
+    const CellSet& cellSet,
+    NormalizationMethod normalizationMethod,
+    vector< vector<float> >& v) const
+{
+    CZI_ASSERT(geneExpressionCounts.isOpen());
+    const GeneId geneCount = geneSet.size();
+    const CellId cellCount = CellId(cellSet.size());
+    v.clear();
+    v.resize(geneCount, vector<float>(cellCount, 0.));
+
+    vector<double> sum1(cellCount, 0.);
+    vector<double> sum2(cellCount, 0.);
+    vector< pair<CellId, float> > counts;
+    for(GeneId localGeneId=0; localGeneId!=geneCount; localGeneId++) {
+        getGeneExpressionCounts(geneSet.getGlobalGeneId(localGeneId), cellSet, counts);
+        vector<float>& x = v[localGeneId];
+        for(const auto& p: counts) {
+            const CellId localCellId = p.first;
+            const float count = p.second;
+            x[localCellId] = count;
+            sum1[localCellId] += count;
+            sum2[localCellId] += count*count;
+        }
+    }
+
+    // Normalize the expression vector of each cell, if requested.
+    if(normalizationMethod != NormalizationMethod::none) {
+        CZI_ASSERT(normalizationMethod != NormalizationMethod::Invalid);
+        for(CellId cellId=0; cellId!=cellCount; cellId++) {
+            const double scaling =
+                (normalizationMethod==NormalizationMethod::L1) ?
+                    sum1[cellId] :
+                    sqrt(sum2[cellId]);
+            if(scaling != 0.) {
+                const float factor = float(1./scaling);
+                for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+                    v[geneId][cellId] *= factor;
+                }
+            }
+        }
+    }
+}
+
+
+
 // Add a cell to the expression matrix.
 // The meta data is passed as a vector of names and values, which are all strings.
 // The cell name should be entered as meta data "CellName".
@@ -276,6 +505,22 @@ CellId ExpressionMatrix::addCell(
         }
     }
 
+    // Also store them in the structure of arrays copy, if we have one.
+    if(splitCellExpressionCounts.isOpen()) {
+        splitCellExpressionCounts.appendVector(storedExpressionCounts.begin(), storedExpressionCounts.end());
+    }
+
+    // Also store them in the gene-major copy, if we have one.
+    // The new cell has the largest CellId, so the
+    // counts for each gene remain sorted by CellId.
+    if(geneExpressionCounts.isOpen()) {
+        const CellId cellId = CellId(cells.size());
+        geneExpressionCounts.resize(geneCount());
+        for(const auto& p: storedExpressionCounts) {
+            geneExpressionCounts.append(p.first, make_pair(cellId, p.second));
+        }
+    }
+
     // Add this cell to the AllCells set.
     cellSets.cellSets["AllCells"]->push_back(CellId(cells.size()));
 
@@ -1076,6 +1321,24 @@ vector< pair<GeneId, float> > ExpressionMatrix::getCellExpressionCounts(CellId c
 
 
 
+vector< pair<GeneId, float> > ExpressionMatrix::getSplitCellExpressionCounts(CellId cellId) const
+{
+    if(!splitCellExpressionCounts.isOpen()) {
+        throw runtime_error("Split cell expression counts do not exist.");
+    }
+    CZI_ASSERT(cellId < splitCellExpressionCounts.size());
+    vector< pair<GeneId, float> > returnVector;
+    returnVector.reserve(splitCellExpressionCounts.size(cellId));
+    const GeneId* geneIds = splitCellExpressionCounts.firstBegin(cellId);
+    const float* counts = splitCellExpressionCounts.secondBegin(cellId);
+    for(size_t i=0; i<splitCellExpressionCounts.size(cellId); i++) {
+        returnVector.push_back(make_pair(geneIds[i], counts[i]));
+    }
+    return returnVector;
+}
+
+
+
 // Get the expression count for a given gene, for a specified set of cells.
 // Each position in the returned vector has the count for
 // the cell at the same position in the input vector.
@@ -1084,6 +1347,20 @@ vector<float> ExpressionMatrix::getCellsExpressionCount(const vector<CellId>& ce
 {
     vector<float> returnVector;
     returnVector.reserve(cellIds.size());
+
+    // If we have the gene-major copy of the expression counts,
+    // look up the cells in the counts for this gene.
+    if(geneExpressionCounts.isOpen()) {
+        const pair<CellId, float>* begin = geneExpressionCounts.begin(geneId);
+        const pair<CellId, float>* end = geneExpressionCounts.end(geneId);
+        for(const CellId cellId: cellIds) {
+            const auto it = std::lower_bound(begin, end, cellId,
+                [](const pair<CellId, float>& p, CellId cellId) {return p.first < cellId;});
+            returnVector.push_back((it!=end && it->first==cellId) ? it->second : 0.f);
+        }
+        return returnVector;
+    }
+
     for(const CellId cellId: cellIds) {
         returnVector.push_back(getCellExpressionCount(cellId, geneId));
     }
@@ -1398,27 +1675,23 @@ pair<double, double> ExpressionMatrix::computeMetaDataRandIndex(
 double ExpressionMatrix::computeCellSimilarity(CellId cellId0, CellId cellId1) const
 {
     // Compute the scalar product of the expression counts for the two cells.
-    typedef pair<GeneId, float>const* Iterator;
-    const Iterator begin0 = cellExpressionCounts.begin(cellId0);
-    const Iterator end0 = cellExpressionCounts.end(cellId0);
-    const Iterator begin1 = cellExpressionCounts.begin(cellId1);
-    const Iterator end1 = cellExpressionCounts.end(cellId1);
-    Iterator it0 = begin0;
-    Iterator it1 = begin1;
-    double scalarProduct = 0.;
-    while((it0 != end0) && (it1 != end1)) {
-        const GeneId geneId0 = it0->first;
-        const GeneId geneId1 = it1->first;
-
-        if(geneId0 < geneId1) {
-            ++it0;
-        } else if(geneId1 < geneId0) {
-            ++it1;
-        } else {
-            scalarProduct += it0->second * it1->second;
-            ++it0;
-            ++it1;
-        }
+    // This uses a SIMD sorted set intersection kernel
+    // selected at run time (see sparseKernels.hpp).
+    // If available, use the structure of arrays copy of the expression counts,
+    // which lets the kernel load GeneIds directly.
+    double scalarProduct;
+    if(splitCellExpressionCounts.isOpen()) {
+        scalarProduct = SparseKernels::computeScalarProduct(
+            splitCellExpressionCounts.firstBegin(cellId0),
+            splitCellExpressionCounts.secondBegin(cellId0),
+            splitCellExpressionCounts.size(cellId0),
+            splitCellExpressionCounts.firstBegin(cellId1),
+            splitCellExpressionCounts.secondBegin(cellId1),
+            splitCellExpressionCounts.size(cellId1));
+    } else {
+        scalarProduct = SparseKernels::computeScalarProduct(
+            cellExpressionCounts.begin(cellId0), cellExpressionCounts.end(cellId0),
+            cellExpressionCounts.begin(cellId1), cellExpressionCounts.end(cellId1));
     }
 
     // Compute the correlation coefficient.
@@ -1791,14 +2064,15 @@ vector<string> ExpressionMatrix::getCellGraphNames() const
 
 
 // Create a new graph.
-// Graphs are not persistent (they are stored in memory only).
+// Graphs are stored in memory only, unless storeCellGraph is called.
 void ExpressionMatrix::createCellGraph(
     const string& graphName,            // The name of the graph to be created. This is used as a key in the graph map.
     const string& cellSetName,          // The cell set to be used.
     const string& similarPairsName,     // The name of the SimilarPairs object to be used to create the graph.
     double similarityThreshold,         // The minimum similarity to create an edge.
     size_t maxConnectivity,             // The maximum number of neighbors (k of the k-NN graph).
-    bool keepIsolatedVertices
+    bool keepIsolatedVertices,
+    size_t threadCount                  // The number of threads used to create the graph (0 = use all).
     )
 {
     // A graph with this name should not already exist.
@@ -1814,13 +2088,16 @@ void ExpressionMatrix::createCellGraph(
     const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
 
     // Create the graph.
+    // It is created directly in compressed sparse row format (see CompactCellGraph.hpp),
+    // which is also the format used to store it.
     typedef shared_ptr<CellGraph> GraphSharedPointer;
     const GraphSharedPointer graph = make_shared<CellGraph>(
         cellSet,
         directoryName,
         similarPairsName,
         similarityThreshold,
-        maxConnectivity
+        maxConnectivity,
+        threadCount
         );
 
     // Create the GraphInformation object that will be stored with the graph.
@@ -1836,8 +2113,8 @@ void ExpressionMatrix::createCellGraph(
     } else {
         graphInformation.isolatedRemovedVertexCount = graph->removeIsolatedVertices();
     }
-    graphInformation.vertexCount = num_vertices(*graph);
-    graphInformation.edgeCount = num_edges(*graph);
+    graphInformation.vertexCount = graph->vertexCount();
+    graphInformation.edgeCount = graph->edgeCount();
 
     // Store it.
     cellGraphs.insert(make_pair(graphName, make_pair(graphInformation, graph)));
@@ -1859,8 +2136,112 @@ void ExpressionMatrix::computeCellGraphLayout(const string& graphName)
     if(!cellGraph.layoutWasComputed) {
         cellGraph.computeLayout();
         cellGraph.layoutWasComputed = true;
+
+        // If the graph is stored, the positions are already in its
+        // memory mapped files. Also record that the layout was computed.
+        const string name = directoryName + "/CellGraph-" + graphName;
+        if(cellGraph.getName() == name) {
+            MemoryMapped::Object<StoredCellGraphInformation> storedInformation;
+            storedInformation.accessExistingReadWrite(name + "-Info");
+            storedInformation->layoutWasComputed = true;
+        }
+    }
+
+}
+
+
+
+// Store a cell graph in memory mapped files.
+// The graph is stored in compressed sparse row format (see CompactCellGraph.hpp),
+// together with its CellGraphInformation, and is accessed again
+// the next time this ExpressionMatrix is accessed.
+// The graph in the cellGraphs map is replaced by the stored graph,
+// so later clustering and layout computations are also stored.
+void ExpressionMatrix::storeCellGraph(const string& graphName)
+{
+    // Locate the graph.
+    const auto it = cellGraphs.find(graphName);
+    if(it == cellGraphs.end()) {
+        throw runtime_error("Graph " + graphName + " does not exist.");
+    }
+    const CellGraphInformation& graphInformation = it->second.first;
+    shared_ptr<CellGraph>& graph = it->second.second;
+
+    // Store the graph, unless it is already stored.
+    // The stored copy, if any, is replaced.
+    const string name = directoryName + "/CellGraph-" + graphName;
+    if(graph->getName() != name) {
+        removeStoredCellGraph(graphName);
+        {
+            const CompactCellGraph compactCellGraph(*graph, name);
+        }
+        const shared_ptr<CellGraph> storedGraph = make_shared<CellGraph>(name, false);
+        storedGraph->layoutWasComputed = graph->layoutWasComputed;
+        graph = storedGraph;
+    }
+
+    // Store the graph information.
+    MemoryMapped::Object<StoredCellGraphInformation> storedInformation;
+    if(filesystem::exists(name + "-Info")) {
+        storedInformation.accessExistingReadWrite(name + "-Info");
+    } else {
+        storedInformation.createNew(name + "-Info");
+    }
+    storedInformation->cellSetName = graphInformation.cellSetName;
+    storedInformation->similarPairsName = graphInformation.similarPairsName;
+    storedInformation->similarityThreshold = graphInformation.similarityThreshold;
+    storedInformation->maxConnectivity = graphInformation.maxConnectivity;
+    storedInformation->isolatedRemovedVertexCount = graphInformation.isolatedRemovedVertexCount;
+    storedInformation->layoutWasComputed = graph->layoutWasComputed;
+}
+
+
+
+// Access the cell graphs stored by storeCellGraph.
+// Each of them is accessed in place in its memory mapped files
+// and added to the cellGraphs map.
+void ExpressionMatrix::accessStoredCellGraphs(bool allowReadOnly)
+{
+    const string fileNamePrefix = directoryName + "/CellGraph-";
+    const string fileNameSuffix = "-Info";
+    const vector<string> directoryContents = filesystem::directoryContents(directoryName);
+    for(string graphName: directoryContents) {
+        // Here, graphName is the entire file name.
+        if(!stripPrefixAndSuffix(fileNamePrefix, fileNameSuffix, graphName)) {
+            continue;
+        }
+        // Here, graphName contains just the graph name.
+        const string name = fileNamePrefix + graphName;
+        MemoryMapped::Object<StoredCellGraphInformation> storedInformation;
+        storedInformation.accessExistingReadOnly(name + "-Info");
+        const shared_ptr<CellGraph> graph = make_shared<CellGraph>(name, allowReadOnly);
+        graph->layoutWasComputed = storedInformation->layoutWasComputed;
+
+        CellGraphInformation graphInformation;
+        graphInformation.cellSetName = storedInformation->cellSetName;
+        graphInformation.similarPairsName = storedInformation->similarPairsName;
+        graphInformation.similarityThreshold = storedInformation->similarityThreshold;
+        graphInformation.maxConnectivity = storedInformation->maxConnectivity;
+        graphInformation.isolatedRemovedVertexCount = storedInformation->isolatedRemovedVertexCount;
+        graphInformation.vertexCount = graph->vertexCount();
+        graphInformation.edgeCount = graph->edgeCount();
+        cellGraphs.insert(make_pair(graphName, make_pair(graphInformation, graph)));
     }
+}
+
 
+
+// Remove the stored copy of a cell graph, if there is one.
+void ExpressionMatrix::removeStoredCellGraph(const string& graphName)
+{
+    const string name = directoryName + "/CellGraph-" + graphName;
+    if(CompactCellGraph::exists(name)) {
+        CompactCellGraph compactCellGraph(name, true);
+        compactCellGraph.remove();
+    }
+    if(filesystem::exists(name + "-Info")) {
+        filesystem::remove(name + "-Info");
+    }
 }
 
 
@@ -1881,8 +2262,10 @@ vector<CellGraphVertexInfo> ExpressionMatrix::getCellGraphVertices(const string&
 
     // Fill the return vector by looping over all vertices.
     vector<CellGraphVertexInfo> vertexInfos;
-    BGL_FORALL_VERTICES(v, cellGraph, CellGraph) {
-        vertexInfos.push_back(cellGraph[v]);
+    for(CellId v=0; v<cellGraph.vertexCount(); v++) {
+        CellGraphVertexInfo vertexInfo(cellGraph.getCellId(v));
+        vertexInfo.position = cellGraph.position(v);
+        vertexInfos.push_back(vertexInfo);
     }
     return vertexInfos;
 }
@@ -1901,13 +2284,15 @@ vector< pair<CellId, CellId> > ExpressionMatrix::getCellGraphEdges(const string&
     const CellGraph& cellGraph = *(it->second.second);
 
     // Loop over graph edges.
+    // Each edge is stored twice, so we only use it for the vertex with the lower vertex id.
     vector< pair<CellId, CellId> > v;
-    BGL_FORALL_EDGES(e, cellGraph, CellGraph) {
-        const CellGraph::vertex_descriptor v0 = source(e, cellGraph);
-        const CellGraph::vertex_descriptor v1 = target(e, cellGraph);
-        const CellGraphVertex& vertex0 = cellGraph[v0];
-        const CellGraphVertex& vertex1 = cellGraph[v1];
-        v.push_back(make_pair(vertex0.cellId, vertex1.cellId));
+    for(CellId v0=0; v0<cellGraph.vertexCount(); v0++) {
+        for(const CellId* it=cellGraph.neighborsBegin(v0); it!=cellGraph.neighborsEnd(v0); ++it) {
+            const CellId v1 = *it;
+            if(v1 > v0) {
+                v.push_back(make_pair(cellGraph.getCellId(v0), cellGraph.getCellId(v1)));
+            }
+        }
     }
     return v;
 }
@@ -1924,12 +2309,11 @@ void ExpressionMatrix::storeClusterId(
     const StringId metaDataNameStringId = cellMetaDataNames[metaDataName];
 
     // Loop over all vertices in the graph.
-    BGL_FORALL_VERTICES(v, graph, CellGraph) {
-        const CellGraphVertex& vertex = graph[v];
+    for(CellId v=0; v<graph.vertexCount(); v++) {
 
         // Extract the cell id and the cluster id.
-        const CellId cellId = vertex.cellId;
-        const uint32_t clusterId = vertex.clusterId;
+        const CellId cellId = graph.getCellId(v);
+        const uint32_t clusterId = graph.clusterId(v);
 
         // Store the cluster id as cell meta data.
         // If the name already exists for this cell, the value is replaced.
@@ -1941,26 +2325,110 @@ void ExpressionMatrix::storeClusterId(
 
 // Compute gene information content in bits for a given gene set and cell set,
 // using the specified normalization method.
-// We do it one gene at a time to avoid the need for an amount of
-// memory proportional to the product of the number of cells
-// times the number of genes.
+// The information content of a gene is
+// log(N) + sum_i p_i log(p_i), with p_i = c_i / S, S = sum_i c_i,
+// and where N is the number of cells and c_i are the expression counts
+// of the gene in each cell. This can also be written as
+// log(N) + T/S - log(S), with T = sum_i c_i log(c_i),
+// so we only need to accumulate S and T for each gene.
+// This allows us to do the computation in a single pass over the
+// expression counts of the cells in the cell set,
+// without the need for an amount of memory proportional to the number
+// of cells times the number of genes.
+// The cells are divided into a fixed number of chunks, and S and T
+// are accumulated separately for each chunk, then added in chunk order,
+// so the result is the same for any number of threads.
 void ExpressionMatrix::computeGeneInformationContent(
     const GeneSet& geneSet,
     const CellSet& cellSet,
     NormalizationMethod normalizationMethod,
-    vector<float>& geneInformationContent) const
+    vector<float>& geneInformationContent,
+    size_t threadCount) const
 {
-    geneInformationContent.reserve(geneSet.size());
-    geneInformationContent.clear();
-    uint64_t processedCount = 0;
-    for(const GeneId geneId : geneSet) {
-        if((processedCount>0) &&  ((processedCount%100)==0)) {
-            cout << timestamp << "Processed "  << processedCount << " genes of " << geneSet.size() << endl;
+    const GeneId geneCount = geneSet.size();
+    const CellId cellCount = CellId(cellSet.size());
+    threadCount = getThreadCount(threadCount);
+    cout << timestamp << "Computing information content for " << geneCount <<
+        " genes and " << cellCount << " cells using " << threadCount << " threads." << endl;
+
+    // Sums of the expression counts (S) and of c log(c) (T) for each gene,
+    // indexed by [chunk][localGeneId].
+    // We also need the sum of the positive counts, which is
+    // the same as S unless some counts are negative.
+    // The cells are divided into a fixed number of contiguous chunks,
+    // independent of the number of threads. The sums for each chunk
+    // are accumulated in cell order and then added in chunk order,
+    // so the result does not depend on the number of threads
+    // or on how the chunks are assigned to threads.
+    class Sums {
+    public:
+        double s = 0.;
+        double positiveS = 0.;
+        double t = 0.;
+    };
+    const size_t chunkCount = 64;
+    const size_t chunkSize = (size_t(cellCount) + chunkCount - 1) / chunkCount;
+    vector< vector<Sums> > chunkSums(chunkCount, vector<Sums>(geneCount));
+
+    // Accumulate the sums for each gene, one cell at a time.
+    parallelFor(chunkCount, 1, threadCount,
+        [&](size_t threadId, size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t chunk=chunkBegin; chunk!=chunkEnd; chunk++) {
+                vector<Sums>& sums = chunkSums[chunk];
+                const size_t begin = min(chunk*chunkSize, size_t(cellCount));
+                const size_t end = min((chunk+1)*chunkSize, size_t(cellCount));
+                for(size_t i=begin; i!=end; i++) {
+                    const CellId cellId = cellSet[i];
+                    const Cell& cell = cells[cellId];
+                    float factor = 1.;
+                    switch(normalizationMethod) {
+                    case NormalizationMethod::L1:
+                        factor = float(cell.norm1Inverse);
+                        break;
+                    case NormalizationMethod::L2:
+                        factor = float(cell.norm2Inverse);
+                        break;
+                    default:
+                        break;
+                    }
+                    for(const auto& p: cellExpressionCounts[cellId]) {
+                        const GeneId localGeneId = geneSet.getLocalGeneId(p.first);
+                        if(localGeneId == invalidGeneId) {
+                            continue;
+                        }
+                        const float c = p.second * factor;
+                        Sums& geneSums = sums[localGeneId];
+                        geneSums.s += double(c);
+                        if(c > 0.) {
+                            geneSums.positiveS += double(c);
+                            geneSums.t += double(c) * log(double(c));
+                        }
+                    }
+                }
+            }
+        });
+
+    // Add the sums of all chunks and compute the information content.
+    geneInformationContent.resize(geneCount);
+    const double logCellCount = log(double(cellCount));
+    for(GeneId localGeneId=0; localGeneId!=geneCount; localGeneId++) {
+        Sums sums;
+        for(size_t chunk=0; chunk!=chunkCount; chunk++) {
+            const Sums& chunkGeneSums = chunkSums[chunk][localGeneId];
+            sums.s += chunkGeneSums.s;
+            sums.positiveS += chunkGeneSums.positiveS;
+            sums.t += chunkGeneSums.t;
+        }
+        double informationContent = logCellCount; // Equally distributed.
+        if(sums.positiveS > 0.) {
+            informationContent += (sums.t - sums.positiveS * log(sums.s)) / sums.s;
         }
-        processedCount++;
-        geneInformationContent.push_back(computeGeneInformationContent(geneId, cellSet, normalizationMethod));
-    }
 
+        // Convert to bits.
+        geneInformationContent[localGeneId] = float(informationContent / log(2.));
+    }
+    cout << timestamp << "Gene information content computation completed." << endl;
 }
 
 
@@ -1971,14 +2439,17 @@ float ExpressionMatrix::computeGeneInformationContent(
     NormalizationMethod normalizationMethod) const
 {
 
-    // Create a vector of expression counts for this gene and for all cells in the cell set,
-    // using the requested normalization.
+    // Create a vector of the non-zero expression counts for this gene
+    // in the cells of the cell set, using the requested normalization.
     // Note that we use the normalization defined using all genes.
+    // Zero counts don't contribute to the information content.
+    vector< pair<CellId, float> > geneCounts;
+    getGeneExpressionCounts(geneId, cellSet, geneCounts);
     vector<float> count;
-    count.reserve(cellSet.size());
-    for(const CellId cellId : cellSet) {
-        const Cell& cell = cells[cellId];
-        float c = getCellExpressionCount(cellId, geneId);
+    count.reserve(geneCounts.size());
+    for(const auto& p: geneCounts) {
+        const Cell& cell = cells[cellSet[p.first]];
+        float c = p.second;
         switch(normalizationMethod) {
         case NormalizationMethod::L1:
             c *= float(cell.norm1Inverse);
@@ -2127,8 +2598,7 @@ void ExpressionMatrix::createClusterGraph(
     }
     const CellGraphInformation& cellGraphInformation = it->second.first;
     const string& similarPairsName = cellGraphInformation.similarPairsName;
-    const SimilarPairs similarPairs(directoryName, similarPairsName, true);
-    const GeneSet& geneSet = similarPairs.getGeneSet();
+    const GeneSet& geneSet = getSimilarPairsGeneSet(similarPairsName);
     CellGraph& cellGraph = *(it->second.second);
 
 
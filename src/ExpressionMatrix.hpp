@@ -11,10 +11,13 @@
 #include "HttpServer.hpp"
 #include "Ids.hpp"
 #include "MemoryMappedVector.hpp"
+#include "MemoryMappedSplitVectorOfVectors.hpp"
+#include "MemoryMappedVectorOfAppendableVectors.hpp"
 #include "MemoryMappedVectorOfLists.hpp"
 #include "MemoryMappedVectorOfVectors.hpp"
 #include "MemoryMappedStringTable.hpp"
 #include "NormalizationMethod.hpp"
+#include "ShortStaticString.hpp"
 
 // Standard library.
 #include <limits>
@@ -35,9 +38,11 @@ namespace ChanZuckerberg {
         class ExpressionMatrixSubset;
         class GeneGraph;
         class Lsh;
+        class LshIndex;
         class ServerParameters;
         class SimilarPairs;
         class SignatureGraph;
+        class StoredCellGraphInformation;
 
     }
 }
@@ -65,6 +70,20 @@ public:
 
 
 
+// Class used to store a CellGraphInformation object in a memory mapped file
+// for a cell graph stored by ExpressionMatrix::storeCellGraph.
+class ChanZuckerberg::ExpressionMatrix2::StoredCellGraphInformation {
+public:
+    StaticString255 cellSetName;
+    StaticString255 similarPairsName;
+    double similarityThreshold;
+    uint64_t maxConnectivity;
+    uint64_t isolatedRemovedVertexCount;
+    bool layoutWasComputed;
+};
+
+
+
 // Class used to specify parameters when starting the http server.
 class ChanZuckerberg::ExpressionMatrix2::ServerParameters {
 public:
@@ -375,15 +394,18 @@ public:
 
     // Find similar cell pairs by looping over all pairs,
     // taking into account only genes in the specified gene set.
-    // This is O(N**2) slow because it loops over cell pairs.
-    // It typically takes of the order of 20 microseconds per pair.
-
+    // This is O(N**2) slow because it loops over cell pairs,
+    // but the similarities are exact.
+    // Blocks of cells are compared against all cells at once
+    // on threadCount threads, and the pairs stored
+    // for each cell (ties broken by CellId) don't depend on the number of threads.
     void findSimilarPairs0(
         const string& geneSetName,  // The name of the gene set to be used.
         const string& cellSetName,  // The name of the cell set to be used.
         const string& name,         // The name of the SimilarPairs object to be created.
         size_t k,                   // The maximum number of similar pairs to be stored for each cell.
-        double similarityThreshold
+        double similarityThreshold,
+        size_t threadCount = 0      // The number of threads to use, or 0 to use all hardware threads.
         );
     void findSimilarPairs0(
         ostream& out,
@@ -391,7 +413,8 @@ public:
         const string& cellSetName,  // The name of the cell set to be used.
         const string& name,         // The name of the SimilarPairs object to be created.
         size_t k,                   // The maximum number of similar pairs to be stored for each cell.
-        double similarityThreshold
+        double similarityThreshold,
+        size_t threadCount = 0      // The number of threads to use, or 0 to use all hardware threads.
         );
 
 
@@ -403,6 +426,8 @@ public:
     // It typically takes of the order of 15 nanoseconds per pair
     // (for lshCount=1024, which guarantees rms error 0.05 or better
     // on computed similarities).
+    // The computation runs on threadCount threads, and the pairs stored
+    // for each cell (ties broken by CellId) don't depend on the number of threads.
     void findSimilarPairs4(
         const string& geneSetName,      // The name of the gene set to be used.
         const string& cellSetName,      // The name of the cell set to be used.
@@ -410,7 +435,8 @@ public:
         size_t k,                       // The maximum number of similar pairs to be stored for each cell.
         double similarityThreshold,     // The minimum similarity for a pair to be stored.
         size_t lshCount,                // The number of LSH vectors to use.
-        unsigned int seed               // The seed used to generate the LSH vectors.
+        unsigned int seed,              // The seed used to generate the LSH vectors.
+        size_t threadCount = 0          // The number of threads to use, or 0 to use all hardware threads.
         );
     void findSimilarPairs4(
         ostream&,
@@ -420,7 +446,8 @@ public:
         size_t k,                       // The maximum number of similar pairs to be stored for each cell.
         double similarityThreshold,     // The minimum similarity for a pair to be stored.
         size_t lshCount,                // The number of LSH vectors to use.
-        unsigned int seed               // The seed used to generate the LSH vectors.
+        unsigned int seed,              // The seed used to generate the LSH vectors.
+        size_t threadCount = 0          // The number of threads to use, or 0 to use all hardware threads.
         );
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
     void findSimilarPairs4Gpu(
@@ -464,7 +491,8 @@ public:
         size_t k,                       // The maximum number of similar pairs to be stored for each cell.
         double similarityThreshold,     // The minimum similarity for a pair to be stored.
         size_t lshSliceLength,          // The number of bits in each LSH signature slice, or 0 for automatic selection.
-        size_t bucketOverflow           // If not zero, ignore buckets larger than this.
+        size_t bucketOverflow,          // If not zero, ignore buckets larger than this.
+        const string& lshIndexName = "" // The name of a persistent LshIndex to use or create, or empty for a temporary one.
         );
 
     // Find similar cell pairs using LSH and the Charikar algorithm.
@@ -478,6 +506,9 @@ public:
     // the permuted signatures - only the most significant permutedBitCount.
     // In practice it is best to set this to 64, so the permuted signatured
     // use only one 64-bit word each.
+    // The permutations are built and sorted in parallel, and the
+    // search for the neighbors of each cell also runs in parallel.
+    // Results do not depend on the number of threads.
     void findSimilarPairs6(
         const string& geneSetName,      // The name of the gene set to be used.
         const string& cellSetName,      // The name of the cell set to be used.
@@ -488,11 +519,16 @@ public:
         size_t permutationCount,        // The number of bit permutations for the Charikar algorithm.
         size_t searchCount,             // The number of cells checked for each cell, in the Charikar algorithm.
         size_t permutedBitCount,        // The number of most significant bits stored for each permuted signature.
-        int seed                        // The seed used to randomly generate the bit permutations.
+        int seed,                       // The seed used to randomly generate the bit permutations.
+        size_t threadCount = 0          // The number of threads to use, or 0 to use all hardware threads.
         );
 
     // Find similar cell pairs using the full LSH algorithm, without looping over all pairs.
     // Like findSimilarPairs5, but using variable lsh slice length.
+    // If probeCount is not zero, uses multi-probe LSH: for each slice, also probes
+    // the probeCount buckets obtained by flipping the signature bits with the
+    // smallest margins (see MultiProbe.hpp). This requires an Lsh object
+    // created with storeMargins=true.
     // This is prototype code.
     void findSimilarPairs7(
         const string& geneSetName,      // The name of the gene set to be used.
@@ -503,15 +539,59 @@ public:
         double similarityThreshold,     // The minimum similarity for a pair to be stored.
         const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
         CellId maxCheck,                // Maximum number of cells to consider for each cell.
-        size_t log2BucketCount
+        size_t log2BucketCount,
+        size_t threadCount = 0,         // The number of threads to use, or 0 to use all hardware threads.
+        const string& lshIndexName = "",// The name of a persistent LshIndex to use or create, or empty for a temporary one.
+        size_t probeCount = 0           // The number of additional buckets to probe for each slice (multi-probe LSH).
     );
-    void findSimilarPairs7AssignCellsToBuckets(
-        Lsh&,
-        const vector<int>& lshSliceLengths,                     // The number of signature slice bits, in decreasing order.
-        vector< vector< vector< size_t > > >& sliceBits3,       // The bits of each slice.
-        vector< vector< vector< vector<CellId> > > >& table4,   // The cells in each bucket.
-        size_t log2BucketCount
-        );
+
+    // Find similar cell pairs using a Hierarchical Navigable Small World (HNSW)
+    // graph built over the LSH signatures of the cells (see HnswIndex.hpp).
+    // If hnswName is not empty, the HNSW graph with that name is used
+    // (and created if it does not exist) and kept for reuse.
+    // Otherwise, a temporary HNSW graph is created and removed when done.
+    void findSimilarPairs8(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        const string& lshName,          // The name of the Lsh object to be used.
+        const string& similarPairsName, // The name of the SimilarPairs object to be created.
+        size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+        double similarityThreshold,     // The minimum similarity for a pair to be stored.
+        size_t M = 16,                  // The maximum number of neighbors in the HNSW graph at levels above 0.
+        size_t efConstruction = 200,    // The size of the dynamic candidate list when building the HNSW graph.
+        size_t efSearch = 100,          // The size of the dynamic candidate list when searching.
+        size_t threadCount = 0,         // The number of threads to use, or 0 to use all hardware threads.
+        const string& hnswName = "",    // The name of a persistent HNSW graph to use or create, or empty for a temporary one.
+        uint32_t seed = 231             // The seed used to assign levels to cells in the HNSW graph.
+    );
+    void findSimilarPairs8(
+        ostream&,
+        const string& geneSetName,
+        const string& cellSetName,
+        const string& lshName,
+        const string& similarPairsName,
+        size_t k,
+        double similarityThreshold,
+        size_t M,
+        size_t efConstruction,
+        size_t efSearch,
+        size_t threadCount,
+        const string& hnswName,
+        uint32_t seed
+    );
+
+    // Find cells similar to a given cell using an existing HNSW graph
+    // created by findSimilarPairs8.
+    // Cell ids are local to the cell set used to create the Lsh object.
+    // Returns pairs (localCellId, similarity), sorted by decreasing similarity.
+    vector< pair<CellId, double> > findSimilarCellsHnsw(
+        const string& lshName,
+        const string& hnswName,
+        CellId localCellId,
+        size_t k,
+        size_t efSearch = 100);
+    void removeHnswIndex(const string& lshName, const string& hnswName);
+
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
     // GPU version. See Lsh.cl for details.
     void findSimilarPairs7Gpu(
@@ -542,8 +622,37 @@ public:
         const string& cellSetName,      // The name of the cell set to be used.
         const string& lshName,          // The name of the Lsh object to be created.
         size_t lshCount,                // The number of LSH vectors to use.
-        unsigned int seed               // The seed used to generate the LSH vectors.
+        unsigned int seed,              // The seed used to generate the LSH vectors.
+        size_t threadCount = 0,         // The number of threads to use, or 0 to use all hardware threads.
+        bool streamLshVectors = false,  // Generate the LSH vectors in blocks without storing them (see Lsh.hpp).
+        bool storeMargins = false       // Also store the margins of the signature bits, for multi-probe LSH.
+        );
+
+    // Create a persistent LshIndex for an existing Lsh object (see LshIndex.hpp).
+    // The index can then be reused by findSimilarPairs5 and findSimilarPairs7
+    // by passing its name as lshIndexName.
+    void createLshIndex(
+        const string& lshName,          // The name of the Lsh object to be used.
+        const string& lshIndexName,     // The name of the LshIndex to be created.
+        const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
+        size_t log2BucketCount,
+        size_t threadCount = 0          // The number of threads to use, or 0 to use all hardware threads.
         );
+    void removeLshIndex(const string& lshName, const string& lshIndexName);
+    vector<string> getAvailableLshIndexes(const string& lshName) const;
+private:
+    // Access the LshIndex with the given name, creating it if it does not exist.
+    // If lshIndexName is empty, a temporary LshIndex is created,
+    // and its files are removed when the returned pointer is destroyed.
+    shared_ptr<LshIndex> accessLshIndex(
+        const string& lshName,
+        const string& lshIndexName,
+        const string& temporaryName,
+        Lsh&,
+        const vector<int>& lshSliceLengths,
+        size_t log2BucketCount,
+        size_t threadCount);
+public:
 
 
     // Analyze the quality of the LSH computation of cell similarity.
@@ -578,22 +687,49 @@ public:
         const string& similarPairsName0,
         const string& similarPairsName1);
 
-    // Remove a similar pairs object given its name.
+    // Create the compact form of a SimilarPairs object, which only stores
+    // the pairs actually used, with delta coded cell ids and 16-bit similarities
+    // (see CompactSimilarPairs.hpp). When it exists, createCellGraph
+    // uses it instead of the SimilarPairs object. If removeOriginal is true,
+    // the SimilarPairs object is removed, and only the compact form remains.
+    // Creating a new SimilarPairs object with the same name removes the compact form.
+    void compactSimilarPairs(
+        const string& name,
+        bool removeOriginal = false,
+        size_t threadCount = 0);
+
+    // Remove a similar pairs object given its name, including its compact form.
     // This throws an exception if the requested SimilarPairs object does not exist.
     void removeSimilarPairs(const string& name);
 
+    // Return the gene set used by a SimilarPairs object,
+    // which can exist in dense form, compact form, or both.
+    const GeneSet& getSimilarPairsGeneSet(const string& similarPairsName) const;
+
+    // Throw an exception if a SimilarPairs object only exists in compact form.
+    // Used by functions that need the similarities as originally stored.
+    void checkSimilarPairsNotCompactOnly(const string& similarPairsName) const;
+
 
     // Create a new cell graph.
-    // Graphs are not persistent (they are stored in memory only).
+    // Graphs are stored in memory only, unless storeCellGraph is called.
     void createCellGraph(
         const string& graphName,            // The name of the graph to be created. This is used as a key in the graph map.
         const string& cellSetName,          // The cell set to be used.
         const string& similarPairsName,     // The name of the SimilarPairs object to be used to create the graph.
         double similarityThreshold,         // The minimum similarity to create an edge.
         size_t k,                           // The maximum number of neighbors (k of the k-NN graph).
-        bool keepIsolatedVertices
+        bool keepIsolatedVertices,
+        size_t threadCount = 0              // The number of threads used to create the graph (0 = use all).
      );
 
+    // Store a cell graph, including its cluster ids and layout, in compressed
+    // sparse row format in memory mapped files (see CompactCellGraph.hpp).
+    // If the graph was already stored, the stored copy is replaced.
+    // From then on the graph is backed by the stored files, so later
+    // clustering and layout computations are stored as well.
+    void storeCellGraph(const string& graphName);
+
     // Unit test for class ExpressionMatrixSubset.
     void testExpressionMatrixSubset(CellId, CellId) const;
 
@@ -606,7 +742,8 @@ public:
         const string& similarGenePairsName,
         size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
         double similarityThreshold,
-        bool writeCsv
+        bool writeCsv,
+        size_t threadCount = 0      // The number of threads, or 0 to use all hardware threads.
         );
     void findSimilarGenePairs0(
         const string& geneSetName,
@@ -615,7 +752,69 @@ public:
         const string& similarGenePairsName,
         size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
         double similarityThreshold,
-        bool writeCsv
+        bool writeCsv,
+        size_t threadCount = 0      // The number of threads, or 0 to use all hardware threads.
+        );
+
+    // Find pairs of similar genes, using only the non-zero expression counts.
+    // This gives the same pairs as findSimilarGenePairs0
+    // (up to rounding of the similarities), but uses an amount of memory
+    // proportional to the number of non-zero expression counts,
+    // instead of the number of genes times the number of cells.
+    void findSimilarGenePairs1(
+        ostream&,
+        const string& geneSetName,
+        const string& cellSetName,
+        NormalizationMethod,
+        const string& similarGenePairsName,
+        size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
+        double similarityThreshold,
+        size_t threadCount = 0      // The number of threads, or 0 to use all hardware threads.
+        );
+    void findSimilarGenePairs1(
+        const string& geneSetName,
+        const string& cellSetName,
+        NormalizationMethod,
+        const string& similarGenePairsName,
+        size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
+        double similarityThreshold,
+        size_t threadCount = 0      // The number of threads, or 0 to use all hardware threads.
+        );
+
+    // Find pairs of similar genes using LSH, without looping over all pairs.
+    // The similarities stored are exact, but some pairs can be missed.
+    void findSimilarGenePairs2(
+        const string& geneSetName,
+        const string& cellSetName,
+        NormalizationMethod,
+        const string& similarGenePairsName,
+        size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
+        double similarityThreshold,
+        size_t lshCount,            // The number of LSH hyperplanes.
+        size_t lshSliceLength,      // The number of bits in each LSH signature slice, or 0 for automatic selection based on similarityThreshold.
+        unsigned int seed,          // The seed used to generate the LSH hyperplanes.
+        size_t threadCount = 0      // The number of threads, or 0 to use all hardware threads.
+        );
+
+    // Functions used by findSimilarGenePairs2 to choose the LSH slice length.
+    static double computeLshCollisionProbability(
+        double similarity,
+        size_t lshCount,
+        size_t lshSliceLength);
+    static size_t computeGeneLshSliceLength(
+        double similarityThreshold,
+        size_t lshCount,
+        double recall);
+
+    // Analyze the quality of the LSH computation of gene similarity
+    // used by findSimilarGenePairs2.
+    void analyzeGeneLsh(
+        const string& geneSetName,      // The name of the gene set to be used.
+        const string& cellSetName,      // The name of the cell set to be used.
+        NormalizationMethod,
+        size_t lshCount,                // The number of LSH vectors to use.
+        unsigned int seed,              // The seed used to generate the LSH vectors and to downsample.
+        double csvDownsample            // The fraction of pairs that will be included in the output spreadsheet.
         );
 
     // Remove a similar gene pairs object given its name.
@@ -733,9 +932,68 @@ private:
     // This is indexed by the CellId.
     MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t> cellExpressionCounts;
 
+    // Optional copy of the expression counts for each cell,
+    // with the GeneIds and counts stored in separate arrays
+    // (structure of arrays layout, see MemoryMapped::SplitVectorOfVectors).
+    // If present, it is kept up to date by addCell and used by the
+    // functions that scan expression counts in hot loops
+    // (currently computeCellSimilarity).
+    MemoryMapped::SplitVectorOfVectors<GeneId, float, uint64_t> splitCellExpressionCounts;
+
+    // Optional gene-major copy of the expression counts.
+    // For each gene, it contains pairs (CellId, count) for the cells
+    // in which the gene is expressed, sorted by increasing CellId.
+    // This is indexed by the GeneId.
+    // If present, it is kept up to date by addCell and used by gene-centric
+    // queries, which can then scan contiguous memory instead of
+    // doing a binary search in the expression counts of each cell.
+    MemoryMapped::VectorOfAppendableVectors< pair<CellId, float> > geneExpressionCounts;
+
+    // Get the non-zero expression counts for a gene, for the cells in a cell set.
+    // On return, counts contains pairs (local CellId, count),
+    // sorted by increasing local CellId, where the local CellId
+    // is the position of the cell in the cell set.
+    // This uses geneExpressionCounts if available.
+    void getGeneExpressionCounts(GeneId, const CellSet&, vector< pair<CellId, float> >& counts) const;
+
+    // Get a dense representation of the expression counts for a gene set and cell set,
+    // indexed by [localGeneId][localCellId], using geneExpressionCounts.
+    // This gives the same result as ExpressionMatrixSubset::getDenseRepresentation,
+    // without creating an ExpressionMatrixSubset.
+    void getDenseRepresentationFromGeneExpressionCounts(
+        const GeneSet&,
+        const CellSet&,
+        NormalizationMethod,
+        vector< vector<float> >&) const;
+
 
 
 public:
+
+    // Create geneExpressionCounts from cellExpressionCounts, using multiple threads.
+    // This only needs to be done once for each ExpressionMatrix:
+    // afterwards, geneExpressionCounts is accessed automatically
+    // when the ExpressionMatrix is accessed, and it is kept up to date
+    // when cells are added.
+    void createGeneExpressionCounts(size_t threadCount = 0);
+    void removeGeneExpressionCounts();
+    bool hasGeneExpressionCounts() const
+    {
+        return geneExpressionCounts.isOpen();
+    }
+
+    // Create splitCellExpressionCounts from cellExpressionCounts.
+    // This only needs to be done once for each ExpressionMatrix:
+    // afterwards, splitCellExpressionCounts is accessed automatically
+    // when the ExpressionMatrix is accessed, and it is kept up to date
+    // when cells are added.
+    void createSplitCellExpressionCounts();
+    void removeSplitCellExpressionCounts();
+    bool hasSplitCellExpressionCounts() const
+    {
+        return splitCellExpressionCounts.isOpen();
+    }
+
     // Accessors for expression counts, mostly used in Python.
     // The ones that specify a gene id or gene name can be slow,
     // as they require binary searches.
@@ -750,6 +1008,10 @@ public:
     // Get all the non-zero expression counts for a given cell.
     vector< pair<GeneId, float> > getCellExpressionCounts(CellId) const;
 
+    // Same as above, but reading them from splitCellExpressionCounts,
+    // which must exist. This is used to check that the two copies agree.
+    vector< pair<GeneId, float> > getSplitCellExpressionCounts(CellId) const;
+
     // Get the expression count for a given gene, for a specified set of cells.
     // Each position in the returned vector has the count for
     // the cell at the same position in the input vector.
@@ -892,6 +1154,7 @@ private:
     void removeCellSet(const vector<string>& request, ostream& html);
     void similarPairs(const vector<string>& request, ostream& html);
     void createSimilarPairs(const vector<string>& request, ostream& html);
+    void createSimilarPairsHnsw(const vector<string>& request, ostream& html);
     void removeSimilarPairs(const vector<string>& request, ostream& html);
     void exploreCellGraphs(const vector<string>& request, ostream& html);
     void compareCellGraphs(const vector<string>& request, ostream& html);
@@ -1007,11 +1270,15 @@ public:
 
     // Compute gene information content in bits for a given gene set and cell set,
     // using the specified normalization method.
+    // This makes a single pass over the expression counts of the cells
+    // in the cell set, using multiple threads.
+    // The result does not depend on the number of threads.
     void computeGeneInformationContent(
         const GeneSet&,
         const CellSet&,
         NormalizationMethod,
-        vector<float>& geneInformationContent) const;
+        vector<float>& geneInformationContent,
+        size_t threadCount = 0) const;
 
     // Same, for a single gene.
     float computeGeneInformationContent(GeneId, const CellSet&, NormalizationMethod) const;
@@ -1128,9 +1395,21 @@ public:
         int seed);
 
     // The cell similarity graphs.
-    // This is not persistent (lives in memory only).
+    // These live in memory, but they can be stored in memory mapped files
+    // (see storeCellGraph), in which case they are accessed again
+    // the next time this ExpressionMatrix is accessed.
+    // A stored graph is backed by its memory mapped files,
+    // so changes to its cluster ids and layout are also stored.
     map<string, pair<CellGraphInformation, shared_ptr<CellGraph> > > cellGraphs;
 
+    // Access the cell graphs stored by storeCellGraph.
+    // If allowReadOnly is true and read-write access is not possible,
+    // they are accessed read-only and cannot be modified.
+    void accessStoredCellGraphs(bool allowReadOnly);
+
+    // Remove the stored copy of a cell graph, if there is one.
+    void removeStoredCellGraph(const string& graphName);
+
     // Get the names of all currently defined cell similarity graphs.
     vector<string> getCellGraphNames() const;
 
@@ -1,14 +1,28 @@
 #include "ExpressionMatrix.hpp"
+#include "denseKernels.hpp"
 #include "ExpressionMatrixSubset.hpp"
-#include "heap.hpp"
+#include "Lsh.hpp"
+#include "LshIndex.hpp"
+#include "multipleSetUnion.hpp"
+#include "parallelFor.hpp"
+#include "RemoveOnExit.hpp"
 #include "SimilarGenePairs.hpp"
+#include "sparseKernels.hpp"
 #include "timestamp.hpp"
 #include "tokenize.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
+#include <boost/math/constants/constants.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_01.hpp>
+#include <boost/random/variate_generator.hpp>
+
+#include "algorithm.hpp"
+#include <cmath>
 #include "fstream.hpp"
-#include <numeric>
+#include <mutex>
+#include <sstream>
 
 
 
@@ -20,12 +34,13 @@ void ExpressionMatrix::findSimilarGenePairs0(
     const string& similarGenePairsName,
     size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
     double similarityThreshold,
-    bool writeCsv
+    bool writeCsv,
+    size_t threadCount
     )
 {
     findSimilarGenePairs0(cout, geneSetName, cellSetName,
         normalizationMethod, similarGenePairsName, k, similarityThreshold,
-        writeCsv);
+        writeCsv, threadCount);
 }
 void ExpressionMatrix::findSimilarGenePairs0(
     ostream& s,
@@ -35,7 +50,8 @@ void ExpressionMatrix::findSimilarGenePairs0(
     const string& similarGenePairsName,
     size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
     double similarityThreshold,
-    bool writeCsv
+    bool writeCsv,
+    size_t threadCount
     )
 {
     s << timestamp << "ExpressionMatrix::findSimilarGenePairs0 begins." << endl;
@@ -65,20 +81,25 @@ void ExpressionMatrix::findSimilarGenePairs0(
         throw runtime_error("Cell set " + cellSetName + " is empty.");
     }
 
-    // Create the expression matrix subset for this gene set and cell set.
-    s << timestamp << "Creating expression matrix subset." << endl;
-    const string expressionMatrixSubsetName =
-        directoryName + "/tmp-ExpressionMatrixSubset-" + similarGenePairsName;
-    ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
-
-
-
     // Create a dense expression vector for each gene.
     // All indices are local to the gene set and cell set.
-    s << timestamp << "Creating dense expression vectors." << endl;
+    // If we have the gene-major copy of the expression counts,
+    // we can do this directly, one gene at a time.
+    // Otherwise, we create the expression matrix subset
+    // for this gene set and cell set.
     vector< vector<float> > v;
-    expressionMatrixSubset.getDenseRepresentation(v, normalizationMethod);
+    if(geneExpressionCounts.isOpen()) {
+        s << timestamp << "Creating dense expression vectors from gene expression counts." << endl;
+        getDenseRepresentationFromGeneExpressionCounts(geneSet, cellSet, normalizationMethod, v);
+    } else {
+        s << timestamp << "Creating expression matrix subset." << endl;
+        const string expressionMatrixSubsetName =
+            directoryName + "/tmp-ExpressionMatrixSubset-" + similarGenePairsName;
+        ExpressionMatrixSubset expressionMatrixSubset(
+            expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, threadCount);
+        s << timestamp << "Creating dense expression vectors." << endl;
+        expressionMatrixSubset.getDenseRepresentation(v, normalizationMethod);
+    }
 
 
 
@@ -135,55 +156,161 @@ void ExpressionMatrix::findSimilarGenePairs0(
     }
 
 
-    // Vectors to store the similar genes for each gene.
+    // The similar genes for each gene, stored as a heap of at most k pairs
+    // (GeneId, similarity), with the worst pair at the top of the heap.
+    // Pairs with higher similarity are better. For equal similarity,
+    // pairs with lower GeneId are better, so the result does not depend
+    // on the order in which the pairs are found.
+    // Each gene has a mutex to protect its heap.
     vector< vector< pair<GeneId, float> > > similarGenes(geneCount);
+    vector<std::mutex> similarGenesMutexes(geneCount);
+    const auto isBetter = [](const pair<GeneId, float>& x, const pair<GeneId, float>& y)
+    {
+        return (x.second > y.second) || (x.second == y.second && x.first < y.first);
+    };
+
+    // Add a set of similar genes to the heap of a gene.
+    const auto addSimilarGenes = [&](GeneId geneId, const vector< pair<GeneId, float> >& newPairs)
+    {
+        if(newPairs.empty() || k == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(similarGenesMutexes[geneId]);
+        vector< pair<GeneId, float> >& heap = similarGenes[geneId];
+        for(const auto& p: newPairs) {
+            if(heap.size() < k) {
+                heap.push_back(p);
+                push_heap(heap.begin(), heap.end(), isBetter);
+            } else if(isBetter(p, heap.front())) {
+                pop_heap(heap.begin(), heap.end(), isBetter);
+                heap.back() = p;
+                push_heap(heap.begin(), heap.end(), isBetter);
+            }
+        }
+    };
 
     // Open the csv file, if requested.
+    // The csv file is written one tile at a time (see below),
+    // so the order of the lines in the file is not defined.
     ofstream csv;
+    std::mutex csvMutex;
     if(writeCsv) {
         csv.open(similarGenePairsName + ".csv");
     }
 
-    // Loop over gene pairs.
-    size_t pairsDone = 0;
-    size_t pairsStored = 0.;
-    const size_t totalPairCount = (size_t(geneCount) * (size_t(geneCount) - 1)) / 2;
-    s << timestamp << "Loop over gene pairs begins." << endl;
-    const size_t messageFrequency = size_t(1.e10/double(cellCount));
-    for(GeneId geneId0=1; geneId0!=geneCount; geneId0++) {
-        vector<float>& x0 = v[geneId0];
-        for(GeneId geneId1=0; geneId1!=geneId0; geneId1++, ++pairsDone) {
-            if(pairsDone>0 && (pairsDone % messageFrequency) == 0) {
-                s << timestamp << 100.*double(pairsDone)/double(totalPairCount) << "% done. ";
-                s << 100.*double(pairsStored)/double(pairsDone) << "% of gene pairs were stored.";
-                s << endl;
-            }
-            vector<float>& x1 = v[geneId1];
-            const float r = std::inner_product(x0.begin(), x0.end(), x1.begin(), 0.f);
-            if(r > similarityThreshold) {
-                ++pairsStored;
-                similarGenes[geneId0].push_back(make_pair(geneId1, r));
-                similarGenes[geneId1].push_back(make_pair(geneId0, r));
-            }
-            if(writeCsv) {
-                csv << geneNames[geneId0] << ",";
-                csv << geneNames[geneId1] << ",";
-                csv << r << "\n";
-                csv << geneNames[geneId1] << ",";
-                csv << geneNames[geneId0] << ",";
-                csv << r << "\n";
-            }
+
+
+    // Compute the similarity of all gene pairs, one tile at a time.
+    // A tile contains the gene pairs with the first gene in a block of
+    // geneBlockSize genes and the second gene in another block
+    // (or the same block, for the tiles on the diagonal).
+    // For each tile, we loop over blocks of cellBlockSize cells
+    // so the expression vectors used stay in cache.
+    // The full matrix of similarities is never stored.
+    // Each tile is processed by a single thread, so the results
+    // don't depend on the number of threads.
+    const size_t geneBlockSize = 32;
+    const size_t cellBlockSize = 512;
+    const size_t geneBlockCount = (geneCount + geneBlockSize - 1) / geneBlockSize;
+    vector< pair<size_t, size_t> > tiles;
+    for(size_t geneBlock0=0; geneBlock0!=geneBlockCount; geneBlock0++) {
+        for(size_t geneBlock1=0; geneBlock1<=geneBlock0; geneBlock1++) {
+            tiles.push_back(make_pair(geneBlock0, geneBlock1));
         }
     }
+    vector<const float*> x(geneCount);
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        x[geneId] = v[geneId].data();
+    }
 
+    threadCount = getThreadCount(threadCount);
+    s << timestamp << "Computing similarities of " << (size_t(geneCount) * (size_t(geneCount) - 1)) / 2 <<
+        " gene pairs in " << tiles.size() << " tiles using " << threadCount << " threads." << endl;
+    size_t tilesDone = 0;
+    size_t pairsStored = 0;
+    std::mutex progressMutex;
+    const size_t messageFrequency = max(size_t(1), size_t(1.e10/(double(cellCount)*double(geneBlockSize*geneBlockSize))));
+    parallelFor(tiles.size(), 1, threadCount,
+        [&](size_t threadId, size_t tileBegin, size_t tileEnd)
+        {
+            vector<float> r(geneBlockSize * geneBlockSize);
+            vector< vector< pair<GeneId, float> > > rowPairs(geneBlockSize);
+            vector< vector< pair<GeneId, float> > > columnPairs(geneBlockSize);
+            std::ostringstream csvTile;
+            for(size_t tile=tileBegin; tile!=tileEnd; tile++) {
+                const GeneId begin0 = GeneId(tiles[tile].first * geneBlockSize);
+                const GeneId end0 = GeneId(min(size_t(begin0) + geneBlockSize, size_t(geneCount)));
+                const GeneId begin1 = GeneId(tiles[tile].second * geneBlockSize);
+                const GeneId end1 = GeneId(min(size_t(begin1) + geneBlockSize, size_t(geneCount)));
+                const bool isDiagonal = (begin0 == begin1);
+                const size_t n0 = end0 - begin0;
+                const size_t n1 = end1 - begin1;
+
+                // Compute the scalar products for this tile.
+                fill(r.begin(), r.end(), 0.f);
+                for(size_t cellBegin=0; cellBegin<cellCount; cellBegin+=cellBlockSize) {
+                    const size_t cellEnd = min(cellBegin + cellBlockSize, size_t(cellCount));
+                    DenseKernels::accumulateScalarProducts(
+                        x.data() + begin0, n0, x.data() + begin1, n1,
+                        cellBegin, cellEnd, r.data(), geneBlockSize);
+                }
+
+                // Gather the pairs above threshold and add them to the heaps.
+                size_t tilePairsStored = 0;
+                for(size_t j=0; j!=n1; j++) {
+                    columnPairs[j].clear();
+                }
+                for(size_t i=0; i!=n0; i++) {
+                    const GeneId geneId0 = GeneId(begin0 + i);
+                    rowPairs[i].clear();
+                    const size_t jEnd = isDiagonal ? i : n1;
+                    for(size_t j=0; j!=jEnd; j++) {
+                        const GeneId geneId1 = GeneId(begin1 + j);
+                        const float similarity = r[i*geneBlockSize + j];
+                        if(similarity > similarityThreshold) {
+                            ++tilePairsStored;
+                            rowPairs[i].push_back(make_pair(geneId1, similarity));
+                            columnPairs[j].push_back(make_pair(geneId0, similarity));
+                        }
+                        if(writeCsv) {
+                            csvTile << geneNames[geneId0] << ",";
+                            csvTile << geneNames[geneId1] << ",";
+                            csvTile << similarity << "\n";
+                            csvTile << geneNames[geneId1] << ",";
+                            csvTile << geneNames[geneId0] << ",";
+                            csvTile << similarity << "\n";
+                        }
+                    }
+                }
+                for(size_t i=0; i!=n0; i++) {
+                    addSimilarGenes(GeneId(begin0 + i), rowPairs[i]);
+                }
+                for(size_t j=0; j!=n1; j++) {
+                    addSimilarGenes(GeneId(begin1 + j), columnPairs[j]);
+                }
+                if(writeCsv) {
+                    std::lock_guard<std::mutex> lock(csvMutex);
+                    csv << csvTile.str();
+                    csvTile.str("");
+                }
+
+                std::lock_guard<std::mutex> lock(progressMutex);
+                pairsStored += tilePairsStored;
+                ++tilesDone;
+                if((tilesDone % messageFrequency) == 0) {
+                    s << timestamp << 100.*double(tilesDone)/double(tiles.size()) << "% done." << endl;
+                }
+            }
+        });
+    s << timestamp << "Found " << pairsStored << " gene pairs with similarity above threshold." << endl;
 
 
-    // For each gene, keep only the k best and sort them.
+
+    // For each gene, sort the best k similar genes.
     s << timestamp << "Keeping best " << k << " pairs for each gene." << endl;
     size_t totalKept = 0;
     for(vector< pair<GeneId, float> >& v: similarGenes) {
-        keepBest(v, k, OrderPairsBySecondGreater< pair<GeneId, float> >());
-        sort(v.begin(), v.end(), OrderPairsBySecondGreater< pair<GeneId, float> >());
+        sort(v.begin(), v.end(), isBetter);
         totalKept += v.size();
     }
     s << "Average number of pairs kept per gene is " << double(totalKept)/geneCount << endl;
@@ -199,6 +326,632 @@ void ExpressionMatrix::findSimilarGenePairs0(
 
 
 
+// Compute the sum and the centered norm of the expression vector of each gene,
+// given the expression counts stored by gene (see
+// ExpressionMatrixSubset::createGeneExpressionCounts).
+// The centered norm is the norm of the expression vector shifted
+// to zero mean, or zero if the expression vector is constant.
+static void computeGeneSumsAndNorms(
+    const ExpressionMatrixSubset::GeneExpressionCounts& geneExpressionCounts,
+    CellId cellCount,
+    vector<double>& geneSums,
+    vector<double>& geneNorms)
+{
+    const GeneId geneCount = GeneId(geneExpressionCounts.size());
+    geneSums.resize(geneCount);
+    geneNorms.resize(geneCount);
+    for(GeneId geneId=0; geneId!=geneCount; geneId++) {
+        double sum = 0.;
+        double sum2 = 0.;
+        for(const float* it=geneExpressionCounts.secondBegin(geneId); it!=geneExpressionCounts.secondEnd(geneId); ++it) {
+            const double x = *it;
+            sum += x;
+            sum2 += x * x;
+        }
+        geneSums[geneId] = sum;
+        const double centeredSum2 = sum2 - sum * sum / double(cellCount);
+        geneNorms[geneId] = (centeredSum2 > 0.) ? sqrt(centeredSum2) : 0.;
+    }
+}
+
+
+
+// Sparse version of findSimilarGenePairs0.
+// Instead of creating a dense expression vector for each gene,
+// this uses the expression matrix subset (stored by cell)
+// and a copy of it stored by gene, so the storage used is proportional to the
+// number of non-zero expression counts, not to the number
+// of genes times the number of cells.
+// The similarity of genes a and b is the Pearson correlation coefficient
+// of their (normalized) expression counts over the cells of the cell set:
+//     r = (Dab - Sa Sb / N) / sqrt((Qa - Sa^2 / N) (Qb - Sb^2 / N))
+// where N is the number of cells, Sa and Qa are the sum and sum of squares
+// of the expression counts of gene a, and Dab is the scalar product
+// of the expression counts of genes a and b. Only Dab depends on the pair,
+// and it can be computed using the non-zero expression counts only.
+// Each thread computes all Dab for one gene a at a time, by looping over the
+// cells that express gene a and, for each of those cells,
+// over the genes it expresses, accumulating in a dense vector indexed by gene.
+// When a gene is done, its best k pairs are immediately stored
+// in the SimilarGenePairs object, so the pairs for all genes
+// are never kept in memory.
+// The result does not depend on the number of threads.
+void ExpressionMatrix::findSimilarGenePairs1(
+    const string& geneSetName,
+    const string& cellSetName,
+    NormalizationMethod normalizationMethod,
+    const string& similarGenePairsName,
+    size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
+    double similarityThreshold,
+    size_t threadCount
+    )
+{
+    findSimilarGenePairs1(cout, geneSetName, cellSetName,
+        normalizationMethod, similarGenePairsName, k, similarityThreshold,
+        threadCount);
+}
+void ExpressionMatrix::findSimilarGenePairs1(
+    ostream& s,
+    const string& geneSetName,
+    const string& cellSetName,
+    NormalizationMethod normalizationMethod,
+    const string& similarGenePairsName,
+    size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
+    double similarityThreshold,
+    size_t threadCount
+    )
+{
+    s << timestamp << "ExpressionMatrix::findSimilarGenePairs1 begins." << endl;
+    s << "Gene set: " << geneSetName << endl;
+    s << "Cell set: " << cellSetName << endl;
+    s << "Normalization method: " << normalizationMethodToLongString(normalizationMethod) << endl;
+
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+    const GeneId geneCount = geneSet.size();
+
+    // Locate the cell set and verify that it is not empty.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount == 0) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+
+    // Create the expression matrix subset for this gene set and cell set.
+    s << timestamp << "Creating expression matrix subset." << endl;
+    const string expressionMatrixSubsetName =
+        directoryName + "/tmp-ExpressionMatrixSubset-" + similarGenePairsName;
+    ExpressionMatrixSubset expressionMatrixSubset(
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, threadCount);
+    const auto& subsetCounts = expressionMatrixSubset.cellExpressionCounts;
+
+
+
+    // Get the normalization factor of each cell, and create a copy of the
+    // normalized expression counts stored by gene.
+    s << timestamp << "Creating expression counts by gene." << endl;
+    vector<float> cellFactors;
+    expressionMatrixSubset.getNormalizationFactors(normalizationMethod, cellFactors);
+    ExpressionMatrixSubset::GeneExpressionCounts geneExpressionCounts;
+    const RemoveOnExit<ExpressionMatrixSubset::GeneExpressionCounts> removeGeneExpressionCounts(geneExpressionCounts);
+    expressionMatrixSubset.createGeneExpressionCounts(
+        directoryName + "/tmp-GeneExpressionCounts-" + similarGenePairsName,
+        normalizationMethod, geneExpressionCounts);
+
+
+
+    // Compute the sum and the centered norm of the normalized
+    // expression counts of each gene.
+    vector<double> geneSums;
+    vector<double> geneNorms;
+    computeGeneSumsAndNorms(geneExpressionCounts, cellCount, geneSums, geneNorms);
+
+
+
+    // Create the SimilarGenePairs object, initially with no pairs.
+    SimilarGenePairs similarGenePairs(directoryName, similarGenePairsName,
+        geneSetName, cellSetName, k, normalizationMethod);
+
+    // Pairs with higher similarity are better. For equal similarity,
+    // pairs with lower GeneId are better.
+    const auto isBetter = [](const pair<GeneId, float>& x, const pair<GeneId, float>& y)
+    {
+        return (x.second > y.second) || (x.second == y.second && x.first < y.first);
+    };
+
+
+
+    // Find the similar genes of each gene.
+    threadCount = getThreadCount(threadCount);
+    s << timestamp << "Computing gene similarities using " << threadCount << " threads." << endl;
+    size_t genesDone = 0;
+    size_t totalKept = 0;
+    std::mutex progressMutex;
+    parallelFor(geneCount, 16, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            vector<double> scalarProducts(geneCount, 0.);
+            vector<SimilarGenePairs::Pair> similarGenes;
+            size_t kept = 0;
+            for(GeneId geneId0=GeneId(begin); geneId0!=GeneId(end); geneId0++) {
+                similarGenes.clear();
+
+                // Compute the scalar products with all other genes.
+                // Genes that are not expressed in any of the cells
+                // that express geneId0 have a zero scalar product.
+                const CellId* cellIds0 = geneExpressionCounts.firstBegin(geneId0);
+                const float* counts0 = geneExpressionCounts.secondBegin(geneId0);
+                const size_t n0 = geneExpressionCounts.size(geneId0);
+                for(size_t i=0; i!=n0; i++) {
+                    const CellId cellId = cellIds0[i];
+                    const float count0 = counts0[i];
+                    const float factor = cellFactors[cellId];
+                    const GeneId* geneIds = subsetCounts.firstBegin(cellId);
+                    const float* counts = subsetCounts.secondBegin(cellId);
+                    const size_t n = subsetCounts.size(cellId);
+                    for(size_t j=0; j!=n; j++) {
+                        scalarProducts[geneIds[j]] += double(count0 * (counts[j] * factor));
+                    }
+                }
+
+                // Compute the correlation coefficients and keep the ones above threshold.
+                if(geneNorms[geneId0] > 0.) {
+                    const double sum0 = geneSums[geneId0];
+                    const double norm0 = geneNorms[geneId0];
+                    for(GeneId geneId1=0; geneId1!=geneCount; geneId1++) {
+                        if(geneId1==geneId0 || geneNorms[geneId1]==0.) {
+                            continue;
+                        }
+                        const double covariance =
+                            scalarProducts[geneId1] - sum0 * geneSums[geneId1] / double(cellCount);
+                        const float similarity = float(covariance / (norm0 * geneNorms[geneId1]));
+                        if(similarity > similarityThreshold) {
+                            similarGenes.push_back(make_pair(geneId1, similarity));
+                        }
+                    }
+                }
+                fill(scalarProducts.begin(), scalarProducts.end(), 0.);
+
+                // Store the best k.
+                if(similarGenes.size() > k) {
+                    nth_element(similarGenes.begin(), similarGenes.begin() + k, similarGenes.end(), isBetter);
+                    similarGenes.resize(k);
+                }
+                sort(similarGenes.begin(), similarGenes.end(), isBetter);
+                similarGenePairs.store(geneId0, similarGenes);
+                kept += similarGenes.size();
+            }
+
+            std::lock_guard<std::mutex> lock(progressMutex);
+            totalKept += kept;
+            const size_t oldGenesDone = genesDone;
+            genesDone += end - begin;
+            if(genesDone/1000 != oldGenesDone/1000) {
+                s << timestamp << genesDone << " genes of " << geneCount << " done." << endl;
+            }
+        });
+    s << "Average number of pairs kept per gene is " << double(totalKept)/geneCount << endl;
+
+    s << timestamp << "ExpressionMatrix::findSimilarGenePairs1 ends." << endl;
+}
+
+
+
+// Compute the similarity (Pearson correlation coefficient) of two genes,
+// given the expression counts stored by gene,
+// and the sums and centered norms computed by computeGeneSumsAndNorms.
+// This gives the same result as the computation in findSimilarGenePairs1.
+static double computeGeneSimilarity(
+    const ExpressionMatrixSubset::GeneExpressionCounts& geneExpressionCounts,
+    CellId cellCount,
+    const vector<double>& geneSums,
+    const vector<double>& geneNorms,
+    GeneId geneId0,
+    GeneId geneId1)
+{
+    const double scalarProduct = SparseKernels::computeScalarProduct(
+        geneExpressionCounts.firstBegin(geneId0),
+        geneExpressionCounts.secondBegin(geneId0),
+        geneExpressionCounts.size(geneId0),
+        geneExpressionCounts.firstBegin(geneId1),
+        geneExpressionCounts.secondBegin(geneId1),
+        geneExpressionCounts.size(geneId1));
+    const double covariance = scalarProduct - geneSums[geneId0] * geneSums[geneId1] / double(cellCount);
+    return covariance / (geneNorms[geneId0] * geneNorms[geneId1]);
+}
+
+
+
+// Return the probability that LSH finds a pair of genes with a given similarity,
+// that is, that the two genes share a bucket for at least one of the
+// lshCount/lshSliceLength slices used by findSimilarGenePairs2.
+// Each signature bit agrees with probability 1-acos(similarity)/pi,
+// and the slices use disjoint sets of bits.
+double ExpressionMatrix::computeLshCollisionProbability(
+    double similarity,
+    size_t lshCount,
+    size_t lshSliceLength)
+{
+    using boost::math::double_constants::pi;
+    const double bitAgreementProbability = 1. - std::acos(max(-1., min(1., similarity))) / pi;
+    const double sliceAgreementProbability = std::pow(bitAgreementProbability, double(lshSliceLength));
+    const size_t sliceCount = lshCount / lshSliceLength;
+    return 1. - std::pow(1. - sliceAgreementProbability, double(sliceCount));
+}
+
+
+
+// Return the longest slice length for which LSH finds a pair of genes
+// with similarity equal to the similarity threshold with probability
+// at least equal to the specified recall.
+// Pairs with higher similarity are found with higher probability.
+size_t ExpressionMatrix::computeGeneLshSliceLength(
+    double similarityThreshold,
+    size_t lshCount,
+    double recall)
+{
+    size_t lshSliceLength = 1;
+    while(lshSliceLength < min(lshCount, size_t(64)) &&
+        computeLshCollisionProbability(similarityThreshold, lshCount, lshSliceLength+1) >= recall) {
+        ++lshSliceLength;
+    }
+    return lshSliceLength;
+}
+
+
+
+// Approximate version of findSimilarGenePairs1, using LSH.
+// This uses the same LSH machinery used for cells (class Lsh),
+// with the roles of genes and cells reversed: the normalized expression
+// vector of each gene over the cells of the cell set is projected
+// onto lshCount random hyperplanes in cell space to obtain
+// its LSH signature. The genes are then assigned to buckets
+// based on the values of signature slices of lshSliceLength bits (see LshIndex.hpp),
+// and the candidate similar genes of each gene are the genes
+// that share a bucket with it for at least one slice.
+// The exact similarity is then computed for each candidate,
+// so the stored similarities are the same as computed by findSimilarGenePairs1,
+// but some similar pairs may be missed.
+// Longer slices give fewer candidates and are faster, but miss more pairs.
+// If lshSliceLength is 0, it is set to the longest slice length
+// for which a pair of genes with similarity equal to the
+// similarity threshold is found with probability at least 0.9
+// (see computeGeneLshSliceLength). For low similarity thresholds,
+// this gives short slices and most genes become candidates,
+// so the computation is not much faster than findSimilarGenePairs1.
+// Use analyzeGeneLsh to check the accuracy of the LSH similarities
+// for a given number of LSH hyperplanes.
+void ExpressionMatrix::findSimilarGenePairs2(
+    const string& geneSetName,
+    const string& cellSetName,
+    NormalizationMethod normalizationMethod,
+    const string& similarGenePairsName,
+    size_t k,                   // The maximum number of similar genes pairs to be stored for each gene.
+    double similarityThreshold,
+    size_t lshCount,            // The number of LSH hyperplanes.
+    size_t lshSliceLength,      // The number of bits in each LSH signature slice, or 0 for automatic selection.
+    unsigned int seed,          // The seed used to generate the LSH hyperplanes.
+    size_t threadCount
+    )
+{
+    cout << timestamp << "ExpressionMatrix::findSimilarGenePairs2 begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+    const GeneId geneCount = geneSet.size();
+
+    // Locate the cell set and verify that it is not empty.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount == 0) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+
+    // Choose the slice length, and check it before creating anything.
+    // Slices longer than the base 2 log of the number of genes
+    // are hashed to a smaller number of buckets (see LshIndex.hpp).
+    if(lshCount == 0) {
+        throw runtime_error("Invalid number of LSH hyperplanes.");
+    }
+    if(lshSliceLength == 0) {
+        lshSliceLength = computeGeneLshSliceLength(similarityThreshold, lshCount, 0.9);
+    }
+    if(lshSliceLength > min(lshCount, size_t(64))) {
+        throw runtime_error("Invalid LSH slice length " + to_string(lshSliceLength) + ".");
+    }
+    size_t log2GeneCount = 0;
+    while((size_t(1) << log2GeneCount) < size_t(geneCount)) {
+        ++log2GeneCount;
+    }
+    const size_t log2BucketCount = min(min(lshSliceLength, log2GeneCount), size_t(30)) + 1;
+    cout << "Using LSH slice length " << lshSliceLength << endl;
+    cout << "Probability of finding a pair with similarity equal to the threshold is " <<
+        computeLshCollisionProbability(similarityThreshold, lshCount, lshSliceLength) << endl;
+
+    // Create the expression matrix subset for this gene set and cell set,
+    // and a copy of its normalized expression counts stored by gene.
+    // All temporary objects are removed when done, including when an exception is thrown.
+    cout << timestamp << "Creating expression counts by gene." << endl;
+    ExpressionMatrixSubset expressionMatrixSubset(
+        directoryName + "/tmp-ExpressionMatrixSubset-" + similarGenePairsName,
+        geneSet, cellSet, cellExpressionCounts, threadCount);
+    ExpressionMatrixSubset::GeneExpressionCounts geneExpressionCounts;
+    const RemoveOnExit<ExpressionMatrixSubset::GeneExpressionCounts> removeGeneExpressionCounts(geneExpressionCounts);
+    expressionMatrixSubset.createGeneExpressionCounts(
+        directoryName + "/tmp-GeneExpressionCounts-" + similarGenePairsName,
+        normalizationMethod, geneExpressionCounts);
+    vector<double> geneSums;
+    vector<double> geneNorms;
+    computeGeneSumsAndNorms(geneExpressionCounts, cellCount, geneSums, geneNorms);
+
+    // Compute the LSH signatures of the genes and assign genes to buckets.
+    // In the Lsh and LshIndex objects, the "cells" are genes.
+    Lsh lsh(directoryName + "/tmp-GeneLsh-" + similarGenePairsName,
+        geneExpressionCounts, cellCount, lshCount, seed, threadCount);
+    const RemoveOnExit<Lsh> removeLsh(lsh);
+    const vector<int> lshSliceLengths(1, int(lshSliceLength));
+    LshIndex lshIndex(directoryName + "/tmp-GeneLshIndex-" + similarGenePairsName,
+        lsh, lshSliceLengths, log2BucketCount, threadCount);
+    const RemoveOnExit<LshIndex> removeLshIndex(lshIndex);
+    const size_t sliceCount = lshIndex.sliceCount(0);
+
+    // Create the SimilarGenePairs object, initially with no pairs.
+    SimilarGenePairs similarGenePairs(directoryName, similarGenePairsName,
+        geneSetName, cellSetName, k, normalizationMethod);
+
+    // Pairs with higher similarity are better. For equal similarity,
+    // pairs with lower GeneId are better.
+    const auto isBetter = [](const pair<GeneId, float>& x, const pair<GeneId, float>& y)
+    {
+        return (x.second > y.second) || (x.second == y.second && x.first < y.first);
+    };
+
+
+
+    // Find the similar genes of each gene.
+    // For each gene, the candidates are the union of the buckets
+    // it belongs to.
+    threadCount = getThreadCount(threadCount);
+    cout << timestamp << "Finding similar genes using " << threadCount << " threads." << endl;
+    size_t totalCandidateCount = 0;
+    size_t totalKept = 0;
+    std::mutex sumsMutex;
+    parallelFor(geneCount, 16, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            vector< MemoryAsContainer<const CellId> > buckets;
+            buckets.reserve(sliceCount);    // So pointers in setsToUnion remain valid.
+            vector< const MemoryAsContainer<const CellId>* > setsToUnion;
+            vector<CellId> candidates;
+            vector<SimilarGenePairs::Pair> similarGenes;
+            size_t candidateCount = 0;
+            size_t kept = 0;
+            for(GeneId geneId0=GeneId(begin); geneId0!=GeneId(end); geneId0++) {
+                similarGenes.clear();
+                if(geneNorms[geneId0] > 0.) {
+
+                    // Find the candidates.
+                    buckets.clear();
+                    setsToUnion.clear();
+                    candidates.clear();
+                    const BitSetPointer signature = lsh.getSignature(geneId0);
+                    for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
+                        const uint64_t bucketId = lshIndex.getBucketId(signature, 0, sliceId);
+                        buckets.push_back(lshIndex.getBucket(0, sliceId, bucketId));
+                        setsToUnion.push_back(&buckets.back());
+                    }
+                    multipleSetUnion(setsToUnion, candidates);
+                    candidateCount += candidates.size();
+
+                    // Compute the exact similarity of each candidate.
+                    for(const GeneId geneId1: candidates) {
+                        if(geneId1==geneId0 || geneNorms[geneId1]==0.) {
+                            continue;
+                        }
+                        const float similarity = float(computeGeneSimilarity(
+                            geneExpressionCounts, cellCount, geneSums, geneNorms, geneId0, geneId1));
+                        if(similarity > similarityThreshold) {
+                            similarGenes.push_back(make_pair(geneId1, similarity));
+                        }
+                    }
+                }
+
+                // Store the best k.
+                if(similarGenes.size() > k) {
+                    nth_element(similarGenes.begin(), similarGenes.begin() + k, similarGenes.end(), isBetter);
+                    similarGenes.resize(k);
+                }
+                sort(similarGenes.begin(), similarGenes.end(), isBetter);
+                similarGenePairs.store(geneId0, similarGenes);
+                kept += similarGenes.size();
+            }
+            std::lock_guard<std::mutex> lock(sumsMutex);
+            totalCandidateCount += candidateCount;
+            totalKept += kept;
+        });
+    cout << "Average number of candidates per gene is " << double(totalCandidateCount)/geneCount << endl;
+    cout << "Average number of pairs kept per gene is " << double(totalKept)/geneCount << endl;
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "ExpressionMatrix::findSimilarGenePairs2 ends. Took " << t01 << " s." << endl;
+}
+
+
+
+// Analyze the quality of the LSH computation of gene similarity
+// used by findSimilarGenePairs2.
+// This is the same as analyzeLsh, but for genes: for all pairs of genes,
+// it compares the exact similarity with the LSH similarity,
+// and writes the results to GeneLsh-analysis.csv (subject to downsampling)
+// and GeneLsh-analysis-statistics.csv (bias and rms error
+// for bins of exact similarity).
+void ExpressionMatrix::analyzeGeneLsh(
+    const string& geneSetName,      // The name of the gene set to be used.
+    const string& cellSetName,      // The name of the cell set to be used.
+    NormalizationMethod normalizationMethod,
+    size_t lshCount,                // The number of LSH vectors to use.
+    unsigned int seed,              // The seed used to generate the LSH vectors and to downsample.
+    double csvDownsample            // The fraction of pairs that will be included in the output spreadsheet.
+    )
+{
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
+    }
+    const GeneId geneCount = geneSet.size();
+
+    // Locate the cell set and verify that it is not empty.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount == 0) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
+    }
+
+    // Create the expression counts stored by gene.
+    cout << timestamp << "Creating expression counts by gene." << endl;
+    ExpressionMatrixSubset expressionMatrixSubset(
+        directoryName + "/tmp-ExpressionMatrixSubset",
+        geneSet, cellSet, cellExpressionCounts);
+    ExpressionMatrixSubset::GeneExpressionCounts geneExpressionCounts;
+    const RemoveOnExit<ExpressionMatrixSubset::GeneExpressionCounts> removeGeneExpressionCounts(geneExpressionCounts);
+    expressionMatrixSubset.createGeneExpressionCounts(
+        directoryName + "/tmp-GeneExpressionCounts",
+        normalizationMethod, geneExpressionCounts);
+    vector<double> geneSums;
+    vector<double> geneNorms;
+    computeGeneSumsAndNorms(geneExpressionCounts, cellCount, geneSums, geneNorms);
+
+    // Create the Lsh object that will do the computation.
+    Lsh lsh(directoryName + "/tmp-GeneLsh", geneExpressionCounts, cellCount, lshCount, seed);
+    const RemoveOnExit<Lsh> removeLsh(lsh);
+
+    // Random number generator used for downsampling
+    using RandomSource = boost::mt19937;
+    using UniformDistribution = boost::uniform_01<>;
+    RandomSource randomSource(seed);
+    UniformDistribution uniformDistribution;
+    boost::variate_generator<RandomSource, UniformDistribution>
+        uniformGenerator(randomSource, uniformDistribution);
+
+    // Statistics for bins of exact similarity values.
+    const size_t binCount = 200;
+    const double binWidth = 2. / binCount;
+    vector<size_t> sum0(binCount, 0);
+    vector<double> sum1(binCount, 0.);
+    vector<double> sum2(binCount, 0.);
+
+    // Open the output csv file.
+    ofstream csvOut("GeneLsh-analysis.csv");
+    csvOut << "LocalGeneId0,LocalGeneId1,GeneName0,GeneName1,ExactSimilarity,LshSimilarity\n";
+
+
+
+    // Loop over pairs of genes.
+    // Genes with constant expression have no defined similarity and are skipped.
+    // For each localGeneId0, the LSH mismatch counts with all
+    // subsequent genes are computed at once.
+    vector<uint32_t> mismatchCounts(geneCount);
+    for(GeneId localGeneId0=0; localGeneId0<geneCount-1; localGeneId0++) {
+        if((localGeneId0%1000) == 0 ) {
+            cout << timestamp << "Working on gene " << localGeneId0 << " of " << geneCount << endl;
+        }
+        if(geneNorms[localGeneId0] == 0.) {
+            continue;
+        }
+        lsh.computeMismatchCounts(localGeneId0, localGeneId0+1, localGeneId0+1, geneCount, mismatchCounts.data());
+        for(GeneId localGeneId1=localGeneId0+1; localGeneId1<geneCount; localGeneId1++) {
+            if(geneNorms[localGeneId1] == 0.) {
+                continue;
+            }
+
+            // Compute exact similarity for this pair.
+            const double exactSimilarity = computeGeneSimilarity(
+                geneExpressionCounts, cellCount, geneSums, geneNorms, localGeneId0, localGeneId1);
+
+            // LSH similarity for this pair.
+            const double lshSimilarity = lsh.getSimilarity(mismatchCounts[localGeneId1 - (localGeneId0+1)]);
+
+            // Update statistics.
+            const double delta = lshSimilarity - exactSimilarity;
+            const size_t bin = min(binCount-1, size_t(max(0., floor((exactSimilarity+1.) / binWidth))));
+            ++(sum0[bin]);
+            sum1[bin] += delta;
+            sum2[bin] += delta*delta;
+
+            // Write to the output csv file, subject to downsampling.
+            if(uniformGenerator() < csvDownsample) {
+                csvOut << localGeneId0 << ",";
+                csvOut << localGeneId1 << ",";
+                csvOut << geneNames[geneSet.getGlobalGeneId(localGeneId0)] << ",";
+                csvOut << geneNames[geneSet.getGlobalGeneId(localGeneId1)] << ",";
+                csvOut << exactSimilarity << ",";
+                csvOut << lshSimilarity << ",\n";
+            }
+        }
+    }
+
+
+
+    // Compute average and standard deviation of the error for each bin.
+    ofstream statsOut("GeneLsh-analysis-statistics.csv");
+    statsOut << "Similarity,Bias,Rms,RmsTheory\n";
+    for(size_t bin=0; bin<binCount; bin++) {
+        if(sum0[bin] < 2) {
+            continue;
+        }
+        using boost::math::double_constants::pi;
+        const double similarity = (double(bin) + 0.5) * binWidth - 1.;
+        const double sinTheta = sqrt(1.-similarity*similarity);
+        const double theta = std::acos(similarity);
+        const double p = 1.- theta / pi;
+        const double theoreticalSigma = pi * sinTheta * sqrt(p*(1.-p)/double(lshCount));
+        const double s0 = double(sum0[bin]);
+        const double s1 = sum1[bin];
+        const double s2 = sum2[bin];
+        const double average = s1 / s0;
+        const double sigma = sqrt(s2 / s0); // Sigma around 0.
+        statsOut << similarity << ",";
+        statsOut << average << ",";
+        statsOut << sigma << ",";
+        statsOut << theoreticalSigma << "\n";
+    }
+}
+
+
+
 // Get a list of the currently available sets of similar gene pairs.
 void ExpressionMatrix::getAvailableSimilarGenePairs(
     vector<string>& availableSimilarGenePairs) const
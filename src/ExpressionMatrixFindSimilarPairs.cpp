@@ -1,25 +1,51 @@
 #include "ExpressionMatrix.hpp"
+#include "CompactSimilarPairs.hpp"
 #include "ExpressionMatrixSubset.hpp"
+#include "filesystem.hpp"
+#include "heap.hpp"
+#include "parallelFor.hpp"
 #include "SimilarPairs.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
+#include <atomic>
 #include <chrono>
 #include "fstream.hpp"
+#include <mutex>
 
 
 
 // Find similar cell pairs by looping over all pairs,
 // taking into account only genes in the specified gene set.
-// This is O(N**2) slow because it loops over cell pairs.
+// This is O(N**2) slow because it loops over cell pairs,
+// but the similarities are exact, so it can be used
+// as a reference for the approximate methods.
+
+// The query cells are processed in blocks of blockSize cells,
+// on multiple threads. For each block, the expression counts of the
+// query cells are stored in a dense matrix indexed by [localGeneId][cell in block],
+// so the blockSize counts for a gene are contiguous.
+// Each cell of the cell set is then compared against the entire block
+// by looping over its sparse expression counts and accumulating
+// the scalar products with all query cells of the block at once.
+// The dense block is reused for all cells, so it stays in cache.
+// The products and the order in which they are accumulated are the same
+// as in ExpressionMatrixSubset::computeCellSimilarity, so the
+// similarities are identical to the ones computed one pair at a time.
+
+// For each query cell, the best k pairs seen so far are kept in a heap,
+// with ties broken by CellId, so the pairs stored for each cell are
+// uniquely defined and don't depend on the number of threads.
+// Each pair is computed twice, but this avoids any communication between threads.
 void ExpressionMatrix::findSimilarPairs0(
     ostream& out,
     const string& geneSetName,      // The name of the gene set to be used.
     const string& cellSetName,      // The name of the cell set to be used.
     const string& similarPairsName, // The name of the SimilarPairs object to be created.
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
-    double similarityThreshold
+    double similarityThreshold,
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
     )
 {
     // Sanity check.
@@ -41,50 +67,153 @@ void ExpressionMatrix::findSimilarPairs0(
         throw runtime_error("Cell set " + cellSetName + " does not exist.");
     }
     const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
-    if(cellSet.size() == 0) {
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount == 0) {
         throw runtime_error("Cell set " + cellSetName + " is empty.");
     }
 
-    // Create the SimilarPairs object where we will store the pairs.
-    SimilarPairs similarPairs(directoryName, similarPairsName, geneSetName, cellSetName, k);
-
     // Create the expression matrix subset for this gene set and cell set.
     const string expressionMatrixSubsetName = directoryName + "/tmp-ExpressionMatrixSubset-" + similarPairsName;
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, threadCount);
+    const auto& subsetCounts = expressionMatrixSubset.cellExpressionCounts;
+    const auto& sums = expressionMatrixSubset.sums;
+    const size_t geneCount = geneSet.size();
+    const double n = double(geneCount);
+
+    // Create the SimilarPairs object. Each thread stores the pairs
+    // found for its query cells directly in it.
+    // This is safe because each cell has its own fixed slot of k pairs.
+    SimilarPairs similarPairs(directoryName, similarPairsName, geneSetName, cellSetName, k);
 
+    // Order pairs (similarity, cellId) by decreasing similarity,
+    // then by increasing CellId. Used as the heap comparator,
+    // this keeps the worst pair at the top of the heap.
+    const auto isBetter = [](const pair<double, CellId>& x, const pair<double, CellId>& y)
+    {
+        return (x.first > y.first) || (x.first == y.first && x.second < y.second);
+    };
 
     // Loop over all pairs.
-    out << timestamp << "Begin computing similarities for all cell pairs." << endl;
+    threadCount = getThreadCount(threadCount);
+    out << timestamp << "Begin computing similarities for all cell pairs using " <<
+        threadCount << " threads." << endl;
     const auto t0 = std::chrono::steady_clock::now();
-    for(CellId localCellId0=0; localCellId0!=similarPairs.cellCount()-1; localCellId0++) {
-        if(localCellId0>0 && ((localCellId0%100) == 0)) {
-            out << timestamp << "Working on cell " << localCellId0 << " of " << cellSet.size() << endl;
-        }
-
-        // Find all cells with similarity better than the specified threshold.
-        for(CellId localCellId1=localCellId0+1; localCellId1!=similarPairs.cellCount(); localCellId1++) {
-            const double similarity = expressionMatrixSubset.computeCellSimilarity(localCellId0, localCellId1);
-
-            // If the similarity is sufficient, pass it to the SimilarPairs container,
-            // which will make the decision whether to store it, depending on the
-            // number of pairs already stored for cellId0 and cellId1.
-            if(similarity > similarityThreshold) {
-                similarPairs.add(localCellId0, localCellId1, similarity);
+    const size_t blockSize = 64;
+    const size_t blockCount = (cellCount - 1) / blockSize + 1;
+    const size_t messageFrequency = max(size_t(1), size_t(1.e9 / (double(cellCount) * double(blockSize))));
+    std::atomic<size_t> processedBlockCount(0);
+    std::mutex outMutex;
+    parallelFor(blockCount, 1, threadCount,
+        [&](size_t, size_t blockBegin, size_t blockEnd)
+        {
+            vector<float> dense(geneCount * blockSize, 0.f);
+            vector< vector< pair<double, CellId> > > heaps(blockSize);
+            for(auto& heap: heaps) {
+                heap.reserve(k);
             }
-        }
-    }
+            vector<SimilarPairs::Pair> cellPairs;
+            cellPairs.reserve(k);
+
+            for(size_t block=blockBegin; block!=blockEnd; block++) {
+                const CellId begin0 = CellId(block * blockSize);
+                const CellId end0 = min(CellId(begin0 + blockSize), cellCount);
+
+                // Store the expression counts of the query cells of this block
+                // in the dense matrix.
+                for(CellId cell0=begin0; cell0!=end0; ++cell0) {
+                    const GeneId* geneIds = subsetCounts.firstBegin(cell0);
+                    const float* counts = subsetCounts.secondBegin(cell0);
+                    const size_t m = subsetCounts.size(cell0);
+                    for(size_t i=0; i!=m; i++) {
+                        dense[geneIds[i]*blockSize + (cell0 - begin0)] = counts[i];
+                    }
+                }
+                for(auto& heap: heaps) {
+                    heap.clear();
+                }
+
+                // Loop over all cells of the cell set.
+                for(CellId cell1=0; cell1!=cellCount; ++cell1) {
+
+                    // Compute the scalar products of this cell
+                    // with all query cells of the block.
+                    // This loop has a fixed trip count and vectorizes.
+                    double scalarProducts[blockSize] = {};
+                    const GeneId* geneIds = subsetCounts.firstBegin(cell1);
+                    const float* counts = subsetCounts.secondBegin(cell1);
+                    const size_t m = subsetCounts.size(cell1);
+                    for(size_t i=0; i!=m; i++) {
+                        const float count = counts[i];
+                        const float* row = dense.data() + geneIds[i]*blockSize;
+                        for(size_t j=0; j!=blockSize; j++) {
+                            scalarProducts[j] += count * row[j];
+                        }
+                    }
+
+                    // Compute the similarities and update the heaps.
+                    const ExpressionMatrixSubset::Sum& sum1 = sums[cell1];
+                    for(CellId cell0=begin0; cell0!=end0; ++cell0) {
+                        if(cell0 == cell1) {
+                            continue;
+                        }
+                        const ExpressionMatrixSubset::Sum& sum0 = sums[cell0];
+                        const double numerator = n*scalarProducts[cell0 - begin0] - sum0.sum1*sum1.sum1;
+                        const double denominator = sqrt(
+                            (n*sum0.sum2 - sum0.sum1*sum0.sum1) *
+                            (n*sum1.sum2 - sum1.sum1*sum1.sum1)
+                            );
+                        const double similarity = numerator / denominator;
+                        if(!(similarity > similarityThreshold)) {
+                            continue;
+                        }
+                        const pair<double, CellId> p(similarity, cell1);
+                        vector< pair<double, CellId> >& heap = heaps[cell0 - begin0];
+                        if(heap.size() < k) {
+                            heap.push_back(p);
+                            std::push_heap(heap.begin(), heap.end(), isBetter);
+                        } else if(k>0 && isBetter(p, heap.front())) {
+                            popAndPushHeap(heap.begin(), heap.end(), p, isBetter);
+                        }
+                    }
+                }
+
+                // Store the pairs found for the query cells of this block
+                // and clear the dense matrix.
+                for(CellId cell0=begin0; cell0!=end0; ++cell0) {
+                    vector< pair<double, CellId> >& heap = heaps[cell0 - begin0];
+                    std::sort(heap.begin(), heap.end(), isBetter);
+                    cellPairs.clear();
+                    for(const auto& p: heap) {
+                        cellPairs.push_back(SimilarPairs::Pair(p.second, SimilarPairs::CellSimilarity(p.first)));
+                    }
+                    similarPairs.copy(cell0, cellPairs.data(), cellPairs.data() + cellPairs.size());
+
+                    const GeneId* geneIds = subsetCounts.firstBegin(cell0);
+                    const size_t m = subsetCounts.size(cell0);
+                    for(size_t i=0; i!=m; i++) {
+                        dense[geneIds[i]*blockSize + (cell0 - begin0)] = 0.f;
+                    }
+                }
+
+                const size_t processed = ++processedBlockCount;
+                if((processed % messageFrequency) == 0) {
+                    std::lock_guard<std::mutex> lock(outMutex);
+                    out << timestamp << "Pair computation ";
+                    out << 100.*double(processed)/double(blockCount);
+                    out << "% complete." << endl;
+                }
+            }
+        });
     const auto t1 = std::chrono::steady_clock::now();
     const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
-
+    out << "Time for all pairs: " << t01 << " s." << endl;
+    out << "Time per pair: " << t01/(0.5*double(cellCount)*double(cellCount-1)) << " s." << endl;
 
     // Sort the similar pairs for each cell by decreasing similarity.
+    // They are already sorted, except possibly for ties
+    // created when converting the similarities to CellSimilarity.
     similarPairs.sort();
-
-
-    out << "Time for all pairs: " << t01 << " s." << endl;
-    const CellId cellCount = CellId(cellSet.size());
-    out << "Time per pair: " << t01/(0.5*double(cellCount)*double(cellCount-1)) << " s." << endl;
 }
 
 void ExpressionMatrix::findSimilarPairs0(
@@ -92,10 +221,11 @@ void ExpressionMatrix::findSimilarPairs0(
     const string& cellSetName,      // The name of the cell set to be used.
     const string& similarPairsName, // The name of the SimilarPairs object to be created.
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
-    double similarityThreshold
+    double similarityThreshold,
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
     )
 {
-    findSimilarPairs0(cout, geneSetName, cellSetName, similarPairsName, k, similarityThreshold);
+    findSimilarPairs0(cout, geneSetName, cellSetName, similarPairsName, k, similarityThreshold, threadCount);
 }
 
 
@@ -103,6 +233,7 @@ void ExpressionMatrix::findSimilarPairs0(
 // Dump to csv file a set of similar cell pairs.
 void ExpressionMatrix::writeSimilarPairs(const string& name) const
 {
+    checkSimilarPairsNotCompactOnly(name);
     SimilarPairs similarPairs(directoryName, name, true);
     ofstream csvOut("SimilarPairs-" + name + ".csv");
     csvOut << "Cell0,Cell1,Computed,Exact AllGenes\n";
@@ -121,13 +252,81 @@ void ExpressionMatrix::writeSimilarPairs(const string& name) const
 
 
 
+// Create the compact form of a SimilarPairs object (see CompactSimilarPairs.hpp).
+// If removeOriginal is true, the original SimilarPairs object is removed
+// after the compact form is created.
+void ExpressionMatrix::compactSimilarPairs(
+    const string& name,
+    bool removeOriginal,
+    size_t threadCount)
+{
+    if(CompactSimilarPairs::exists(directoryName, name)) {
+        throw runtime_error("Compact form of similar pairs object " + name + " already exists.");
+    }
+    SimilarPairs similarPairs(directoryName, name, false);
+    const CompactSimilarPairs compactSimilarPairs(directoryName, name, similarPairs, threadCount);
+    cout << timestamp << "Created compact form of similar pairs object " << name << " with " <<
+        compactSimilarPairs.totalSize() << " pairs using " <<
+        compactSimilarPairs.byteCount() << " bytes (" <<
+        double(compactSimilarPairs.byteCount()) / double(max(size_t(1), compactSimilarPairs.totalSize())) <<
+        " bytes per pair)." << endl;
+    if(removeOriginal) {
+        similarPairs.remove();
+    }
+}
+
+
+
+// Return the gene set used by a SimilarPairs object.
+// The SimilarPairs object might only exist in compact form,
+// if it was created by compactSimilarPairs with removeOriginal set.
+// Accessing either form checks that the gene set did not change since
+// the SimilarPairs object was created.
+const GeneSet& ExpressionMatrix::getSimilarPairsGeneSet(const string& similarPairsName) const
+{
+    string geneSetName;
+    if(filesystem::exists(directoryName + "/SimilarPairs-" + similarPairsName + "-Info")) {
+        const SimilarPairs similarPairs(directoryName, similarPairsName, true);
+        geneSetName = similarPairs.getGeneSetName();
+    } else {
+        const CompactSimilarPairs compactSimilarPairs(directoryName, similarPairsName);
+        geneSetName = compactSimilarPairs.getGeneSetName();
+    }
+    return getGeneSet(geneSetName);
+}
+
+
+
+// Throw an exception if a SimilarPairs object only exists in compact form.
+// The compact form stores quantized similarities in a different order,
+// so it cannot be used by functions that need the original SimilarPairs object.
+void ExpressionMatrix::checkSimilarPairsNotCompactOnly(const string& similarPairsName) const
+{
+    if(!filesystem::exists(directoryName + "/SimilarPairs-" + similarPairsName + "-Info") &&
+        CompactSimilarPairs::exists(directoryName, similarPairsName)) {
+        throw runtime_error("Similar pairs object " + similarPairsName +
+            " only exists in compact form, which cannot be used for this operation. "
+            "Recreate it without removing the original to use it here.");
+    }
+}
+
+
+
 // Remove a similar pairs object given its name.
+// This also removes its compact form, if present.
 // This throws an exception if the requested SimilarPairs object does not exist.
 void ExpressionMatrix::removeSimilarPairs(const string& name)
 {
     try {
-        SimilarPairs similarPairs(directoryName, name, false);
-        similarPairs.remove();
+        const bool compactExists = CompactSimilarPairs::exists(directoryName, name);
+        if(compactExists) {
+            CompactSimilarPairs compactSimilarPairs(directoryName, name);
+            compactSimilarPairs.remove();
+        }
+        if(!compactExists || filesystem::exists(directoryName + "/SimilarPairs-" + name + "-Info")) {
+            SimilarPairs similarPairs(directoryName, name, false);
+            similarPairs.remove();
+        }
     } catch(runtime_error e) {
         cout << e.what() << endl;
         throw runtime_error("Error removing similar pairs object " + name);
@@ -1,5 +1,4 @@
 #include "ExpressionMatrix.hpp"
-#include "SimilarPairs.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
@@ -369,15 +368,15 @@ void ExpressionMatrix::createWellExpressedGeneSet(
 // that satisfy this condition.
 vector<string> ExpressionMatrix::geneSetNamesFromSimilarPairsName(const string& similarPairsName) const
 {
-    // Open the existing SimilarPairs object.
-    const SimilarPairs similarPairs(directoryName, similarPairsName, true);
+    // Access the gene set of the existing SimilarPairs object.
+    const GeneSet& similarPairsGeneSet = getSimilarPairsGeneSet(similarPairsName);
 
     // Start with no gene sets.
     vector<string> geneSetNames;
 
     // Loop over our map of gene sets.
     for(auto it=geneSets.begin(); it!=geneSets.end(); ++it) {
-        if(it->second == similarPairs.getGeneSet()) {
+        if(it->second == similarPairsGeneSet) {
             geneSetNames.push_back(it->first);
         }
 
@@ -22,6 +22,12 @@ bool ExpressionMatrix::addGene(const string& geneName)
         // Make space for meta data for this gene.
         geneMetaData.push_back();
 
+        // Make space for this gene in the gene-major copy of the expression counts,
+        // if we have one. It has no expression counts yet.
+        if(geneExpressionCounts.isOpen()) {
+            geneExpressionCounts.resize(geneCount());
+        }
+
         // Set the GeneName meta data for this gene.
         setGeneMetaData(geneId, "GeneName", geneName);
 
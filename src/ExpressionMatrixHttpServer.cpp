@@ -72,6 +72,7 @@ void ExpressionMatrix::fillServerFunctionTable()
     // Similar cell pairs.
     CZI_ADD_TO_FUNCTION_TABLE(similarPairs);
     CZI_ADD_TO_FUNCTION_TABLE(createSimilarPairs);
+    CZI_ADD_TO_FUNCTION_TABLE(createSimilarPairsHnsw);
     CZI_ADD_TO_FUNCTION_TABLE(removeSimilarPairs);
 
     // Cell graphs.
@@ -948,6 +949,7 @@ void ExpressionMatrix::removeCellGraph(
             html << "<p>Graph " << graphName << " does not exist.";
         } else {
             cellGraphs.erase(it);
+            removeStoredCellGraph(graphName);
             html << "<p>Graph " << graphName << " was removed.";
         }
     }
@@ -1094,8 +1096,7 @@ void ExpressionMatrix::cluster(
     }
     const CellGraphInformation& graphInformation = it->second.first;
     const string& similarPairsName = graphInformation.similarPairsName;
-    const SimilarPairs similarPairs(directoryName + "/SimilarPairs-" + similarPairsName);
-    const GeneSet& geneSet = similarPairs.getGeneSet();
+    const GeneSet& geneSet = getSimilarPairsGeneSet(similarPairsName);
     CellGraph& graph = *(it->second.second);
 
     // Write the title.
@@ -1291,6 +1292,10 @@ void ExpressionMatrix::createCellGraph(
         return;
     }
 
+    // The number of threads is optional (0 = use all hardware threads).
+    size_t threadCount = 0;
+    getParameterValue(request, "threadCount", threadCount);
+
     // Check that the name does not already exist.
     if(cellGraphs.find(graphName) != cellGraphs.end()) {
         html << "<p>Graph " << graphName << " already exists.";
@@ -1302,7 +1307,7 @@ void ExpressionMatrix::createCellGraph(
     // Create the graph.
     html << "<div style='font-family:courier'>";
     html << timestamp << "Cell graph creation begins.";
-    createCellGraph(graphName, cellSetName, similarPairsName, similarityThreshold, maxConnectivity, false);
+    createCellGraph(graphName, cellSetName, similarPairsName, similarityThreshold, maxConnectivity, false, threadCount);
     const CellGraphInformation& graphInfo = cellGraphs[graphName].first;
     html <<
         "<br>" << timestamp << "New graph " << graphName << " was created. It has " << graphInfo.vertexCount <<
@@ -1325,10 +1330,18 @@ void ExpressionMatrix::getAvailableSimilarPairs(
 
     const string fileNamePrefix = directoryName + "/SimilarPairs-";
     const string fileNameSuffix = "-Info";
+    const string compactFileNameSuffix = "-CompactInfo";
     const vector<string> directoryContents = filesystem::directoryContents(directoryName);
     for(string name: directoryContents) {
         // Here, name contains the entire file name.
-        if(stripPrefixAndSuffix(fileNamePrefix, fileNameSuffix, name)) {
+        string compactName = name;
+        if(stripPrefixAndSuffix(fileNamePrefix, compactFileNameSuffix, compactName)) {
+            // This is the compact form of a similar pairs set.
+            // It is only listed if the original was removed.
+            if(!filesystem::exists(fileNamePrefix + compactName + fileNameSuffix)) {
+                availableSimilarPairs.push_back(compactName);
+            }
+        } else if(stripPrefixAndSuffix(fileNamePrefix, fileNameSuffix, name)) {
             // Here, now contains just the similar pairs set name.
             availableSimilarPairs.push_back(name);
         }
@@ -1339,6 +1352,8 @@ void ExpressionMatrix::getAvailableSimilarPairs(
 
 // Get a list of the currently available sets of cell signatures
 // ( each corresponding to a possible Lsh objects).
+// The persistent LshIndex objects of each Lsh object
+// are listed by getAvailableLshIndexes.
 vector<string> ExpressionMatrix::getAvailableLsh() const
 {
     vector<string> availableLshNames;
@@ -1350,7 +1365,11 @@ vector<string> ExpressionMatrix::getAvailableLsh() const
         // Here, name contains the entire file name.
         if(stripPrefixAndSuffix(fileNamePrefix, fileNameSuffix, name)) {
             // Here, now contains just the similar pairs set name.
-            availableLshNames.push_back(name);
+            // Skip the files of LshIndex objects (see LshIndex.hpp),
+            // which have no signatures.
+            if(filesystem::exists(fileNamePrefix + name + "-Signatures")) {
+                availableLshNames.push_back(name);
+            }
         }
     }
     sort(availableLshNames.begin(), availableLshNames.end());
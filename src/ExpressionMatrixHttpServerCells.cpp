@@ -1151,6 +1151,23 @@ void ExpressionMatrix::similarPairs(const vector<string>& request, ostream& html
     html << "</table>";
 
 
+    // Write the table of existing Lsh objects,
+    // with the persistent LshIndex objects available for each.
+    html << "<h2>Existing LSH signatures</h2>";
+    html << "<table><tr><th>LSH signatures<th>LSH indexes";
+    for(const string& lshName: getAvailableLsh()) {
+        html << "<tr><td>" << lshName << "<td>";
+        const vector<string> lshIndexNames = getAvailableLshIndexes(lshName);
+        for(size_t i=0; i<lshIndexNames.size(); i++) {
+            if(i != 0) {
+                html << " ";
+            }
+            html << lshIndexNames[i];
+        }
+    }
+    html << "</table>";
+
+
     // Form to create a new SimilarPairs object.
     html <<
         "<h2>Create a new set of similar cell pairs</h2>"
@@ -1180,6 +1197,45 @@ void ExpressionMatrix::similarPairs(const vector<string>& request, ostream& html
         "In that case, the computation will be exact but much slower."
         "</form>";
 
+
+    // Form to create a new SimilarPairs object using an HNSW graph.
+    html <<
+        "<h2>Create a new set of similar cell pairs using an HNSW graph</h2>"
+        "<form action=createSimilarPairsHnsw>"
+        "<table>"
+        "<tr><td>Gene set<td class=centered>";
+    writeGeneSetSelection(html, "geneSetName", false);
+    html << "<tr><td>Cell set<td class=centered>";
+    writeCellSetSelection(html, "cellSetName", false);
+    html << "<tr><td>LSH signatures<td class=centered>";
+    writeLshSelection(html, "lshName");
+    html <<
+        "<tr><td>Similar pairs name<td class=centered>"
+        "<input type=text size=8 required name=similarPairsName>"
+        "<tr><td>Similarity threshold<td class=centered>"
+        "<input type=text style='text-align:center' size=8 name=similarityThreshold value='0.2'>"
+        "<tr><td>Maximum connectivity<td class=centered>"
+        "<input type=text style='text-align:center' size=8 name=maxConnectivity value='100'>"
+        "<tr><td>M<td class=centered>"
+        "<input type=text style='text-align:center' size=8 name=M value='16'>"
+        "<tr><td>efConstruction<td class=centered>"
+        "<input type=text style='text-align:center' size=8 name=efConstruction value='200'>"
+        "<tr><td>efSearch<td class=centered>"
+        "<input type=text style='text-align:center' size=8 name=efSearch value='100'>"
+        "<tr><td>Seed<td class=centered>"
+        "<input type=text style='text-align:center' size=8 name=seed value='231'>"
+        "<tr><td>HNSW graph name<td class=centered>"
+        "<input type=text size=8 name=hnswName>"
+        "</table>"
+        "<p><input type=submit value='Create'>"
+        "<p>The computation uses a Hierarchical Navigable Small World (HNSW) graph "
+        "built over existing LSH signatures of the cells of the selected cell set. "
+        "This scales to large numbers of cells, but only finds approximate neighbors. "
+        "Larger values of M, efConstruction, and efSearch give better accuracy but take longer. "
+        "If an HNSW graph name is specified, the graph is kept and reused "
+        "for later computations using the same LSH signatures."
+        "</form>";
+
 }
 
 
@@ -1232,3 +1288,52 @@ void ExpressionMatrix::createSimilarPairs(const vector<string>& request, ostream
         "<p>New set of similar cell pairs " << similarPairsName << " was created."
         "<p><form action=similarPairs><input type=submit value=Continue></form>";
 }
+
+
+
+void ExpressionMatrix::createSimilarPairsHnsw(const vector<string>& request, ostream& html)
+{
+    html << "<h1>Create a new set of similar cell pairs using an HNSW graph</h1>";
+
+    // Get the parameters from the URL.
+    string geneSetName;
+    getParameterValue(request, "geneSetName", geneSetName);
+    string cellSetName;
+    getParameterValue(request, "cellSetName", cellSetName);
+    string lshName;
+    getParameterValue(request, "lshName", lshName);
+    string similarPairsName;
+    getParameterValue(request, "similarPairsName", similarPairsName);
+    double similarityThreshold = 0.2;
+    getParameterValue(request, "similarityThreshold", similarityThreshold);
+    int maxConnectivity = 100;
+    getParameterValue(request, "maxConnectivity", maxConnectivity);
+    int M = 16;
+    getParameterValue(request, "M", M);
+    int efConstruction = 200;
+    getParameterValue(request, "efConstruction", efConstruction);
+    int efSearch = 100;
+    getParameterValue(request, "efSearch", efSearch);
+    int seed = 231;
+    getParameterValue(request, "seed", seed);
+    string hnswName;
+    getParameterValue(request, "hnswName", hnswName);
+
+    // Reject negative values, which would wrap around when converted to size_t.
+    if(maxConnectivity<0 || M<0 || efConstruction<0 || efSearch<0 || seed<0) {
+        html <<
+            "<p>Invalid parameters: maximum connectivity, M, efConstruction, efSearch, "
+            "and seed cannot be negative."
+            "<p><form action=similarPairs><input type=submit value=Continue></form>";
+        return;
+    }
+
+    html << "<pre>";
+    findSimilarPairs8(html, geneSetName, cellSetName, lshName, similarPairsName,
+        maxConnectivity, similarityThreshold, M, efConstruction, efSearch, 0, hnswName, seed);
+    html << "</pre>";
+
+    html <<
+        "<p>New set of similar cell pairs " << similarPairsName << " was created."
+        "<p><form action=similarPairs><input type=submit value=Continue></form>";
+}
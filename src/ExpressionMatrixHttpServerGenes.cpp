@@ -256,17 +256,18 @@ void ExpressionMatrix::exploreGene(
 
 
     // Gather the expression counts for this gene for all cells in the specified cell set.
+    vector< pair<CellId, float> > geneCounts;
+    getGeneExpressionCounts(geneId, cellSet, geneCounts);
     vector<ExploreGeneData> counts;
-    for(const CellId cellId: cellSet) {
+    for(const auto& p: geneCounts) {
+        const CellId cellId = cellSet[p.first];
         const Cell& cell = cells[cellId];
         ExploreGeneData data;
         data.cellId = cellId;
-        data.rawCount =  getCellExpressionCount(cellId, geneId);
-        if(data.rawCount) {
-            data.count1 = float(data.rawCount * cell.norm1Inverse);
-            data.count2 = float(data.rawCount * cell.norm2Inverse);
-            counts.push_back(data);
-        }
+        data.rawCount = p.second;
+        data.count1 = float(data.rawCount * cell.norm1Inverse);
+        data.count2 = float(data.rawCount * cell.norm2Inverse);
+        counts.push_back(data);
     }
 
 
@@ -4,7 +4,6 @@
 #include "ExpressionMatrix.hpp"
 #include "CellGraph.hpp"
 #include "color.hpp"
-#include "SimilarPairs.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
@@ -79,6 +78,8 @@ void ExpressionMatrix::exploreCellGraphs(
         "<td class=centered><input type=text style='text-align:center' size=8 name=similarityThreshold value='0.5'>"
         "<td class=centered><input type=text style='text-align:center' size=8 name=maxConnectivity value='20'>"
         "<td><td><td><td class=centered><input type=submit value='Create a new cell graph'>"
+        "<br>using <input type=text style='text-align:center' size=2 name=threadCount value='0'"
+        " title='The number of threads used to create the graph (0 = use all hardware threads).'> threads"
         "</form>";
 
     html << "</table>";
@@ -137,14 +138,13 @@ void ExpressionMatrix::compareCellGraphs(
 
     // Find the common vertices (vertices that correspond to the same cell).
     vector<CellId> cells0, cells1;
-    BGL_FORALL_VERTICES(v, graph0, CellGraph) {
-        cells0.push_back(graph0[v].cellId);
+    // The vertices are in order of increasing cell id, so no sorting is needed.
+    for(CellId v=0; v<graph0.vertexCount(); v++) {
+        cells0.push_back(graph0.getCellId(v));
     }
-    BGL_FORALL_VERTICES(v, graph1, CellGraph) {
-        cells1.push_back(graph1[v].cellId);
+    for(CellId v=0; v<graph1.vertexCount(); v++) {
+        cells1.push_back(graph1.getCellId(v));
     }
-    sort(cells0.begin(), cells0.end());
-    sort(cells1.begin(), cells1.end());
     vector<CellId> commonCells;
     std::set_intersection(cells0.begin(), cells0.end(), cells1.begin(), cells1.end(), back_inserter(commonCells));
 
@@ -153,29 +153,35 @@ void ExpressionMatrix::compareCellGraphs(
     // Maps of the edges. Keyed by pair(CellId, CellId), with the lowest numbered cell first.
     // Values: similarities.
     map< pair<CellId, CellId>, float> edgeMap0, edgeMap1;
-    BGL_FORALL_EDGES(e, graph0, CellGraph) {
-        const CellGraph::vertex_descriptor vA = source(e, graph0);
-        const CellGraph::vertex_descriptor vB = target(e, graph0);
-        CellId cellIdA = graph0[vA].cellId;
-        CellId cellIdB = graph0[vB].cellId;
-        CZI_ASSERT(cellIdA != cellIdB);
-        if(cellIdB < cellIdA) {
-            swap(cellIdA, cellIdB);
+    for(CellId vA=0; vA<graph0.vertexCount(); vA++) {
+        const CellId* neighbor = graph0.neighborsBegin(vA);
+        const CellId* end = graph0.neighborsEnd(vA);
+        const float* similarity = graph0.similaritiesBegin(vA);
+        for(; neighbor!=end; ++neighbor, ++similarity) {
+            const CellId vB = *neighbor;
+            if(vB > vA) {
+                // Cell ids are in the same order as vertices, so cellIdA < cellIdB.
+                const CellId cellIdA = graph0.getCellId(vA);
+                const CellId cellIdB = graph0.getCellId(vB);
+                CZI_ASSERT(cellIdA < cellIdB);
+                edgeMap0.insert(make_pair( make_pair(cellIdA, cellIdB), *similarity));
+            }
         }
-        CZI_ASSERT(cellIdA < cellIdB);
-        edgeMap0.insert(make_pair( make_pair(cellIdA, cellIdB), graph0[e].similarity));
     }
-    BGL_FORALL_EDGES(e, graph1, CellGraph) {
-        const CellGraph::vertex_descriptor vA = source(e, graph1);
-        const CellGraph::vertex_descriptor vB = target(e, graph1);
-        CellId cellIdA = graph1[vA].cellId;
-        CellId cellIdB = graph1[vB].cellId;
-        CZI_ASSERT(cellIdA != cellIdB);
-        if(cellIdB < cellIdA) {
-            swap(cellIdA, cellIdB);
+    for(CellId vA=0; vA<graph1.vertexCount(); vA++) {
+        const CellId* neighbor = graph1.neighborsBegin(vA);
+        const CellId* end = graph1.neighborsEnd(vA);
+        const float* similarity = graph1.similaritiesBegin(vA);
+        for(; neighbor!=end; ++neighbor, ++similarity) {
+            const CellId vB = *neighbor;
+            if(vB > vA) {
+                // Cell ids are in the same order as vertices, so cellIdA < cellIdB.
+                const CellId cellIdA = graph1.getCellId(vA);
+                const CellId cellIdB = graph1.getCellId(vB);
+                CZI_ASSERT(cellIdA < cellIdB);
+                edgeMap1.insert(make_pair( make_pair(cellIdA, cellIdB), *similarity));
+            }
         }
-        CZI_ASSERT(cellIdA < cellIdB);
-        edgeMap1.insert(make_pair( make_pair(cellIdA, cellIdB), graph1[e].similarity));
     }
 
 
@@ -379,10 +385,9 @@ void ExpressionMatrix::exploreCellGraph(
     if (!graph.layoutWasComputed) {
         html << "<div style='font-family:courier'>";
         html << timestamp << "Graph layout computation begins.";
-        graph.computeLayout();
+        computeCellGraphLayout(graphName);
         html << "<br>" << timestamp << "Graph layout computation ends.";
         html << "</div>";
-        graph.layoutWasComputed = true;
     }
 
 
@@ -398,8 +403,8 @@ void ExpressionMatrix::exploreCellGraph(
     html << "<tr><td>Gene set name<td>" << geneSetName;
     html << "<tr><td>Similarity threshold<td class=centered>" << graphInformation.similarityThreshold;
     html << "<tr><td>Maximum connectivity<td class=centered>" << graphInformation.maxConnectivity;
-    html << "<tr><td>Number of vertices (cells)<td class=centered>" << boost::num_vertices(graph);
-    html << "<tr><td>Number of edges<td class=centered>" << boost::num_edges(graph);
+    html << "<tr><td>Number of vertices (cells)<td class=centered>" << graph.vertexCount();
+    html << "<tr><td>Number of edges<td class=centered>" << graph.edgeCount();
     html << "<tr><td>Number of isolated vertices (cells) removed<td class=centered>"
         << graphInformation.isolatedRemovedVertexCount;
     html << "</table>";
@@ -795,17 +800,16 @@ Thinner edge
 #if 0
         // THIS IS THE OLD CODE THAT USES ALL THE GENES
         // Set the value field for all the vertices.
-        BGL_FORALL_VERTICES(v, graph, CellGraph) {
-            CellGraphVertex& vertex = graph[v];
-            const double rawCount = getCellExpressionCount(vertex.cellId, geneId);
+        for(CellId v=0; v<graph.vertexCount(); v++) {
+            const double rawCount = getCellExpressionCount(graph.getCellId(v), geneId);
             if(normalizationMethod == NormalizationMethod::none) {
-                vertex.value = rawCount;
+                graph.value(v) = rawCount;
             } else {
-                const Cell& cell = cells[vertex.cellId];
+                const Cell& cell = cells[graph.getCellId(v)];
                 if(normalizationMethod == NormalizationMethod::L1) {
-                    vertex.value = rawCount * cell.norm1Inverse;
+                    graph.value(v) = rawCount * cell.norm1Inverse;
                 } else if(normalizationMethod == NormalizationMethod::L2) {
-                    vertex.value = rawCount * cell.norm2Inverse;
+                    graph.value(v) = rawCount * cell.norm2Inverse;
                 } else if(normalizationMethod == NormalizationMethod::Invalid){
                     html << "<p>Invalid normalization method.";
                     return;
@@ -815,18 +819,16 @@ Thinner edge
 #endif
 
         // THIS IS THE NEW CODE THAT USES THE GENE SET APPROPRIATE FOR THIS GRAPH.
-        const SimilarPairs similarPairs(directoryName, similarPairsName, true);
-        const GeneSet& geneSet = similarPairs.getGeneSet();
+        const GeneSet& geneSet = getSimilarPairsGeneSet(similarPairsName);
         const GeneId localGeneId = geneSet.getLocalGeneId(geneId);
         CZI_ASSERT(localGeneId != invalidGeneId);
         vector< pair<GeneId, float> > expressionVector;
-        BGL_FORALL_VERTICES(v, graph, CellGraph) {
-            CellGraphVertex& vertex = graph[v];
-            computeExpressionVector(vertex.cellId, geneSet, normalizationMethod, expressionVector);
-            vertex.value = 0.;
+        for(CellId v=0; v<graph.vertexCount(); v++) {
+            computeExpressionVector(graph.getCellId(v), geneSet, normalizationMethod, expressionVector);
+            graph.value(v) = 0.;
             for(const auto& p: expressionVector) {  // Could do a binary search instead.
                 if(p.first == localGeneId) {
-                    vertex.value = p.second;
+                    graph.value(v) = p.second;
                     break;
                 }
             }
@@ -841,11 +843,9 @@ Thinner edge
             return;
         }
         colorByNumber = true;
-        const SimilarPairs similarPairs(directoryName, similarPairsName, true);
-        const GeneSet& geneSet = similarPairs.getGeneSet();
-        BGL_FORALL_VERTICES(v, graph, CellGraph) {
-            CellGraphVertex& vertex = graph[v];
-            vertex.value = computeCellSimilarity(geneSet, cellIdForColoringBySimilarity, vertex.cellId);
+        const GeneSet& geneSet = getSimilarPairsGeneSet(similarPairsName);
+        for(CellId v=0; v<graph.vertexCount(); v++) {
+            graph.value(v) = computeCellSimilarity(geneSet, cellIdForColoringBySimilarity, graph.getCellId(v));
         }
     }
 
@@ -865,9 +865,8 @@ Thinner edge
             // We need to assign groups based on the of values of the specified meta data field.
             // Find the frequency of each of them.
             map<string, int> frequencyTable;
-            BGL_FORALL_VERTICES(v, graph, CellGraph) {
-                const CellGraphVertex& vertex = graph[v];
-                const string metaDataValue = getCellMetaData(vertex.cellId, metaDataName);
+            for(CellId v=0; v<graph.vertexCount(); v++) {
+                const string metaDataValue = getCellMetaData(graph.getCellId(v), metaDataName);
                 const auto it = frequencyTable.find(metaDataValue);
                 if(it == frequencyTable.end()) {
                     frequencyTable.insert(make_pair(metaDataValue, 1));
@@ -888,10 +887,9 @@ Thinner edge
             }
 
             // Assign the vertices to groups..
-            BGL_FORALL_VERTICES(v, graph, CellGraph) {
-                CellGraphVertex& vertex = graph[v];
-                const string metaData = getCellMetaData(vertex.cellId, metaDataName);
-                vertex.group = groupMap[metaData];
+            for(CellId v=0; v<graph.vertexCount(); v++) {
+                const string metaData = getCellMetaData(graph.getCellId(v), metaDataName);
+                graph.group(v) = groupMap[metaData];
             }
 
 
@@ -935,10 +933,9 @@ Thinner edge
         else if(metaDataMeaning == "color") {
 
             // The meta data field is interpreted directly as an html color.
-            BGL_FORALL_VERTICES(v, graph, CellGraph) {
-                CellGraphVertex& vertex = graph[v];
-                vertex.group = 0;
-                vertex.color = getCellMetaData(vertex.cellId, metaDataName);
+            for(CellId v=0; v<graph.vertexCount(); v++) {
+                graph.group(v) = 0;
+                graph.color(v) = getCellMetaData(graph.getCellId(v), metaDataName);
             }
         }
 
@@ -948,12 +945,11 @@ Thinner edge
         // We store in each vertex the meta data value that will determine the vertex color.
         else if(metaDataMeaning == "number") {
             colorByNumber = true;
-            BGL_FORALL_VERTICES(v, graph, CellGraph) {
-                CellGraphVertex& vertex = graph[v];
-                vertex.group = 0;
-                vertex.value = std::numeric_limits<double>::max();
+            for(CellId v=0; v<graph.vertexCount(); v++) {
+                graph.group(v) = 0;
+                graph.value(v) = std::numeric_limits<double>::max();
                 try {
-                    vertex.value = lexical_cast<double>(getCellMetaData(vertex.cellId, metaDataName));
+                    graph.value(v) = lexical_cast<double>(getCellMetaData(graph.getCellId(v), metaDataName));
                 } catch(bad_lexical_cast) {
                     // If the meta data cannot be interpreted as a number, the value is left at
                     // the ":invalid" value set above, and the vertex will be colored black.
@@ -966,34 +962,22 @@ Thinner edge
 
         // Otherwise, don't color the vertices.
         else {
-            BGL_FORALL_VERTICES(v, graph, CellGraph) {
-                CellGraphVertex& vertex = graph[v];
-                vertex.color.clear();
-                vertex.group = 0;
+            for(CellId v=0; v<graph.vertexCount(); v++) {
+                graph.color(v).clear();
+                graph.group(v) = 0;
             }
         }
 
-
-
-        // Don't color the edges.
-        BGL_FORALL_EDGES(e, graph, CellGraph) {
-            graph[e].color.clear();
-        }
-
     }
 
 
 
-    // Otherwise, all vertices and edges are colored black.
+    // Otherwise, all vertices are colored black.
     else {
 
-        BGL_FORALL_VERTICES(v, graph, CellGraph) {
-            CellGraphVertex& vertex = graph[v];
-            vertex.color.clear();
-            vertex.group = 0;
-        }
-        BGL_FORALL_EDGES(e, graph, CellGraph) {
-            graph[e].color.clear();
+        for(CellId v=0; v<graph.vertexCount(); v++) {
+            graph.color(v).clear();
+            graph.group(v) = 0;
         }
     }
 
@@ -1005,8 +989,8 @@ Thinner edge
     if(colorByNumber) {
 
         // Compute the minimum and maximum values.
-        BGL_FORALL_VERTICES(v, graph, CellGraph) {
-            const double value = graph[v].value;
+        for(CellId v=0; v<graph.vertexCount(); v++) {
+            const double value = graph.value(v);
             if(value == std::numeric_limits<double>::max()) {
                 continue;
             }
@@ -1023,18 +1007,17 @@ Thinner edge
 
         // Now compute the colors.
         if(minValue==maxValue || maxValue==std::numeric_limits<double>::lowest()) {
-            BGL_FORALL_VERTICES(v, graph, CellGraph) {
-                graph[v].color = "black";
+            for(CellId v=0; v<graph.vertexCount(); v++) {
+                graph.color(v) = "black";
             }
         } else {
             const double scalingFactor = 1./(maxColorValue - minColorValue);
-            BGL_FORALL_VERTICES(v, graph, CellGraph) {
-                CellGraphVertex& vertex = graph[v];
-                const double value = vertex.value;
+            for(CellId v=0; v<graph.vertexCount(); v++) {
+                const double value = graph.value(v);
                 if(value == std::numeric_limits<double>::max()) {
                     continue;
                 }
-                vertex.color = spectralColor(scalingFactor * (value-minColorValue));
+                graph.color(v) = spectralColor(scalingFactor * (value-minColorValue));
             }
         }
     }
@@ -25,14 +25,20 @@
 #include "BitSet.hpp"
 #include "charikar.hpp"
 #include "ExpressionMatrixSubset.hpp"
+#include "filesystem.hpp"
 #include "heap.hpp"
+#include "HnswIndex.hpp"
 #include "iterator.hpp"
 #include "Lsh.hpp"
+#include "LshIndex.hpp"
 #include "multipleSetUnion.hpp"
+#include "MultiProbe.hpp"
 #include "nextPowerOfTwo.hpp"
 #include "orderPairs.hpp"
+#include "parallelFor.hpp"
 #include "SimilarPairs.hpp"
 #include "timestamp.hpp"
+#include "tokenize.hpp"
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
@@ -44,7 +50,9 @@ using namespace ExpressionMatrix2;
 #include "algorithm.hpp"
 #include <cmath>
 #include "fstream.hpp"
+#include <atomic>
 #include <chrono>
+#include <mutex>
 #include <numeric>
 #include <queue>
 #include <random>
@@ -57,6 +65,7 @@ void ExpressionMatrix::analyzeSimilarPairs(
     double csvDownsample) const
 {
     // Open the SimilarPairs object we want to analyze.
+    checkSimilarPairsNotCompactOnly(similarPairsName);
     const SimilarPairs similarPairs(directoryName, similarPairsName, true);
     const GeneSet& geneSet = similarPairs.getGeneSet();
     const CellSet& cellSet = similarPairs.getCellSet();
@@ -160,7 +169,8 @@ void ExpressionMatrix::findSimilarPairs4(
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
     double similarityThreshold,     // The minimum similarity for a pair to be stored.
     size_t lshCount,                // The number of LSH vectors to use.
-    unsigned int seed               // The seed used to generate the LSH vectors.
+    unsigned int seed,              // The seed used to generate the LSH vectors.
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
     )
 {
     out << timestamp << "ExpressionMatrix::findSimilarPairs4 begins." << endl;
@@ -191,96 +201,164 @@ void ExpressionMatrix::findSimilarPairs4(
     const string expressionMatrixSubsetName =
         directoryName + "/tmp-ExpressionMatrixSubset-" + similarPairsName;
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, threadCount);
 
     // Create the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/tmp-Lsh", expressionMatrixSubset, lshCount, seed);
-
-    // Temporary storage of pairs for each cell.
-    vector< vector< pair<CellId, float> > > tmp(cellCount);
-    const size_t tmpStore = 2 * k;
-    for(auto& v: tmp) {
-        v.reserve(tmpStore);
+    Lsh lsh(directoryName + "/tmp-Lsh", expressionMatrixSubset, lshCount, seed, threadCount);
+
+    // The LSH similarity is a decreasing function of the number of
+    // mismatching signature bits, so we work with mismatch counts.
+    // A pair is stored if its mismatch count is less than mismatchCountEnd.
+    size_t mismatchCountEnd = 0;
+    while(mismatchCountEnd<=lshCount && lsh.getSimilarity(mismatchCountEnd) > similarityThreshold) {
+        ++mismatchCountEnd;
     }
 
-    // Current similarity threshold for each cell.
-    vector<float> cellThreshold(cellCount, float(similarityThreshold));
+    // For each cell, the best k pairs found so far are kept in a heap
+    // of keys (mismatchCount, cellId1), with the worst key at the top.
+    // The heap for cellId0 uses heapKeys[cellId0*k, cellId0*k+heapSizes[cellId0]).
+    // Because the keys are totally ordered, the k best keys
+    // for each cell don't depend on the order in which pairs are added,
+    // so the pairs stored for each cell are uniquely defined,
+    // with ties broken by CellId, and don't depend on the number of threads.
+    vector<uint64_t> heapKeys(size_t(cellCount) * k);
+    vector<uint32_t> heapSizes(cellCount, 0);
+    const auto addToHeap = [&](CellId cellId0, uint64_t key)
+    {
+        if(k == 0) {
+            return;
+        }
+        uint64_t* heapBegin = heapKeys.data() + size_t(cellId0) * k;
+        uint32_t& heapSize = heapSizes[cellId0];
+        if(heapSize < k) {
+            heapBegin[heapSize++] = key;
+            std::push_heap(heapBegin, heapBegin + heapSize);
+        } else if(key < heapBegin[0]) {
+            popAndPushHeap(heapBegin, heapBegin + k, key, std::less<uint64_t>());
+        }
+    };
 
 
 
     // Loop over all pairs. This is much faster than findSimilarPairs0
     // (around 15 ns per pair when using LSH vectors of 1024 bits), but
     // still scales like the square of the number of cells in the cell set.
-    // This loops in blocks of cells for better memory locality than a simple
-    // loop over cell pairs.
-    out << timestamp << "Begin computing similarities for all cell pairs." << endl;
+    // The cells are divided into an even number of panels of contiguous cells,
+    // and each pair of cells is computed once, in the tile
+    // for its pair of panels (upper triangle only) and is added to the heaps of both cells.
+    // Tiles are processed in rounds on multiple threads.
+    // The tiles of a round involve disjoint panels (round robin schedule), so the
+    // thread that processes a tile is the only one that updates the heaps of its
+    // two panels during that round, and the heaps need no locking or per-thread copies.
+    // There are panelCount-1 rounds for the tiles between two different panels,
+    // plus a final round for the diagonal tiles.
+    // Within each tile, the mismatch counts are computed by Lsh::computeMismatchCounts
+    // in sub-tiles of blockSize0 x blockSize1 cells, for good memory locality.
+    threadCount = getThreadCount(threadCount);
+    out << timestamp << "Begin computing similarities for all cell pairs using " <<
+        threadCount << " threads." << endl;
     const auto t0 = std::chrono::steady_clock::now();
-    const CellId blockSize = 64;
-    size_t pairCount = 0;
-    size_t totalPairCount = size_t(cellCount)*(size_t(cellCount-1))/2;
-    size_t blockCount = 0;
-    for(CellId begin0=0; begin0<cellCount; begin0+=blockSize) {
-        const CellId end0 = min(begin0+blockSize, cellCount);
-        for(CellId begin1=0; begin1<=begin0; begin1+=blockSize) {
-            if(blockCount>0 && ((blockCount%1000000)==0)) {
-                out << timestamp << "Pair computation ";
-                out << 100.*double(pairCount)/double(totalPairCount);
-                out << "% complete." << endl;
-            }
-            ++blockCount;
-            const CellId end1 = min(begin1+blockSize, end0);
-            for(CellId cell0=begin0; cell0!=end0; ++cell0) {
-                auto& tmp0 = tmp[cell0];
-                for(CellId cell1=begin1; cell1!=end1 && cell1<cell0; ++cell1) {
-                    auto& tmp1 = tmp[cell1];
-                    ++pairCount;
-
-                    // Compute the LSH similarity between these two cells.
-                    const double similarity = lsh.computeCellSimilarity(cell0, cell1);
-
-                    // If the similarity is sufficient, pass it to the SimilarPairs container,
-                    // which will make the decision whether to store it, depending on the
-                    // number of pairs already stored for cellId0 and cellId1.
-                    if(similarity > similarityThreshold) {
-                        if(similarity > cellThreshold[cell0]) {
-                            tmp0.push_back(make_pair(cell1, similarity));
-                            if(tmp0.size() == tmpStore) {
-                                keepBest(tmp0, k, OrderPairsBySecondGreater< pair<CellId, float> >());
-                                cellThreshold[cell0] = tmp0.back().second;
-                            }
-                        }
-                        if(similarity > cellThreshold[cell1]) {
-                            tmp1.push_back(make_pair(cell0, similarity));
-                            if(tmp1.size() == tmpStore) {
-                                keepBest(tmp1, k, OrderPairsBySecondGreater< pair<CellId, float> >());
-                                cellThreshold[cell1] = tmp1.back().second;
-                            }
+    const CellId blockSize0 = 64;
+    const CellId blockSize1 = 1024;
+    const size_t blockCount = (cellCount - 1) / blockSize0 + 1;
+    size_t panelCount = min(8 * threadCount, blockCount);
+    if(panelCount % 2) {
+        ++panelCount;   // The last panel can be empty.
+    }
+    const CellId panelSize = CellId(((blockCount - 1) / panelCount + 1) * blockSize0);
+    const auto panelBegin = [&](size_t panel)
+    {
+        return CellId(min(size_t(cellCount), panel * panelSize));
+    };
+
+    // Process the tile for panels (panel0, panel1), with panel0 <= panel1.
+    const auto processTile = [&](size_t panel0, size_t panel1, vector<uint32_t>& mismatchCounts)
+    {
+        const bool isDiagonal = (panel0 == panel1);
+        for(CellId begin0=panelBegin(panel0); begin0<panelBegin(panel0+1); begin0+=blockSize0) {
+            const CellId end0 = min(CellId(begin0 + blockSize0), panelBegin(panel0+1));
+            const CellId end1 = panelBegin(panel1+1);
+            for(CellId begin1=(isDiagonal ? begin0 : panelBegin(panel1)); begin1<end1; begin1+=blockSize1) {
+                const CellId end1Block = min(CellId(begin1 + blockSize1), end1);
+                const CellId n1 = end1Block - begin1;
+                lsh.computeMismatchCounts(begin0, end0, begin1, end1Block, mismatchCounts.data());
+                for(CellId cell0=begin0; cell0!=end0; ++cell0) {
+                    const uint32_t* mismatchCounts0 = mismatchCounts.data() + size_t(cell0 - begin0) * n1;
+                    for(CellId cell1=max(begin1, CellId(cell0+1)); cell1<end1Block; ++cell1) {
+                        const uint64_t mismatchCount = mismatchCounts0[cell1 - begin1];
+                        if(mismatchCount >= mismatchCountEnd) {
+                            continue;
                         }
+                        addToHeap(cell0, (mismatchCount << 32) | cell1);
+                        addToHeap(cell1, (mismatchCount << 32) | cell0);
                     }
                 }
             }
         }
-    }
-    // Keep at most k of each.
-    for(auto& tmp0: tmp) {
-        if(tmp0.size() > k) {
-            keepBest(tmp0, k, OrderPairsBySecondGreater< pair<CellId, float> >());
-        }
+    };
+
+    const size_t roundCount = panelCount;
+    for(size_t round=0; round<roundCount; round++) {
+        parallelFor(panelCount / 2, 1, threadCount,
+            [&](size_t threadId, size_t begin, size_t end)
+            {
+                vector<uint32_t> mismatchCounts(size_t(blockSize0) * size_t(blockSize1));
+                for(size_t i=begin; i!=end; i++) {
+                    if(round == roundCount - 1) {
+
+                        // Diagonal tiles, two for each task.
+                        processTile(2*i, 2*i, mismatchCounts);
+                        processTile(2*i+1, 2*i+1, mismatchCounts);
+
+                    } else {
+
+                        // Round robin pairing of the panels.
+                        size_t panel0, panel1;
+                        if(i == 0) {
+                            panel0 = round;
+                            panel1 = panelCount - 1;
+                        } else {
+                            panel0 = (round + i) % (panelCount - 1);
+                            panel1 = (round + panelCount - 1 - i) % (panelCount - 1);
+                        }
+                        processTile(min(panel0, panel1), max(panel0, panel1), mismatchCounts);
+                    }
+                }
+            });
+        out << timestamp << "Pair computation ";
+        out << 100.*double(round+1)/double(roundCount);
+        out << "% complete." << endl;
     }
     const auto t1 = std::chrono::steady_clock::now();
     const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
-    CZI_ASSERT(pairCount == totalPairCount);
     out << "Time for all pairs: " << t01 << " s." << endl;
     out << "Time per pair: " << t01/(0.5*double(cellCount)*double(cellCount-1)) << " s." << endl;
 
     // Store the pairs in a SimilarPairs object.
-    out << timestamp << "Initializing SimilarPairs object." << endl;
+    out << timestamp << "Storing similar pairs." << endl;
     SimilarPairs similarPairs(directoryName, similarPairsName, geneSetName, cellSetName, k);
-    out << timestamp << "Copying similar pairs." << endl;
-    similarPairs.copy(tmp);
-
+    parallelFor(cellCount, 1000, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            vector<SimilarPairs::Pair> pairs;
+            for(CellId cellId0=CellId(begin); cellId0!=CellId(end); ++cellId0) {
+                uint64_t* heapBegin = heapKeys.data() + size_t(cellId0) * k;
+                uint64_t* heapEnd = heapBegin + heapSizes[cellId0];
+                std::sort(heapBegin, heapEnd);
+                pairs.clear();
+                for(const uint64_t* key=heapBegin; key!=heapEnd; ++key) {
+                    const CellId cellId1 = CellId(*key & 0xffffffffULL);
+                    const size_t mismatchCount = size_t(*key >> 32);
+                    pairs.push_back(SimilarPairs::Pair(cellId1,
+                        SimilarPairs::CellSimilarity(lsh.getSimilarity(mismatchCount))));
+                }
+                similarPairs.copy(cellId0, pairs.data(), pairs.data() + pairs.size());
+            }
+        });
 
     // Sort the similar pairs for each cell by decreasing similarity.
+    // They are already sorted, except possibly for ties
+    // created when converting the similarities to CellSimilarity.
     out << timestamp << "Sorting similar pairs." << endl;
     similarPairs.sort();
     out << timestamp << "ExpressionMatrix::findSimilarPairs4 ends." << endl;
@@ -295,11 +373,12 @@ void ExpressionMatrix::findSimilarPairs4(
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
     double similarityThreshold,     // The minimum similarity for a pair to be stored.
     size_t lshCount,                // The number of LSH vectors to use.
-    unsigned int seed               // The seed used to generate the LSH vectors.
+    unsigned int seed,              // The seed used to generate the LSH vectors.
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
     )
 {
     findSimilarPairs4(cout, geneSetName, cellSetName, similarPairsName,
-        k, similarityThreshold, lshCount, seed);
+        k, similarityThreshold, lshCount, seed, threadCount);
 }
 
 
@@ -317,7 +396,8 @@ void ExpressionMatrix::findSimilarPairs5(
     size_t k,                       // The maximum number of similar pairs to be stored for each cell.
     double similarityThreshold,     // The minimum similarity for a pair to be stored.
     size_t lshSliceLength,          // The number of bits in each LSH signature slice, or 0 for automatic selection.
-    size_t bucketOverflow           // If not zero, ignore buckets larger than this.
+    size_t bucketOverflow,          // If not zero, ignore buckets larger than this.
+    const string& lshIndexName      // The name of a persistent LshIndex to use or create, or empty for a temporary one.
     )
 {
     cout << timestamp << "ExpressionMatrix::findSimilarPairs5 begins." << endl;
@@ -351,43 +431,30 @@ void ExpressionMatrix::findSimilarPairs5(
     }
 
 
-    // Find the signature bits corresponding to each slice.
-    const size_t sliceCount = lsh.lshCount() / lshSliceLength;
-    vector< vector<size_t> > allSlicesBits(sliceCount);
-    for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
-        vector<size_t>& sliceBits = allSlicesBits[sliceId];
-        const size_t sliceBegin = sliceId * lshSliceLength;
-        const size_t sliceEnd = sliceBegin + lshSliceLength;
-        for(size_t bit=sliceBegin; bit!=sliceEnd; bit++) {
-            sliceBits.push_back(bit);
-        }
+    // Automatic selection of the slice length.
+    const size_t log2CellCount = size_t(std::ceil(std::log2(double(cellCount))));
+    if(lshSliceLength == 0) {
+        lshSliceLength = max(size_t(1), log2CellCount);
+        cout << "Using LSH slice length " << lshSliceLength << endl;
     }
-
-
-    // Table to contain, for each signature slice,
-    // the cells with each of possible value of the slice.
-    // Indexed by [sliceId][sliceValue].
-    // All cell ids are local to the cell set we are using.
-    vector< vector < vector<CellId> > > tables(sliceCount);
-
-
-
-    // Loop over the signature slices.
-    // Each generates a new table of cells.
-    for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
-        cout << timestamp << "Computing cell table for signature slice " << sliceId << " of " << sliceCount << endl;
-        vector < vector<CellId> >& table = tables[sliceId];
-        table.resize(1ULL << lshSliceLength);
-        const vector<size_t>& sliceBits = allSlicesBits[sliceId];
-
-        // Store each cell id based on the value of this signature slice.
-        for(CellId cellId=0; cellId<cellCount; cellId++) {
-            const uint64_t signatureSlice = lsh.getSignature(cellId).getBits(sliceBits);
-            CZI_ASSERT(signatureSlice < table.size());
-            table[signatureSlice].push_back(cellId);
-        }
+    if(lshSliceLength > min(lsh.lshCount(), size_t(64))) {
+        throw runtime_error("The LSH slice length can be at most 64 and at most the number of LSH signature bits.");
     }
-    cout << timestamp << "Computation of cell table completed." << endl;
+
+    // Assign cells to buckets based on the value of each signature slice
+    // (see LshIndex.hpp). Each slice has lshSliceLength bits.
+    // With log2BucketCount greater than the slice length,
+    // the bucket id is the value of the signature slice.
+    // For long slices, this would make the tables much larger than the number of cells,
+    // so the number of buckets is limited to about twice the number of cells
+    // and the signature slices are hashed to that number of bits instead.
+    const vector<int> lshSliceLengths(1, int(lshSliceLength));
+    const size_t log2BucketCount = min(min(lshSliceLength, log2CellCount), size_t(30)) + 1;
+    const shared_ptr<LshIndex> lshIndexPointer = accessLshIndex(
+        lshName, lshIndexName, "tmp-LshIndex-" + similarPairsName,
+        lsh, lshSliceLengths, log2BucketCount, 0);
+    const LshIndex& lshIndex = *lshIndexPointer;
+    const size_t sliceCount = lshIndex.sliceCount(0);
 
     // Temporary storage of pairs for each cell.
     vector< vector< pair<CellId, float> > > tmp(cellCount);
@@ -399,7 +466,9 @@ void ExpressionMatrix::findSimilarPairs5(
     // for this cell.
     size_t fullCellCount = 0;
     vector<CellId> candidates;
-    vector< const vector<CellId>* > setsToUnion;
+    vector< MemoryAsContainer<const CellId> > buckets;
+    buckets.reserve(sliceCount);    // So pointers in setsToUnion remain valid.
+    vector< const MemoryAsContainer<const CellId>* > setsToUnion;
     vector< pair<CellId, float> > cellNeighbors;    // The neighbors of a single cell.
     size_t totalCandidateCount = 0;
     for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
@@ -414,19 +483,15 @@ void ExpressionMatrix::findSimilarPairs5(
         candidates.clear();
         setsToUnion.clear();
         // size_t totalCountToUnion = 0;
+        buckets.clear();
+        const BitSetPointer signature = lsh.getSignature(cellId0);
         for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
-            const uint64_t signatureSlice = lsh.getSignature(cellId0).getBits(allSlicesBits[sliceId]);
-            const auto& bucket = tables[sliceId][signatureSlice];
-            if(bucketOverflow==0 || bucket.size()<=bucketOverflow) {
-                setsToUnion.push_back(&tables[sliceId][signatureSlice]);
-                // totalCountToUnion += tables[sliceId][signatureSlice].size();
+            const uint64_t bucketId = lshIndex.getBucketId(signature, 0, sliceId);
+            buckets.push_back(lshIndex.getBucket(0, sliceId, bucketId));
+            if(bucketOverflow==0 || buckets.back().size()<=bucketOverflow) {
+                setsToUnion.push_back(&buckets.back());
+                // totalCountToUnion += buckets.back().size();
             }
-#if 0
-            cout << "Bucket for cell " << cellId0 << " slice " << sliceId << ": ";
-            copy(tables[sliceId][signatureSlice].begin(), tables[sliceId][signatureSlice].end(),
-                ostream_iterator<CellId>(cout, " "));
-            cout << endl;
-#endif
         }
         multipleSetUnion(setsToUnion, candidates);
         totalCandidateCount += candidates.size();
@@ -513,7 +578,10 @@ void ExpressionMatrix::findSimilarPairs7(
     double similarityThreshold,     // The minimum similarity for a pair to be stored.
     const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
     CellId maxCheck,                // Maximum number of cells to consider for each cell.
-    size_t log2BucketCount
+    size_t log2BucketCount,
+    size_t threadCount,             // The number of threads to use, or 0 to use all hardware threads.
+    const string& lshIndexName,     // The name of a persistent LshIndex to use or create, or empty for a temporary one.
+    size_t probeCount               // The number of additional buckets to probe for each slice (multi-probe LSH).
     )
 {
     cout << timestamp << "ExpressionMatrix::findSimilarPairs7 begins." << endl;
@@ -547,59 +615,26 @@ void ExpressionMatrix::findSimilarPairs7(
     }
     const size_t lshBitCount = lsh.lshCount();
     cout << "Number of LSH signature bits is " << lshBitCount << endl;
-
-    // Check that the slice lengths are in decreasing order.
-    const size_t sliceLengthCount = lshSliceLengths.size();
-    for(size_t i=1; i<sliceLengthCount; i++) {
-        if(lshSliceLengths[i] >= lshSliceLengths[i-1]) {
-            throw runtime_error("The slice lengths are not in decreasing order.");
-        }
+    if(probeCount>0 && !lsh.hasMargins()) {
+        throw runtime_error("Multi-probe LSH requires LSH object " + lshName +
+            " to be created with storeMargins=True.");
     }
 
-    // Check that the slice lengths are no more than 64.
-    for(size_t i=0; i<sliceLengthCount; i++) {
-        if(lshSliceLengths[i] > 64) {
-            throw runtime_error("Each slice length can be at most 64 bits.");
-        }
-    }
+    // Assign cells to buckets, for each slice length
+    // and signature slice of that length (see LshIndex.hpp).
+    // The buckets are stored in memory mapped files, which are temporary
+    // unless we were given the name of a persistent LshIndex.
+    const shared_ptr<LshIndex> lshIndexPointer = accessLshIndex(
+        lshName, lshIndexName, "tmp-LshIndex-" + similarPairsName,
+        lsh, lshSliceLengths, log2BucketCount, threadCount);
+    const LshIndex& buckets = *lshIndexPointer;
+    const size_t sliceLengthCount = buckets.sliceLengthCount();
 
     // Create SimilarPairs object that will store the results.
     SimilarPairs similarPairs(directoryName, similarPairsName, geneSetName, cellSetName, k);
 
 
 
-    // For each slice length and signature slice of that length,
-    // each cell is assigned to a bucket
-    // based on the value of its signature slice.
-    // The cells in each bucket will be stored in
-    // tables4[sliceLengthId][sliceId][bucketId],
-    // where:
-    // - sliceLengthId corresponds to the slice lengths to be used,
-    //   stored in lshSliceLengths in decreasing order.
-    // - sliceId identifies the particular slice of that length
-    //   (we have a total lshBitCount bits, which can be used
-    //   to form lshBitCount/lshSliceLength possible signature
-    //   slices each lshSliceLength bits in length).
-    // - bucketId identifies the bucket.
-    vector< vector< vector< vector<CellId> > > > table4;
-
-    // Vector to contain the signature bits of each signature slice.
-    // Indexed by [sliceLengthId][sliceId].
-    vector< vector< vector< size_t > > > sliceBits3;
-
-    // Assign cells to buckets.
-    findSimilarPairs7AssignCellsToBuckets(lsh, lshSliceLengths, sliceBits3, table4, log2BucketCount);
-
-
-
-    // Bit set to keep track which cellId1 cells we have already
-    // looked at, for a given cellId0.
-    BitSet cellMap(cellCount);
-
-    // Other vectors used over and over again for each cell.
-    vector<CellId> candidateNeighbors;
-    vector< pair<uint32_t, CellId> > neighbors; // pair(mismatchCount, cellId1)
-
     const size_t mismatchCountThreshold =
         lsh.computeMismatchCountThresholdFromSimilarityThreshold(similarityThreshold);
     cout << "Mismatch count threshold is " << mismatchCountThreshold << endl;
@@ -608,93 +643,125 @@ void ExpressionMatrix::findSimilarPairs7(
 
     // For each cell, look at cells in the same bucket.
     // Stop when we found enough similar cells.
-    cout << timestamp << "Finding similar cell pairs." << endl;
-    const uint64_t bucketCount = (1ULL << log2BucketCount);
-    const uint64_t bucketMask = bucketCount - 1ULL;
-    for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
-        if(cellId0!=0 && (cellId0 % 1000)==0) {
-            cout << timestamp << "Working on cell " << cellId0 << " of " << cellCount << endl;
-        }
-        const BitSetPointer signature = lsh.getSignature(cellId0);
+    // The buckets are read-only at this point, so cells can be
+    // processed in parallel. Each thread uses its own scratch data structures,
+    // and only stores pairs for the cells it processes,
+    // so the results don't depend on the number of threads.
+    threadCount = getThreadCount(threadCount);
+    cout << timestamp << "Finding similar cell pairs using " << threadCount << " threads." << endl;
+    const size_t batchSize = 1000;
+    std::mutex coutMutex;
+    parallelFor(cellCount, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            if(begin != 0) {
+                std::lock_guard<std::mutex> lock(coutMutex);
+                cout << timestamp << "Working on cell " << begin << " of " << cellCount << endl;
+            }
 
-        // Loop over slice lengths.
-        for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
-            const auto& table3 = table4[sliceLengthId];
-            const auto& sliceBits2 = sliceBits3[sliceLengthId];
-
-            // Extract the slice length.
-            const size_t sliceLength = lshSliceLengths[sliceLengthId];
-
-            // Compute the number of possible slices for this length.
-            const size_t sliceCount = lshBitCount / sliceLength;
-
-            // Loop over all possible signature slices of this length.
-            for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
-                const auto& table2 = table3[sliceId];
-                const auto& sliceBits1 = sliceBits2[sliceId];
-
-                // Extract this signature slice for this cell.
-                const uint64_t signatureSlice = signature.getBits(sliceBits1);
-
-                // Find the bucket that corresponds to this signature slice.
-                const uint64_t bucketId =
-                    (sliceLength<log2BucketCount) ?
-                    signatureSlice :
-                    (MurmurHash64A(&signatureSlice, 8, 231) & bucketMask);
-                CZI_ASSERT(bucketId < table2.size());
-                const auto& table1 = table2[bucketId];
-
-                // Loop over cells in the same bucket.
-                for(const CellId cellId1: table1) {
-                    if(cellId1 == cellId0){
-                        continue;
-                    }
-                    if(cellMap.get(cellId1)) {
-                        continue;   // We already looked at this one.
-                    }
-                    cellMap.set(cellId1);
-                    candidateNeighbors.push_back(cellId1);
-                    const uint32_t mismatchCount = uint32_t(lsh.computeMismatchCount(cellId0, cellId1));
-                    if(mismatchCount < mismatchCountThreshold) {
-                        neighbors.push_back(make_pair(mismatchCount, cellId1));
+            // Bit set to keep track which cellId1 cells we have already
+            // looked at, for a given cellId0.
+            BitSet cellMap(cellCount);
+
+            // Other vectors used over and over again for each cell.
+            vector<CellId> candidateNeighbors;
+            vector< pair<uint32_t, CellId> > neighbors; // pair(mismatchCount, cellId1)
+            vector<uint32_t> mismatchCounts;
+            vector<uint64_t> probeBucketIds;
+            MultiProbe multiProbe;
+
+            for(CellId cellId0=CellId(begin); cellId0!=CellId(end); cellId0++) {
+                const BitSetPointer signature = lsh.getSignature(cellId0);
+
+                // Loop over slice lengths.
+                for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
+
+                    // Compute the number of possible slices for this length.
+                    const size_t sliceCount = buckets.sliceCount(sliceLengthId);
+
+                    // Loop over all possible signature slices of this length.
+                    const size_t sliceLength = buckets.sliceLength(sliceLengthId);
+                    for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
+
+                        // Find the bucket that corresponds to this signature slice.
+                        probeBucketIds.clear();
+                        probeBucketIds.push_back(buckets.getBucketId(signature, sliceLengthId, sliceId));
+
+                        // If using multi-probe LSH, also find the buckets
+                        // obtained by flipping the bits with the smallest margins.
+                        if(probeCount > 0) {
+                            const size_t sliceBegin = sliceId * sliceLength;
+                            const uint64_t signatureSlice =
+                                LshIndex::getSignatureSlice(signature, sliceBegin, sliceLength);
+                            const vector<uint64_t>& masks = multiProbe.computeMasks(
+                                lsh.getMargins(cellId0) + sliceBegin, sliceLength, probeCount);
+                            for(const uint64_t mask: masks) {
+                                probeBucketIds.push_back(
+                                    buckets.getBucketIdFromSlice(signatureSlice ^ mask, sliceLengthId));
+                            }
+                        }
+
+                        // Loop over cells in these buckets.
+                        for(const uint64_t bucketId: probeBucketIds) {
+                            for(const CellId cellId1: buckets.getBucket(sliceLengthId, sliceId, bucketId)) {
+                                if(cellId1 == cellId0){
+                                    continue;
+                                }
+                                if(cellMap.get(cellId1)) {
+                                    continue;   // We already looked at this one.
+                                }
+                                cellMap.set(cellId1);
+                                candidateNeighbors.push_back(cellId1);
+                                if(candidateNeighbors.size() == maxCheck) {
+                                    break;
+                                }
+                            }
+                            if(candidateNeighbors.size() == maxCheck) {
+                                break;
+                            }
+                        }
+                        if(candidateNeighbors.size() == maxCheck) {
+                            break;
+                        }
                     }
                     if(candidateNeighbors.size() == maxCheck) {
                         break;
                     }
                 }
-                if(candidateNeighbors.size() == maxCheck) {
-                    break;
-                }
-            }
-            if(candidateNeighbors.size() == maxCheck) {
-                break;
-            }
-        }
 
-        // Only keep the k best neighbors, then sort them.
-        // This is faster than sorting, then keeping the k best,
-        // because it avoids doing a complete sorting of all of the neighbors.
-        // Instead, keepBest uses std::nth_element, which does a partial sorting.
-        keepBest(neighbors, k, std::less< pair<uint32_t, CellId> >());
-        sort(neighbors.begin(), neighbors.end());
-
-        // Store.
-        for(const auto& neighbor: neighbors) {
-            const CellId cellId1 = neighbor.second;
-            const uint32_t mismatchCount = neighbor.first;
-            const double similarity = lsh.getSimilarity(mismatchCount);
-            similarPairs.addUnsymmetricNoCheck(cellId0, cellId1, similarity);
-        }
+                // Compute the mismatch counts for all the candidate neighbors at once.
+                lsh.computeMismatchCounts(cellId0, candidateNeighbors, mismatchCounts);
+                for(size_t i=0; i<candidateNeighbors.size(); i++) {
+                    const uint32_t mismatchCount = mismatchCounts[i];
+                    if(mismatchCount < mismatchCountThreshold) {
+                        neighbors.push_back(make_pair(mismatchCount, candidateNeighbors[i]));
+                    }
+                }
 
-        // Clean up our data structures so we can reuse them for the next cell.
-        for(const CellId cellId1: candidateNeighbors) {
-            cellMap.clear(cellId1);
-        }
-        candidateNeighbors.clear();
-        neighbors.clear();
+                // Only keep the k best neighbors, then sort them.
+                // This is faster than sorting, then keeping the k best,
+                // because it avoids doing a complete sorting of all of the neighbors.
+                // Instead, keepBest uses std::nth_element, which does a partial sorting.
+                keepBest(neighbors, k, std::less< pair<uint32_t, CellId> >());
+                sort(neighbors.begin(), neighbors.end());
+
+                // Store. This only modifies the pairs stored for cellId0.
+                for(const auto& neighbor: neighbors) {
+                    const CellId cellId1 = neighbor.second;
+                    const uint32_t mismatchCount = neighbor.first;
+                    const double similarity = lsh.getSimilarity(mismatchCount);
+                    similarPairs.addUnsymmetricNoCheck(cellId0, cellId1, similarity);
+                }
 
-    }
+                // Clean up our data structures so we can reuse them for the next cell.
+                for(const CellId cellId1: candidateNeighbors) {
+                    cellMap.clear(cellId1);
+                }
+                candidateNeighbors.clear();
+                neighbors.clear();
 
+            }
+        });
 
     const auto t1 = std::chrono::steady_clock::now();
     const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
@@ -703,127 +770,183 @@ void ExpressionMatrix::findSimilarPairs7(
 
 
 
-// In the initial phase of findSimilarPairs7, we assign cells to buckets.
-// For each slice length and signature slice of that length,
-// each cell is assigned to a bucket
-// based on the value of its signature slice.
-
-// The cells in each bucket are stored in
-// tables4[sliceLengthId][sliceId][bucketId],
-// where:
-// - sliceLengthId corresponds to the slice lengths to be used,
-//   stored in lshSliceLengths in decreasing order.
-// - sliceId identifies the particular slice of that length
-//   (we have a total lshBitCount bits, which can be used
-//   to form lshBitCount/lshSliceLength possible signature
-//   slices each lshSliceLength bits in length).
-// - bucketId identifies the bucket.
-
-// Vector sliceBits3 is used to store the signature bits of each signature slice.
-// Indexed by [sliceLengthId][sliceId].
-
-void ExpressionMatrix::findSimilarPairs7AssignCellsToBuckets(
-    Lsh& lsh,
-    const vector<int>& lshSliceLengths,                     // The number of signature slice bits, in decreasing order.
-    vector< vector< vector< size_t > > >& sliceBits3,       // The bits of each slice. See comments above.
-    vector< vector< vector< vector<CellId> > > >& table4,   // The cells in each bucket. See comments above.
-    size_t log2BucketCount
+// Find similar cell pairs using an HNSW graph built over the LSH signatures
+// of the cells (see HnswIndex.hpp).
+void ExpressionMatrix::findSimilarPairs8(
+    const string& geneSetName,      // The name of the gene set to be used.
+    const string& cellSetName,      // The name of the cell set to be used.
+    const string& lshName,          // The name of the Lsh object to be used.
+    const string& similarPairsName, // The name of the SimilarPairs object to be created.
+    size_t k,                       // The maximum number of similar pairs to be stored for each cell.
+    double similarityThreshold,     // The minimum similarity for a pair to be stored.
+    size_t M,                       // The maximum number of neighbors in the HNSW graph at levels above 0.
+    size_t efConstruction,          // The size of the dynamic candidate list when building the HNSW graph.
+    size_t efSearch,                // The size of the dynamic candidate list when searching.
+    size_t threadCount,             // The number of threads to use, or 0 to use all hardware threads.
+    const string& hnswName,         // The name of a persistent HNSW graph to use or create, or empty for a temporary one.
+    uint32_t seed                   // The seed used to assign levels to cells in the HNSW graph.
     )
 {
-    // Check that the slice lengths are in decreasing order.
-    const size_t sliceLengthCount = lshSliceLengths.size();
-    for(size_t i=1; i<sliceLengthCount; i++) {
-        if(lshSliceLengths[i] >= lshSliceLengths[i-1]) {
-            throw runtime_error("The slice lengths are not in decreasing order.");
-        }
+    findSimilarPairs8(cout, geneSetName, cellSetName, lshName, similarPairsName,
+        k, similarityThreshold, M, efConstruction, efSearch, threadCount, hnswName, seed);
+}
+void ExpressionMatrix::findSimilarPairs8(
+    ostream& out,
+    const string& geneSetName,
+    const string& cellSetName,
+    const string& lshName,
+    const string& similarPairsName,
+    size_t k,
+    double similarityThreshold,
+    size_t M,
+    size_t efConstruction,
+    size_t efSearch,
+    size_t threadCount,
+    const string& hnswName,
+    uint32_t seed
+    )
+{
+    out << timestamp << "ExpressionMatrix::findSimilarPairs8 begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Locate the gene set and verify that it is not empty.
+    const auto itGeneSet = geneSets.find(geneSetName);
+    if(itGeneSet == geneSets.end()) {
+        throw runtime_error("Gene set " + geneSetName + " does not exist.");
+    }
+    const GeneSet& geneSet = itGeneSet->second;
+    if(geneSet.size() == 0) {
+        throw runtime_error("Gene set " + geneSetName + " is empty.");
     }
 
-    // Check that the slice lengths are no more than 64.
-    for(size_t i=0; i<sliceLengthCount; i++) {
-        if(lshSliceLengths[i] > 64) {
-            throw runtime_error("Each slice length can be at most 64 bits.");
-        }
+    // Locate the cell set and verify that it is not empty.
+    const auto& it = cellSets.cellSets.find(cellSetName);
+    if(it == cellSets.cellSets.end()) {
+        throw runtime_error("Cell set " + cellSetName + " does not exist.");
+    }
+    const MemoryMapped::Vector<CellId>& cellSet = *(it->second);
+    const CellId cellCount = CellId(cellSet.size());
+    if(cellCount == 0) {
+        throw runtime_error("Cell set " + cellSetName + " is empty.");
     }
 
+    // Access the Lsh object that will do the computation.
+    Lsh lsh(directoryName + "/Lsh-" + lshName);
+    if(lsh.cellCount() != cellCount) {
+        throw runtime_error("LSH object " + lshName + " has a number of cells inconsistent with cell set " + cellSetName);
+    }
 
-    // Initialize the table4 and sliceBits3 data structures.
-    cout << timestamp << "Initializing data structures for findSimilarPairs7." << endl;
-    table4.resize(sliceLengthCount);
-    sliceBits3.resize(sliceLengthCount);
-    const uint64_t bucketCount = (1ULL << log2BucketCount);
-    const uint64_t bucketMask = bucketCount - 1ULL;
-    const size_t lshBitCount = lsh.lshCount();
-    for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
-        auto& table3 = table4[sliceLengthId];
-        auto& sliceBits2 = sliceBits3[sliceLengthId];
-
-        // Extract the slice length.
-        const size_t sliceLength = lshSliceLengths[sliceLengthId];
-
-        // Compute the number of possible slices for this length.
-        const size_t sliceCount = lshBitCount / sliceLength;
-        table3.resize(sliceCount);
-        sliceBits2.resize(sliceCount);
-        const uint64_t tableSize = std::min(uint64_t(1ULL<<sliceLength), bucketCount);
-        cout << "Number of slices of length " << sliceLength << " is " << sliceCount;
-        cout << ". Table size is " << tableSize << endl;
-
-        // Loop over all possible signature slices of this length.
-        for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
-            auto& table2 = table3[sliceId];
-            table2.resize(tableSize);
-
-            // Gather the signature bits.
-            auto& sliceBits1 = sliceBits2[sliceId];
-            sliceBits1.resize(sliceLength);
-            size_t bitPosition = sliceId * sliceLength;
-            for(size_t bitId=0; bitId<sliceLength; bitId++, ++bitPosition) {
-                sliceBits1[bitId] = bitPosition;
+    // Access or create the HNSW graph.
+    // A temporary graph is removed when hnswIndexPointer goes out of scope,
+    // including when an exception is thrown.
+    shared_ptr<HnswIndex> hnswIndexPointer;
+    if(hnswName.empty()) {
+        hnswIndexPointer = shared_ptr<HnswIndex>(
+            new HnswIndex(directoryName + "/tmp-Hnsw-" + similarPairsName,
+                lsh, M, efConstruction, seed, threadCount),
+            [](HnswIndex* hnswIndex)
+            {
+                hnswIndex->remove();
+                delete hnswIndex;
+            });
+    } else {
+        const string name = directoryName + "/Lsh-" + lshName + "-Hnsw-" + hnswName;
+        if(filesystem::exists(name + "-Info")) {
+            out << timestamp << "Using existing HNSW graph " << hnswName << endl;
+            hnswIndexPointer = make_shared<HnswIndex>(name);
+            if(!hnswIndexPointer->isCompatible(lsh, M, efConstruction, seed)) {
+                throw runtime_error("HNSW graph " + hnswName + " for LSH object " + lshName +
+                    " was created for a different version of the LSH object, "
+                    "or with different values of M, efConstruction, or seed.");
             }
+        } else {
+            out << timestamp << "Creating HNSW graph " << hnswName << endl;
+            hnswIndexPointer = make_shared<HnswIndex>(name, lsh, M, efConstruction, seed, threadCount);
         }
     }
+    const HnswIndex& hnswIndex = *hnswIndexPointer;
+    const auto t1 = std::chrono::steady_clock::now();
 
+    // Create SimilarPairs object that will store the results.
+    SimilarPairs similarPairs(directoryName, similarPairsName, geneSetName, cellSetName, k);
 
+    const size_t mismatchCountThreshold =
+        lsh.computeMismatchCountThresholdFromSimilarityThreshold(similarityThreshold);
 
-    // Assign cells to buckets.
-    cout << timestamp << "Assigning cells to buckets." << endl;
-    const CellId cellCount = lsh.cellCount();
-    for(CellId cellId=0; cellId<cellCount; cellId++) {
-        if(cellId!=0 && (cellId % 100000)==0) {
-            cout << timestamp << "Working on cell " << cellId << " of " << cellCount << endl;
-        }
-        const BitSetPointer signature = lsh.getSignature(cellId);
-
-        // Loop over slice lengths.
-        for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
-            auto& table3 = table4[sliceLengthId];
-            const auto& sliceBits2 = sliceBits3[sliceLengthId];
-
-            // Extract the slice length.
-            const size_t sliceLength = lshSliceLengths[sliceLengthId];
-
-            // Compute the number of possible slices for this length.
-            const size_t sliceCount = lshBitCount / sliceLength;
-
-            // Loop over all possible signature slices of this length.
-            for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
-                auto& table2 = table3[sliceId];
-                const auto& sliceBits1 = sliceBits2[sliceId];
-
-                // Extract this signature slice for this cell.
-                const uint64_t signatureSlice = signature.getBits(sliceBits1);
-
-                // Add this cell to the bucket that corresponds to this signature slice.
-                const uint64_t bucketId =
-                    (sliceLength<log2BucketCount) ?
-                    signatureSlice :
-                    (MurmurHash64A(&signatureSlice, 8, 231) & bucketMask);
-                CZI_ASSERT(bucketId < table2.size());
-                table2[bucketId].push_back(cellId);
+    // Search the neighbors of each cell.
+    // The graph is read-only at this point, so cells can be
+    // processed in parallel, and each thread only stores pairs for the cells it processes.
+    threadCount = getThreadCount(threadCount);
+    out << timestamp << "Searching the HNSW graph for " << cellCount <<
+        " cells using " << threadCount << " threads." << endl;
+    parallelFor(cellCount, 1000, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            HnswIndex::SearchData data(cellCount);
+            vector< pair<uint32_t, CellId> > neighbors;
+            for(CellId cellId0=CellId(begin); cellId0!=CellId(end); cellId0++) {
+                hnswIndex.findNeighbors(lsh, cellId0, k, efSearch, data, neighbors);
+                for(const auto& neighbor: neighbors) {
+                    if(neighbor.first < mismatchCountThreshold) {
+                        similarPairs.addUnsymmetricNoCheck(cellId0, neighbor.second,
+                            lsh.getSimilarity(neighbor.first));
+                    }
+                }
             }
-        }
+        });
+
+    const auto t2 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    const double t12 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1)).count());
+    out << "Time to create or access the HNSW graph: " << t01 << " s." << endl;
+    out << "Time to search the HNSW graph: " << t12 << " s." << endl;
+    out << timestamp << "ExpressionMatrix::findSimilarPairs8 ends." << endl;
+}
+
+
+
+// Find cells similar to a given cell using an existing HNSW graph.
+vector< pair<CellId, double> > ExpressionMatrix::findSimilarCellsHnsw(
+    const string& lshName,
+    const string& hnswName,
+    CellId localCellId,
+    size_t k,
+    size_t efSearch)
+{
+    Lsh lsh(directoryName + "/Lsh-" + lshName);
+    const string name = directoryName + "/Lsh-" + lshName + "-Hnsw-" + hnswName;
+    if(hnswName.empty() || !filesystem::exists(name + "-Info")) {
+        throw runtime_error("HNSW graph " + hnswName + " for LSH object " + lshName + " does not exist.");
+    }
+    const HnswIndex hnswIndex(name);
+    if(!hnswIndex.isCompatible(lsh, hnswIndex.M(), hnswIndex.efConstruction(), hnswIndex.seed())) {
+        throw runtime_error("HNSW graph " + hnswName + " for LSH object " + lshName +
+            " was created for a different version of the LSH object.");
+    }
+    if(localCellId >= hnswIndex.cellCount()) {
+        throw runtime_error("Invalid cell id.");
+    }
+
+    HnswIndex::SearchData data(CellId(hnswIndex.cellCount()));
+    vector< pair<uint32_t, CellId> > neighbors;
+    hnswIndex.findNeighbors(lsh, localCellId, k, efSearch, data, neighbors);
+
+    vector< pair<CellId, double> > similarCells;
+    for(const auto& neighbor: neighbors) {
+        similarCells.push_back(make_pair(neighbor.second, lsh.getSimilarity(neighbor.first)));
+    }
+    return similarCells;
+}
+
 
+
+void ExpressionMatrix::removeHnswIndex(const string& lshName, const string& hnswName)
+{
+    const string name = directoryName + "/Lsh-" + lshName + "-Hnsw-" + hnswName;
+    if(hnswName.empty() || !filesystem::exists(name + "-Info")) {
+        throw runtime_error("HNSW graph " + hnswName + " for LSH object " + lshName + " does not exist.");
     }
+    HnswIndex(name).remove();
 }
 
 
@@ -849,7 +972,8 @@ void ExpressionMatrix::findSimilarPairs6(
     size_t permutationCount,        // The number of bit permutations for the Charikar algorithm.
     size_t searchCount,             // The number of cells checked for each cell, in the Charikar algorithm.
     size_t permutedBitCount,        // The number of most significant bits stored for each permuted signature.
-    int seed                        // The seed used to randomly generate the bit permutations.
+    int seed,                       // The seed used to randomly generate the bit permutations.
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
     )
 {
     cout << timestamp << "ExpressionMatrix::findSimilarPairs6 begins." << endl;
@@ -925,202 +1049,185 @@ void ExpressionMatrix::findSimilarPairs6(
 
 
 
-    // For each of the permutations, compute permuted/sorted signatures.
-    // We only compute and store the first permutedBitCount bits of each permuted signature.
-    cout << timestamp << "Phase 1 of Charikar algorithm begins." << endl;
-    const auto t1 = std::chrono::steady_clock::now();
+    // Generate the random permutations of the signature bits.
+    // This is done sequentially, so the permutations
+    // don't depend on the number of threads.
+    // We only keep the permutedBitCount most significant bits of each permutation.
+    vector< vector<uint64_t> > bitPermutations(permutationCount);
     for(size_t permutationId=0; permutationId<permutationCount; permutationId++) {
-        cout << timestamp << "Working on permutation " << permutationId << " of " << permutationCount << endl;
-
-        // Generate a random permutation of the signature bits.
-        vector<uint64_t> bitPermutation(lshCount);
+        vector<uint64_t>& bitPermutation = bitPermutations[permutationId];
+        bitPermutation.resize(lshCount);
         std::iota(bitPermutation.begin(), bitPermutation.end(), 0ULL);
         std::shuffle(bitPermutation.begin(), bitPermutation.end(), randomGenerator);
-        bitPermutation.resize(permutedBitCount);    // Only keep the permutedBitCount most significant bits.
-
-        if(debug) {
-            cout << "Creating permutation data for permutation " << permutationId << ".\n";
-            cout << "Bit permutation:\n";
-            for(size_t i=0; i<lshCount; i++) {
-                cout << i << " " << bitPermutation[i] << "\n";
-            }
-        }
-
-        // Compute the permuted signatures for this permutation.
-        BitSets permutedSignatures(cellCount, permutedWordCount);
-        for(CellId cellId=0; cellId<cellCount; cellId++) {
-            BitSetPointer signature = lsh.getSignature(cellId);
-            BitSetPointer permutedSignature = permutedSignatures[cellId];
-            permutedSignature.fillUsingPermutation(bitPermutation, signature);
-        }
+        bitPermutation.resize(permutedBitCount);
+    }
 
-        // Write the permuted signatures.
-        if(debug) {
-            for(CellId cellId=0; cellId<cellCount; cellId++) {
-                cout << permutedSignatures[cellId].getString(lshCount) << " " << cellId << "\n";
-            }
-        }
 
-        // Sort the permuted signatures lexicographically,
-        // Keeping track of the cell ids as they get reordered.
-        vector< pair<BitSetPointer, CellId> > table(cellCount);
-        for(CellId cellId=0; cellId<cellCount; cellId++) {
-            pair<BitSetPointer, CellId>& p = table[cellId];
-            p.first = permutedSignatures[cellId];
-            p.second = cellId;
-        }
-        if(debug) {
-            cout << "Table before sorting:" << endl;
-            for(CellId cellId=0; cellId<cellCount; cellId++) {
-                pair<BitSetPointer, CellId>& p = table[cellId];
-                cout << p.first.getString(lshCount) << " " << p.second << "\n";
-            }
-        }
-        sort(table.begin(), table.end());
-        if(debug) {
-            cout << "Table after sorting:" << endl;
-            for(CellId i=0; i<cellCount; i++) {
-                pair<BitSetPointer, CellId>& p = table[i];
-                cout << p.first.getString(lshCount) << " " << p.second << "\n";
-            }
-        }
 
-        // Store the sorted signatures and corresponding cell ids for this permutation.
-        BitSets& thisPermutationBitSets = permutationData[permutationId].signatures;
-        vector<CellId>& thisPermutationCellIds = permutationData[permutationId].cellIds;
-        CZI_ASSERT(thisPermutationBitSets.bitSetCount == cellCount);
-        CZI_ASSERT(thisPermutationBitSets.wordCount == permutedWordCount);
-        CZI_ASSERT(thisPermutationCellIds.size() == cellCount);
-        for(CellId i=0; i<cellCount; i++) {
-            pair<BitSetPointer, CellId>& p = table[i];
-            thisPermutationBitSets.set(i, p.first);
-            thisPermutationCellIds[i] = p.second;
-        }
-        permutationData[permutationId].computeCellPositions();
+    // For each of the permutations, compute permuted/sorted signatures.
+    // We only compute and store the first permutedBitCount bits of each permuted signature.
+    // The permutations are independent of each other, so they are
+    // processed in parallel, one permutation at a time for each thread.
+    // If there are fewer permutations than threads, the remaining threads
+    // are used to sort each permutation (see Charikar::PermutationData::sortSignatures).
+    threadCount = getThreadCount(threadCount);
+    const size_t permutationThreadCount = min(threadCount, permutationCount);
+    const size_t sortThreadCount = max(size_t(1), threadCount / max(size_t(1), permutationThreadCount));
+    cout << timestamp << "Phase 1 of Charikar algorithm begins using " << threadCount << " threads." << endl;
+    const auto t1 = std::chrono::steady_clock::now();
+    std::mutex coutMutex;
+    vector<Charikar::SortData> sortData(permutationThreadCount);
+    parallelFor(permutationCount, 1, permutationThreadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(size_t permutationId=begin; permutationId!=end; permutationId++) {
+                {
+                    std::lock_guard<std::mutex> lock(coutMutex);
+                    cout << timestamp << "Working on permutation " << permutationId << " of " << permutationCount << endl;
+                }
+                const vector<uint64_t>& bitPermutation = bitPermutations[permutationId];
+                Charikar::PermutationData& thisPermutationData = permutationData[permutationId];
+                CZI_ASSERT(thisPermutationData.signatures.bitSetCount == cellCount);
+                CZI_ASSERT(thisPermutationData.signatures.wordCount == permutedWordCount);
+                CZI_ASSERT(thisPermutationData.cellIds.size() == cellCount);
+
+                // Compute the permuted signatures for this permutation,
+                // in order of increasing CellId.
+                for(CellId cellId=0; cellId<cellCount; cellId++) {
+                    BitSetPointer signature = lsh.getSignature(cellId);
+                    BitSetPointer permutedSignature = thisPermutationData.signatures[cellId];
+                    permutedSignature.fillUsingPermutation(bitPermutation, signature);
+                }
 
-        if(debug) {
-            cout << "Permutation data for permutation " << permutationId << ":" << endl;
-            for(CellId i=0; i<cellCount; i++) {
-                cout << thisPermutationBitSets[i].getString(lshCount) << " " << thisPermutationCellIds[i] << "\n";
+                // Sort the permuted signatures lexicographically,
+                // keeping track of the cell ids as they get reordered.
+                thisPermutationData.sortSignatures(sortData[threadId], sortThreadCount);
             }
-        }
-    }
+        });
     const auto t2 = std::chrono::steady_clock::now();
     cout << timestamp << "Phase 1 of Charikar algorithm took ";
     cout << 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1)).count()) << " s." << endl;
 
     // Temporary storage of pairs for each cell.
     vector< vector< pair<CellId, float> > > pairs(cellCount);
-    vector< pair<CellId, float> > cellNeighbors;
 
 
     // At this point the necessary data structures are in place and we can use the Charikar algorithm
     // to find the neighbors of each cell.
-    debug = false;
+    // The permutation data are read-only at this point,
+    // so cells are processed in parallel, and each thread
+    // only stores pairs for the cells it processes.
     cout << timestamp << "Phase 2 of Charikar algorithm begins." << endl;
     const auto t3 = std::chrono::steady_clock::now();
-    for(CellId cellId0=0; cellId0<cellCount; cellId0++) {
-        if(cellId0!=0 && (cellId0%100000)==0) {
-            cout << timestamp << "Working on cell " << cellId0 << " of " << cellCount << endl;
-        }
+    const size_t batchSize = 1000;
+    parallelFor(cellCount, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            if(begin!=0 && (begin%100000)==0) {
+                std::lock_guard<std::mutex> lock(coutMutex);
+                cout << timestamp << "Working on cell " << begin << " of " << cellCount << endl;
+            }
+            vector< pair<CellId, float> > cellNeighbors;
+            for(CellId cellId0=CellId(begin); cellId0!=CellId(end); cellId0++) {
+
+                // Extract the permuted signatures for this cell.
+                vector<BitSetPointer> signatures0(permutationCount);
+                for(size_t permutationId=0; permutationId<permutationCount; permutationId++) {
+                   Charikar::PermutationData& p = permutationData[permutationId];
+                   const size_t i = p.cellPositions[cellId0];
+                   CZI_ASSERT(p.cellIds[i] == cellId0);
+                   signatures0[permutationId] = p.signatures[i];
+                }
 
-        // Extract the permuted signatures for this cell.
-        vector<BitSetPointer> signatures0(permutationCount);
-        for(size_t permutationId=0; permutationId<permutationCount; permutationId++) {
-           Charikar::PermutationData& p = permutationData[permutationId];
-           const size_t i = p.cellPositions[cellId0];
-           CZI_ASSERT(p.cellIds[i] == cellId0);
-           signatures0[permutationId] = p.signatures[i];
-        }
 
+                // Create the priority queue of Charikar pointers.
+                std::priority_queue<Charikar::Pointer> priorityQueue;
+                for(size_t permutationId=0; permutationId<permutationCount; permutationId++) {
+                    Charikar::PermutationData& pd = permutationData[permutationId];
+                    const size_t i = pd.cellPositions[cellId0];
+                    CZI_ASSERT(pd.cellIds[i] == cellId0);
+
+                    // Add the forward moving pointer.
+                    if(i < cellCount-1) {
+                        Charikar::Pointer pointer;
+                        pointer.permutationId = permutationId;
+                        pointer.index = i+1;
+                        pointer.movesForward = true;
+                        pointer.prefixLength = commonPrefixLength(
+                            signatures0[permutationId], pd.signatures[i+1]);
+                        priorityQueue.push(pointer);
+                    }
 
-        // Create the priority queue of Charikar pointers.
-        std::priority_queue<Charikar::Pointer> priorityQueue;
-        for(size_t permutationId=0; permutationId<permutationCount; permutationId++) {
-            Charikar::PermutationData& pd = permutationData[permutationId];
-            const size_t i = pd.cellPositions[cellId0];
-            CZI_ASSERT(pd.cellIds[i] == cellId0);
-
-            // Add the forward moving pointer.
-            if(i < cellCount-1) {
-                Charikar::Pointer pointer;
-                pointer.permutationId = permutationId;
-                pointer.index = i+1;
-                pointer.movesForward = true;
-                pointer.prefixLength = commonPrefixLength(
-                    signatures0[permutationId], pd.signatures[i+1]);
-                priorityQueue.push(pointer);
-            }
+                    // Add the backward moving pointer.
+                    if(i > 1) {
+                        Charikar::Pointer pointer;
+                        pointer.permutationId = permutationId;
+                        pointer.index = i-1;
+                        pointer.movesForward = false;
+                        pointer.prefixLength = commonPrefixLength(
+                            signatures0[permutationId], pd.signatures[i-1]);
+                        priorityQueue.push(pointer);
+                    }
 
-            // Add the backward moving pointer.
-            if(i > 1) {
-                Charikar::Pointer pointer;
-                pointer.permutationId = permutationId;
-                pointer.index = i-1;
-                pointer.movesForward = false;
-                pointer.prefixLength = commonPrefixLength(
-                    signatures0[permutationId], pd.signatures[i-1]);
-                priorityQueue.push(pointer);
-            }
+                }
 
-        }
 
 
+                // The heart of the Charikar algorithm begins here.
+                // At each iteration we get the pointer with the best prefix.
+                cellNeighbors.clear();
+                for(size_t iteration=0; iteration<searchCount; iteration++) {
 
-        // The heart of the Charikar algorithm begins here.
-        // At each iteration we get the pointer with the best prefix.
-        cellNeighbors.clear();
-        for(size_t iteration=0; iteration<searchCount; iteration++) {
+                    // Get the pointer with the best prefix.
+                    if(priorityQueue.empty()) {
+                        break;
+                    }
+                    Charikar::Pointer pointer = priorityQueue.top();
+                    priorityQueue.pop();
+
+                    // Compute the number of mismatches.
+                    Charikar::PermutationData& pd = permutationData[pointer.permutationId];
+                    const CellId cellId1 = pd.cellIds[pointer.index];
+                    CZI_ASSERT(cellId1 != cellId0); // By construction.
+                    const double similarity = lsh.computeCellSimilarity(cellId0, cellId1);
+                    if(similarity > similarityThreshold) {
+                        cellNeighbors.push_back(make_pair(cellId1, similarity));
+                        if(false) {
+                            cout << cellId0 << " " << cellId1 << " " << pointer.prefixLength << " " << similarity << endl;
+                        }
+                    }
 
-            // Get the pointer with the best prefix.
-            if(priorityQueue.empty()) {
-                break;
-            }
-            Charikar::Pointer pointer = priorityQueue.top();
-            priorityQueue.pop();
+                    // Update the pointer and requeue it.
+                    if(pointer.movesForward) {
+                        if(pointer.index < cellCount-1) {
+                            ++pointer.index;
+                            pointer.prefixLength = commonPrefixLength(
+                                signatures0[pointer.permutationId], pd.signatures[pointer.index]);
+                            priorityQueue.push(pointer);
+                        }
+                    } else {
+                        if(pointer.index > 0) {
+                            --pointer.index;
+                            pointer.prefixLength = commonPrefixLength(
+                                signatures0[pointer.permutationId], pd.signatures[pointer.index]);
+                            priorityQueue.push(pointer);
+                        }
+                    }
 
-            // Compute the number of mismatches.
-            Charikar::PermutationData& pd = permutationData[pointer.permutationId];
-            const CellId cellId1 = pd.cellIds[pointer.index];
-            CZI_ASSERT(cellId1 != cellId0); // By construction.
-            const double similarity = lsh.computeCellSimilarity(cellId0, cellId1);
-            if(similarity > similarityThreshold) {
-                cellNeighbors.push_back(make_pair(cellId1, similarity));
-                if(false) {
-                    cout << cellId0 << " " << cellId1 << " " << pointer.prefixLength << " " << similarity << endl;
                 }
-            }
 
-            // Update the pointer and requeue it.
-            if(pointer.movesForward) {
-                if(pointer.index < cellCount-1) {
-                    ++pointer.index;
-                    pointer.prefixLength = commonPrefixLength(
-                        signatures0[pointer.permutationId], pd.signatures[pointer.index]);
-                    priorityQueue.push(pointer);
+                // Sort, deduplicate, keep the best k.
+                sort(cellNeighbors.begin(), cellNeighbors.end(),
+                    OrderPairsBySecondGreaterThenByFirstLess< pair<CellId, float> >());
+                cellNeighbors.resize(unique(cellNeighbors.begin(), cellNeighbors.end()) - cellNeighbors.begin());
+                if(cellNeighbors.size() > k) {
+                    cellNeighbors.resize(k);
                 }
-            } else {
-                if(pointer.index > 0) {
-                    --pointer.index;
-                    pointer.prefixLength = commonPrefixLength(
-                        signatures0[pointer.permutationId], pd.signatures[pointer.index]);
-                    priorityQueue.push(pointer);
-                }
-            }
-
-        }
 
-        // Sort, deduplicate, keep the best k.
-        sort(cellNeighbors.begin(), cellNeighbors.end(),
-            OrderPairsBySecondGreaterThenByFirstLess< pair<CellId, float> >());
-        cellNeighbors.resize(unique(cellNeighbors.begin(), cellNeighbors.end()) - cellNeighbors.begin());
-        if(cellNeighbors.size() > k) {
-            cellNeighbors.resize(k);
-        }
-
-        // Store.
-        pairs[cellId0] = cellNeighbors;
-    }
+                // Store.
+                pairs[cellId0] = cellNeighbors;
+            }
+        });
     const auto t4 = std::chrono::steady_clock::now();
     cout << timestamp << "Phase 2 of Charikar algorithm took ";
     cout << 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3)).count()) << " s." << endl;
@@ -1152,7 +1259,10 @@ void ExpressionMatrix::computeLshSignatures(
     const string& cellSetName,      // The name of the cell set to be used.
     const string& lshName,          // The name of the Lsh object to be created.
     size_t lshCount,                // The number of LSH vectors to use.
-    unsigned int seed               // The seed used to generate the LSH vectors.
+    unsigned int seed,              // The seed used to generate the LSH vectors.
+    size_t threadCount,             // The number of threads to use, or 0 to use all hardware threads.
+    bool streamLshVectors,          // Generate the LSH vectors in blocks without storing them (see Lsh.hpp).
+    bool storeMargins               // Also store the margins of the signature bits, for multi-probe LSH.
     )
 {
     cout << timestamp << "ExpressionMatrix::computeLshSignatures begins." << endl;
@@ -1183,10 +1293,11 @@ void ExpressionMatrix::computeLshSignatures(
     const string expressionMatrixSubsetName =
         directoryName + "/tmp-ExpressionMatrixSubset-" + lshName;
     ExpressionMatrixSubset expressionMatrixSubset(
-        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts);
+        expressionMatrixSubsetName, geneSet, cellSet, cellExpressionCounts, threadCount);
 
     // Create the Lsh object that will do the computation.
-    Lsh lsh(directoryName + "/Lsh-" + lshName, expressionMatrixSubset, lshCount, seed);
+    Lsh lsh(directoryName + "/Lsh-" + lshName, expressionMatrixSubset,
+        lshCount, seed, threadCount, streamLshVectors, storeMargins);
 
     cout << timestamp << "ExpressionMatrix::computeLshSignatures ends." << endl;
 }
@@ -1201,6 +1312,8 @@ void ExpressionMatrix::compareSimilarPairs(
     const string& similarPairsName1)
 {
     // Access the SimilarPairs objects.
+    checkSimilarPairsNotCompactOnly(similarPairsName0);
+    checkSimilarPairsNotCompactOnly(similarPairsName1);
     const SimilarPairs similarPairs0(directoryName, similarPairsName0, true);
     const SimilarPairs similarPairs1(directoryName, similarPairsName1, true);
 
@@ -1303,18 +1416,22 @@ void ExpressionMatrix::analyzeLsh(
 
 
     // Loop over pairs of cells.
+    // For each localCellId0, the LSH mismatch counts with all
+    // subsequent cells are computed at once.
+    vector<uint32_t> mismatchCounts(cellCount);
     for(CellId localCellId0=0; localCellId0<cellCount-1; localCellId0++) {
         if((localCellId0%1000) == 0 ) {
             cout << timestamp << "Working on cell " << localCellId0 << " of " << cellCount << endl;
         }
+        lsh.computeMismatchCounts(localCellId0, localCellId0+1, localCellId0+1, cellCount, mismatchCounts.data());
         for(CellId localCellId1=localCellId0+1; localCellId1<cellCount; localCellId1++) {
 
             // Compute exact similarity for this pair.
             const double exactSimilarity = expressionMatrixSubset.
                 computeCellSimilarity(localCellId0, localCellId1);
 
-            // Compute LSH similarity for this pair.
-            const double lshSimilarity = lsh.computeCellSimilarity(localCellId0, localCellId1);
+            // LSH similarity for this pair.
+            const double lshSimilarity = lsh.getSimilarity(mismatchCounts[localCellId1 - (localCellId0+1)]);
 
             // Update statistics.
             const double delta = lshSimilarity - exactSimilarity;
@@ -1472,3 +1589,108 @@ void ExpressionMatrix::analyzeLshSignatures(
     lsh.remove();
 
 }
+
+
+
+// Create a persistent LshIndex for an existing Lsh object.
+void ExpressionMatrix::createLshIndex(
+    const string& lshName,          // The name of the Lsh object to be used.
+    const string& lshIndexName,     // The name of the LshIndex to be created.
+    const vector<int>& lshSliceLengths, // The number of bits in each LSH signature slice, in decreasing order.
+    size_t log2BucketCount,
+    size_t threadCount              // The number of threads to use, or 0 to use all hardware threads.
+    )
+{
+    cout << timestamp << "ExpressionMatrix::createLshIndex begins." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    if(lshIndexName.empty()) {
+        throw runtime_error("Empty name specified for LSH index.");
+    }
+    const string name = directoryName + "/Lsh-" + lshName + "-Index-" + lshIndexName;
+    if(filesystem::exists(name + "-Info")) {
+        throw runtime_error("LSH index " + lshIndexName + " for LSH object " + lshName + " already exists.");
+    }
+
+    Lsh lsh(directoryName + "/Lsh-" + lshName);
+    LshIndex lshIndex(name, lsh, lshSliceLengths, log2BucketCount, threadCount);
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    cout << timestamp << "ExpressionMatrix::createLshIndex ends. Took " << t01 << " s." << endl;
+}
+
+
+
+void ExpressionMatrix::removeLshIndex(const string& lshName, const string& lshIndexName)
+{
+    const string name = directoryName + "/Lsh-" + lshName + "-Index-" + lshIndexName;
+    if(lshIndexName.empty() || !filesystem::exists(name + "-Info")) {
+        throw runtime_error("LSH index " + lshIndexName + " for LSH object " + lshName + " does not exist.");
+    }
+    LshIndex(name).remove();
+}
+
+
+
+// Get the names of the persistent LshIndex objects available for an Lsh object.
+vector<string> ExpressionMatrix::getAvailableLshIndexes(const string& lshName) const
+{
+    vector<string> availableLshIndexNames;
+
+    const string fileNamePrefix = directoryName + "/Lsh-" + lshName + "-Index-";
+    const string fileNameSuffix = "-Info";
+    const vector<string> directoryContents = filesystem::directoryContents(directoryName);
+    for(string name: directoryContents) {
+        // Here, name contains the entire file name.
+        if(stripPrefixAndSuffix(fileNamePrefix, fileNameSuffix, name)) {
+            // Here, name contains just the LshIndex name.
+            availableLshIndexNames.push_back(name);
+        }
+    }
+    sort(availableLshIndexNames.begin(), availableLshIndexNames.end());
+
+    return availableLshIndexNames;
+}
+
+
+
+// Access the LshIndex with the given name, creating it if it does not exist.
+// If lshIndexName is empty, a temporary LshIndex is created.
+// Its files are removed when the last copy of the returned pointer
+// is destroyed, including when an exception is thrown.
+shared_ptr<LshIndex> ExpressionMatrix::accessLshIndex(
+    const string& lshName,
+    const string& lshIndexName,
+    const string& temporaryName,
+    Lsh& lsh,
+    const vector<int>& lshSliceLengths,
+    size_t log2BucketCount,
+    size_t threadCount)
+{
+    if(lshIndexName.empty()) {
+        return shared_ptr<LshIndex>(
+            new LshIndex(directoryName + "/" + temporaryName,
+                lsh, lshSliceLengths, log2BucketCount, threadCount),
+            [](LshIndex* lshIndex)
+            {
+                lshIndex->remove();
+                delete lshIndex;
+            });
+    }
+
+    const string name = directoryName + "/Lsh-" + lshName + "-Index-" + lshIndexName;
+    if(!filesystem::exists(name + "-Info")) {
+        cout << timestamp << "Creating LSH index " << lshIndexName << endl;
+        return make_shared<LshIndex>(name, lsh, lshSliceLengths, log2BucketCount, threadCount);
+    }
+
+    cout << timestamp << "Using existing LSH index " << lshIndexName << endl;
+    const shared_ptr<LshIndex> lshIndex = make_shared<LshIndex>(name);
+    if(!lshIndex->isCompatible(lsh, lshSliceLengths, log2BucketCount)) {
+        throw runtime_error("LSH index " + lshIndexName + " for LSH object " + lshName +
+            " was created for a different version of the LSH object, "
+            "or with different slice lengths or number of buckets.");
+    }
+    return lshIndex;
+}
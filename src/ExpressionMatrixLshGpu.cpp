@@ -5,6 +5,7 @@
 #include "ExpressionMatrixSubset.hpp"
 #include "heap.hpp"
 #include "Lsh.hpp"
+#include "LshIndex.hpp"
 #include "SimilarPairs.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
@@ -443,10 +444,7 @@ void ExpressionMatrix::findSimilarPairs7GpuKernel3(
     size_t log2BucketCount)
 {
     const CellId cellCount = lsh.cellCount();
-    const size_t lshBitCount = lsh.lshCount();
     const size_t sliceLengthCount = lshSliceLengths.size();
-    const uint64_t bucketCount = (1ULL << log2BucketCount);
-    const uint64_t bucketMask = bucketCount - 1ULL;
 
     // Compute the threshold on the number of mismatches.
     const size_t mismatchCountThreshold =
@@ -454,27 +452,11 @@ void ExpressionMatrix::findSimilarPairs7GpuKernel3(
 
 
 
-    // For each slice length and signature slice of that length,
-    // each cell is assigned to a bucket
-    // based on the value of its signature slice.
-    // The cells in each bucket will be stored in
-    // tables4[sliceLengthId][sliceId][bucketId],
-    // where:
-    // - sliceLengthId corresponds to the slice lengths to be used,
-    //   stored in lshSliceLengths in decreasing order.
-    // - sliceId identifies the particular slice of that length
-    //   (we have a total lshBitCount bits, which can be used
-    //   to form lshBitCount/lshSliceLength possible signature
-    //   slices each lshSliceLength bits in length).
-    // - bucketId identifies the bucket.
-    vector< vector< vector< vector<CellId> > > > table4;
-
-    // Vector to contain the signature bits of each signature slice.
-    // Indexed by [sliceLengthId][sliceId].
-    vector< vector< vector< size_t > > > sliceBits3;
-
-    // Assign cells to buckets.
-    findSimilarPairs7AssignCellsToBuckets(lsh, lshSliceLengths, sliceBits3, table4, log2BucketCount);
+    // Assign cells to buckets, for each slice length
+    // and signature slice of that length (see LshIndex.hpp).
+    // The buckets are stored in temporary memory mapped files.
+    LshIndex buckets(directoryName + "/tmp-LshIndex-Gpu",
+        lsh, lshSliceLengths, log2BucketCount);
 
     // Vectors reused for each block in the loop below.
     // Each of these corresponds to a buffer in the GPU.
@@ -519,34 +501,18 @@ void ExpressionMatrix::findSimilarPairs7GpuKernel3(
 
             // Loop over slice lengths.
             for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
-                const auto& table3 = table4[sliceLengthId];
-                const auto& sliceBits2 = sliceBits3[sliceLengthId];
-
-                // Extract the slice length.
-                const size_t sliceLength = lshSliceLengths[sliceLengthId];
 
                 // Compute the number of possible slices for this length.
-                const size_t sliceCount = lshBitCount / sliceLength;
+                const size_t sliceCount = buckets.sliceCount(sliceLengthId);
 
                 // Loop over all possible signature slices of this length.
                 for(size_t sliceId=0; sliceId<sliceCount; sliceId++) {
-                    // const auto tt0 = std::chrono::steady_clock::now();
-                    const auto& table2 = table3[sliceId];
-                    const auto& sliceBits1 = sliceBits2[sliceId];
-
-                    // Extract this signature slice for this cell.
-                    const uint64_t signatureSlice = signature.getBits(sliceBits1);
 
                     // Find the bucket that corresponds to this signature slice.
-                    const uint64_t bucketId =
-                        (sliceLength<log2BucketCount) ?
-                        signatureSlice :
-                        (MurmurHash64A(&signatureSlice, 8, 231) & bucketMask);
-                    CZI_ASSERT(bucketId < table2.size());
-                    const auto& table1 = table2[bucketId];
+                    const uint64_t bucketId = buckets.getBucketId(signature, sliceLengthId, sliceId);
 
                     // Loop over cells in the same bucket.
-                    for(const CellId cellId1: table1) {
+                    for(const CellId cellId1: buckets.getBucket(sliceLengthId, sliceId, bucketId)) {
                         if(cellId1 == cellId0){
                             continue;
                         }
@@ -633,5 +599,6 @@ void ExpressionMatrix::findSimilarPairs7GpuKernel3(
     cout << timestamp << "Similar pairs computation on GPU took " << t01 << " s at ";
     cout << 1.e9*t01/(double(cellCount)*double(cellCount)) << " ns/pair" << endl;
     lsh.cleanupGpuKernel3();
+    buckets.remove();
 }
 #endif
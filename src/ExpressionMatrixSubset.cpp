@@ -2,6 +2,9 @@
 // subset of cells and a subset of genes.
 
 #include "ExpressionMatrixSubset.hpp"
+#include "parallelFor.hpp"
+#include "sparseKernels.hpp"
+#include <unistd.h>
 using namespace ChanZuckerberg;
 using namespace ExpressionMatrix2;
 
@@ -10,50 +13,95 @@ ExpressionMatrixSubset::ExpressionMatrixSubset(
     const string& name,
     const GeneSet& geneSet,
     const CellSet& cellSet,
-    const CellExpressionCounts& globalExpressionCounts) :
+    const CellExpressionCounts& globalExpressionCounts,
+    size_t threadCount,
+    bool allowAnonymousMemory) :
         geneSet(geneSet), cellSet(cellSet)
 {
     // Sanity checks.
     CZI_ASSERT(std::is_sorted(geneSet.begin(), geneSet.end()));
     CZI_ASSERT(std::is_sorted(cellSet.begin(), cellSet.end()));
 
-    // Initialize the cell expression counts for the ExpressionMatrixSubset.
-    cellExpressionCounts.createNew(name);
+    // The cells are processed in batches, each by a single thread.
+    const CellId cellCount = CellId(cellSet.size());
+    const size_t batchSize = 1024;
 
-    // Loop over cells in the subset.
-    for(CellId localCellId=0; localCellId!=cellSet.size(); localCellId++) {
-        const CellId globalCellId = cellSet[localCellId];
-        cellExpressionCounts.appendVector();
-
-        // Loop over all expression counts for this cell.
-        for(const auto& p: globalExpressionCounts[globalCellId]) {
-            const GeneId globalGeneId = p.first;
-            const GeneId localGeneId = geneSet.getLocalGeneId(globalGeneId);
-            if(localGeneId == invalidGeneId) {
-                continue;   // This gene is not in the gene set
+    // Pass 1: count the expression counts of each cell
+    // for genes in the gene set.
+    cellExpressionCounts.beginPass1(cellCount);
+    parallelFor(cellCount, batchSize, threadCount,
+        [&](size_t, size_t begin, size_t end)
+        {
+            for(CellId localCellId=CellId(begin); localCellId!=CellId(end); localCellId++) {
+                const CellId globalCellId = cellSet[localCellId];
+                uint64_t n = 0;
+                for(const auto& p: globalExpressionCounts[globalCellId]) {
+                    if(geneSet.getLocalGeneId(p.first) != invalidGeneId) {
+                        ++n;
+                    }
+                }
+                cellExpressionCounts.incrementCount(localCellId, n);
             }
-            const float count = p.second;
-            cellExpressionCounts.append(make_pair(localGeneId, count));
-        }
-    }
-
-    // Compute sums and sums of squares of the expression counts for all cells.
-    computeSums();
-}
-
+        });
 
+    // Now that we know the total size, decide where to store the
+    // expression counts. Anonymous memory is used if it takes
+    // less than half of the physical memory currently available.
+    uint64_t totalCount = 0;
+    for(const uint64_t n: cellExpressionCounts.count) {
+        totalCount += n;
+    }
+    const size_t requiredBytes =
+        (cellCount + 1) * sizeof(uint64_t) +
+        totalCount * (sizeof(GeneId) + sizeof(float));
+    const long availablePageCount = ::sysconf(_SC_AVPHYS_PAGES);
+    const long pageSize = ::sysconf(_SC_PAGESIZE);
+    const bool useAnonymousMemory =
+        allowAnonymousMemory &&
+        availablePageCount > 0 && pageSize > 0 &&
+        requiredBytes < size_t(availablePageCount) * size_t(pageSize) / 2;
+    if(useAnonymousMemory) {
+        cellExpressionCounts.createNewAnonymous();
+    } else {
+        cellExpressionCounts.createNew(name);
+    }
 
-// Compute sums and sums of squares of the expression counts for all cells.
-void ExpressionMatrixSubset::computeSums()
-{
-    sums.resize(cellSet.size());
-    for(CellId localCellId=0; localCellId<cellSet.size(); localCellId++) {
-        Sum& sum = sums[localCellId];
-        for(const auto& p: cellExpressionCounts[localCellId]) {
-            const float& count = p.second;
-            sum.sum1 += count;
-            sum.sum2 += count*count;
-        }
+    // Pass 2: store the expression counts of each cell, using local GeneIds,
+    // and compute sums and sums of squares of the expression counts.
+    // Each thread writes to the range of a different set of cells.
+    // The destructor is not called if the constructor throws,
+    // so in that case we remove the supporting files here.
+    try {
+        cellExpressionCounts.beginPass2();
+        sums.resize(cellCount);
+        parallelFor(cellCount, batchSize, threadCount,
+            [&](size_t, size_t begin, size_t end)
+            {
+                for(CellId localCellId=CellId(begin); localCellId!=CellId(end); localCellId++) {
+                    const CellId globalCellId = cellSet[localCellId];
+                    GeneId* geneIds = cellExpressionCounts.firstBegin(localCellId);
+                    float* counts = cellExpressionCounts.secondBegin(localCellId);
+                    Sum& sum = sums[localCellId];
+                    size_t i = 0;
+                    for(const auto& p: globalExpressionCounts[globalCellId]) {
+                        const GeneId localGeneId = geneSet.getLocalGeneId(p.first);
+                        if(localGeneId == invalidGeneId) {
+                            continue;   // This gene is not in the gene set
+                        }
+                        const float count = p.second;
+                        geneIds[i] = localGeneId;
+                        counts[i] = count;
+                        ++i;
+                        sum.sum1 += count;
+                        sum.sum2 += count*count;
+                    }
+                    CZI_ASSERT(i == cellExpressionCounts.size(localCellId));
+                }
+            });
+        cellExpressionCounts.endPass2(false);
+    } catch(...) {
+        remove();
+        throw;
     }
 }
 
@@ -83,28 +131,15 @@ void ExpressionMatrixSubset::remove()
 double ExpressionMatrixSubset::computeCellSimilarity(CellId localCellId0, CellId localCellId1) const
 {
     // Compute the scalar product of the expression counts for the two cells.
-    typedef pair<GeneId, float>const* Iterator;
-    const Iterator begin0 = cellExpressionCounts.begin(localCellId0);
-    const Iterator end0 = cellExpressionCounts.end(localCellId0);
-    const Iterator begin1 = cellExpressionCounts.begin(localCellId1);
-    const Iterator end1 = cellExpressionCounts.end(localCellId1);
-    Iterator it0 = begin0;
-    Iterator it1 = begin1;
-    double scalarProduct = 0.;
-    while((it0 != end0) && (it1 != end1)) {
-        const GeneId localGeneId0 = it0->first;
-        const GeneId localGeneId1 = it1->first;
-
-        if(localGeneId0 < localGeneId1) {
-            ++it0;
-        } else if(localGeneId1 < localGeneId0) {
-            ++it1;
-        } else {
-            scalarProduct += it0->second * it1->second;
-            ++it0;
-            ++it1;
-        }
-    }
+    // This uses a SIMD sorted set intersection kernel
+    // selected at run time (see sparseKernels.hpp).
+    const double scalarProduct = SparseKernels::computeScalarProduct(
+        cellExpressionCounts.firstBegin(localCellId0),
+        cellExpressionCounts.secondBegin(localCellId0),
+        cellExpressionCounts.size(localCellId0),
+        cellExpressionCounts.firstBegin(localCellId1),
+        cellExpressionCounts.secondBegin(localCellId1),
+        cellExpressionCounts.size(localCellId1));
 
     // Compute the correlation coefficient.
     // See, for example, https://en.wikipedia.org/wiki/Correlation_and_dependence
@@ -147,28 +182,83 @@ void ExpressionMatrixSubset::getDenseRepresentation(
     v.resize(geneCount(), vector<float>(cellCount(), 0.));
 
     for(CellId cellId=0; cellId!=cellCount(); ++cellId) {
-        for(const auto& p: cellExpressionCounts[cellId]) {
-            const GeneId geneId = p.first;
-            const float count = p.second;
-            v[geneId][cellId] = count;
+        const GeneId* geneIds = cellExpressionCounts.firstBegin(cellId);
+        const float* counts = cellExpressionCounts.secondBegin(cellId);
+        const size_t n = cellExpressionCounts.size(cellId);
+        for(size_t i=0; i!=n; i++) {
+            v[geneIds[i]][cellId] = counts[i];
         }
     }
 
     // Normalize the expression vector of each cell, if requested.
     if(normalizationMethod != NormalizationMethod::none) {
-        CZI_ASSERT(normalizationMethod != NormalizationMethod::Invalid);
+        vector<float> factors;
+        getNormalizationFactors(normalizationMethod, factors);
         for(CellId cellId=0; cellId!=cellCount(); cellId++) {
-            const double scaling =
-                (normalizationMethod==NormalizationMethod::L1) ?
-                    sums[cellId].sum1 :
-                    sqrt(sums[cellId].sum2);
-            if(scaling != 0.) {
-                const float factor = float(1./scaling);
-                for(GeneId geneId=0; geneId!=geneCount(); geneId++) {
-                    v[geneId][cellId] *= factor;
-                }
+            const float factor = factors[cellId];
+            for(GeneId geneId=0; geneId!=geneCount(); geneId++) {
+                v[geneId][cellId] *= factor;
             }
         }
     }
 
 }
+
+
+
+// Get the factor used to normalize the expression vector of each cell.
+void ExpressionMatrixSubset::getNormalizationFactors(
+    NormalizationMethod normalizationMethod,
+    vector<float>& factors) const
+{
+    factors.clear();
+    factors.resize(cellCount(), 1.f);
+    if(normalizationMethod == NormalizationMethod::none) {
+        return;
+    }
+    CZI_ASSERT(normalizationMethod != NormalizationMethod::Invalid);
+    for(CellId cellId=0; cellId!=cellCount(); cellId++) {
+        const double scaling =
+            (normalizationMethod==NormalizationMethod::L1) ?
+                sums[cellId].sum1 :
+                sqrt(sums[cellId].sum2);
+        if(scaling != 0.) {
+            factors[cellId] = float(1./scaling);
+        }
+    }
+}
+
+
+
+// Create a copy of the expression counts stored by gene,
+// normalized as requested.
+// The cells are processed in reverse order because
+// SplitVectorOfVectors::store fills each vector starting at the end.
+void ExpressionMatrixSubset::createGeneExpressionCounts(
+    const string& name,
+    NormalizationMethod normalizationMethod,
+    GeneExpressionCounts& geneExpressionCounts) const
+{
+    vector<float> factors;
+    getNormalizationFactors(normalizationMethod, factors);
+
+    geneExpressionCounts.createNew(name);
+    geneExpressionCounts.beginPass1(geneCount());
+    for(CellId cellId=0; cellId!=cellCount(); cellId++) {
+        for(const GeneId* it=cellExpressionCounts.firstBegin(cellId); it!=cellExpressionCounts.firstEnd(cellId); ++it) {
+            geneExpressionCounts.incrementCount(*it);
+        }
+    }
+    geneExpressionCounts.beginPass2();
+    for(CellId cellId=cellCount(); cellId!=0; ) {
+        --cellId;
+        const GeneId* geneIds = cellExpressionCounts.firstBegin(cellId);
+        const float* counts = cellExpressionCounts.secondBegin(cellId);
+        const size_t n = cellExpressionCounts.size(cellId);
+        const float factor = factors[cellId];
+        for(size_t i=0; i!=n; i++) {
+            geneExpressionCounts.store(geneIds[i], make_pair(cellId, counts[i] * factor));
+        }
+    }
+    geneExpressionCounts.endPass2();
+}
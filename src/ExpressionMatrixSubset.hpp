@@ -8,13 +8,16 @@
 Class ExpressionMatrixSubset is used to store expression counts for a
 subset of cells and a subset of genes.
 
-It uses temporary files for all of its mapped files, so it is not persistent.
+It is not persistent. Its expression counts are stored in anonymous memory
+if they fit comfortably in the physical memory currently available,
+and otherwise in temporary memory mapped files.
 
 *******************************************************************************/
 
 #include "CellSets.hpp"
 #include "GeneSet.hpp"
 #include "Ids.hpp"
+#include "MemoryMappedSplitVectorOfVectors.hpp"
 #include "MemoryMappedVectorOfVectors.hpp"
 #include "NormalizationMethod.hpp"
 
@@ -33,12 +36,19 @@ public:
     // the base name to be used for the supporting files files,
     // plus the GeneSet and CellSet to be used
     // and the expression counts for the global expression matrix.
+    // The expression counts are extracted in two passes over the cells
+    // (count, then fill), each using threadCount threads
+    // (0 = use all hardware threads).
+    // If allowAnonymousMemory is true, the supporting files are only
+    // created if the subset is too large to be kept in anonymous memory.
     using CellExpressionCounts = MemoryMapped::VectorOfVectors<pair<GeneId, float>, uint64_t>;
     ExpressionMatrixSubset(
         const string& name,
         const GeneSet& geneSet,
         const CellSet& cellSet,
-        const CellExpressionCounts& globalExpressionCounts);
+        const CellExpressionCounts& globalExpressionCounts,
+        size_t threadCount = 0,
+        bool allowAnonymousMemory = true);
     ~ExpressionMatrixSubset();
 
     // The set of genes used by this ExpressionMatrixSubset.
@@ -71,7 +81,12 @@ public:
     // for this ExpressionbMatrixSubset.
     // This is similar to the cellExpressionCounts of class ExpressionMatrix
     // except that it uses local GeneId's and CellId's instead of global ones.
-    CellExpressionCounts cellExpressionCounts;
+    // The GeneIds and counts are stored in separate arrays
+    // (structure of arrays layout), so code that only
+    // needs the GeneIds does not touch the counts, and vice versa,
+    // and SIMD code can load consecutive GeneIds or counts directly.
+    using SplitCellExpressionCounts = MemoryMapped::SplitVectorOfVectors<GeneId, float, uint64_t>;
+    SplitCellExpressionCounts cellExpressionCounts;
 
     // Return the total number of non-zero expression counts
     // for all cells and genes in the subset.
@@ -108,8 +123,25 @@ public:
         vector< vector<float> >&,
         NormalizationMethod) const;
 
-private:
-    void computeSums();
+    // Get the factor used to normalize the expression vector of each cell,
+    // as requested. Indexed by the local CellId.
+    // This is 1 for NormalizationMethod::none, and for cells
+    // with no expression counts in our gene set.
+    void getNormalizationFactors(
+        NormalizationMethod,
+        vector<float>&) const;
+
+    // Create a copy of the expression counts stored by gene.
+    // For each local GeneId, this contains pairs (local CellId, count),
+    // sorted by local CellId, with the counts normalized as requested.
+    // The GeneIds and counts are stored in separate arrays,
+    // like in cellExpressionCounts, so the same kernels can be used
+    // to compute scalar products of gene expression vectors.
+    using GeneExpressionCounts = MemoryMapped::SplitVectorOfVectors<CellId, float, uint64_t>;
+    void createGeneExpressionCounts(
+        const string& name,
+        NormalizationMethod,
+        GeneExpressionCounts&) const;
 };
 
 #endif
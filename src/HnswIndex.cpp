@@ -0,0 +1,448 @@
+#include "HnswIndex.hpp"
+#include "Lsh.hpp"
+#include "parallelFor.hpp"
+#include "philox.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include "iostream.hpp"
+#include "memory.hpp"
+#include "stdexcept.hpp"
+
+
+
+HnswIndex::HnswIndex(
+    const string& name,
+    Lsh& lsh,
+    size_t M,
+    size_t efConstruction,
+    uint32_t seed,
+    size_t threadCount)
+{
+    if(M < 2) {
+        throw runtime_error("HNSW parameter M must be at least 2.");
+    }
+    if(efConstruction < 1) {
+        throw runtime_error("HNSW parameter efConstruction must be at least 1.");
+    }
+    const CellId cellCount = lsh.cellCount();
+    if(cellCount == 0) {
+        throw runtime_error("Cannot create an HNSW index without cells.");
+    }
+    threadCount = getThreadCount(threadCount);
+
+    info.createNew(name + "-Info");
+    info->cellCount = cellCount;
+    info->lshCount = lsh.lshCount();
+    info->M = M;
+    info->efConstruction = efConstruction;
+    info->seed = seed;
+    info->lshSeed = lsh.seed();
+    info->lshSignatureHash = lsh.signatureHash();
+
+    // Assign a random level to each cell.
+    levels.createNew(name + "-Levels", cellCount);
+    parallelFor(cellCount, 4096, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(size_t cellId=begin; cellId!=end; cellId++) {
+                levels[cellId] = uint8_t(computeLevel(CellId(cellId), M, seed));
+            }
+        });
+
+    // Allocate space for the neighbors of all cells at all levels.
+    linkOffsets.createNew(name + "-LinkOffsets", cellCount + 1);
+    linkOffsets[0] = 0;
+    for(CellId cellId=0; cellId<cellCount; cellId++) {
+        linkOffsets[cellId+1] = linkOffsets[cellId] +
+            (maxNeighborCount(0) + 1) + levels[cellId] * (maxNeighborCount(1) + 1);
+    }
+    links.createNew(name + "-Links", linkOffsets[cellCount]);
+
+    // The first cell is the initial entry point.
+    info->entryPoint = 0;
+    info->maxLevel = levels[0];
+
+    // Insert the remaining cells.
+    cout << timestamp << "Creating HNSW graph for " << cellCount << " cells using " <<
+        threadCount << " threads." << endl;
+    vector<std::mutex> cellMutexes(cellCount);
+    std::mutex entryPointMutex;
+    vector< shared_ptr<SearchData> > threadData(threadCount);
+    std::atomic<size_t> insertedCount(1);
+    const size_t messageFrequency = 100000;
+    std::mutex coutMutex;
+    parallelFor(cellCount - 1, 64, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            if(!threadData[threadId]) {
+                threadData[threadId] = make_shared<SearchData>(cellCount);
+            }
+            SearchData& data = *threadData[threadId];
+            for(size_t i=begin; i!=end; i++) {
+                insert(lsh, CellId(i+1), data, cellMutexes.data(), entryPointMutex);
+            }
+            const size_t n = (insertedCount += (end - begin));
+            if(n/messageFrequency != (n - (end - begin))/messageFrequency) {
+                std::lock_guard<std::mutex> lock(coutMutex);
+                cout << timestamp << "Inserted " << n << " of " << cellCount << " cells." << endl;
+            }
+        });
+    cout << timestamp << "Creation of HNSW graph completed." << endl;
+    writeStatistics(cout);
+}
+
+
+
+HnswIndex::HnswIndex(const string& name)
+{
+    info.accessExistingReadOnly(name + "-Info");
+    levels.accessExistingReadOnly(name + "-Levels");
+    linkOffsets.accessExistingReadOnly(name + "-LinkOffsets");
+    links.accessExistingReadOnly(name + "-Links");
+    CZI_ASSERT(levels.size() == info->cellCount);
+    CZI_ASSERT(linkOffsets.size() == info->cellCount + 1);
+}
+
+
+
+void HnswIndex::remove()
+{
+    links.remove();
+    linkOffsets.remove();
+    levels.remove();
+    info.remove();
+}
+
+
+
+bool HnswIndex::isCompatible(const Lsh& lsh, size_t M, size_t efConstruction, uint32_t seed) const
+{
+    return
+        info->cellCount == lsh.cellCount() &&
+        info->lshCount == lsh.lshCount() &&
+        info->lshSeed == lsh.seed() &&
+        info->lshSignatureHash == lsh.signatureHash() &&
+        info->M == M &&
+        info->efConstruction == efConstruction &&
+        info->seed == seed;
+}
+
+
+
+// The level is floor(-ln(u)/ln(M)), with u uniformly distributed in (0,1),
+// so the probability of level l or higher is M^(-l).
+// We use the Philox generator so the level only depends on the seed and the cell.
+size_t HnswIndex::computeLevel(CellId cellId, size_t M, uint32_t seed)
+{
+    const Philox::Counter r = Philox::philox4x32(
+        Philox::Counter{{cellId, 0, 0, 0}}, Philox::Key{{seed, 0x2b7e1516U}});
+    const double u = (double((uint64_t(r[0]) << 32) | r[1]) + 0.5) / 18446744073709551616.;
+    const double level = std::floor(-std::log(u) / std::log(double(M)));
+    return size_t(min(level, 255.));
+}
+
+
+
+void HnswIndex::SearchData::clearVisited()
+{
+    for(const CellId cellId: visitedCells) {
+        visited.clear(cellId);
+    }
+    visitedCells.clear();
+}
+
+
+
+void HnswIndex::copyNeighbors(
+    CellId cellId,
+    size_t level,
+    SearchData& data,
+    std::mutex* cellMutexes) const
+{
+    std::unique_lock<std::mutex> lock;
+    if(cellMutexes) {
+        lock = std::unique_lock<std::mutex>(cellMutexes[cellId]);
+    }
+    const CellId* cellLinks = getLinks(cellId, level);
+    data.neighbors.assign(cellLinks + 1, cellLinks + 1 + cellLinks[0]);
+}
+
+
+
+void HnswIndex::greedySearch(
+    Lsh& lsh,
+    CellId query,
+    CellId& cellId,
+    uint32_t& mismatchCount,
+    size_t level,
+    SearchData& data,
+    std::mutex* cellMutexes) const
+{
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        copyNeighbors(cellId, level, data, cellMutexes);
+        if(data.neighbors.empty()) {
+            break;
+        }
+        lsh.computeMismatchCounts(query, data.neighbors, data.mismatchCounts);
+        for(size_t i=0; i<data.neighbors.size(); i++) {
+            if(make_pair(data.mismatchCounts[i], data.neighbors[i]) < make_pair(mismatchCount, cellId)) {
+                mismatchCount = data.mismatchCounts[i];
+                cellId = data.neighbors[i];
+                changed = true;
+            }
+        }
+    }
+}
+
+
+
+void HnswIndex::searchLevel(
+    Lsh& lsh,
+    CellId query,
+    size_t ef,
+    size_t level,
+    SearchData& data,
+    std::mutex* cellMutexes) const
+{
+    typedef pair<uint32_t, CellId> Pair;
+    vector<Pair>& candidates = data.candidates;
+    vector<Pair>& results = data.results;
+
+    data.clearVisited();
+    for(const Pair& p: results) {
+        data.visited.set(p.second);
+        data.visitedCells.push_back(p.second);
+    }
+    candidates = results;
+    std::make_heap(candidates.begin(), candidates.end(), std::greater<Pair>());
+    std::make_heap(results.begin(), results.end());
+
+    while(!candidates.empty()) {
+
+        // Get the closest candidate.
+        std::pop_heap(candidates.begin(), candidates.end(), std::greater<Pair>());
+        const Pair candidate = candidates.back();
+        candidates.pop_back();
+        if(results.size() >= ef && results.front() < candidate) {
+            break;
+        }
+
+        // Evaluate the neighbors we have not seen yet.
+        copyNeighbors(candidate.second, level, data, cellMutexes);
+        data.cellsToEvaluate.clear();
+        for(const CellId cellId: data.neighbors) {
+            if(!data.visited.get(cellId)) {
+                data.visited.set(cellId);
+                data.visitedCells.push_back(cellId);
+                data.cellsToEvaluate.push_back(cellId);
+            }
+        }
+        if(data.cellsToEvaluate.empty()) {
+            continue;
+        }
+        lsh.computeMismatchCounts(query, data.cellsToEvaluate, data.mismatchCounts);
+        for(size_t i=0; i<data.cellsToEvaluate.size(); i++) {
+            const Pair p(data.mismatchCounts[i], data.cellsToEvaluate[i]);
+            if(results.size() < ef || p < results.front()) {
+                candidates.push_back(p);
+                std::push_heap(candidates.begin(), candidates.end(), std::greater<Pair>());
+                results.push_back(p);
+                std::push_heap(results.begin(), results.end());
+                if(results.size() > ef) {
+                    std::pop_heap(results.begin(), results.end());
+                    results.pop_back();
+                }
+            }
+        }
+    }
+}
+
+
+
+// Keep a candidate only if it is closer to the base cell
+// than to all the neighbors already selected.
+void HnswIndex::selectNeighbors(
+    Lsh& lsh,
+    const vector< pair<uint32_t, CellId> >& candidates,
+    size_t maxCount,
+    vector< pair<uint32_t, CellId> >& selected) const
+{
+    selected.clear();
+    for(const auto& candidate: candidates) {
+        if(selected.size() == maxCount) {
+            break;
+        }
+        bool keep = true;
+        for(const auto& s: selected) {
+            if(lsh.computeMismatchCount(candidate.second, s.second) < candidate.first) {
+                keep = false;
+                break;
+            }
+        }
+        if(keep) {
+            selected.push_back(candidate);
+        }
+    }
+}
+
+
+
+// Insert a cell (algorithm 1 of the reference in HnswIndex.hpp).
+void HnswIndex::insert(
+    Lsh& lsh,
+    CellId query,
+    SearchData& data,
+    std::mutex* cellMutexes,
+    std::mutex& entryPointMutex)
+{
+    const size_t level = levels[query];
+
+    // Get the entry point. If this cell will become the new entry point,
+    // hold the lock until we are done.
+    std::unique_lock<std::mutex> entryPointLock(entryPointMutex);
+    const size_t maxLevel = info->maxLevel;
+    CellId cellId = info->entryPoint;
+    if(level <= maxLevel) {
+        entryPointLock.unlock();
+    }
+
+    // Greedy search at the levels above the level of this cell.
+    uint32_t mismatchCount = uint32_t(lsh.computeMismatchCount(query, cellId));
+    for(size_t l=maxLevel; l>level; l--) {
+        greedySearch(lsh, query, cellId, mismatchCount, l, data, cellMutexes);
+    }
+
+    // Full search and connection at the remaining levels.
+    data.results.clear();
+    data.results.push_back(make_pair(mismatchCount, cellId));
+    for(size_t l=min(level, maxLevel)+1; l-- > 0; ) {
+        searchLevel(lsh, query, info->efConstruction, l, data, cellMutexes);
+        data.sortedResults = data.results;
+        sort(data.sortedResults.begin(), data.sortedResults.end());
+        selectNeighbors(lsh, data.sortedResults, info->M, data.selected);
+
+        // Store the neighbors of this cell.
+        {
+            std::lock_guard<std::mutex> lock(cellMutexes[query]);
+            CellId* queryLinks = getLinks(query, l);
+            queryLinks[0] = CellId(data.selected.size());
+            for(size_t i=0; i<data.selected.size(); i++) {
+                queryLinks[i+1] = data.selected[i].second;
+            }
+        }
+
+        // Add this cell to the neighbors of its neighbors.
+        for(const auto& p: data.selected) {
+            connect(lsh, p.second, query, p.first, l, data, cellMutexes);
+        }
+    }
+
+    // If necessary, make this cell the new entry point.
+    if(level > maxLevel) {
+        info->maxLevel = level;
+        info->entryPoint = query;
+    }
+}
+
+
+
+void HnswIndex::connect(
+    Lsh& lsh,
+    CellId cellId0,
+    CellId cellId1,
+    uint32_t mismatchCount,
+    size_t level,
+    SearchData& data,
+    std::mutex* cellMutexes)
+{
+    std::lock_guard<std::mutex> lock(cellMutexes[cellId0]);
+    CellId* cellLinks = getLinks(cellId0, level);
+    const size_t neighborCount = cellLinks[0];
+
+    // If there is room, just add it.
+    if(neighborCount < maxNeighborCount(level)) {
+        cellLinks[neighborCount + 1] = cellId1;
+        cellLinks[0] = CellId(neighborCount + 1);
+        return;
+    }
+
+    // Otherwise, select the neighbors to keep
+    // among the existing ones and the new one.
+    data.connectCandidates.clear();
+    data.connectCandidates.push_back(make_pair(mismatchCount, cellId1));
+    for(size_t i=0; i<neighborCount; i++) {
+        const CellId cellId = cellLinks[i+1];
+        data.connectCandidates.push_back(make_pair(uint32_t(lsh.computeMismatchCount(cellId0, cellId)), cellId));
+    }
+    sort(data.connectCandidates.begin(), data.connectCandidates.end());
+    selectNeighbors(lsh, data.connectCandidates, maxNeighborCount(level), data.connectSelected);
+    cellLinks[0] = CellId(data.connectSelected.size());
+    for(size_t i=0; i<data.connectSelected.size(); i++) {
+        cellLinks[i+1] = data.connectSelected[i].second;
+    }
+}
+
+
+
+void HnswIndex::findNeighbors(
+    Lsh& lsh,
+    CellId query,
+    size_t k,
+    size_t efSearch,
+    SearchData& data,
+    vector< pair<uint32_t, CellId> >& neighbors) const
+{
+    CZI_ASSERT(query < cellCount());
+
+    // Greedy search at the upper levels.
+    CellId cellId = info->entryPoint;
+    uint32_t mismatchCount = uint32_t(lsh.computeMismatchCount(query, cellId));
+    for(size_t l=info->maxLevel; l>0; l--) {
+        greedySearch(lsh, query, cellId, mismatchCount, l, data, 0);
+    }
+
+    // Full search at level 0. The query cell is in the graph,
+    // so we need one more result than requested.
+    data.results.clear();
+    data.results.push_back(make_pair(mismatchCount, cellId));
+    searchLevel(lsh, query, max(efSearch, k+1), 0, data, 0);
+
+    neighbors.clear();
+    for(const auto& p: data.results) {
+        if(p.second != query) {
+            neighbors.push_back(p);
+        }
+    }
+    sort(neighbors.begin(), neighbors.end());
+    if(neighbors.size() > k) {
+        neighbors.resize(k);
+    }
+}
+
+
+
+void HnswIndex::writeStatistics(ostream& s) const
+{
+    const size_t cellCount = info->cellCount;
+    vector<size_t> levelHistogram(info->maxLevel + 1, 0);
+    size_t level0NeighborCount = 0;
+    for(CellId cellId=0; cellId<cellCount; cellId++) {
+        ++levelHistogram[levels[cellId]];
+        level0NeighborCount += getLinks(cellId, 0)[0];
+    }
+    s << "HNSW graph with M=" << info->M << ", efConstruction=" << info->efConstruction <<
+        ", " << cellCount << " cells, maximum level " << info->maxLevel << "." << endl;
+    for(size_t level=0; level<levelHistogram.size(); level++) {
+        s << "Number of cells with level " << level << " is " << levelHistogram[level] << endl;
+    }
+    s << "Average number of neighbors at level 0 is " <<
+        double(level0NeighborCount) / double(cellCount) << endl;
+}
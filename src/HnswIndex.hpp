@@ -0,0 +1,248 @@
+#ifndef CZI_EXPRESSION_MATRIX2_HNSW_INDEX_HPP
+#define CZI_EXPRESSION_MATRIX2_HNSW_INDEX_HPP
+
+
+// Class HnswIndex is a Hierarchical Navigable Small World graph
+// built over the LSH signatures of the cells of an Lsh object,
+// using the Hamming distance (number of mismatching signature bits).
+// It is used by findSimilarPairs8 to find approximate
+// k nearest neighbors of each cell in sub-quadratic time.
+// See Y. A. Malkov, D. A. Yashunin, "Efficient and robust approximate
+// nearest neighbor search using Hierarchical Navigable Small World graphs",
+// IEEE Transactions on Pattern Analysis and Machine Intelligence, 2018.
+
+// Each cell is assigned a random level, with probability of level l
+// or higher equal to M^(-l). The cell appears in the graph at all levels
+// from 0 to its level. At level 0 each cell has at most 2*M neighbors,
+// and at higher levels at most M neighbors, selected using
+// the heuristic of algorithm 4 of the above reference.
+
+// The graph is built on multiple threads, inserting cells concurrently
+// with a lock for each cell, as done in hnswlib.
+// Because of this, the graph depends on the number of threads,
+// but it is uniquely defined when using a single thread.
+// The level of each cell is a function of the seed and the CellId only.
+
+// All data are stored in memory mapped files.
+// A persistent HnswIndex for Lsh object lshName is stored next to it,
+// in files named Lsh-lshName-Hnsw-hnswName-*, and can be reused
+// by any number of queries (see ExpressionMatrix::findSimilarPairs8).
+
+#include "BitSet.hpp"
+#include "Ids.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedVector.hpp"
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "iosfwd.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+#include <mutex>
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class HnswIndex;
+        class Lsh;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::HnswIndex {
+public:
+
+    // Build the HNSW graph for all cells of an Lsh object
+    // and store it in memory mapped files.
+    HnswIndex(
+        const string& name,             // Name prefix for memory mapped files.
+        Lsh&,
+        size_t M,                       // The maximum number of neighbors at levels above 0.
+        size_t efConstruction,          // The size of the dynamic candidate list during construction.
+        uint32_t seed,                  // The seed used to assign levels to cells.
+        size_t threadCount = 0);        // The number of threads, or 0 to use all hardware threads.
+
+    // Access an existing HnswIndex.
+    HnswIndex(const string& name);
+
+    // Remove the memory mapped files.
+    void remove();
+
+    // Return true if this HnswIndex was created for the given Lsh object
+    // and with the given parameters.
+    // The Lsh object is identified by its seed and a hash of its signatures,
+    // so an HnswIndex is not reused if the Lsh object was recreated
+    // with the same name but with a different seed, gene set, or cell set.
+    // Both are stored in the Lsh object (see Lsh::signatureHash),
+    // so this is O(1) and can be called for every query.
+    bool isCompatible(const Lsh&, size_t M, size_t efConstruction, uint32_t seed) const;
+
+    size_t cellCount() const
+    {
+        return info->cellCount;
+    }
+    size_t M() const
+    {
+        return info->M;
+    }
+    size_t efConstruction() const
+    {
+        return info->efConstruction;
+    }
+    uint32_t seed() const
+    {
+        return info->seed;
+    }
+    size_t maxLevel() const
+    {
+        return info->maxLevel;
+    }
+
+    // Scratch data used during a search.
+    // Each thread must use its own SearchData.
+    class SearchData {
+    public:
+        SearchData(CellId cellCount) : visited(cellCount) {}
+    private:
+        friend class HnswIndex;
+        BitSet visited;
+        vector<CellId> visitedCells;
+        vector< pair<uint32_t, CellId> > candidates;    // Min-heap of pair(mismatchCount, cellId).
+        vector< pair<uint32_t, CellId> > results;       // Max-heap of pair(mismatchCount, cellId).
+        vector<CellId> neighbors;
+        vector<CellId> cellsToEvaluate;
+        vector<uint32_t> mismatchCounts;
+        vector< pair<uint32_t, CellId> > sortedResults;
+        vector< pair<uint32_t, CellId> > selected;
+        vector< pair<uint32_t, CellId> > connectCandidates;
+        vector< pair<uint32_t, CellId> > connectSelected;
+        void clearVisited();
+    };
+
+    // Find approximate k nearest neighbors of one of the indexed cells,
+    // excluding the cell itself. The search uses a dynamic candidate list
+    // of size efSearch (at least k+1).
+    // On return, neighbors contains pairs (mismatchCount, cellId),
+    // sorted by increasing mismatch count, then by CellId.
+    void findNeighbors(
+        Lsh&,
+        CellId,
+        size_t k,
+        size_t efSearch,
+        SearchData&,
+        vector< pair<uint32_t, CellId> >& neighbors) const;
+
+    // Write a summary of the graph.
+    void writeStatistics(ostream&) const;
+
+private:
+
+    class Info {
+    public:
+        size_t cellCount;
+        size_t lshCount;
+        size_t M;
+        size_t efConstruction;
+        size_t maxLevel;
+        CellId entryPoint;
+        uint32_t seed;
+
+        // The seed and the hash of the signatures of the Lsh object
+        // used to create this HnswIndex (see isCompatible).
+        uint32_t lshSeed;
+        uint64_t lshSignatureHash;
+    };
+    MemoryMapped::Object<Info> info;
+
+    // The level of each cell.
+    MemoryMapped::Vector<uint8_t> levels;
+
+    // The neighbors of each cell at each level, stored contiguously.
+    // For each cell, there is one list for each level from 0 to
+    // the level of the cell. Each list begins with the number of neighbors,
+    // followed by space for the maximum number of neighbors at that level.
+    MemoryMapped::Vector<CellId> links;
+    MemoryMapped::Vector<uint64_t> linkOffsets;    // Indexed by CellId, cellCount+1 entries.
+
+    // The maximum number of neighbors at a given level.
+    size_t maxNeighborCount(size_t level) const
+    {
+        return level==0 ? 2*info->M : info->M;
+    }
+
+    // Return a pointer to the list of neighbors of a cell at a given level.
+    CellId* getLinks(CellId cellId, size_t level)
+    {
+        return links.begin() + linkOffsetInCell(cellId, level);
+    }
+    const CellId* getLinks(CellId cellId, size_t level) const
+    {
+        return links.begin() + linkOffsetInCell(cellId, level);
+    }
+    uint64_t linkOffsetInCell(CellId cellId, size_t level) const
+    {
+        return linkOffsets[cellId] +
+            (level==0 ? 0 : (maxNeighborCount(0) + 1) + (level-1) * (maxNeighborCount(1) + 1));
+    }
+
+    // Copy the neighbors of a cell at a given level to data.neighbors,
+    // locking the cell if cellMutexes is not null (during construction).
+    void copyNeighbors(CellId, size_t level, SearchData&, std::mutex* cellMutexes) const;
+
+    // Greedy search at one level, used at the levels above those
+    // where a full search is done.
+    void greedySearch(
+        Lsh&,
+        CellId query,
+        CellId& cellId,
+        uint32_t& mismatchCount,
+        size_t level,
+        SearchData&,
+        std::mutex* cellMutexes) const;
+
+    // Search at one level (algorithm 2 of the above reference).
+    // On entry, data.results contains the entry points.
+    // On exit, it contains up to ef cells closest to the query,
+    // organized as a max-heap.
+    void searchLevel(
+        Lsh&,
+        CellId query,
+        size_t ef,
+        size_t level,
+        SearchData&,
+        std::mutex* cellMutexes) const;
+
+    // Select at most maxCount neighbors from candidates sorted by
+    // increasing mismatch count with the base cell (algorithm 4 of the above
+    // reference, without extending or keeping pruned connections).
+    void selectNeighbors(
+        Lsh&,
+        const vector< pair<uint32_t, CellId> >& candidates,
+        size_t maxCount,
+        vector< pair<uint32_t, CellId> >& selected) const;
+
+    // Insert a cell in the graph during construction.
+    void insert(
+        Lsh&,
+        CellId,
+        SearchData&,
+        std::mutex* cellMutexes,
+        std::mutex& entryPointMutex);
+
+    // Add cellId1 to the neighbors of cellId0 at a given level,
+    // pruning the neighbors of cellId0 if necessary.
+    void connect(
+        Lsh&,
+        CellId cellId0,
+        CellId cellId1,
+        uint32_t mismatchCount,
+        size_t level,
+        SearchData&,
+        std::mutex* cellMutexes);
+
+    // Compute the random level of a cell.
+    static size_t computeLevel(CellId, size_t M, uint32_t seed);
+};
+
+#endif
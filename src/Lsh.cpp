@@ -1,5 +1,10 @@
 #include "Lsh.hpp"
 #include "ExpressionMatrixSubset.hpp"
+#include "filesystem.hpp"
+#include "lshKernels.hpp"
+#include "MurmurHash2.hpp"
+#include "parallelFor.hpp"
+#include "philox.hpp"
 #include "SimilarPairs.hpp"
 #include "timestamp.hpp"
 using namespace ChanZuckerberg;
@@ -12,6 +17,7 @@ using namespace ExpressionMatrix2;
 
 #include <chrono>
 #include "fstream.hpp"
+#include <mutex>
 
 
 
@@ -19,27 +25,86 @@ Lsh::Lsh(
     const string& name,             // Name prefix for memory mapped files.
     const ExpressionMatrixSubset& expressionMatrixSubset,
     size_t lshCount,                // Number of LSH hyperplanes
-    uint32_t seed                   // Seed to generate LSH hyperplanes.
+    uint32_t seed,                  // Seed to generate LSH hyperplanes.
+    size_t threadCount,             // Number of threads used to compute the signatures.
+    bool streamLshVectors,          // Generate the LSH vectors in blocks, without storing them.
+    bool storeMargins               // Also store the margin of each signature bit.
+    ) :
+    Lsh(name, expressionMatrixSubset.cellExpressionCounts, expressionMatrixSubset.geneCount(),
+        lshCount, seed, threadCount, streamLshVectors, storeMargins)
+{
+}
+
+
+
+Lsh::Lsh(
+    const string& name,             // Name prefix for memory mapped files.
+    const Vectors& vectors,         // The sparse vectors.
+    size_t dimension,               // The dimension of the space containing the vectors.
+    size_t lshCount,                // Number of LSH hyperplanes
+    uint32_t seed,                  // Seed to generate LSH hyperplanes.
+    size_t threadCount,             // Number of threads used to compute the signatures.
+    bool streamLshVectors,          // Generate the LSH vectors in blocks, without storing them.
+    bool storeMargins               // Also store the margin of each signature bit.
     )
 {
+    const Input input(vectors, dimension);
+
     // Store the Info object.
     info.createNew(name + "-Info");
     info->lshCount = lshCount;
-    info->cellCount = expressionMatrixSubset.cellCount();
+    info->cellCount = input.vectorCount();
+
+    if(streamLshVectors) {
+
+        // Generate the LSH vectors in blocks and compute cell signatures
+        // one word at a time.
+        cout << timestamp << "Computing cell LSH signatures using streamed LSH vectors." << endl;
+        computeCellLshSignaturesStreaming(name, input, seed, threadCount, storeMargins);
 
-    // Generate the LSH vectors.
-    cout << timestamp << "Generating LSH vectors." << endl;
-    generateLshVectors(expressionMatrixSubset.geneCount(), lshCount, seed);
+    } else {
 
-    // Compute cell signatures.
-    cout << timestamp << "Computing cell LSH signatures." << endl;
-    computeCellLshSignatures(name, expressionMatrixSubset);
+        // Generate the LSH vectors.
+        cout << timestamp << "Generating LSH vectors." << endl;
+        generateLshVectors(input.dimension, lshCount, seed);
+
+        // Compute cell signatures.
+        cout << timestamp << "Computing cell LSH signatures." << endl;
+        computeCellLshSignatures(name, input, threadCount, storeMargins);
+    }
 
     // Compute the similarity table.
     // This is a look up table indexed by the number of mismatching bits.
     // Each entry contgains the similarity corresponding to that number
     // of mismatching bits.
     computeSimilarityTable();
+
+    chooseMismatchCountKernel();
+
+    // Store the seed and the hash of the signatures.
+    signatureInfo.createNew(name + "-SignatureInfo");
+    signatureInfo->seed = seed;
+    signatureInfo->signatureHash = computeSignatureHash();
+}
+
+
+
+// Compute the sum and sum of squares of each input vector.
+// The sums are computed as in ExpressionMatrixSubset::computeSums,
+// so for cells they are identical to the ones stored there.
+Lsh::Input::Input(const Vectors& vectors, size_t dimension) :
+    vectors(vectors), dimension(dimension)
+{
+    const size_t n = vectors.size();
+    sum1.resize(n, 0.);
+    sum2.resize(n, 0.);
+    for(size_t i=0; i!=n; i++) {
+        for(const float* it=vectors.secondBegin(i); it!=vectors.secondEnd(i); ++it) {
+            const float x = *it;
+            sum1[i] += x;
+            sum2[i] += x*x;
+        }
+    }
 }
 
 
@@ -52,6 +117,12 @@ Lsh::Lsh(
     // Access the memory mapped data.
     info.accessExistingReadOnly(name + "-Info");
     signatures.accessExistingReadOnly(name + "-Signatures");
+    if(filesystem::exists(name + "-Margins")) {
+        margins.accessExistingReadOnly(name + "-Margins");
+    }
+    if(filesystem::exists(name + "-SignatureInfo")) {
+        signatureInfo.accessExistingReadOnly(name + "-SignatureInfo");
+    }
 
     // Compute the number of 64 bit words in each cell signature.
     signatureWordCount = (lshCount()-1)/64 + 1;
@@ -61,10 +132,18 @@ Lsh::Lsh(
     // Each entry contgains the similarity corresponding to that number
     // of mismatching bits.
     computeSimilarityTable();
+
+    chooseMismatchCountKernel();
 }
 
 
 // Generate the LSH vectors.
+// The components are generated in double precision, then normalized
+// and stored in single precision.
+// To avoid storing a double precision copy of the LSH vectors,
+// the random components are generated twice, using the same seed.
+// The first pass computes the normalization factors, and
+// the second pass stores the normalized components.
 void Lsh::generateLshVectors(
     size_t geneCount,
     size_t lshCount,                // Number of LSH hyperplanes
@@ -74,40 +153,55 @@ void Lsh::generateLshVectors(
     // Prepare to generate normally vector distributed components.
     using RandomSource = boost::mt19937;
     using NormalDistribution = boost::normal_distribution<>;
-    RandomSource randomSource(seed);
-    NormalDistribution normalDistribution;
-    boost::variate_generator<RandomSource, NormalDistribution> normalGenerator(randomSource, normalDistribution);
-
-    // Allocate space for the LSH vectors.
-    lshVectors.resize(geneCount, vector<double>(lshCount, 0.));
 
     // Sum of the squares of the components of each of the LSH vectors.
     vector<double> normalizationFactor(lshCount, 0.);
+    {
+        RandomSource randomSource(seed);
+        NormalDistribution normalDistribution;
+        boost::variate_generator<RandomSource, NormalDistribution> normalGenerator(randomSource, normalDistribution);
+        for(size_t geneId = 0; geneId<geneCount; geneId++) {
+            for(size_t lshVectorId = 0; lshVectorId<lshCount; lshVectorId++) {
+                const double x = normalGenerator();
+                normalizationFactor[lshVectorId] += x*x;
+            }
+        }
+    }
+    for(auto& f: normalizationFactor) {
+        f = 1. / sqrt(f);
+    }
 
 
 
+    // Allocate space for the LSH vectors.
+    // The padding components stay at zero.
+    lshStride = ((lshCount - 1) / LshKernels::blockSize + 1) * LshKernels::blockSize;
+    lshVectors.clear();
+    lshVectors.resize(geneCount * lshStride, 0.f);
+
     // Loop over genes.
+    RandomSource randomSource(seed);
+    NormalDistribution normalDistribution;
+    boost::variate_generator<RandomSource, NormalDistribution> normalGenerator(randomSource, normalDistribution);
+    vector<double> sums(lshCount, 0.);
     for(size_t geneId = 0; geneId<geneCount; geneId++) {
+        float* v = lshVectors.data() + geneId*lshStride;
 
         // For this gene, generate the components of all the LSH vectors.
         for(size_t lshVectorId = 0; lshVectorId<lshCount; lshVectorId++) {
-
-            const double x = normalGenerator();
-            lshVectors[geneId][lshVectorId] = x;
-
-            // Update the sum of squares for this LSH vector.
-            normalizationFactor[lshVectorId] += x*x;
+            const float x = float(normalGenerator() * normalizationFactor[lshVectorId]);
+            v[lshVectorId] = x;
+            sums[lshVectorId] += x;
         }
     }
 
-    // Normalize each of the LSH vectors.
-    for(auto& f: normalizationFactor) {
-        f = 1. / sqrt(f);
-    }
-    for(size_t geneId = 0; geneId<geneCount; geneId++) {
-        for(size_t lshVectorId = 0; lshVectorId<lshCount; lshVectorId++) {
-            lshVectors[geneId][lshVectorId] *= normalizationFactor[lshVectorId];
-        }
+    // Store the sum of the components of each lsh vector.
+    // It is needed to compute the contribution of the
+    // expression counts that are zero.
+    lshVectorsSums.clear();
+    lshVectorsSums.resize(lshStride, 0.f);
+    for(size_t lshVectorId = 0; lshVectorId<lshCount; lshVectorId++) {
+        lshVectorsSums[lshVectorId] = float(sums[lshVectorId]);
     }
 
 }
@@ -115,9 +209,20 @@ void Lsh::generateLshVectors(
 
 
 // Compute the LSH signatures of all cells in the cell set we are using.
+// Cells are processed in batches, on threadCount threads.
+// Each cell signature only depends on the expression counts for
+// that cell, so the result does not depend on the number of threads.
+// The signature of each cell is computed by one of the SIMD
+// kernels in lshKernels.cpp, chosen at run time based on the
+// instruction sets supported by the processor.
+// All kernels return identical signatures.
+// If storeMargins is true, the kernel also returns the scalar products,
+// which are used to compute the margins of the signature bits.
 void Lsh::computeCellLshSignatures(
     const string& name,             // Name prefix for memory mapped files.
-    const ExpressionMatrixSubset& expressionMatrixSubset)
+    const Input& input,
+    size_t threadCount,
+    bool storeMargins)
 {
     // Get the number of LSH vectors.
     CZI_ASSERT(!lshVectors.empty());
@@ -125,98 +230,264 @@ void Lsh::computeCellLshSignatures(
 
     // Compute the number of 64 bit words in each cell signature.
     signatureWordCount = (lshCount-1)/64 + 1;
+    CZI_ASSERT(signatureWordCount * 64 == lshStride);
 
     // Get the number of genes and cells in the gene set and cell set we are using.
-    const auto geneCount = expressionMatrixSubset.geneCount();
-    const auto cellCount = expressionMatrixSubset.cellCount();
-    CZI_ASSERT(lshVectors.size() == geneCount);
-
-    // Compute the sum of the components of each lsh vector.
-    // It is needed below to compute the contribution of the
-    // expression counts that are zero.
-    vector<double> lshVectorsSums(lshCount, 0.);
-    for(GeneId localGeneId=0; localGeneId!=geneCount; localGeneId++) {
-        const auto& v = lshVectors[localGeneId]; // Components of all LSH vectors for this gene.
-        CZI_ASSERT(v.size() == lshCount);
-        for(size_t i=0; i<lshCount; i++) {
-            lshVectorsSums[i] += v[i];
-        }
-    }
+    const auto geneCount = input.dimension;
+    const auto cellCount = input.vectorCount();
+    CZI_ASSERT(lshVectors.size() == geneCount*lshStride);
 
     // Initialize the cell signatures.
     cout << timestamp << "Initializing cell LSH signatures." << endl;
     signatures.createNew(name + "-Signatures", cellCount*signatureWordCount);
+    if(storeMargins) {
+        margins.createNew(name + "-Margins", cellCount*lshStride);
+    }
 
-    // Vector to contain, for a single cell, the scalar products of the shifted
-    // expression vector for the cell with all of the LSH vectors.
-    vector<double> scalarProducts(lshCount);
+    // Choose the kernel.
+    string instructionSetName;
+    const LshKernels::SignatureKernel kernel = LshKernels::getSignatureKernel(instructionSetName);
 
 
 
-    // Loop over all the cells in the cell set we are using.
+    // Loop over all the cells in the cell set we are using, in batches.
     // The CellId is local to the cell set we are using.
-    const CellId messageFrequency = CellId(1.e7 / double(lshCount));
-    cout << timestamp << "Computation of cell LSH signatures begins." << endl;
+    // Each thread writes directly to the signatures of the cells
+    // in the batches it processes.
+    threadCount = getThreadCount(threadCount);
+    const size_t batchSize = 256;
+    const size_t messageFrequency = max(size_t(1), size_t(1.e7 / double(lshCount)) / batchSize) * batchSize;
+    std::mutex coutMutex;
+    cout << timestamp << "Computation of cell LSH signatures begins using " << threadCount <<
+        " threads and " << instructionSetName << " instructions." << endl;
     const auto t0 = std::chrono::steady_clock::now();
-    for(CellId localCellId=0; localCellId<cellCount; localCellId++) {
-        if((localCellId % messageFrequency) == 0) {
-            cout << timestamp << "Working on cell " << localCellId << " of " << cellCount << endl;
-        }
+    parallelFor(cellCount, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            if((begin % messageFrequency) == 0) {
+                std::lock_guard<std::mutex> lock(coutMutex);
+                cout << timestamp << "Working on cell " << begin << " of " << cellCount << endl;
+            }
+            vector<float> scalarProducts(storeMargins ? lshStride : 0);
+            for(size_t localCellId=begin; localCellId!=end; localCellId++) {
+
+                // Compute the mean of the expression vector for this cell.
+                // If U is one of the LSH vectors, we need to compute the scalar product
+                // s = X*U, where X is the cell expression vector, shifted to zero mean:
+                // X = x - mean,
+                // mean = sum(x)/geneCount.
+                // We get:
+                // s = (x-mean)*U = x*U - mean*U = x*U - mean*sum(U)
+                // The kernel initializes the scalar products to -mean*sum(U),
+                // then adds the contributions of the non-zero expression counts.
+                const double mean = input.sum1[localCellId] / double(geneCount);
+
+                kernel(
+                    lshVectors.data(), lshStride, lshVectorsSums.data(), float(-mean),
+                    input.vectors.firstBegin(localCellId),
+                    input.vectors.secondBegin(localCellId),
+                    input.vectors.size(localCellId),
+                    getSignature(CellId(localCellId)).begin,
+                    storeMargins ? scalarProducts.data() : 0);
+                if(storeMargins) {
+                    storeCellMargins(input, CellId(localCellId),
+                        scalarProducts.data(), 0, lshCount);
+                }
+            }
+        });
+    const auto t1 = std::chrono::steady_clock::now();
+    cout << timestamp << "Computation of cell LSH signatures ends." << endl;
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    writeSignatureComputationStatistics(input, t01);
+}
 
-        // Compute the mean of the expression vector for this cell.
-        const ExpressionMatrixSubset::Sum& sum = expressionMatrixSubset.sums[localCellId];
-        const double mean = sum.sum1 / double(geneCount);
-
-        // If U is one of the LSH vectors, we need to compute the scalar product
-        // s = X*U, where X is the cell expression vector, shifted to zero mean:
-        // X = x - mean,
-        // mean = sum(x)/geneCount (computed above).
-        // We get:
-        // s = (x-mean)*U = x*U - mean*U = x*U - mean*sum(U)
-        // We computed sum(U) above and stored it in lshVectorSums for
-        // each of the LSH vectors.
-        // Initialize the scalar products for this cell
-        // with all of the LSH vectors to -mean*sum(U).
-        for(size_t i=0; i<lshCount; i++) {
-            scalarProducts[i] = -mean * lshVectorsSums[i];
-        }
 
-        // Now add to each scalar product the x*U portion.
-        // For performance, the loop over genes is outside,
-        // which gives better memory locality.
-        // Add the contributions of the non-zero expression counts for this cell.
-        for(const auto& p : expressionMatrixSubset.cellExpressionCounts[localCellId]) {
-            const GeneId localGeneId = p.first;
-            const double count = double(p.second);
-
-            // Add the contribution of this gene to the scalar products.
-            const auto& v = lshVectors[localGeneId];
-            CZI_ASSERT(v.size() == lshCount);
-            for(size_t i=0; i<lshCount; i++) {
-                scalarProducts[i] += count * v[i];
-            }
-        }
 
-        // Set to 1 the signature bits corresponding to positive scalar products.
-        BitSetPointer cellSignature = getSignature(localCellId);
-        for(size_t i=0; i<lshCount; i++) {
-            if(scalarProducts[i]>0.) {
-                cellSignature.set(i);
-            }
-        }
+// Compute the LSH signatures of all cells in the cell set we are using,
+// without ever storing all the LSH vectors.
+// We loop over blocks of 64 LSH vectors. For each block,
+// we generate the LSH vectors, then compute the corresponding
+// signature word of all cells, using the same kernel
+// used by computeCellLshSignatures with lshStride=64.
+// Memory usage for the LSH vectors is 64*geneCount floats,
+// regardless of the number of LSH vectors.
+// The result does not depend on the number of threads.
+void Lsh::computeCellLshSignaturesStreaming(
+    const string& name,             // Name prefix for memory mapped files.
+    const Input& input,
+    uint32_t seed,
+    size_t threadCount,
+    bool storeMargins)
+{
+    const size_t lshCount = info->lshCount;
+    signatureWordCount = (lshCount-1)/64 + 1;
+    const auto geneCount = input.dimension;
+    const auto cellCount = input.vectorCount();
+
+    // Initialize the cell signatures.
+    cout << timestamp << "Initializing cell LSH signatures." << endl;
+    signatures.createNew(name + "-Signatures", cellCount*signatureWordCount);
+    if(storeMargins) {
+        margins.createNew(name + "-Margins", cellCount*signatureWordCount*LshKernels::blockSize);
+    }
+
+    // Choose the kernel.
+    string instructionSetName;
+    const LshKernels::SignatureKernel kernel = LshKernels::getSignatureKernel(instructionSetName);
 
+    threadCount = getThreadCount(threadCount);
+    cout << timestamp << "Computation of cell LSH signatures begins using " << threadCount <<
+        " threads and " << instructionSetName << " instructions." << endl;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Loop over blocks of LSH vectors.
+    for(size_t word=0; word<signatureWordCount; word++) {
+        const size_t blockBegin = word * LshKernels::blockSize;
+        cout << timestamp << "Working on LSH vectors " << blockBegin << " to " <<
+            min(lshCount, blockBegin + LshKernels::blockSize) << " of " << lshCount << endl;
+
+        // Generate the LSH vectors for this block.
+        generateLshVectorsBlock(geneCount, blockBegin, seed, threadCount);
+
+        // Compute this signature word for all cells.
+        // See computeCellLshSignatures for details.
+        parallelFor(cellCount, 1024, threadCount,
+            [&](size_t threadId, size_t begin, size_t end)
+            {
+                vector<float> scalarProducts(storeMargins ? LshKernels::blockSize : 0);
+                for(size_t localCellId=begin; localCellId!=end; localCellId++) {
+                    const double mean = input.sum1[localCellId] / double(geneCount);
+                    kernel(
+                        lshVectors.data(), lshStride, lshVectorsSums.data(), float(-mean),
+                        input.vectors.firstBegin(localCellId),
+                        input.vectors.secondBegin(localCellId),
+                        input.vectors.size(localCellId),
+                        getSignature(CellId(localCellId)).begin + word,
+                        storeMargins ? scalarProducts.data() : 0);
+                    if(storeMargins) {
+                        storeCellMargins(input, CellId(localCellId),
+                            scalarProducts.data(),
+                            blockBegin, min(lshCount, blockBegin + LshKernels::blockSize));
+                    }
+                }
+            });
     }
     const auto t1 = std::chrono::steady_clock::now();
     cout << timestamp << "Computation of cell LSH signatures ends." << endl;
-    const size_t nonZeroExpressionCount = expressionMatrixSubset.totalExpressionCounts();
+
+    // We no longer need the last block of LSH vectors.
+    lshVectors.clear();
+    lshVectors.shrink_to_fit();
+    lshVectorsSums.clear();
+    lshVectorsSums.shrink_to_fit();
+
+    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
+    writeSignatureComputationStatistics(input, t01);
+}
+
+
+
+// Generate the block of 64 LSH vectors beginning at blockBegin
+// and store them in lshVectors, with lshStride=64.
+// Components beyond lshCount are set to zero.
+// The random components are generated in parallel over genes.
+// The normalization factors and sums are then computed
+// sequentially, so the result does not depend on the number of threads.
+void Lsh::generateLshVectorsBlock(
+    size_t geneCount,
+    size_t blockBegin,
+    uint32_t seed,
+    size_t threadCount)
+{
+    const size_t lshCount = info->lshCount;
+    const size_t blockSize = LshKernels::blockSize;
+    const size_t n = min(blockSize, lshCount - blockBegin);
+    lshStride = blockSize;
+    lshVectors.resize(geneCount * blockSize);
+    lshVectorsSums.resize(blockSize);
+
+    // Generate the random components.
+    parallelFor(geneCount, 256, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(size_t geneId=begin; geneId!=end; geneId++) {
+                float* v = lshVectors.data() + geneId*blockSize;
+                for(size_t i=0; i<blockSize; i++) {
+                    v[i] = (i < n) ?
+                        float(Philox::normal(seed, uint32_t(geneId), uint32_t(blockBegin + i))) :
+                        0.f;
+                }
+            }
+        });
+
+    // Normalize.
+    vector<double> normalizationFactor(blockSize, 0.);
+    for(size_t geneId=0; geneId<geneCount; geneId++) {
+        const float* v = lshVectors.data() + geneId*blockSize;
+        for(size_t i=0; i<n; i++) {
+            normalizationFactor[i] += double(v[i]) * double(v[i]);
+        }
+    }
+    for(size_t i=0; i<n; i++) {
+        normalizationFactor[i] = 1. / sqrt(normalizationFactor[i]);
+    }
+    vector<double> sums(blockSize, 0.);
+    for(size_t geneId=0; geneId<geneCount; geneId++) {
+        float* v = lshVectors.data() + geneId*blockSize;
+        for(size_t i=0; i<n; i++) {
+            v[i] = float(v[i] * normalizationFactor[i]);
+            sums[i] += v[i];
+        }
+    }
+    for(size_t i=0; i<blockSize; i++) {
+        lshVectorsSums[i] = float(sums[i]);
+    }
+}
+
+
+
+// Store the margins of signature bits [begin, end) of a cell,
+// given the scalar products of the shifted cell expression vector
+// with LSH vectors begin through end-1.
+// See Lsh::getMargins for the definition of the margins.
+// The norm of the shifted cell expression vector X = x - mean is obtained from
+// |X|^2 = sum(x^2) - sum(x)^2/geneCount.
+void Lsh::storeCellMargins(
+    const Input& input,
+    CellId localCellId,
+    const float* scalarProducts,
+    size_t begin,
+    size_t end)
+{
+    const double geneCount = double(input.dimension);
+    const double sum1 = input.sum1[localCellId];
+    const double norm2 = input.sum2[localCellId] - sum1 * sum1 / geneCount;
+    const double factor = (norm2 > 0.) ? double(marginScale) * sqrt(geneCount / norm2) : 0.;
+
+    uint8_t* cellMargins = margins.begin() + localCellId*signatureWordCount*LshKernels::blockSize;
+    for(size_t i=begin; i!=end; i++) {
+        const double margin = std::abs(double(scalarProducts[i-begin])) * factor;
+        cellMargins[i] = uint8_t(min(255., margin + 0.5));
+    }
+}
+
+
+
+void Lsh::writeSignatureComputationStatistics(
+    const Input& input,
+    double t01) const
+{
+    const size_t lshCount = info->lshCount;
+    const auto geneCount = input.dimension;
+    const auto cellCount = input.vectorCount();
+    const size_t nonZeroExpressionCount = input.vectors.totalSize();
     cout << "Processed " << nonZeroExpressionCount << " non-zero expression counts for ";
     cout << geneCount << " genes and " << cellCount << " cells." << endl;
     cout << "Average number of expression counts per cell  is " << double(nonZeroExpressionCount) / double(cellCount) << endl;
     cout << "Average expression matrix sparsity is " <<
         double(nonZeroExpressionCount) / (double(geneCount) * double(cellCount)) << endl;
-    const double t01 = 1.e-9 * double((std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)).count());
     cout << "Computation of LSH cell signatures took " << t01 << "s." << endl;
-    cout << "    Seconds per cell " << t01 / cellCount << endl;
+    cout << "    Seconds per cell " << t01 / double(cellCount) << endl;
     cout << "    Seconds per non-zero expression matrix entry " << t01/double(nonZeroExpressionCount) << endl;
     cout << "    Seconds per inner loop iteration " << t01 / (double(nonZeroExpressionCount) * double(lshCount)) << endl;
     cout << "    Gflop/s " << 2. * 1e-9 * double(nonZeroExpressionCount) * double(lshCount) / t01 << endl;
@@ -275,6 +546,41 @@ size_t Lsh::computeMismatchCount(CellId localCellId0, CellId localCellId1)
 
 
 
+// Compute a tile of mismatch counts, see Lsh.hpp for details.
+void Lsh::computeMismatchCounts(
+    CellId begin0, CellId end0,
+    CellId begin1, CellId end1,
+    uint32_t* mismatchCounts) const
+{
+    CZI_ASSERT(begin0 <= end0 && end0 <= cellCount());
+    CZI_ASSERT(begin1 <= end1 && end1 <= cellCount());
+    mismatchCountKernel(signatures.begin(), signatureWordCount,
+        begin0, end0, 0, begin1, end1 - begin1, mismatchCounts);
+}
+void Lsh::computeMismatchCounts(
+    CellId cellId0,
+    const vector<CellId>& cellIds1,
+    vector<uint32_t>& mismatchCounts) const
+{
+    CZI_ASSERT(cellId0 < cellCount());
+    mismatchCounts.resize(cellIds1.size());
+    if(cellIds1.empty()) {
+        return;
+    }
+    mismatchCountKernel(signatures.begin(), signatureWordCount,
+        cellId0, cellId0 + 1, cellIds1.data(), 0, cellIds1.size(), mismatchCounts.data());
+}
+
+
+
+void Lsh::chooseMismatchCountKernel()
+{
+    string instructionSetName;
+    mismatchCountKernel = LshKernels::getMismatchCountKernel(instructionSetName);
+}
+
+
+
 // Write to a csv file statistics of the cell LSH signatures..
 void Lsh::writeSignatureStatistics(const string& csvFileName)
 {
@@ -305,7 +611,45 @@ void Lsh::writeSignatureStatistics(ostream& csv)
 
 void Lsh::remove()
 {
+    if(margins.isOpen) {
+        margins.remove();
+    }
+    if(signatureInfo.isOpen) {
+        signatureInfo.remove();
+    }
     signatures.remove();
     info.remove();
 }
 
+
+
+// Return the stored hash of all the cell signatures.
+// For Lsh objects created before it was stored, compute it the first time.
+uint64_t Lsh::signatureHash() const
+{
+    if(signatureInfo.isOpen) {
+        return signatureInfo->signatureHash;
+    }
+    if(!unstoredSignatureHashWasComputed) {
+        unstoredSignatureHash = computeSignatureHash();
+        unstoredSignatureHashWasComputed = true;
+    }
+    return unstoredSignatureHash;
+}
+
+
+
+// Compute a hash of all the cell signatures.
+// MurmurHash64A takes an int length, so the signatures
+// are hashed in blocks, each using the hash of the previous block as the seed.
+uint64_t Lsh::computeSignatureHash() const
+{
+    const size_t blockSize = size_t(1) << 20;    // In 64 bit words.
+    uint64_t hash = 231;
+    for(size_t begin=0; begin<signatures.size(); begin+=blockSize) {
+        const size_t n = min(blockSize, signatures.size() - begin);
+        hash = MurmurHash64A(signatures.begin() + begin, int(n * sizeof(uint64_t)), hash);
+    }
+    return hash;
+}
+
@@ -7,9 +7,12 @@
 // Class Lsh is used to do quickly find pairs of similar cells
 // using the cosine distance of Locality Sensitive Hashing (LSH)
 
+#include "AlignedAllocator.hpp"
 #include "BitSet.hpp"
 #include "Ids.hpp"
+#include "lshKernels.hpp"
 #include "MemoryMappedObject.hpp"
+#include "MemoryMappedSplitVectorOfVectors.hpp"
 #include "MemoryMappedVector.hpp"
 
 // OpenCL
@@ -20,6 +23,7 @@
 // Standard libraries.
 #include "cstddef.hpp"
 #include "cstdint.hpp"
+#include <limits>
 #include "memory.hpp"
 #include "vector.hpp"
 
@@ -38,11 +42,47 @@ public:
     // Create a new Lsh object and store it on disk.
     // This can be expensive as it requires creating LSH signatures
     // for all cells in the specified cell set.
+    // The signatures are computed using threadCount threads
+    // (0 to use all hardware threads). The signatures
+    // don't depend on the number of threads used.
+    // If streamLshVectors is true, the LSH vectors are never
+    // stored in full. Instead, they are generated 64 at a time
+    // from a counter-based random number generator,
+    // so memory usage does not grow with lshCount
+    // (other than for the signatures themselves).
+    // This generates different LSH vectors than the default mode,
+    // but the signatures are still reproducible for a given seed.
+    // If storeMargins is true, the margin of each signature bit
+    // is also stored (see getMargins below).
     Lsh(
         const string& name,             // Name prefix for memory mapped files.
         const ExpressionMatrixSubset&,  // For a subset of genes and cells.
         size_t lshCount,                // Number of LSH hyperplanes
-        uint32_t seed                   // Seed to generate LSH hyperplanes.
+        uint32_t seed,                  // Seed to generate LSH hyperplanes.
+        size_t threadCount = 0,         // Number of threads used to compute the signatures.
+        bool streamLshVectors = false,  // Generate the LSH vectors in blocks, without storing them.
+        bool storeMargins = false       // Also store the margin of each signature bit.
+        );
+
+    // Create a new Lsh object for an arbitrary set of sparse vectors,
+    // each stored as pairs (index, value) sorted by index, with
+    // indexes and values in separate arrays.
+    // The vectors play the role of the cell expression vectors,
+    // and the dimension plays the role of the number of genes.
+    // For example, this is used with gene expression vectors
+    // over a set of cells to find similar genes (see
+    // ExpressionMatrix::findSimilarGenePairs2). In that case,
+    // the "cells" of the Lsh object are genes.
+    using Vectors = MemoryMapped::SplitVectorOfVectors<uint32_t, float, uint64_t>;
+    Lsh(
+        const string& name,             // Name prefix for memory mapped files.
+        const Vectors&,                 // The sparse vectors.
+        size_t dimension,               // The dimension of the space containing the vectors.
+        size_t lshCount,                // Number of LSH hyperplanes
+        uint32_t seed,                  // Seed to generate LSH hyperplanes.
+        size_t threadCount = 0,         // Number of threads used to compute the signatures.
+        bool streamLshVectors = false,  // Generate the LSH vectors in blocks, without storing them.
+        bool storeMargins = false       // Also store the margin of each signature bit.
         );
 
     // Access an existing Lsh object.
@@ -58,6 +98,27 @@ public:
     double computeCellSimilarity(CellId localCellId0, CellId localCellId1);
     size_t computeMismatchCount(CellId localCellId0, CellId localCellId1);
 
+    // Compute a tile of mismatch counts between the signatures of cells
+    // [begin0, end0) and the signatures of cells [begin1, end1)
+    // (all local to the cell set), using the fastest kernel in lshKernels.cpp
+    // supported by the processor. On return, the mismatch count
+    // for cells (cellId0, cellId1) is in
+    // mismatchCounts[(cellId0-begin0)*(end1-begin1) + (cellId1-begin1)].
+    // This is much faster than calling computeMismatchCount for each pair.
+    // For best performance, use tiles of about 64 x 1024 cells.
+    void computeMismatchCounts(
+        CellId begin0, CellId end0,
+        CellId begin1, CellId end1,
+        uint32_t* mismatchCounts) const;
+
+    // Same as above, for a single cell and an arbitrary set of cells.
+    // On return, mismatchCounts[i] is the mismatch count between
+    // cellId0 and cellIds1[i].
+    void computeMismatchCounts(
+        CellId cellId0,
+        const vector<CellId>& cellIds1,
+        vector<uint32_t>& mismatchCounts) const;
+
 
     // Get the signature corresponding to a given CellId (local to the cell set).
     BitSetPointer getSignature(CellId cellId)
@@ -67,6 +128,30 @@ public:
         return BitSetPointer(pointer, signatureWordCount);
     }
 
+    // Margins of the signature bits.
+    // The margin of a signature bit measures how close the
+    // cell expression vector is to the corresponding LSH hyperplane,
+    // and therefore how likely the bit is to be different
+    // for a similar cell. Multi-probe LSH (see findSimilarPairs7)
+    // uses the margins to choose which bits to flip.
+    // The margin is |X*U| * sqrt(geneCount) / |X|, where X is the
+    // shifted cell expression vector and U the LSH vector.
+    // For random LSH vectors this is approximately distributed as the
+    // absolute value of a standard normal variable.
+    // It is stored as an 8 bit integer, in units of 1/marginScale,
+    // saturated at 255.
+    // The margins are only available if the Lsh object
+    // was created with storeMargins=true.
+    bool hasMargins() const
+    {
+        return margins.isOpen;
+    }
+    const uint8_t* getMargins(CellId cellId) const
+    {
+        return margins.begin() + cellId*signatureWordCount*64;
+    }
+    static const int marginScale = 64;
+
     void writeSignatureStatistics(const string& csvFileName);
     void writeSignatureStatistics(ostream&);
 
@@ -78,6 +163,19 @@ public:
     {
         return info->lshCount;
     }
+
+    // The seed used to generate the LSH vectors, and a hash of all the cell signatures.
+    // These are used to check that objects derived from the signatures
+    // (LshIndex, HnswIndex) are still consistent with this Lsh object.
+    // Both are computed once when the Lsh object is created and stored
+    // (see SignatureInfo below), so these calls are O(1).
+    // For Lsh objects created before the seed was stored, it is reported as unknownSeed.
+    uint32_t seed() const
+    {
+        return signatureInfo.isOpen ? signatureInfo->seed : unknownSeed;
+    }
+    uint64_t signatureHash() const;
+    static const uint32_t unknownSeed = std::numeric_limits<uint32_t>::max();
     size_t wordCount() const
     {
         return signatureWordCount;
@@ -101,22 +199,45 @@ public:
 
 private:
 
+    // The vectors used to compute the signatures, with their dimension
+    // and the sum and sum of squares of each vector.
+    class Input {
+    public:
+        Input(const Vectors&, size_t dimension);
+        const Vectors& vectors;
+        size_t dimension;
+        vector<double> sum1;
+        vector<double> sum2;
+        size_t vectorCount() const
+        {
+            return vectors.size();
+        }
+    };
+
     // The LSH vectors.
     // These are unit vectors in the Euclidean space of dimension equal to
     // the number of genes. Each defines a hyperplane orthogonal to it.
-    // Indexed by [localGeneId][lshVectorId], where the localGeneId
+    // Stored contiguously in single precision and indexed by
+    // [localGeneId*lshStride + lshVectorId], where the localGeneId
     // is the index of the gene in the gene subset we are using,
     // and lshVectorId identifies the LSH hyperplanes and goes from 0 to lshCount.
     // This way, the components of the LSH vectors for a given gene are
     // all located contiguously in memory. This important to optimize
     // the speed of the computation of cell LSH signatures.
-    vector< vector<double> > lshVectors;
+    // The stride lshStride is lshCount rounded up to a multiple of 64,
+    // and the padding components are zero.
+    // The storage is 64-byte aligned, as required by the SIMD kernels in lshKernels.cpp.
+    vector<float, AlignedAllocator<float> > lshVectors;
+    size_t lshStride;
     void generateLshVectors(
         size_t geneCount,
         size_t lshCount,                // Number of LSH hyperplanes
         uint32_t seed                   // Seed to generate LSH hyperplanes.
     );
 
+    // The sum of the components of each LSH vector, padded to lshStride.
+    vector<float, AlignedAllocator<float> > lshVectorsSums;
+
     // The number of 64 bit words in each cell signature.
     size_t signatureWordCount;
 
@@ -126,7 +247,50 @@ private:
     // with the LSH vector corresponding to the bit position is positive,
     // and negative otherwise.
     MemoryMapped::Vector<uint64_t> signatures;
-    void computeCellLshSignatures(const string& name, const ExpressionMatrixSubset&);
+    void computeCellLshSignatures(
+        const string& name,
+        const Input&,
+        size_t threadCount,
+        bool storeMargins);
+
+    // The margins of the signature bits of all cells (see getMargins).
+    // Indexed by [localCellId*signatureWordCount*64 + lshVectorId].
+    MemoryMapped::Vector<uint8_t> margins;
+    void storeCellMargins(
+        const Input&,
+        CellId localCellId,
+        const float* scalarProducts,    // The scalar products for LSH vectors begin through end-1.
+        size_t begin,
+        size_t end);
+
+    // Streaming version of the above, used when streamLshVectors is true.
+    // It loops over blocks of 64 LSH vectors, each corresponding to
+    // one signature word. For each block it generates the LSH vectors
+    // (stored in lshVectors with lshStride=64),
+    // then computes the corresponding signature word for all cells.
+    // The components of the LSH vectors are generated
+    // by Philox::normal(seed, localGeneId, lshVectorId),
+    // so they don't depend on the order in which they are generated.
+    void computeCellLshSignaturesStreaming(
+        const string& name,
+        const Input&,
+        uint32_t seed,
+        size_t threadCount,
+        bool storeMargins);
+    void generateLshVectorsBlock(
+        size_t geneCount,
+        size_t blockBegin,              // The first LSH vector in this block.
+        uint32_t seed,
+        size_t threadCount);
+
+    // Write performance statistics for the computation of cell signatures.
+    void writeSignatureComputationStatistics(
+        const Input&,
+        double seconds) const;
+
+    // The kernel used by computeMismatchCounts, chosen at run time.
+    LshKernels::MismatchCountKernel mismatchCountKernel;
+    void chooseMismatchCountKernel();
 
     // The similarity (cosine of the angle) corresponding to each number of mismatching bits.
     vector<double> similarityTable;
@@ -140,6 +304,21 @@ private:
     };
     MemoryMapped::Object<Info> info;
 
+    // The seed and the hash of the signatures (see seed and signatureHash).
+    // They are stored in a separate file rather than in Info,
+    // so Lsh objects created before they were added can still be accessed.
+    // For those, the signature hash is computed the first time it is needed
+    // and kept in unstoredSignatureHash.
+    class SignatureInfo {
+    public:
+        uint32_t seed;
+        uint64_t signatureHash;
+    };
+    MemoryMapped::Object<SignatureInfo> signatureInfo;
+    mutable uint64_t unstoredSignatureHash;
+    mutable bool unstoredSignatureHashWasComputed = false;
+    uint64_t computeSignatureHash() const;
+
 
 
     // Private data and functions used for computations on GPUs using OpenCL.
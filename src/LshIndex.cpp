@@ -0,0 +1,376 @@
+#include "LshIndex.hpp"
+#include "Lsh.hpp"
+#include "MurmurHash2.hpp"
+#include "parallelFor.hpp"
+#include "timestamp.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+#include "algorithm.hpp"
+
+
+
+// Assign the cells of an Lsh object to buckets.
+LshIndex::LshIndex(
+    const string& name,
+    Lsh& lsh,
+    const vector<int>& lshSliceLengths,
+    size_t log2BucketCount,
+    size_t threadCount)
+{
+    // Check that the slice lengths are in decreasing order.
+    const size_t sliceLengthCount = lshSliceLengths.size();
+    for(size_t i=1; i<sliceLengthCount; i++) {
+        if(lshSliceLengths[i] >= lshSliceLengths[i-1]) {
+            throw runtime_error("The slice lengths are not in decreasing order.");
+        }
+    }
+
+    // Check that the slice lengths are between 1 and 64.
+    for(size_t i=0; i<sliceLengthCount; i++) {
+        if(lshSliceLengths[i] > 64) {
+            throw runtime_error("Each slice length can be at most 64 bits.");
+        }
+        if(lshSliceLengths[i] < 1) {
+            throw runtime_error("Each slice length must be at least 1 bit.");
+        }
+    }
+
+    // Bucket offsets are stored as 32 bit integers.
+    if(log2BucketCount > 31) {
+        throw runtime_error("The base 2 log of the number of buckets can be at most 31.");
+    }
+
+    // If anything goes wrong after this point,
+    // remove the files created so far.
+    try {
+        create(name, lsh, lshSliceLengths, log2BucketCount, threadCount);
+    } catch(...) {
+        remove();
+        throw;
+    }
+}
+
+
+
+// Create the files and fill the bucket tables.
+// Called by the constructor after checking the arguments.
+void LshIndex::create(
+    const string& name,
+    Lsh& lsh,
+    const vector<int>& lshSliceLengths,
+    size_t log2BucketCount,
+    size_t threadCount)
+{
+    const size_t sliceLengthCount = lshSliceLengths.size();
+
+    // Store the Info object and the slice lengths.
+    const CellId cellCount = lsh.cellCount();
+    info.createNew(name + "-Info");
+    info->cellCount = cellCount;
+    info->lshCount = lsh.lshCount();
+    info->log2BucketCount = log2BucketCount;
+    info->lshSeed = lsh.seed();
+    info->lshSignatureHash = lsh.signatureHash();
+    sliceLengths.createNew(name + "-SliceLengths", sliceLengthCount);
+    std::copy(lshSliceLengths.begin(), lshSliceLengths.end(), sliceLengths.begin());
+    computeIndexes();
+    const size_t tableCount = firstBucketOffset.size() - 1;
+    info->tableCount = tableCount;
+    for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
+        cout << "Number of slices of length " << sliceLength(sliceLengthId) << " is " << sliceCount(sliceLengthId);
+        cout << ". Table size is " << tableSize(sliceLengthId) << endl;
+    }
+
+    // Allocate the bucket tables.
+    cout << timestamp << "Assigning cells to buckets." << endl;
+    bucketOffsets.createNew(name + "-BucketOffsets", firstBucketOffset.back());
+    cells.createNew(name + "-Cells", tableCount * size_t(cellCount));
+
+    // Vector of (sliceLengthId, sliceId) for each table.
+    vector< pair<size_t, size_t> > tables;
+    for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount; sliceLengthId++) {
+        for(size_t sliceId=0; sliceId<sliceCount(sliceLengthId); sliceId++) {
+            tables.push_back(make_pair(sliceLengthId, sliceId));
+        }
+    }
+    CZI_ASSERT(tables.size() == tableCount);
+
+    // Each table is created by a counting sort of the cells by bucket
+    // (a histogram pass followed by a fill pass).
+    // If there are at least as many tables as threads, the tables are processed
+    // in parallel, each by a single thread (see createTable).
+    // Otherwise, there is not enough parallelism across tables,
+    // and the tables are processed one at a time, each using all threads
+    // (see createTableParallel). The counting sort is stable in both cases,
+    // so the cells in each bucket are in increasing order of CellId
+    // and the result does not depend on the number of threads.
+    threadCount = getThreadCount(threadCount);
+    if(tableCount >= threadCount) {
+        parallelFor(tableCount, 1, threadCount,
+            [&](size_t threadId, size_t begin, size_t end)
+            {
+                vector<uint32_t> cellBucketIds(cellCount);
+                for(size_t tableId=begin; tableId!=end; tableId++) {
+                    createTable(lsh, tableId, tables[tableId].first, tables[tableId].second, cellBucketIds);
+                }
+            });
+    } else {
+        vector<uint32_t> cellBucketIds(cellCount);
+        for(size_t tableId=0; tableId!=tableCount; tableId++) {
+            createTableParallel(lsh, tableId, tables[tableId].first, tables[tableId].second,
+                cellBucketIds, threadCount);
+        }
+    }
+    cout << timestamp << "Done assigning cells to buckets." << endl;
+}
+
+
+
+// Create a bucket table on a single thread.
+// cellBucketIds is work space of size cellCount.
+void LshIndex::createTable(
+    Lsh& lsh,
+    size_t tableId,
+    size_t sliceLengthId,
+    size_t sliceId,
+    vector<uint32_t>& cellBucketIds)
+{
+    const CellId cellCount = CellId(info->cellCount);
+    uint32_t* offsets = bucketOffsets.begin() + firstBucketOffset[tableId];
+    const size_t n = tableSize(sliceLengthId);
+    CellId* tableCells = cells.begin() + tableId * size_t(cellCount);
+
+    // Pass 1: compute the bucket of each cell and the number of cells in each bucket.
+    std::fill(offsets, offsets + n + 1, 0U);
+    for(CellId cellId=0; cellId<cellCount; cellId++) {
+        const uint64_t bucketId = getBucketId(lsh.getSignature(cellId), sliceLengthId, sliceId);
+        CZI_ASSERT(bucketId < n);
+        cellBucketIds[cellId] = uint32_t(bucketId);
+        ++offsets[bucketId + 1];
+    }
+
+    // Prefix sum.
+    for(size_t bucketId=0; bucketId<n; bucketId++) {
+        offsets[bucketId + 1] += offsets[bucketId];
+    }
+    CZI_ASSERT(offsets[n] == cellCount);
+
+    // Pass 2: store the cells, using offsets[bucketId]
+    // as the fill position for each bucket.
+    for(CellId cellId=0; cellId<cellCount; cellId++) {
+        tableCells[offsets[cellBucketIds[cellId]]++] = cellId;
+    }
+
+    // The fill positions are now the bucket ends.
+    // Shift them to get back the bucket begins.
+    for(size_t bucketId=n; bucketId>0; bucketId--) {
+        offsets[bucketId] = offsets[bucketId - 1];
+    }
+    offsets[0] = 0;
+}
+
+
+
+// Create a bucket table using multiple threads.
+// The cells are divided into chunks of contiguous cells.
+// Pass 1 computes the bucket of each cell and a histogram for each chunk.
+// The fill position of each (bucket, chunk) is then obtained by a prefix sum
+// over buckets and, within each bucket, over chunks in order.
+// Pass 2 stores the cells of each chunk at its fill positions.
+// Because chunks are in order of CellId, this gives the same
+// result as createTable.
+// The chunk histograms use chunkCount*tableSize entries, so if the table
+// has many buckets compared to the number of cells,
+// this uses fewer chunks, or falls back to createTable.
+void LshIndex::createTableParallel(
+    Lsh& lsh,
+    size_t tableId,
+    size_t sliceLengthId,
+    size_t sliceId,
+    vector<uint32_t>& cellBucketIds,
+    size_t threadCount)
+{
+    const CellId cellCount = CellId(info->cellCount);
+    const size_t n = tableSize(sliceLengthId);
+    const size_t chunkCount = min(threadCount, (4 * size_t(cellCount)) / n);
+    if(chunkCount < 2) {
+        createTable(lsh, tableId, sliceLengthId, sliceId, cellBucketIds);
+        return;
+    }
+    uint32_t* offsets = bucketOffsets.begin() + firstBucketOffset[tableId];
+    CellId* tableCells = cells.begin() + tableId * size_t(cellCount);
+    const CellId chunkSize = CellId((size_t(cellCount) - 1) / chunkCount + 1);
+
+    // Pass 1: bucket of each cell and histogram of each chunk.
+    // histograms[chunkId*n + bucketId] is the number of cells
+    // of chunk chunkId in bucket bucketId.
+    vector<uint32_t> histograms(chunkCount * n, 0U);
+    parallelFor(chunkCount, 1, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(size_t chunkId=begin; chunkId!=end; chunkId++) {
+                uint32_t* histogram = histograms.data() + chunkId * n;
+                const CellId cellIdEnd = CellId(min(size_t(cellCount), (chunkId + 1) * chunkSize));
+                for(CellId cellId=CellId(chunkId * chunkSize); cellId<cellIdEnd; cellId++) {
+                    const uint64_t bucketId = getBucketId(lsh.getSignature(cellId), sliceLengthId, sliceId);
+                    CZI_ASSERT(bucketId < n);
+                    cellBucketIds[cellId] = uint32_t(bucketId);
+                    ++histogram[bucketId];
+                }
+            }
+        });
+
+    // Prefix sum. Afterwards, histograms[chunkId*n + bucketId]
+    // is the fill position of chunk chunkId in bucket bucketId.
+    uint32_t position = 0;
+    for(size_t bucketId=0; bucketId<n; bucketId++) {
+        offsets[bucketId] = position;
+        for(size_t chunkId=0; chunkId<chunkCount; chunkId++) {
+            uint32_t& x = histograms[chunkId * n + bucketId];
+            const uint32_t count = x;
+            x = position;
+            position += count;
+        }
+    }
+    offsets[n] = position;
+    CZI_ASSERT(position == cellCount);
+
+    // Pass 2: store the cells.
+    parallelFor(chunkCount, 1, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(size_t chunkId=begin; chunkId!=end; chunkId++) {
+                uint32_t* fillPositions = histograms.data() + chunkId * n;
+                const CellId cellIdEnd = CellId(min(size_t(cellCount), (chunkId + 1) * chunkSize));
+                for(CellId cellId=CellId(chunkId * chunkSize); cellId<cellIdEnd; cellId++) {
+                    tableCells[fillPositions[cellBucketIds[cellId]]++] = cellId;
+                }
+            }
+        });
+}
+
+
+
+// Access existing bucket tables.
+LshIndex::LshIndex(const string& name)
+{
+    info.accessExistingReadOnly(name + "-Info");
+    sliceLengths.accessExistingReadOnly(name + "-SliceLengths");
+    bucketOffsets.accessExistingReadOnly(name + "-BucketOffsets");
+    cells.accessExistingReadOnly(name + "-Cells");
+    computeIndexes();
+    CZI_ASSERT(info->tableCount == firstBucketOffset.size() - 1);
+    CZI_ASSERT(bucketOffsets.size() == firstBucketOffset.back());
+    CZI_ASSERT(cells.size() == info->tableCount * info->cellCount);
+}
+
+
+
+// Remove the memory mapped files.
+// This only removes the files that are open, so it can also be
+// used to clean up after a failure during construction.
+void LshIndex::remove()
+{
+    if(cells.isOpen) {
+        cells.remove();
+    }
+    if(bucketOffsets.isOpen) {
+        bucketOffsets.remove();
+    }
+    if(sliceLengths.isOpen) {
+        sliceLengths.remove();
+    }
+    if(info.isOpen) {
+        info.remove();
+    }
+}
+
+
+
+bool LshIndex::isCompatible(
+    const Lsh& lsh,
+    const vector<int>& lshSliceLengths,
+    size_t log2BucketCountArgument) const
+{
+    return
+        info->cellCount == lsh.cellCount() &&
+        info->lshCount == lsh.lshCount() &&
+        info->log2BucketCount == log2BucketCountArgument &&
+        info->lshSeed == lsh.seed() &&
+        info->lshSignatureHash == lsh.signatureHash() &&
+        lshSliceLengths.size() == sliceLengths.size() &&
+        std::equal(lshSliceLengths.begin(), lshSliceLengths.end(), sliceLengths.begin());
+}
+
+
+
+// Return the number of buckets in each table for a given slice length.
+size_t LshIndex::tableSize(size_t sliceLengthId) const
+{
+    const size_t length = sliceLength(sliceLengthId);
+    const size_t log2Size = min(length, log2BucketCount());
+    return size_t(1) << log2Size;
+}
+
+
+
+// Compute firstTableId and firstBucketOffset.
+void LshIndex::computeIndexes()
+{
+    firstTableId.clear();
+    firstBucketOffset.clear();
+    firstBucketOffset.push_back(0);
+    size_t tableId = 0;
+    for(size_t sliceLengthId=0; sliceLengthId<sliceLengthCount(); sliceLengthId++) {
+        firstTableId.push_back(tableId);
+        for(size_t sliceId=0; sliceId<sliceCount(sliceLengthId); sliceId++, tableId++) {
+            firstBucketOffset.push_back(firstBucketOffset.back() + tableSize(sliceLengthId) + 1);
+        }
+    }
+}
+
+
+
+uint64_t LshIndex::getBucketId(
+    const BitSetPointer& signature,
+    size_t sliceLengthId,
+    size_t sliceId) const
+{
+    const size_t length = sliceLength(sliceLengthId);
+    return getBucketIdFromSlice(getSignatureSlice(signature, sliceId*length, length), sliceLengthId);
+}
+
+
+
+uint64_t LshIndex::getBucketIdFromSlice(
+    uint64_t signatureSlice,
+    size_t sliceLengthId) const
+{
+    if(sliceLength(sliceLengthId) < log2BucketCount()) {
+        return signatureSlice;
+    } else {
+        const uint64_t bucketMask = (1ULL << log2BucketCount()) - 1ULL;
+        return MurmurHash64A(&signatureSlice, 8, 231) & bucketMask;
+    }
+}
+
+
+
+// Signature bits are stored most significant bit first
+// (see class BitSetPointer), so a slice of contiguous bits
+// spans at most two words.
+uint64_t LshIndex::getSignatureSlice(
+    const BitSetPointer& signature,
+    size_t begin,
+    size_t length)
+{
+    CZI_ASSERT(length>0 && length<=64);
+    const size_t wordId = begin >> 6;
+    const size_t offset = begin & 63;
+    uint64_t bits = signature.begin[wordId] << offset;
+    if(offset + length > 64) {
+        bits |= signature.begin[wordId + 1] >> (64 - offset);
+    }
+    return (length == 64) ? bits : (bits >> (64 - length));
+}
@@ -0,0 +1,205 @@
+#ifndef CZI_EXPRESSION_MATRIX2_LSH_INDEX_HPP
+#define CZI_EXPRESSION_MATRIX2_LSH_INDEX_HPP
+
+
+// Class LshIndex stores the assignment of cells to LSH buckets
+// used by findSimilarPairs5 and findSimilarPairs7.
+// A persistent LshIndex for Lsh object lshName is stored next to it,
+// in files named Lsh-lshName-Index-indexName-*, and can be reused
+// by any number of similar pairs computations (see ExpressionMatrix::createLshIndex).
+
+// For each slice length and each signature slice of that length,
+// each cell is assigned to a bucket based on the value of its signature slice.
+// We have a total lshCount signature bits, which can be used
+// to form lshCount/sliceLength possible signature
+// slices each sliceLength bits in length.
+// Slice sliceId of length sliceLength consists of signature bits
+// sliceId*sliceLength through (sliceId+1)*sliceLength-1.
+// If the slice length is less than log2BucketCount,
+// the bucket id is the value of the signature slice.
+// Otherwise, it is obtained by hashing the signature slice
+// to log2BucketCount bits.
+
+// Each (slice length, slice) pair defines a bucket table.
+// Each bucket table contains all the cells, so its cells are stored
+// contiguously as a counting sort of cells by bucket,
+// in a single vector of cellCount*tableCount CellIds.
+// Each bucket table also has a vector of bucket offsets,
+// relative to the beginning of the cells of that table (CSR format).
+// Cells in each bucket are stored in increasing order of CellId.
+
+// All data are stored in memory mapped files.
+
+#include "BitSet.hpp"
+#include "Ids.hpp"
+#include "MemoryAsContainer.hpp"
+#include "MemoryMappedObject.hpp"
+#include "MemoryMappedVector.hpp"
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "string.hpp"
+#include "vector.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class Lsh;
+        class LshIndex;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::LshIndex {
+public:
+
+    // Assign the cells of an Lsh object to buckets
+    // and store the bucket tables in memory mapped files.
+    // The bucket tables are computed on threadCount threads
+    // (0 to use all hardware threads) and don't depend on the number of threads.
+    LshIndex(
+        const string& name,                     // Name prefix for memory mapped files.
+        Lsh&,
+        const vector<int>& lshSliceLengths,     // The number of bits in each signature slice, in decreasing order.
+        size_t log2BucketCount,
+        size_t threadCount = 0);
+
+    // Access existing bucket tables.
+    LshIndex(const string& name);
+
+    // Disallow C++ copy and assignment.
+    LshIndex(const LshIndex&) = delete;
+    LshIndex& operator=(const LshIndex&) = delete;
+
+    // Remove the memory mapped files that are open.
+    void remove();
+
+    // Return true if this LshIndex was created for the given Lsh object
+    // and with the given slice lengths and number of buckets.
+    // The Lsh object is identified by its seed and a hash of its signatures,
+    // so an LshIndex is not reused if the Lsh object was recreated
+    // with the same name but with a different seed, gene set, or cell set.
+    bool isCompatible(
+        const Lsh&,
+        const vector<int>& lshSliceLengths,
+        size_t log2BucketCount) const;
+
+    size_t cellCount() const
+    {
+        return info->cellCount;
+    }
+    size_t log2BucketCount() const
+    {
+        return info->log2BucketCount;
+    }
+    size_t sliceLengthCount() const
+    {
+        return sliceLengths.size();
+    }
+    size_t sliceLength(size_t sliceLengthId) const
+    {
+        return size_t(sliceLengths[sliceLengthId]);
+    }
+    size_t sliceCount(size_t sliceLengthId) const
+    {
+        return info->lshCount / sliceLength(sliceLengthId);
+    }
+
+    // Return the id of the bucket a signature belongs to,
+    // for a given slice length and slice.
+    uint64_t getBucketId(
+        const BitSetPointer& signature,
+        size_t sliceLengthId,
+        size_t sliceId) const;
+
+    // Return the id of the bucket corresponding to a given value
+    // of a signature slice of a given length.
+    // This is used by multi-probe LSH to find the buckets
+    // of slices with some bits flipped.
+    uint64_t getBucketIdFromSlice(
+        uint64_t signatureSlice,
+        size_t sliceLengthId) const;
+
+    // Return the cells in a given bucket.
+    MemoryAsContainer<const CellId> getBucket(
+        size_t sliceLengthId,
+        size_t sliceId,
+        uint64_t bucketId) const
+    {
+        const size_t tableId = firstTableId[sliceLengthId] + sliceId;
+        const uint32_t* offsets = bucketOffsets.begin() + firstBucketOffset[tableId];
+        const CellId* tableCells = cells.begin() + tableId*info->cellCount;
+        return MemoryAsContainer<const CellId>(
+            tableCells + offsets[bucketId],
+            tableCells + offsets[bucketId+1]);
+    }
+
+    // Extract a slice of contiguous bits from a signature,
+    // with the first bit becoming the most significant bit of the result.
+    // This gives the same result as BitSetPointer::getBits
+    // for bit positions begin through begin+length-1.
+    static uint64_t getSignatureSlice(
+        const BitSetPointer& signature,
+        size_t begin,
+        size_t length);
+
+private:
+
+    class Info {
+    public:
+        size_t cellCount;
+        size_t lshCount;
+        size_t log2BucketCount;
+        size_t tableCount;
+
+        // The seed and the hash of the signatures of the Lsh object
+        // used to create this LshIndex (see isCompatible).
+        uint32_t lshSeed;
+        uint64_t lshSignatureHash;
+    };
+    MemoryMapped::Object<Info> info;
+
+    // The slice lengths, in decreasing order.
+    MemoryMapped::Vector<int> sliceLengths;
+
+    // The bucket offsets for all tables.
+    // For each table, there are tableSize+1 offsets,
+    // relative to the beginning of the cells for that table.
+    MemoryMapped::Vector<uint32_t> bucketOffsets;
+
+    // The cells of all tables, cellCount for each table.
+    MemoryMapped::Vector<CellId> cells;
+
+    // Indexes used to locate the data for each table.
+    // These are not stored.
+    vector<size_t> firstTableId;        // Indexed by sliceLengthId.
+    vector<size_t> firstBucketOffset;   // Indexed by tableId.
+    size_t tableSize(size_t sliceLengthId) const;
+    void computeIndexes();
+
+    // Create the files and fill the bucket tables.
+    void create(
+        const string& name,
+        Lsh&,
+        const vector<int>& lshSliceLengths,
+        size_t log2BucketCount,
+        size_t threadCount);
+
+    // Create the bucket table for a given slice length and slice,
+    // on a single thread or on threadCount threads.
+    void createTable(
+        Lsh&,
+        size_t tableId,
+        size_t sliceLengthId,
+        size_t sliceId,
+        vector<uint32_t>& cellBucketIds);
+    void createTableParallel(
+        Lsh&,
+        size_t tableId,
+        size_t sliceLengthId,
+        size_t sliceId,
+        vector<uint32_t>& cellBucketIds,
+        size_t threadCount);
+};
+
+#endif
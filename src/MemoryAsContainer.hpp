@@ -16,6 +16,8 @@ namespace ChanZuckerberg {
 
 template<class T> class ChanZuckerberg::ExpressionMatrix2::MemoryAsContainer {
 public:
+    typedef T value_type;
+    typedef T* const_iterator;
 
     MemoryAsContainer(T* begin, T* end) :
         dataBegin(begin),
@@ -27,6 +29,10 @@ public:
     {
         return dataEnd - dataBegin;
     }
+    bool empty() const
+    {
+        return dataEnd == dataBegin;
+    }
     T* begin() const
     {
         return dataBegin;
@@ -39,6 +45,10 @@ public:
     {
         return dataBegin[i];
     }
+    T& front() const
+    {
+        return *dataBegin;
+    }
 
 private:
     T* dataBegin;
@@ -0,0 +1,259 @@
+// Class to describe a vector of vectors of pairs stored contiguously in mapped memory,
+// with the first and second members of the pairs stored in separate arrays
+// (structure of arrays layout).
+// A single table of contents (toc) contains indexes pointing to the first
+// element of each vector, in both arrays.
+// This is used instead of VectorOfVectors< pair<T1, T2> > when most accesses
+// only need one of the two members, for example only the GeneIds
+// of a sparse expression vector, so the other member
+// does not use memory bandwidth and cache space.
+
+#ifndef CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_SPLIT_VECTOR_OF_VECTORS_HPP
+#define CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_SPLIT_VECTOR_OF_VECTORS_HPP
+
+// CZI.
+#include "MemoryMappedVector.hpp"
+
+// Standard libraries, partially injected into the ChanZuckerberg::ExpressionMatrix2 namespace.
+#include "algorithm.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+
+// Forward declarations.
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MemoryMapped {
+            template<class T1, class T2, class Int> class SplitVectorOfVectors;
+        }
+    }
+}
+
+
+
+template<class T1, class T2, class Int> class ChanZuckerberg::ExpressionMatrix2::MemoryMapped::SplitVectorOfVectors {
+public:
+
+    void createNew(const string& name)
+    {
+        toc.createNew(name + ".toc");
+        toc.push_back(0);
+        firstData.createNew(name + ".first");
+        secondData.createNew(name + ".second");
+    }
+
+    // Same as createNew, but using anonymous memory instead of
+    // memory mapped files (see Vector::createNewAnonymous).
+    void createNewAnonymous()
+    {
+        toc.createNewAnonymous();
+        toc.push_back(0);
+        firstData.createNewAnonymous();
+        secondData.createNewAnonymous();
+    }
+
+
+
+    void accessExisting(const string& name, bool readWriteAccess)
+    {
+        toc.accessExisting(name + ".toc", readWriteAccess);
+        firstData.accessExisting(name + ".first", readWriteAccess);
+        secondData.accessExisting(name + ".second", readWriteAccess);
+        CZI_ASSERT(firstData.size() == secondData.size());
+    }
+    void accessExistingReadOnly(const string& name)
+    {
+        accessExisting(name, false);
+    }
+
+    void accessExistingReadWrite(const string& name, bool allowReadOnly)
+    {
+        if(allowReadOnly) {
+            try {
+                accessExisting(name, true);
+            } catch(const runtime_error&) {
+                accessExisting(name, false);
+            }
+        } else {
+            accessExisting(name, true);
+        }
+    }
+
+    void remove()
+    {
+        toc.remove();
+        firstData.remove();
+        secondData.remove();
+    }
+
+    bool isOpen() const
+    {
+        return toc.isOpen;
+    }
+    bool isAnonymous() const
+    {
+        return toc.isAnonymous;
+    }
+    size_t size() const
+    {
+        return toc.size() - 1;
+    }
+    size_t totalSize() const
+    {
+        return firstData.size();
+    }
+    void close()
+    {
+        toc.close();
+        firstData.close();
+        secondData.close();
+    }
+    bool empty() const
+    {
+        return toc.size() == 1;
+    }
+
+
+    // Return size/begin/end of the first and second members
+    // of the i-th vector.
+    size_t size(size_t i) const
+    {
+        return toc[i+1] - toc[i];
+    }
+    T1* firstBegin(Int i)
+    {
+        return firstData.begin() + toc[i];
+    }
+    const T1* firstBegin(Int i) const
+    {
+        return firstData.begin() + toc[i];
+    }
+    T1* firstEnd(Int i)
+    {
+        return firstData.begin() + toc[i+1];
+    }
+    const T1* firstEnd(Int i) const
+    {
+        return firstData.begin() + toc[i+1];
+    }
+    T2* secondBegin(Int i)
+    {
+        return secondData.begin() + toc[i];
+    }
+    const T2* secondBegin(Int i) const
+    {
+        return secondData.begin() + toc[i];
+    }
+    T2* secondEnd(Int i)
+    {
+        return secondData.begin() + toc[i+1];
+    }
+    const T2* secondEnd(Int i) const
+    {
+        return secondData.begin() + toc[i+1];
+    }
+
+    // Reserve space for a given number of vectors
+    // and a given total number of elements.
+    void reserve(size_t vectorCount, size_t elementCount)
+    {
+        toc.reserve(vectorCount + 1);
+        firstData.reserve(elementCount);
+        secondData.reserve(elementCount);
+    }
+
+    // Add an empty vector at the end.
+    void appendVector()
+    {
+        const Int tocBack = toc.back();
+        toc.push_back(tocBack);
+    }
+
+    // Add a pair at the end of the last vector.
+    void append(const pair<T1, T2>& p)
+    {
+        CZI_ASSERT(!empty());
+        ++toc.back();
+        firstData.push_back(p.first);
+        secondData.push_back(p.second);
+    }
+
+    // Add a vector at the end, given iterators to pairs.
+    template<class Iterator> void appendVector(Iterator begin, Iterator end)
+    {
+        appendVector();
+        for(Iterator it=begin; it!=end; ++it) {
+            append(*it);
+        }
+    }
+
+    // Functions to construct the SplitVectorOfVectors in two passes,
+    // as in VectorOfVectors.
+    // In pass 1 we count the number of entries in each of the vectors.
+    // In pass 2 we store the entries. Because store fills each vector
+    // starting at the end, the entries of each vector must be stored
+    // in reverse order.
+    // Alternatively, after beginPass2 the entries of each vector
+    // can be written directly via firstBegin and secondBegin,
+    // which allows different vectors to be filled by different threads.
+    // In that case, endPass2 must be called with check=false,
+    // because the counts are not decremented.
+    vector<Int> count;
+    void beginPass1(Int n)
+    {
+        count.resize(n);
+        fill(count.begin(), count.end(), Int(0));
+    }
+    void incrementCount(Int index, Int m=1)  // Called during pass 1.
+    {
+        count[index] += m;
+    }
+    void beginPass2()
+    {
+        const Int n = Int(count.size());
+        toc.reserve(n+1);
+        toc.resize(n+1);
+        toc[0] = 0;
+        for(Int i=0; i<n; i++) {
+            toc[i+1] = toc[i] + count[i];
+        }
+        firstData.reserve(toc.back());
+        firstData.resize(toc.back());
+        secondData.reserve(toc.back());
+        secondData.resize(toc.back());
+    }
+    void store(Int index, const pair<T1, T2>& p)    // Called during pass 2.
+    {
+        const Int position = toc[index] + (--count[index]);
+        firstData[position] = p.first;
+        secondData[position] = p.second;
+    }
+    void endPass2(bool check = true)
+    {
+        // Verify that all counts are now zero.
+        if(check) {
+            for(const Int c: count) {
+                CZI_ASSERT(c == 0);
+            }
+        }
+
+        // Free the memory of the count vector.
+        vector<Int> emptyVector;
+        count.swap(emptyVector);
+    }
+
+    // Touch the memory in order to cause the
+    // supporting pages of virtual memory to be loaded in real memory.
+    size_t touchMemory() const
+    {
+        return toc.touchMemory() + firstData.touchMemory() + secondData.touchMemory();
+    }
+
+private:
+    Vector<Int> toc;
+    Vector<T1> firstData;
+    Vector<T2> secondData;
+};
+
+
+
+#endif
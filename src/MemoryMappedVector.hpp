@@ -74,6 +74,13 @@ public:
     // The vector is stored in a memory mapped file with the specified name.
     void createNew(const string& name, size_t n=0, size_t requiredCapacity=0);
 
+    // Same as createNew, but the vector is stored in anonymous memory
+    // instead of a memory mapped file. It is not persistent and
+    // its contents are lost when it is closed.
+    // This avoids file system activity for temporary vectors
+    // that fit in memory.
+    void createNewAnonymous(size_t n=0, size_t requiredCapacity=0);
+
     // Open a previously created vector with read-only or read-write access.
     // If accessExistingReadWrite is called with allowReadOnly=true,
     // it attempts to open with read-write access, but if that fails falls back to
@@ -208,7 +215,11 @@ public:
     bool isOpen;
     bool isOpenWithWriteAccess;
 
-    // The file name. If not open, this is an empty string.
+    // Flag that indicates that the vector is stored in anonymous memory
+    // (see createNewAnonymous).
+    bool isAnonymous;
+
+    // The file name. If not open or anonymous, this is an empty string.
     string fileName;
 
 private:
@@ -234,6 +245,10 @@ private:
 
     // Find the size of the file corresponding to an open file descriptor.
     size_t getFileSize(int fileDescriptor);
+
+    // Change the size of the anonymous memory used by the vector,
+    // possibly moving it to a different address.
+    void remapAnonymous(size_t fileSize);
 };
 
 
@@ -334,7 +349,8 @@ template<class T> inline ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector
     header(0),
     data(0),
     isOpen(false),
-    isOpenWithWriteAccess(false)
+    isOpenWithWriteAccess(false),
+    isAnonymous(false)
 {
 }
 
@@ -467,6 +483,62 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
 
 
 
+// Create a new vector with n objects, stored in anonymous memory.
+template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::createNewAnonymous(
+    size_t n,
+    size_t requiredCapacity)
+{
+    // If already open, should have called close first.
+    CZI_ASSERT(!isOpen);
+
+    // Create the header.
+    requiredCapacity = std::max(requiredCapacity, n);
+    const Header headerOnStack(n, requiredCapacity);
+    const size_t fileSize = headerOnStack.fileSize;
+
+    // Map anonymous memory.
+    void* pointer = ::mmap(0, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(pointer == reinterpret_cast<void*>(-1LL)) {
+        throw runtime_error("Error during anonymous mmap of " +
+            lexical_cast<string>(fileSize) + " bytes.");
+    }
+
+    // Figure out where the data and the header go.
+    header = static_cast<Header*>(pointer);
+    data = reinterpret_cast<T*>(header+1);
+
+    // Store the header.
+    *header = headerOnStack;
+
+    // Call the default constructor on the data.
+    for(size_t i=0; i<n; i++) {
+        new(data+i) T();
+    }
+
+    // Indicate that the vector is open with write access.
+    isOpen = true;
+    isOpenWithWriteAccess = true;
+    isAnonymous = true;
+    fileName = "";
+}
+
+
+
+// Change the size of the anonymous memory used by the vector.
+template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::remapAnonymous(size_t fileSize)
+{
+    CZI_ASSERT(isAnonymous);
+    void* pointer = ::mremap(header, header->fileSize, fileSize, MREMAP_MAYMOVE);
+    if(pointer == reinterpret_cast<void*>(-1LL)) {
+        throw runtime_error("Error during mremap of anonymous memory to " +
+            lexical_cast<string>(fileSize) + " bytes.");
+    }
+    header = static_cast<Header*>(pointer);
+    data = reinterpret_cast<T*>(header+1);
+}
+
+
+
 // Open a previously created vector with read-only or read-write access.
 template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::accessExisting(const string& name, bool readWriteAccess)
 {
@@ -536,6 +608,9 @@ template<class T> inline
 template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::syncToDisk()
 {
     CZI_ASSERT(isOpen);
+    if(isAnonymous) {
+        return;     // There is no file to sync to.
+    }
     const int msyncReturnCode = ::msync(header, header->fileSize, MS_SYNC);
     if(msyncReturnCode == -1) {
         throw runtime_error("Error during msync for " + fileName);
@@ -555,6 +630,7 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
     // Mark it as not open.
     isOpen = false;
     isOpenWithWriteAccess = false;
+    isAnonymous = false;
     header = 0;
     data = 0;
     fileName = "";
@@ -573,8 +649,11 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
 template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::Vector<T>::remove()
 {
     const string savedFileName = fileName;
+    const bool wasAnonymous = isAnonymous;
     close();	// This forgets the fileName.
-    filesystem::remove(savedFileName);
+    if(!wasAnonymous) {
+        filesystem::remove(savedFileName);
+    }
 }
 
 
@@ -613,6 +692,19 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
             }
 
 
+        } else if(isAnonymous) {
+
+            // The vector is growing beyond the current capacity.
+            // Grow the anonymous memory, possibly moving it.
+            const Header headerOnStack(newSize, size_t(1.5*double(newSize)));
+            remapAnonymous(headerOnStack.fileSize);
+            *header = headerOnStack;
+
+            // Call the constructor on the elements we added.
+            for(size_t i=oldSize; i<newSize; i++) {
+                new(data+i) T();
+            }
+
         } else {
 
             // The vector is growing beyond the current capacity.
@@ -672,12 +764,22 @@ template<class T> inline void ChanZuckerberg::ExpressionMatrix2::MemoryMapped::V
         return;
     }
 
-    // Save the file name and close it.
+    // Anonymous memory is resized in place, if possible.
+    if(isAnonymous) {
+        const Header headerOnStack(size(), capacity);
+        remapAnonymous(headerOnStack.fileSize);
+        *header = headerOnStack;
+        return;
+    }
+
+    // Save the file name and size and close it.
+    // The size must be saved first, because size() returns 0 after close.
     const string name = fileName;
+    const size_t n = size();
     close();
 
     // Create a header corresponding to increased capacity.
-    const Header headerOnStack(size(), capacity);
+    const Header headerOnStack(n, capacity);
 
     // Resize the file as necessary.
     const int fileDescriptor = openExisting(name, true);
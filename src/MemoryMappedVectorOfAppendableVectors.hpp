@@ -0,0 +1,206 @@
+// Class to describe a vector of vectors stored in mapped memory,
+// in which elements can be appended efficiently to any of the vectors.
+
+// Each vector is stored contiguously in a region of the data array
+// with room for a given capacity. When an element is appended
+// to a vector which is already at capacity, the vector is moved
+// to a new region at the end of the data array, with twice the capacity.
+// The old region is not reused, but, as with std::vector,
+// the total space used is at most a constant factor
+// larger than the total number of elements, and the amortized cost
+// of each append operation is constant.
+
+// This is used for the gene-major copy of the expression matrix
+// (ExpressionMatrix::geneExpressionCounts), where adding a cell
+// appends one element to the vectors of all genes expressed in the cell.
+
+#ifndef CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_VECTOR_OF_APPENDABLE_VECTORS_HPP
+#define CZI_EXPRESSION_MATRIX2_MEMORY_MAPPED_VECTOR_OF_APPENDABLE_VECTORS_HPP
+
+// CZI.
+#include "MemoryMappedVector.hpp"
+#include "MemoryAsContainer.hpp"
+
+// Standard libraries, partially injected into the ChanZuckerberg::ExpressionMatrix2 namespace.
+#include "algorithm.hpp"
+#include "cstdint.hpp"
+#include "vector.hpp"
+
+// Forward declarations.
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace MemoryMapped {
+            template<class T> class VectorOfAppendableVectors;
+        }
+    }
+}
+
+
+
+template<class T> class ChanZuckerberg::ExpressionMatrix2::MemoryMapped::VectorOfAppendableVectors {
+public:
+
+    void createNew(const string& name)
+    {
+        slots.createNew(name + ".slots");
+        data.createNew(name + ".data");
+    }
+
+    void accessExisting(const string& name, bool readWriteAccess)
+    {
+        slots.accessExisting(name + ".slots", readWriteAccess);
+        data.accessExisting(name + ".data", readWriteAccess);
+    }
+    void accessExistingReadOnly(const string& name)
+    {
+        accessExisting(name, false);
+    }
+
+    void accessExistingReadWrite(const string& name, bool allowReadOnly)
+    {
+        if(allowReadOnly) {
+            try {
+                accessExisting(name, true);
+            } catch(const runtime_error&) {
+                accessExisting(name, false);
+            }
+        } else {
+            accessExisting(name, true);
+        }
+    }
+
+    void remove()
+    {
+        slots.remove();
+        data.remove();
+    }
+
+    void close()
+    {
+        slots.close();
+        data.close();
+    }
+
+    bool isOpen() const
+    {
+        return slots.isOpen;
+    }
+
+    // Return the number of vectors.
+    size_t size() const
+    {
+        return slots.size();
+    }
+
+    // Return the total number of elements in all vectors.
+    size_t totalSize() const
+    {
+        size_t n = 0;
+        for(const Slot& slot: slots) {
+            n += slot.size;
+        }
+        return n;
+    }
+
+    // Add empty vectors at the end, so there are n vectors.
+    void resize(size_t n)
+    {
+        CZI_ASSERT(n >= slots.size());
+        slots.resize(n);
+    }
+
+    // Return size/begin/end of the i-th vector.
+    size_t size(size_t i) const
+    {
+        return slots[i].size;
+    }
+    T* begin(size_t i)
+    {
+        return data.begin() + slots[i].begin;
+    }
+    const T* begin(size_t i) const
+    {
+        return data.begin() + slots[i].begin;
+    }
+    T* end(size_t i)
+    {
+        return begin(i) + slots[i].size;
+    }
+    const T* end(size_t i) const
+    {
+        return begin(i) + slots[i].size;
+    }
+
+    // Operator[] return a MemoryAsContainer object.
+    MemoryAsContainer<T> operator[](size_t i)
+    {
+        return MemoryAsContainer<T>(begin(i), end(i));
+    }
+    MemoryAsContainer<const T> operator[](size_t i) const
+    {
+        return MemoryAsContainer<const T>(begin(i), end(i));
+    }
+
+    // Append an element to the i-th vector.
+    void append(size_t i, const T& t)
+    {
+        Slot& slot = slots[i];
+        if(slot.size == slot.capacity) {
+
+            // Move this vector to a new region at the end of the data array.
+            // Resizing the data array can remap it, so we use indexes, not pointers.
+            const uint64_t newBegin = data.size();
+            const uint64_t newCapacity = max(uint64_t(4), 2 * slot.capacity);
+            data.resize(newBegin + newCapacity);
+            copy(data.begin() + slot.begin, data.begin() + slot.begin + slot.size,
+                data.begin() + newBegin);
+            slot.begin = newBegin;
+            slot.capacity = newCapacity;
+        }
+        data[slot.begin + slot.size++] = t;
+    }
+
+    // Replace all vectors with vectors of the given sizes,
+    // stored contiguously without any extra capacity.
+    // The elements are default constructed and
+    // can then be filled using begin(i).
+    // Different vectors can be filled by different threads.
+    void initialize(const vector<uint64_t>& sizes)
+    {
+        slots.resize(sizes.size());
+        uint64_t position = 0;
+        for(size_t i=0; i<sizes.size(); i++) {
+            Slot& slot = slots[i];
+            slot.begin = position;
+            slot.size = sizes[i];
+            slot.capacity = sizes[i];
+            position += sizes[i];
+        }
+        data.resize(0);
+        data.reserve(position);
+        data.resize(position);
+    }
+
+    // Touch the memory in order to cause the
+    // supporting pages of virtual memory to be loaded in real memory.
+    size_t touchMemory() const
+    {
+        return slots.touchMemory() + data.touchMemory();
+    }
+
+private:
+
+    // The position of each vector in the data array.
+    class Slot {
+    public:
+        uint64_t begin = 0;
+        uint64_t size = 0;
+        uint64_t capacity = 0;
+    };
+    Vector<Slot> slots;
+    Vector<T> data;
+};
+
+
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef CZI_EXPRESSION_MATRIX2_MULTI_PROBE_HPP
+#define CZI_EXPRESSION_MATRIX2_MULTI_PROBE_HPP
+
+
+// Class MultiProbe generates the probe sequence used by multi-probe LSH.
+// See Q. Lv, W. Josephson, Z. Wang, M. Charikar, K. Li,
+// "Multi-Probe LSH: Efficient Indexing for High-Dimensional Similarity Search",
+// VLDB 2007, section 4.
+
+// For a given signature slice, in addition to the bucket
+// the slice belongs to, we also probe the buckets obtained
+// by flipping one or more bits of the slice.
+// Each set of flipped bits is scored by the sum of the margins
+// of the flipped bits (see Lsh::getMargins), and sets are generated
+// in order of increasing score, so that the most likely
+// buckets are probed first.
+
+// Sets of flipped bits are generated without enumerating all
+// possible sets, using the "shift" and "expand" operations
+// described in the above reference, applied to bit positions
+// sorted by increasing margin. Each set is generated exactly once.
+
+#include "algorithm.hpp"
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "tuple.hpp"
+#include "utility.hpp"
+#include "vector.hpp"
+#include <functional>
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        class MultiProbe;
+    }
+}
+
+
+
+class ChanZuckerberg::ExpressionMatrix2::MultiProbe {
+public:
+
+    // Compute the masks to be xor'ed with a signature slice
+    // to obtain the slices of the first probeCount additional buckets to probe.
+    // The margins of the bits of the slice are margins[0] through margins[length-1],
+    // with margins[0] corresponding to the first bit of the slice,
+    // which is the most significant bit of the slice value
+    // (see LshIndex::getSignatureSlice).
+    // Fewer than probeCount masks are returned if length is small.
+    const vector<uint64_t>& computeMasks(
+        const uint8_t* margins,
+        size_t length,
+        size_t probeCount)
+    {
+        masks.clear();
+        if(probeCount==0 || length==0) {
+            return masks;
+        }
+
+        // Sort the bits of the slice by increasing margin.
+        sortedBits.clear();
+        for(size_t i=0; i<length; i++) {
+            sortedBits.push_back(make_pair(margins[i], uint32_t(i)));
+        }
+        sort(sortedBits.begin(), sortedBits.end());
+
+        // Each set of flipped bits is represented by a mask of
+        // positions in sortedBits, and the highest position in the set.
+        // The heap contains tuples (score, set mask, highest position),
+        // and its top is the set with the lowest score.
+        heap.clear();
+        heap.push_back(Set(sortedBits[0].first, 1ULL, 0));
+        while(masks.size()<probeCount && !heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Set>());
+            const Set set = heap.back();
+            heap.pop_back();
+            const uint32_t score = std::get<0>(set);
+            const uint64_t setMask = std::get<1>(set);
+            const uint32_t last = std::get<2>(set);
+
+            // Convert the set to a mask of slice bits and store it.
+            uint64_t mask = 0;
+            for(size_t j=0; j<=last; j++) {
+                if(setMask & (1ULL << j)) {
+                    mask |= 1ULL << (length - 1 - sortedBits[j].second);
+                }
+            }
+            masks.push_back(mask);
+
+            // Generate the successors of this set.
+            if(last+1 < length) {
+                const uint32_t next = last + 1;
+                const uint64_t nextBit = 1ULL << next;
+
+                // Shift: replace the highest position with the next one.
+                heap.push_back(Set(
+                    score - sortedBits[last].first + sortedBits[next].first,
+                    (setMask & ~(1ULL << last)) | nextBit,
+                    next));
+                std::push_heap(heap.begin(), heap.end(), std::greater<Set>());
+
+                // Expand: add the next position.
+                heap.push_back(Set(
+                    score + sortedBits[next].first,
+                    setMask | nextBit,
+                    next));
+                std::push_heap(heap.begin(), heap.end(), std::greater<Set>());
+            }
+        }
+        return masks;
+    }
+
+private:
+    // Vectors reused for each slice, to avoid memory allocation.
+    typedef tuple<uint32_t, uint64_t, uint32_t> Set;
+    vector< pair<uint8_t, uint32_t> > sortedBits;   // pair(margin, bit position in slice)
+    vector<Set> heap;
+    vector<uint64_t> masks;
+};
+
+#endif
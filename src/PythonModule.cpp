@@ -130,9 +130,12 @@ pybind11::array ExpressionMatrix::getDenseExpressionMatrix(
         }
 
         const size_t offset = cellId * geneSet.size();
-        for(const pair<GeneId, float>& p: expressionMatrixSubset.cellExpressionCounts[cellId]) {
-            const GeneId geneId = p.first;
-            float count = normalizationFactor * p.second;
+        const GeneId* geneIds = expressionMatrixSubset.cellExpressionCounts.firstBegin(cellId);
+        const float* counts = expressionMatrixSubset.cellExpressionCounts.secondBegin(cellId);
+        const size_t n = expressionMatrixSubset.cellExpressionCounts.size(cellId);
+        for(size_t i=0; i!=n; i++) {
+            const GeneId geneId = geneIds[i];
+            float count = normalizationFactor * counts[i];
             data[offset + geneId] = double(count);
         }
     }
@@ -494,6 +497,43 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("cellSetName") = "AllCells",
            arg("normalizationMethod") = NormalizationMethod::none
        )
+       .def("createSplitCellExpressionCounts",
+           &ExpressionMatrix::createSplitCellExpressionCounts,
+           "Creates a copy of the cell expression counts with gene ids "
+           "and counts stored in separate arrays, which speeds up "
+           "computation of cell similarities. This only needs to be done once: "
+           "the copy is kept up to date as cells are added, "
+           "and used automatically when the expression matrix is accessed again."
+       )
+       .def("removeSplitCellExpressionCounts",
+           &ExpressionMatrix::removeSplitCellExpressionCounts,
+           "Removes the copy of the cell expression counts created by "
+           "createSplitCellExpressionCounts."
+       )
+       .def("hasSplitCellExpressionCounts",
+           &ExpressionMatrix::hasSplitCellExpressionCounts,
+           "Returns True if the copy of the cell expression counts created by "
+           "createSplitCellExpressionCounts is present."
+       )
+       .def("createGeneExpressionCounts",
+           &ExpressionMatrix::createGeneExpressionCounts,
+           "Creates a gene-major copy of the expression counts, "
+           "which speeds up computations that access the expression counts "
+           "of one gene at a time. This only needs to be done once: "
+           "the copy is kept up to date as cells are added, "
+           "and used automatically when the expression matrix is accessed again.",
+           arg("threadCount") = 0
+       )
+       .def("removeGeneExpressionCounts",
+           &ExpressionMatrix::removeGeneExpressionCounts,
+           "Removes the gene-major copy of the expression counts created by "
+           "createGeneExpressionCounts."
+       )
+       .def("hasGeneExpressionCounts",
+           &ExpressionMatrix::hasGeneExpressionCounts,
+           "Returns True if the gene-major copy of the expression counts created by "
+           "createGeneExpressionCounts is present."
+       )
 
 
        // Gene sets.
@@ -776,7 +816,7 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        .def("findSimilarPairs0",
            (
                void (ExpressionMatrix::*)
-               (const string&, const string&, const string&, size_t, double)
+               (const string&, const string&, const string&, size_t, double, size_t)
            )
            &ExpressionMatrix::findSimilarPairs0,
            "Creates and stores a new object similarPairsName "
@@ -789,20 +829,23 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "among those that exceed the specified similarityThreshold. "
            "This computational cost of this function grows "
            "with the square of the number of cells in cellSetName. "
-           "The required computing time will typically be a few minutes "
-           "for a few thousand cells or several hours for a few tens of thousands cells. "
-           "When the number of cells exceeds a few thousands, "
-           "it is more practical to perform an approximate computation using findSimilarPairs4. ",
+           "Because the similarities are exact, this can be used as a reference "
+           "to evaluate the approximate methods. "
+           "When the number of cells exceeds a few tens of thousands, "
+           "it is more practical to perform an approximate computation using findSimilarPairs4. "
+           "The computation uses threadCount threads, or all available hardware threads "
+           "if threadCount is 0. The result does not depend on the number of threads.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("similarPairsName"),
            arg("k") = 100,
-           arg("similarityThreshold") = 0.2
+           arg("similarityThreshold") = 0.2,
+           arg("threadCount") = 0
        )
        .def("findSimilarPairs4",
            (
                void (ExpressionMatrix::*)
-               (const string&, const string&, const string&, size_t, double, size_t, unsigned int)
+               (const string&, const string&, const string&, size_t, double, size_t, unsigned int, size_t)
            )
            &ExpressionMatrix::findSimilarPairs4,
            "Like findSimilarPairs0, but uses Locality-Sensitive Hashing (LSH) "
@@ -813,14 +856,17 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "However the computation is orders of magnitudes faster. "
            "The computation is approximate, and the error decreases as lshCount increases. "
            "For the suggested value lshCount=1024, "
-           "the standard deviation of the pair similarity computed in this way is 0.05 or less.",
+           "the standard deviation of the pair similarity computed in this way is 0.05 or less. "
+           "The computation uses threadCount threads, or all available hardware threads "
+           "if threadCount is 0. The result does not depend on the number of threads.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("similarPairsName"),
            arg("k") = 100,
            arg("similarityThreshold") = 0.2,
            arg("lshCount") = 1024,
-           arg("seed") = 231
+           arg("seed") = 231,
+           arg("threadCount") = 0
        )
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
        .def("findSimilarPairs4Gpu",
@@ -861,7 +907,8 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("k") = 100,
            arg("similarityThreshold") = 0.2,
            arg("lshSliceLength"),
-           arg("bucketOverflow") = 1000
+           arg("bucketOverflow") = 1000,
+           arg("lshIndexName") = ""
        )
        .def("findSimilarPairs6",
            &ExpressionMatrix::findSimilarPairs6,
@@ -877,13 +924,21 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("permutationCount"),
            arg("searchCount"),
            arg("permutedBitCount") = 64,
-           arg("seed") = 231
+           arg("seed") = 231,
+           arg("threadCount") = 0
        )
        .def("findSimilarPairs7",
            &ExpressionMatrix::findSimilarPairs7,
            "LSH-based computation of similar cell pairs "
            "without looping over all possible pairs of cells."
-           "Prototype code. Use findSimilarPairs4 instead.",
+           "Prototype code. Use findSimilarPairs4 instead. "
+           "The computation uses threadCount threads, or all available hardware threads "
+           "if threadCount is 0. The result does not depend on the number of threads. "
+           "If lshIndexName is not empty, the LSH index with that name is used "
+           "(and created if it does not exist) and kept for reuse. "
+           "If probeCount is not zero, multi-probe LSH is used: for each signature slice, "
+           "probeCount additional buckets are probed, obtained by flipping the bits "
+           "with the smallest margins. This requires signatures computed with storeMargins=True.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("lshName"),
@@ -892,7 +947,57 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("similarityThreshold") = 0.2,
            arg("lshSliceLengths"),
            arg("maxCheck"),
-           arg("log2BucketCount")
+           arg("log2BucketCount"),
+           arg("threadCount") = 0,
+           arg("lshIndexName") = "",
+           arg("probeCount") = 0
+       )
+       .def("findSimilarPairs8",
+           (
+               void (ExpressionMatrix::*)
+               (const string&, const string&, const string&, const string&,
+                   size_t, double, size_t, size_t, size_t, size_t, const string&, uint32_t)
+           )
+           &ExpressionMatrix::findSimilarPairs8,
+           "Computation of similar cell pairs using a Hierarchical Navigable Small World (HNSW) "
+           "graph built over existing LSH signatures. "
+           "M is the maximum number of neighbors in the graph at levels above 0 (2*M at level 0). "
+           "efConstruction and efSearch are the sizes of the dynamic candidate lists "
+           "used when building and searching the graph. "
+           "If hnswName is not empty, the HNSW graph with that name is used "
+           "(and created if it does not exist) and kept for reuse. "
+           "seed is used to assign levels to cells in the HNSW graph. "
+           "The computation uses threadCount threads, or all available hardware threads "
+           "if threadCount is 0.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("lshName"),
+           arg("similarPairsName"),
+           arg("k") = 100,
+           arg("similarityThreshold") = 0.2,
+           arg("M") = 16,
+           arg("efConstruction") = 200,
+           arg("efSearch") = 100,
+           arg("threadCount") = 0,
+           arg("hnswName") = "",
+           arg("seed") = 231
+       )
+       .def("findSimilarCellsHnsw",
+           &ExpressionMatrix::findSimilarCellsHnsw,
+           "Find cells similar to a given cell using an HNSW graph created by findSimilarPairs8. "
+           "Cell ids are local to the cell set used to create the LSH signatures. "
+           "Returns a list of (cellId, similarity) sorted by decreasing similarity.",
+           arg("lshName"),
+           arg("hnswName"),
+           arg("cellId"),
+           arg("k") = 100,
+           arg("efSearch") = 100
+       )
+       .def("removeHnswIndex",
+           &ExpressionMatrix::removeHnswIndex,
+           "Remove an HNSW graph created by findSimilarPairs8.",
+           arg("lshName"),
+           arg("hnswName")
        )
 #if CZI_EXPRESSION_MATRIX2_BUILD_FOR_GPU
        .def("findSimilarPairs7Gpu",
@@ -932,6 +1037,20 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "Remove the similar cell pairs object with the specified name.",
            arg("similarPairsName")
        )
+       .def("compactSimilarPairs",
+           &ExpressionMatrix::compactSimilarPairs,
+           "Create a compact form of the similar cell pairs object with the specified name, "
+           "storing only the pairs actually used, with delta coded cell ids "
+           "and similarities quantized to 16 bits. "
+           "When the compact form exists, createCellGraph uses it. "
+           "If removeOriginal is True, the original similar pairs object is removed "
+           "and only the compact form remains. "
+           "The computation uses threadCount threads, or all available hardware threads "
+           "if threadCount is 0.",
+           arg("similarPairsName"),
+           arg("removeOriginal") = false,
+           arg("threadCount") = 0
+       )
        .def("compareSimilarPairs",
            &ExpressionMatrix::compareSimilarPairs,
            "Only intended to be used for testing. "
@@ -944,12 +1063,45 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
        )
        .def("computeLshSignatures",
            &ExpressionMatrix::computeLshSignatures,
-           "Compute cell LSH signatures and store them.",
+           "Compute cell LSH signatures and store them. "
+           "The computation uses threadCount threads, or all available hardware threads "
+           "if threadCount is 0. The computed signatures do not depend on the number of threads. "
+           "If streamLshVectors is True, the LSH vectors are generated in blocks of 64 "
+           "and never stored in full, which saves memory for large lshCount. "
+           "This uses a different random number generator, so the signatures "
+           "differ from the ones computed with streamLshVectors=False. "
+           "If storeMargins is True, the margins of the signature bits are also stored, "
+           "as required for multi-probe LSH in findSimilarPairs7.",
            arg("geneSetName") = "AllGenes",
            arg("cellSetName") = "AllCells",
            arg("lshName"),
            arg("lshCount") = 1024,
-           arg("seed") = 231
+           arg("seed") = 231,
+           arg("threadCount") = 0,
+           arg("streamLshVectors") = false,
+           arg("storeMargins") = false
+       )
+       .def("createLshIndex",
+           &ExpressionMatrix::createLshIndex,
+           "Create a persistent LSH index for an existing set of cell LSH signatures. "
+           "The index can be reused by findSimilarPairs5 and findSimilarPairs7 "
+           "by passing its name as lshIndexName.",
+           arg("lshName"),
+           arg("lshIndexName"),
+           arg("lshSliceLengths"),
+           arg("log2BucketCount"),
+           arg("threadCount") = 0
+       )
+       .def("removeLshIndex",
+           &ExpressionMatrix::removeLshIndex,
+           "Remove a persistent LSH index.",
+           arg("lshName"),
+           arg("lshIndexName")
+       )
+       .def("getAvailableLshIndexes",
+           &ExpressionMatrix::getAvailableLshIndexes,
+           "Return the names of the persistent LSH indexes for a set of cell LSH signatures.",
+           arg("lshName")
        )
        .def("analyzeLshSignatures",
            &ExpressionMatrix::analyzeLshSignatures,
@@ -967,7 +1119,7 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            (
                void (ExpressionMatrix::*)
                (const string&, const string&, NormalizationMethod, const string&,
-                   size_t, double, bool)
+                   size_t, double, bool, size_t)
            )
            &ExpressionMatrix::findSimilarGenePairs0,
            arg("geneSetName") = "AllGenes",
@@ -976,7 +1128,46 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            arg("similarGenePairsName"),
            arg("k") = 100,
            arg("similarityThreshold") = 0.2,
-           arg("writeCsv") = false
+           arg("writeCsv") = false,
+           arg("threadCount") = 0
+       )
+       .def("findSimilarGenePairs1",
+           (
+               void (ExpressionMatrix::*)
+               (const string&, const string&, NormalizationMethod, const string&,
+                   size_t, double, size_t)
+           )
+           &ExpressionMatrix::findSimilarGenePairs1,
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("normalizationMethod") = NormalizationMethod::L2,
+           arg("similarGenePairsName"),
+           arg("k") = 100,
+           arg("similarityThreshold") = 0.2,
+           arg("threadCount") = 0
+       )
+       .def("findSimilarGenePairs2",
+           &ExpressionMatrix::findSimilarGenePairs2,
+           "Find pairs of similar genes using LSH. "
+           "The similarities stored are exact, but some similar pairs may be missed. "
+           "If lshSliceLength is 0, it is chosen so a pair with similarity equal to "
+           "similarityThreshold is found with probability at least 0.9. "
+           "Use analyzeGeneLsh to check the accuracy of the LSH similarities.",
+           arg("geneSetName") = "AllGenes",
+           arg("cellSetName") = "AllCells",
+           arg("normalizationMethod") = NormalizationMethod::L2,
+           arg("similarGenePairsName"),
+           arg("k") = 100,
+           arg("similarityThreshold") = 0.2,
+           arg("lshCount") = 1024,
+           arg("lshSliceLength") = 0,
+           arg("seed") = 231,
+           arg("threadCount") = 0
+       )
+       .def("analyzeGeneLsh",
+           &ExpressionMatrix::analyzeGeneLsh,
+           "Only intended to be used for testing. "
+           "Like analyzeLsh, but for the gene LSH used by findSimilarGenePairs2."
        )
 
 
@@ -1013,7 +1204,7 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "createCellGraph",
            (
                void (ExpressionMatrix::*)
-               (const string&, const string&, const string&, double, size_t, bool)
+               (const string&, const string&, const string&, double, size_t, bool, size_t)
            )
            &ExpressionMatrix::createCellGraph,
            "Create a new cell similarity graph. "
@@ -1024,13 +1215,24 @@ PYBIND11_MODULE(ExpressionMatrix2, module)
            "An edge between two vertices is created if the corresponding cells "
            "have similarity that exceeds a chosen threshold. "
            "In areas of high connectivity, only the edges "
-           "with the highest similarity for each cell are kept. ",
+           "with the highest similarity for each cell are kept. "
+           "The graph is created using threadCount threads, or all available hardware threads "
+           "if threadCount is 0. The graph does not depend on the number of threads.",
            arg("graphName"),
            arg("cellSetName") = "AllCells",
            arg("similarPairsName"),
            arg("similarityThreshold") = 0.5,
            arg("k") = 20,
-           arg("keepIsolatedVertices") = false
+           arg("keepIsolatedVertices") = false,
+           arg("threadCount") = 0
+       )
+       .def("storeCellGraph",
+           &ExpressionMatrix::storeCellGraph,
+           "Stores the cell graph with the given name, including its layout "
+           "and cluster ids, in memory mapped files in compressed sparse row format. "
+           "Stored graphs are available again the next time the expression matrix "
+           "is accessed. If the graph was already stored, the stored copy is replaced.",
+           arg("graphName")
        )
        .def("computeCellGraphLayout",
            &ExpressionMatrix::computeCellGraphLayout,
@@ -0,0 +1,40 @@
+// Class to remove a temporary memory mapped object when it goes out of scope,
+// including when an exception is thrown.
+
+#ifndef CZI_EXPRESSION_MATRIX2_REMOVE_ON_EXIT_HPP
+#define CZI_EXPRESSION_MATRIX2_REMOVE_ON_EXIT_HPP
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        template<class T> class RemoveOnExit;
+    }
+}
+
+
+
+// The object must have a remove() function that closes it
+// and removes its supporting files.
+// Errors are ignored, because the object might not have been
+// completely created when an exception was thrown,
+// and because a destructor must not throw.
+template<class T> class ChanZuckerberg::ExpressionMatrix2::RemoveOnExit {
+public:
+
+    explicit RemoveOnExit(T& t) : t(t) {}
+
+    ~RemoveOnExit()
+    {
+        try {
+            t.remove();
+        } catch(...) {
+        }
+    }
+
+    RemoveOnExit(const RemoveOnExit&) = delete;
+    RemoveOnExit& operator=(const RemoveOnExit&) = delete;
+
+private:
+    T& t;
+};
+
+#endif
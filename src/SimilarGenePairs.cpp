@@ -24,6 +24,43 @@ SimilarGenePairs::SimilarGenePairs(
             );
     }
 
+    // Create the info object and the vectors.
+    createNew(directoryName, similarGenePairsName, geneSetName, cellSetName, k, normalizationMethod);
+
+    // Store the pairs that were passed in as the argument.
+    for(GeneId localGeneId=0; localGeneId<geneSet.size(); localGeneId++){
+        store(localGeneId, pairsArgument[localGeneId]);
+     }
+
+}
+
+
+
+// Create a new SimilarGenePairs object with no pairs stored.
+SimilarGenePairs::SimilarGenePairs(
+    const string& directoryName,
+    const string& similarGenePairsName,
+    const string& geneSetName,
+    const string& cellSetName,
+    size_t k,
+    NormalizationMethod normalizationMethod)
+{
+    accessGeneSet(directoryName, geneSetName);
+    accessCellSet(directoryName, cellSetName);
+    createNew(directoryName, similarGenePairsName, geneSetName, cellSetName, k, normalizationMethod);
+}
+
+
+
+// Create the info object and the vectors, with no pairs stored.
+void SimilarGenePairs::createNew(
+    const string& directoryName,
+    const string& similarGenePairsName,
+    const string& geneSetName,
+    const string& cellSetName,
+    size_t k,
+    NormalizationMethod normalizationMethod)
+{
     // Create the info object and fill it in.
     const string pathBaseName = getPathBaseName(directoryName, similarGenePairsName);
     info.createNew(pathBaseName + "-Info");
@@ -37,14 +74,20 @@ SimilarGenePairs::SimilarGenePairs(
     // Create the remaining objects.
     pairs.createNew(pathBaseName + "-Pairs", k*size_t(geneSet.size()));
     geneInfo.createNew(pathBaseName + "-GeneInfo", geneSet.size());
+    for(GeneInfo& g: geneInfo) {
+        g.usedCount = 0;
+    }
+}
 
-    // Store the pairs that were passed in as the argument.
-    for(GeneId localGeneId=0; localGeneId<geneSet.size(); localGeneId++){
-        const vector<Pair>& pairsThisGene = pairsArgument[localGeneId];
-        geneInfo[localGeneId].usedCount = GeneId(pairsThisGene.size());
-        copy(pairsThisGene.begin(), pairsThisGene.end(), begin(localGeneId));
-     }
 
+
+// Store the pairs for a given gene.
+void SimilarGenePairs::store(GeneId localGeneId, const vector<Pair>& pairsThisGene)
+{
+    CZI_ASSERT(localGeneId < geneInfo.size());
+    CZI_ASSERT(pairsThisGene.size() <= k());
+    geneInfo[localGeneId].usedCount = GeneId(pairsThisGene.size());
+    copy(pairsThisGene.begin(), pairsThisGene.end(), begin(localGeneId));
 }
 
 
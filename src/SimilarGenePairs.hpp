@@ -54,6 +54,21 @@ public:
         NormalizationMethod normalizationMethod,
         const vector< vector<Pair> >&);
 
+    // Create a new SimilarGenePairs object with no pairs stored.
+    // The pairs for each gene can then be stored using store.
+    SimilarGenePairs(
+        const string& directoryName,
+        const string& similarGenePairsName,
+        const string& geneSetName,
+        const string& cellSetName,
+        size_t k,
+        NormalizationMethod normalizationMethod);
+
+    // Store the pairs for a given gene, replacing any pairs previously stored.
+    // The pairs should be sorted by decreasing similarity.
+    // This can be called concurrently for different genes.
+    void store(GeneId, const vector<Pair>&);
+
     // Access an existing SimilarGenePairs object.
     SimilarGenePairs(
         const string& directoryName,
@@ -154,6 +169,16 @@ public:
     MemoryMapped::Object<Info> info;
 private:
 
+    // Create the info object and the vectors, with no pairs stored.
+    // The gene set and cell set must already be accessed.
+    void createNew(
+        const string& directoryName,
+        const string& similarGenePairsName,
+        const string& geneSetName,
+        const string& cellSetName,
+        size_t k,
+        NormalizationMethod normalizationMethod);
+
     static string getPathBaseName(
         const string& directoryName,
         const string& similarPairsName
@@ -1,4 +1,5 @@
 #include "SimilarPairs.hpp"
+#include "CompactSimilarPairs.hpp"
 #include "algorithm.hpp"
 #include "heap.hpp"
 #include "orderPairs.hpp"
@@ -19,6 +20,10 @@ SimilarPairs::SimilarPairs(
     accessGeneSet(directoryName, geneSetName);
     accessCellSet(directoryName, cellSetName);
 
+    // Remove the compact form of a previous SimilarPairs object
+    // with the same name, which would otherwise be used in place of this one.
+    CompactSimilarPairs::remove(directoryName, similarPairsName);
+
     // Create the info object and fill it in.
     const string similarPairsPathBaseName = getPathBaseName(directoryName, similarPairsName);
     info.createNew(similarPairsPathBaseName + "-Info");
@@ -39,6 +44,8 @@ SimilarPairs::SimilarPairs(
         info.lowestSimilarity = std::numeric_limits<CellSimilarity>::max();
     }
 
+    // With no pairs stored, the pairs for each cell are trivially a heap.
+    isHeap.resize(cellSet.size(), 1);
 }
 
 
@@ -58,8 +65,8 @@ SimilarPairs::SimilarPairs(
     accessCellSet(directoryName, info->cellSetName);
 
     // Access the remaining objects.
-    similarPairs.accessExistingReadOnly(similarPairsPathBaseName + "-Pairs");
-    cellInfo.accessExistingReadOnly(similarPairsPathBaseName + "-CellInfo");
+    similarPairs.accessExistingReadWrite(similarPairsPathBaseName + "-Pairs", allowReadOnly);
+    cellInfo.accessExistingReadWrite(similarPairsPathBaseName + "-CellInfo", allowReadOnly);
 
     // Check that all is good.
     if(geneSet.genes().hash() != info->geneSetHash) {
@@ -80,6 +87,9 @@ SimilarPairs::SimilarPairs(
         throw runtime_error("SimilarPairs object " +
             similarPairsName + " has cellInfo vector of inconsistent length.");
     }
+
+    // We don't know how the stored pairs are ordered.
+    isHeap.resize(cellSet.size(), 0);
 }
 
 
@@ -164,125 +174,101 @@ void SimilarPairs::addUnsymmetricNoDuplicateCheckUsingHeap(CellId cellId0, CellI
 // Low level version of function to add a pair.
 // The pair or might not be stored, depending on the number
 // of pairs already stored for the given cell and whether it already exists.
-// We could structure storage as a heap to reduce the insertion cost to O(logM),
-// but there is no point because we need to do a linear search anyway
-// to check for existence.
+// The pairs stored for each cell are organized as a heap (see makeHeap),
+// so an insertion is O(log k). The check for existence still requires
+// a linear scan, but it is only done if the pair would be stored.
 void SimilarPairs::add(CellId cellId, Pair pair)
 {
     CellInfo& info = cellInfo[cellId];
-    const CellId otherCellId = pair.first;
     const uint32_t n = info.usedCount;
-    Pair* pairs = begin(cellId);
-    if(n < k()) {
-
-        // There are unused slots. Just check if this pair already exists.
-        for(uint32_t i=0; i<n; i++) {
-            if(pairs[i].first == otherCellId) {
-               return;  // Already exists.
-            }
-        }
-        // Update the lowest stored similarity info for this cell.
-        if(pair.second < info.lowestSimilarity) {
-            info.lowestSimilarityIndex = n;
-            info.lowestSimilarity = pair.second;
-        }
+    const Pair* pairs = begin(cellId);
 
-        // Add it to one of the unused slots.
-        pairs[n] = pair;
-        ++info.usedCount;
-
-        return;
-
-    } else {
-
-        // There are no unused slots.
-
-        // If the similarity of this pair is less than the lowest stored
-        // similarity for this cell, do nothing.
-        // This way we avoid a scan of the stored pairs for this cell.
-        if(pair.second <= info.lowestSimilarity) {
+    // If there are no unused slots and the pair is not better than the
+    // worst pair stored for this cell, do nothing.
+    // This way we avoid a scan of the stored pairs for this cell.
+    if(n == k()) {
+        if(n == 0) {
             return;
         }
-
-
-        // Check if this pair already exists.
-        for(uint32_t i = 0; i < n; i++) {
-            const Pair& existingPair = pairs[i];
-            if(existingPair.first == otherCellId) {
-                return;  // Already exists.
-            }
+        makeHeap(cellId);
+        if(!OrderPairsBySecondGreaterThenByFirstLess<Pair>()(pair, pairs[0])) {
+            return;
         }
+    }
 
-        // Store the pair in the slot containing the pair with the lowest similarity.
-        pairs[info.lowestSimilarityIndex] = pair;
-
-        // Update the lowest similarity.
-        info.lowestSimilarityIndex = std::numeric_limits<uint32_t>::max();
-        info.lowestSimilarity = std::numeric_limits<CellSimilarity>::max();
-        for(uint32_t i=0; i<n; i++) {
-            const Pair& existingPair = pairs[i];
-            if(existingPair.second < info.lowestSimilarity) {
-                info.lowestSimilarityIndex = i;
-                info.lowestSimilarity = existingPair.second;
-            }
+    // Check if this pair already exists.
+    const CellId otherCellId = pair.first;
+    for(uint32_t i=0; i<n; i++) {
+        if(pairs[i].first == otherCellId) {
+           return;  // Already exists.
         }
-
-        return;
     }
+
+    addNoDuplicateCheck(cellId, pair);
 }
 
 
 
-// This version does a linear search to update the position of lowest
-// similarity item.
+// Version without the check for existence.
+// This is O(log k) because the pairs stored for each cell are organized as a heap.
 void SimilarPairs::addNoDuplicateCheck(CellId cellId, Pair pair)
 {
+    const OrderPairsBySecondGreaterThenByFirstLess<Pair> isBetter;
     CellInfo& info = cellInfo[cellId];
     const uint32_t n = info.usedCount;
-    if(n < k()) {
-
-        // Update the lowest stored similarity info for this cell.
-        if(pair.second < info.lowestSimilarity) {
-            info.lowestSimilarityIndex = n;
-            info.lowestSimilarity = pair.second;
-        }
+    const size_t kk = k();
+    if(kk == 0) {
+        return;
+    }
+    makeHeap(cellId);
+    Pair* b = begin(cellId);
+    if(n < kk) {
 
-        // Add it to one of the unused slots.
-        Pair* pairs = begin(cellId);
-        pairs[n] = pair;
+        // Store it in the next unused slot and move it up the heap as required.
+        b[n] = pair;
         ++info.usedCount;
-
-        return;
+        std::push_heap(b, b+n+1, isBetter);
 
     } else {
 
-        // There are no unused slots.
-
-        // If the similarity of this pair is less than the lowest stored
-        // similarity for this cell, do nothing.
-        // This way we avoid a scan of the stored pairs for this cell.
-        if(pair.second <= info.lowestSimilarity) {
+        // The pair with the lowest similarity is the first one in the heap.
+        // If the pair passed as an argument is not better than that,
+        // don't store it.
+        if(!isBetter(pair, *b)) {
             return;
         }
 
+        // Replace the pair with the lowest similarity and update the heap.
+        popAndPushHeap(b, b+kk, pair, isBetter);
+    }
+
+    // Update the lowest stored similarity info for this cell.
+    info.lowestSimilarityIndex = 0;
+    info.lowestSimilarity = b->second;
+}
 
-        // Store the pair in the slot containing the pair with the lowest similarity.
-        Pair* pairs = begin(cellId);
-        pairs[info.lowestSimilarityIndex] = pair;
 
-        // Update the lowest similarity.
-        info.lowestSimilarityIndex = std::numeric_limits<uint32_t>::max();
-        info.lowestSimilarity = std::numeric_limits<CellSimilarity>::max();
-        for(uint32_t i=0; i<n; i++) {
-            const Pair& existingPair = pairs[i];
-            if(existingPair.second < info.lowestSimilarity) {
-                info.lowestSimilarityIndex = i;
-                info.lowestSimilarity = existingPair.second;
-            }
-        }
 
+// Make sure that the pairs stored for a cell are organized as a heap,
+// with the worst pair (lowest similarity, then highest CellId) at the top.
+// This is indicated by isHeap.
+// The pairs are in a different order if they were stored by
+// addUnsymmetricNoCheck or copy, after a call to sort,
+// or if this object was accessed from existing files,
+// and in that case the heap is recreated.
+void SimilarPairs::makeHeap(CellId cellId)
+{
+    if(isHeap[cellId]) {
         return;
     }
+    CellInfo& info = cellInfo[cellId];
+    if(info.usedCount > 0) {
+        Pair* b = begin(cellId);
+        std::make_heap(b, b+info.usedCount, OrderPairsBySecondGreaterThenByFirstLess<Pair>());
+        info.lowestSimilarityIndex = 0;
+        info.lowestSimilarity = b->second;
+    }
+    isHeap[cellId] = 1;
 }
 
 
@@ -299,69 +285,18 @@ void SimilarPairs::addUnsymmetricNoCheck(CellId cellId0, CellId cellId1, double
     pair.second = float(similarity);
     ++n0;
 
+    // The pairs for this cell are no longer organized as a heap.
+    info0.lowestSimilarityIndex = std::numeric_limits<uint32_t>::max();
+    isHeap[cellId0] = 0;
+
 }
 
 
 // Version that uses a heap to avoid linear searches.
+// This is now the same as addNoDuplicateCheck, which also uses a heap.
 void SimilarPairs::addNoDuplicateCheckUsingHeap(CellId cellId, Pair pair)
 {
-    CellInfo& info = cellInfo[cellId];
-    const uint32_t n = info.usedCount;
-    const size_t kk = k();
-    if(n < kk) {
-
-        // Store it in the next unused slot.
-        Pair* pairs = begin(cellId);
-        pairs[n] = pair;
-        ++info.usedCount;
-
-        // If we filled up all the slots, turn it into a heap,
-        // so the next insertions will work.
-        if(info.usedCount == kk) {
-            std::make_heap(pairs, pairs+kk, OrderPairsBySecondGreater<Pair>());
-        }
-
-        return;
-
-    } else {
-
-#if 0
-        cout << "Adding " << pair.first << " " << pair.second << endl;
-        cout << "Heap is: " << endl;
-        for(auto it=begin(cellId); it!=end(cellId); ++it) {
-            cout << it->first << " " << it->second << endl;
-        }
-#endif
-
-        // The pair with the lowest similarity is the first one in the heap.
-        // If the pair passed as an argument has lower similarity than that,
-        // don't store it.
-        Pair* b = begin(cellId);
-        if(pair.second <= b->second) {
-            // cout << "Skipped." << endl;
-            return;
-        }
-
-        // The pair passed as an argument has higher similarity
-        // than the lowest similarity currently stored for this cell.
-        // Update the heap.
-        Pair* e = b + kk;
-#if 1
-        std::pop_heap(b, e, OrderPairsBySecondGreater<Pair>());
-        *(e-1) = pair;  // Store in the last slot. push_head will move it as required.
-        std::push_heap(b, e, OrderPairsBySecondGreater<Pair>());
-#else
-        popAndPushHeap(b, e, pair, OrderPairsBySecondGreater<Pair>());
-#endif
-
-#if 0
-        cout << "After adding, heap is: " << endl;
-        for(auto it=begin(cellId); it!=end(cellId); ++it) {
-            cout << it->first << " " << it->second << endl;
-        }
-#endif
-        return;
-    }
+    addNoDuplicateCheck(cellId, pair);
 }
 
 
@@ -371,15 +306,27 @@ void SimilarPairs::copy(const vector< vector<Pair> >& v)
     CZI_ASSERT(v.size() == size_t(cellCount()));
     for(CellId cellId=0; cellId<cellCount(); cellId++) {
         const vector<Pair>& x = v[cellId];
-        CZI_ASSERT(x.size() <= k());
-        std::copy(x.begin(), x.end(), begin(cellId));
-        cellInfo[cellId].usedCount = CellId(x.size());
+        copy(cellId, x.data(), x.data() + x.size());
     }
 
 }
 
 
 
+// Copy the pairs for a single cell.
+void SimilarPairs::copy(CellId cellId, const Pair* pairsBegin, const Pair* pairsEnd)
+{
+    const size_t n = pairsEnd - pairsBegin;
+    CZI_ASSERT(n <= k());
+    std::copy(pairsBegin, pairsEnd, begin(cellId));
+    CellInfo& info = cellInfo[cellId];
+    info.usedCount = uint32_t(n);
+    info.lowestSimilarityIndex = std::numeric_limits<uint32_t>::max();
+    isHeap[cellId] = 0;
+}
+
+
+
 // Return true if CellId1 is currently listed among the pairs
 // similar to CellId0.
 // Note that this function is not symmetric under a swap of cellId0 and cellid1.
@@ -396,10 +343,17 @@ bool SimilarPairs::exists(CellId cellId0, CellId cellId1) const
 
 
 // Sort the similar pairs for each cell by decreasing similarity.
+// After this, the pair with the lowest similarity for each cell is the last one.
 void SimilarPairs::sort()
 {
     for(CellId cellId=0; cellId<cellSet.size(); cellId++) {
         std::sort(begin(cellId), end(cellId), OrderPairsBySecondGreaterThenByFirstLess<Pair>());
+        CellInfo& info = cellInfo[cellId];
+        if(info.usedCount > 0) {
+            info.lowestSimilarityIndex = info.usedCount - 1;
+            info.lowestSimilarity = (end(cellId) - 1)->second;
+        }
+        isHeap[cellId] = 0;
     }
 
 }
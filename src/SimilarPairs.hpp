@@ -115,6 +115,11 @@ public:
     // Copy the pairs from the argument.
     void copy(const vector< vector<Pair> >&);
 
+    // Copy the pairs for a single cell, replacing any pairs already stored for it.
+    // This only touches the storage for that cell, so pairs for
+    // different cells can be copied concurrently by different threads.
+    void copy(CellId, const Pair* begin, const Pair* end);
+
     // Sort the similar pairs for each cell by decreasing similarity.
     void sort();
 
@@ -154,6 +159,14 @@ public:
     {
         return cellSet;
     }
+    string getGeneSetName() const
+    {
+        return info->geneSetName;
+    }
+    string getCellSetName() const
+    {
+        return info->cellSetName;
+    }
 
     void remove();
 
@@ -175,6 +188,9 @@ private:
 
         // The position of the stored pair with the lowest similarity for this cell.
         // This is relative to begin(cellId) for this cell.
+        // It is only informational: objects created by older code
+        // can hold arbitrary values here, so it is not used
+        // to decide whether the pairs are organized as a heap (see isHeap).
         uint32_t lowestSimilarityIndex;
 
         // The similarity of the stored pair with the lowest similarity for this cell.
@@ -182,6 +198,14 @@ private:
     };
     MemoryMapped::Vector<CellInfo> cellInfo;
 
+    // For each cell, a flag that is set if the pairs stored for the cell
+    // are known to be organized as a heap (see makeHeap).
+    // This is not persistent: when an existing object is accessed,
+    // the heap is recreated the first time pairs are added for each cell.
+    // One byte per cell, so different threads can add pairs
+    // for different cells concurrently.
+    vector<uint8_t> isHeap;
+
 
 
 
@@ -223,6 +247,9 @@ private:
     void add(CellId, Pair);
     void addNoDuplicateCheck(CellId, Pair);
     void addNoDuplicateCheckUsingHeap(CellId, Pair);
+
+    // Make sure the pairs stored for a cell are organized as a heap.
+    void makeHeap(CellId);
 };
 
 
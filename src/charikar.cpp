@@ -0,0 +1,172 @@
+// Radix sort of permuted signatures for the Charikar algorithm.
+// See charikar.hpp for more information.
+
+#include "charikar.hpp"
+#include "parallelFor.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+
+
+
+void Charikar::PermutationData::computeCellPositions(size_t threadCount)
+{
+    const size_t cellCount = cellIds.size();
+    CZI_ASSERT(cellPositions.size() == cellCount);
+    if(cellCount < parallelSortMinCellCount) {
+        threadCount = 1;
+    }
+    const size_t batchSize = 1 << 16;
+    parallelFor(cellCount, batchSize, threadCount,
+        [&](size_t threadId, size_t begin, size_t end)
+        {
+            for(size_t i=begin; i!=end; i++) {
+                cellPositions[cellIds[i]] = i;
+            }
+        });
+}
+
+
+
+void Charikar::PermutationData::sortSignatures(SortData& data, size_t threadCount)
+{
+    const size_t cellCount = cellIds.size();
+    const size_t wordCount = signatures.wordCount;
+    CZI_ASSERT(signatures.bitSetCount == cellCount);
+    CZI_ASSERT(cellPositions.size() == cellCount);
+    if(cellCount == 0) {
+        return;
+    }
+
+    // Split the keys into one chunk per thread, if there are enough cells.
+    threadCount = getThreadCount(threadCount);
+    if(cellCount < parallelSortMinCellCount) {
+        threadCount = 1;
+    }
+    const size_t chunkCount = threadCount;
+
+    // Resize the scratch vectors. This does not allocate memory
+    // if the SortData was already used for at least as many cells.
+    data.keys.resize(cellCount);
+    data.sortedKeys.resize(cellCount);
+    data.cellIds.resize(cellCount);
+    data.sortedCellIds.resize(cellCount);
+    data.histograms.resize(chunkCount * SortData::digitCount);
+
+    // Start with the cells in order of increasing CellId.
+    for(size_t i=0; i!=cellCount; i++) {
+        data.cellIds[i] = CellId(i);
+    }
+
+    // LSD radix sort: process the words beginning with the least significant one,
+    // which is the last word of each signature.
+    // Each pass is stable, so the cells end up sorted
+    // by signature, then by CellId.
+    const size_t batchSize = 1 << 16;
+    for(size_t w=wordCount; w!=0; w--) {
+        const size_t wordIndex = w - 1;
+
+        // Gather this word of each signature, in the current order of the cells.
+        parallelFor(cellCount, batchSize, threadCount,
+            [&](size_t threadId, size_t begin, size_t end)
+            {
+                const uint64_t* signatureData = signatures.data.data();
+                for(size_t i=begin; i!=end; i++) {
+                    data.keys[i] = signatureData[data.cellIds[i]*wordCount + wordIndex];
+                }
+            });
+
+        // Sort on each digit of this word.
+        for(size_t shift=0; shift<64; shift+=SortData::digitBitCount) {
+            data.sortPass(shift, chunkCount, threadCount);
+        }
+    }
+
+    // Store the signatures in sorted order.
+    if(wordCount == 1) {
+        // The keys are the sorted signatures.
+        signatures.data.swap(data.keys);
+    } else {
+        data.signatureData.resize(cellCount * wordCount);
+        parallelFor(cellCount, batchSize, threadCount,
+            [&](size_t threadId, size_t begin, size_t end)
+            {
+                for(size_t i=begin; i!=end; i++) {
+                    const uint64_t* source = signatures.data.data() + data.cellIds[i]*wordCount;
+                    copy(source, source+wordCount, data.signatureData.begin() + i*wordCount);
+                }
+            });
+        signatures.data.swap(data.signatureData);
+    }
+    cellIds.swap(data.cellIds);
+    computeCellPositions(threadCount);
+}
+
+
+
+bool Charikar::SortData::sortPass(size_t shift, size_t chunkCount, size_t threadCount)
+{
+    const size_t cellCount = keys.size();
+    const size_t chunkSize = (cellCount - 1) / chunkCount + 1;
+
+    // Compute the digit histogram of each chunk.
+    fill(histograms.begin(), histograms.end(), 0);
+    parallelFor(chunkCount, 1, threadCount,
+        [&](size_t threadId, size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t chunk=chunkBegin; chunk!=chunkEnd; chunk++) {
+                size_t* histogram = histograms.data() + chunk*digitCount;
+                const size_t begin = min(chunk*chunkSize, cellCount);
+                const size_t end = min(begin+chunkSize, cellCount);
+                for(size_t i=begin; i!=end; i++) {
+                    ++histogram[(keys[i] >> shift) & (digitCount-1)];
+                }
+            }
+        });
+
+    // If all keys have the same digit, this pass would not change anything.
+    for(size_t digit=0; digit!=digitCount; digit++) {
+        size_t count = 0;
+        for(size_t chunk=0; chunk!=chunkCount; chunk++) {
+            count += histograms[chunk*digitCount + digit];
+        }
+        if(count == cellCount) {
+            return false;
+        }
+        if(count != 0) {
+            break;
+        }
+    }
+
+    // Convert the histograms to starting positions for each digit and chunk.
+    // For a given digit, earlier chunks go first, which keeps the sort stable.
+    size_t position = 0;
+    for(size_t digit=0; digit!=digitCount; digit++) {
+        for(size_t chunk=0; chunk!=chunkCount; chunk++) {
+            size_t& h = histograms[chunk*digitCount + digit];
+            const size_t count = h;
+            h = position;
+            position += count;
+        }
+    }
+    CZI_ASSERT(position == cellCount);
+
+    // Scatter the keys and cell ids to their new positions.
+    parallelFor(chunkCount, 1, threadCount,
+        [&](size_t threadId, size_t chunkBegin, size_t chunkEnd)
+        {
+            for(size_t chunk=chunkBegin; chunk!=chunkEnd; chunk++) {
+                size_t* positions = histograms.data() + chunk*digitCount;
+                const size_t begin = min(chunk*chunkSize, cellCount);
+                const size_t end = min(begin+chunkSize, cellCount);
+                for(size_t i=begin; i!=end; i++) {
+                    const uint64_t key = keys[i];
+                    const size_t j = positions[(key >> shift) & (digitCount-1)]++;
+                    sortedKeys[j] = key;
+                    sortedCellIds[j] = cellIds[i];
+                }
+            }
+        });
+    keys.swap(sortedKeys);
+    cellIds.swap(sortedCellIds);
+    return true;
+}
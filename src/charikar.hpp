@@ -14,7 +14,8 @@
 #include "Ids.hpp"
 
 #include "algorithm.hpp"
-#include <limits>
+#include "cstddef.hpp"
+#include "cstdint.hpp"
 #include "vector.hpp"
 
 namespace ChanZuckerberg {
@@ -22,6 +23,7 @@ namespace ChanZuckerberg {
         namespace Charikar {
             class PermutationData;
             class Pointer;
+            class SortData;
         }
     }
 }
@@ -52,18 +54,62 @@ public:
 
     // Store the position in the signatures and cellIds vectors
     // corresponding to each CellId.
+    // Since cellIds is a permutation of the cell ids,
+    // each entry is written exactly once, and the work can be split
+    // between threads for large cell counts.
     vector<size_t> cellPositions;
-    void computeCellPositions()
-    {
-        const CellId cellCount = CellId(cellIds.size());
-        CZI_ASSERT(cellPositions.size() == cellCount);
-        fill(cellPositions.begin(), cellPositions.end(),
-            std::numeric_limits<CellId>::max());
-        for(size_t i=0; i!=cellCount; i++) {
-            const CellId cellId = cellIds[i];
-            cellPositions[cellId] = i;
-        }
-    }
+    void computeCellPositions(size_t threadCount = 1);
+
+    // Sort the signatures in lexicographical order, using an LSD radix sort
+    // on the 64-bit words of the signatures, and compute cellPositions.
+    // On entry, the signatures must be stored in order of increasing CellId
+    // (signatures[cellId] is the permuted signature of cellId).
+    // On exit, signatures and cellIds are in sorted order.
+    // Cells with identical signatures remain in order of increasing CellId,
+    // so the result is the same as for a comparison sort of
+    // pairs (signature, CellId).
+    // The SortData can be reused for any number of calls,
+    // and after the first call no memory is allocated
+    // as long as the number of cells does not increase.
+    // Large cell counts are sorted using threadCount threads.
+    void sortSignatures(SortData&, size_t threadCount = 1);
+
+    // Cell counts below this are always sorted using one thread.
+    static const size_t parallelSortMinCellCount = 1 << 18;
+};
+
+
+
+// Scratch storage used by PermutationData::sortSignatures.
+// Each thread must use its own SortData.
+class ChanZuckerberg::ExpressionMatrix2::Charikar::SortData {
+private:
+    friend class PermutationData;
+
+    // The sort works on 8-bit digits, so each 64-bit word
+    // of the signatures requires up to 8 passes.
+    static const size_t digitBitCount = 8;
+    static const size_t digitCount = 1 << digitBitCount;
+
+    // The keys being sorted (one word of each signature)
+    // and the corresponding cell ids, in their current order,
+    // with second buffers used as the destination of each pass.
+    vector<uint64_t> keys;
+    vector<uint64_t> sortedKeys;
+    vector<CellId> cellIds;
+    vector<CellId> sortedCellIds;
+
+    // Signatures in sorted order, when using more than one word per signature.
+    vector<uint64_t> signatureData;
+
+    // The digit histogram of each chunk of the keys.
+    // Each chunk is processed by one thread.
+    vector<size_t> histograms;
+
+    // Do one radix sort pass on the digit starting at the given bit.
+    // Return false if the pass was skipped because all keys
+    // have the same digit.
+    bool sortPass(size_t shift, size_t chunkCount, size_t threadCount);
 };
 
 
@@ -0,0 +1,227 @@
+// Low level SIMD kernels for dense expression vectors.
+
+#include "denseKernels.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace DenseKernels;
+
+#include <immintrin.h>
+
+
+
+// Sum the four elements of an SSE register.
+// The order of the additions is always the same.
+static inline float horizontalSum(__m128 a)
+{
+    const __m128 b = _mm_add_ps(a, _mm_movehl_ps(a, a));
+    const __m128 c = _mm_add_ss(b, _mm_shuffle_ps(b, b, 1));
+    return _mm_cvtss_f32(c);
+}
+
+
+
+// Compute the scalar products of n0 vectors x[i] with n1 vectors y[j],
+// restricted to positions in [begin, end), for n0<=4 and n1<=2,
+// and add them to r[i*rowStride+j].
+// The template arguments are the number of vectors,
+// so the compiler can keep all accumulators in registers.
+// The positions beyond the last multiple of 4 are processed one at a time.
+template<int n0, int n1> static void accumulateTile(
+    const float* const* x,
+    const float* const* y,
+    size_t begin,
+    size_t end,
+    float* r,
+    size_t rowStride)
+{
+    __m128 accumulators[n0][n1];
+    for(int i=0; i<n0; i++) {
+        for(int j=0; j<n1; j++) {
+            accumulators[i][j] = _mm_setzero_ps();
+        }
+    }
+
+    const size_t vectorEnd = begin + ((end - begin) & ~size_t(3));
+    for(size_t k=begin; k!=vectorEnd; k+=4) {
+        __m128 yk[n1];
+        for(int j=0; j<n1; j++) {
+            yk[j] = _mm_loadu_ps(y[j] + k);
+        }
+        for(int i=0; i<n0; i++) {
+            const __m128 xk = _mm_loadu_ps(x[i] + k);
+            for(int j=0; j<n1; j++) {
+                accumulators[i][j] = _mm_add_ps(accumulators[i][j], _mm_mul_ps(xk, yk[j]));
+            }
+        }
+    }
+
+    for(int i=0; i<n0; i++) {
+        for(int j=0; j<n1; j++) {
+            float sum = horizontalSum(accumulators[i][j]);
+            for(size_t k=vectorEnd; k!=end; k++) {
+                sum += x[i][k] * y[j][k];
+            }
+            r[i*rowStride + j] += sum;
+        }
+    }
+}
+
+
+
+// AVX2 version of accumulateTile, for n0<=4 vectors x[i] and 2*n1Pairs<=4 vectors y[j].
+// Each AVX2 register holds the accumulators for x[i] with y[j] in its low half
+// and for x[i] with y[j+1] in its high half, and each half performs exactly
+// the same operations as the corresponding SSE accumulator in accumulateTile.
+// As a result, the AVX2 and SSE versions return identical results,
+// but the AVX2 version does half as many multiplications and additions,
+// so larger tiles fit in the 16 available registers.
+// The file is not compiled with FMA enabled, so the multiplications
+// and additions are not fused, which would change the results.
+template<int n0, int n1Pairs> __attribute__((target("avx2"))) static void accumulateTileAvx2(
+    const float* const* x,
+    const float* const* y,
+    size_t begin,
+    size_t end,
+    float* r,
+    size_t rowStride)
+{
+    __m256 accumulators[n0][n1Pairs];
+    for(int i=0; i<n0; i++) {
+        for(int j=0; j<n1Pairs; j++) {
+            accumulators[i][j] = _mm256_setzero_ps();
+        }
+    }
+
+    const size_t vectorEnd = begin + ((end - begin) & ~size_t(3));
+    for(size_t k=begin; k!=vectorEnd; k+=4) {
+        __m256 yk[n1Pairs];
+        for(int j=0; j<n1Pairs; j++) {
+            yk[j] = _mm256_insertf128_ps(
+                _mm256_castps128_ps256(_mm_loadu_ps(y[2*j] + k)), _mm_loadu_ps(y[2*j+1] + k), 1);
+        }
+        for(int i=0; i<n0; i++) {
+            const __m128 xk = _mm_loadu_ps(x[i] + k);
+            const __m256 xkk = _mm256_insertf128_ps(_mm256_castps128_ps256(xk), xk, 1);
+            for(int j=0; j<n1Pairs; j++) {
+                accumulators[i][j] = _mm256_add_ps(accumulators[i][j], _mm256_mul_ps(xkk, yk[j]));
+            }
+        }
+    }
+
+    for(int i=0; i<n0; i++) {
+        for(int j=0; j<2*n1Pairs; j++) {
+            const __m256& a = accumulators[i][j/2];
+            float sum = horizontalSum((j%2)==0 ? _mm256_castps256_ps128(a) : _mm256_extractf128_ps(a, 1));
+            for(size_t k=vectorEnd; k!=end; k++) {
+                sum += x[i][k] * y[j][k];
+            }
+            r[i*rowStride + j] += sum;
+        }
+    }
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::DenseKernels::accumulateScalarProductsSse(
+    const float* const* x,
+    size_t n0,
+    const float* const* y,
+    size_t n1,
+    size_t begin,
+    size_t end,
+    float* r,
+    size_t rowStride)
+{
+    size_t i = 0;
+    for(; i+4<=n0; i+=4) {
+        size_t j = 0;
+        for(; j+2<=n1; j+=2) {
+            accumulateTile<4, 2>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+        }
+        if(j < n1) {
+            accumulateTile<4, 1>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+        }
+    }
+    for(; i<n0; i++) {
+        size_t j = 0;
+        for(; j+2<=n1; j+=2) {
+            accumulateTile<1, 2>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+        }
+        if(j < n1) {
+            accumulateTile<1, 1>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+        }
+    }
+}
+
+
+
+// AVX2 version, using tiles of 4x4 vectors.
+__attribute__((target("avx2")))
+void ChanZuckerberg::ExpressionMatrix2::DenseKernels::accumulateScalarProductsAvx2(
+    const float* const* x,
+    size_t n0,
+    const float* const* y,
+    size_t n1,
+    size_t begin,
+    size_t end,
+    float* r,
+    size_t rowStride)
+{
+    size_t i = 0;
+    for(; i+4<=n0; i+=4) {
+        size_t j = 0;
+        for(; j+4<=n1; j+=4) {
+            accumulateTileAvx2<4, 2>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+        }
+        if(j+2 <= n1) {
+            accumulateTileAvx2<4, 1>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+            j += 2;
+        }
+        if(j < n1) {
+            accumulateTile<4, 1>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+        }
+    }
+    for(; i<n0; i++) {
+        size_t j = 0;
+        for(; j+4<=n1; j+=4) {
+            accumulateTileAvx2<1, 2>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+        }
+        if(j+2 <= n1) {
+            accumulateTileAvx2<1, 1>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+            j += 2;
+        }
+        if(j < n1) {
+            accumulateTile<1, 1>(x+i, y+j, begin, end, r + i*rowStride + j, rowStride);
+        }
+    }
+}
+
+
+
+AccumulateScalarProductsKernel DenseKernels::getAccumulateScalarProductsKernel(string& instructionSetName)
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        instructionSetName = "AVX2";
+        return accumulateScalarProductsAvx2;
+    }
+    instructionSetName = "SSE4.2";
+    return accumulateScalarProductsSse;
+}
+
+
+
+void ChanZuckerberg::ExpressionMatrix2::DenseKernels::accumulateScalarProducts(
+    const float* const* x,
+    size_t n0,
+    const float* const* y,
+    size_t n1,
+    size_t begin,
+    size_t end,
+    float* r,
+    size_t rowStride)
+{
+    static string instructionSetName;
+    static const AccumulateScalarProductsKernel kernel = getAccumulateScalarProductsKernel(instructionSetName);
+    kernel(x, n0, y, n1, begin, end, r, rowStride);
+}
@@ -0,0 +1,61 @@
+// Low level SIMD kernels for dense expression vectors.
+
+#ifndef CZI_EXPRESSION_MATRIX2_DENSE_KERNELS_HPP
+#define CZI_EXPRESSION_MATRIX2_DENSE_KERNELS_HPP
+
+#include "cstddef.hpp"
+#include "string.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace DenseKernels {
+
+            // Compute the scalar products of each of the n0 vectors x[i]
+            // with each of the n1 vectors y[j], restricted to positions
+            // in [begin, end), and add them to r[i*rowStride+j].
+            // The vectors are processed in register tiles,
+            // so each element loaded from memory is used for several products.
+            // The result does not depend on how the vectors are grouped
+            // when calling this function, but it does depend on how
+            // the range of positions is split into multiple calls.
+            // All kernels return identical results.
+            typedef void (*AccumulateScalarProductsKernel)(
+                const float* const* x,
+                size_t n0,
+                const float* const* y,
+                size_t n1,
+                size_t begin,
+                size_t end,
+                float* r,
+                size_t rowStride);
+
+            // Return the kernel for the best instruction set
+            // supported by the processor we are running on
+            // (AVX2 or SSE4.2), and store its name.
+            AccumulateScalarProductsKernel getAccumulateScalarProductsKernel(string& instructionSetName);
+
+            // Compute the scalar products using the kernel returned by
+            // getAccumulateScalarProductsKernel, which is selected on the first call.
+            void accumulateScalarProducts(
+                const float* const* x,
+                size_t n0,
+                const float* const* y,
+                size_t n1,
+                size_t begin,
+                size_t end,
+                float* r,
+                size_t rowStride);
+
+            // The individual kernels.
+            // The SSE kernel uses tiles of 4x2 vectors, the AVX2 kernel tiles of 4x4 vectors.
+            void accumulateScalarProductsSse(
+                const float* const*, size_t, const float* const*, size_t,
+                size_t, size_t, float*, size_t);
+            void accumulateScalarProductsAvx2(
+                const float* const*, size_t, const float* const*, size_t,
+                size_t, size_t, float*, size_t);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,329 @@
+// Low level SIMD kernels used by class Lsh.
+
+// This file is compiled with -ffp-contract=off (see CMakeLists.txt),
+// which prevents the compiler from fusing multiplies and adds
+// in the AVX-512 kernel. This guarantees that all kernels
+// return identical signatures.
+
+#include "lshKernels.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace LshKernels;
+
+#include <immintrin.h>
+
+
+
+// SSE4.2 version. This is always available
+// because the build requires -msse4.2.
+void LshKernels::computeSignatureSse(
+    const float* lshVectors,
+    size_t lshStride,
+    const float* lshVectorsSums,
+    float negativeMean,
+    const GeneId* geneIds,
+    const float* counts,
+    size_t nonZeroCount,
+    uint64_t* signature,
+    float* scalarProducts)
+{
+    const size_t n = 4;                         // Floats per register.
+    const size_t registerCount = blockSize / n;
+    const __m128 m = _mm_set1_ps(negativeMean);
+    const __m128 zero = _mm_setzero_ps();
+
+    // Loop over blocks of blockSize hyperplanes.
+    // Each block generates one signature word.
+    for(size_t blockBegin=0; blockBegin<lshStride; blockBegin+=blockSize) {
+
+        // Initialize the scalar products to -mean*sum(U).
+        __m128 s[registerCount];
+        for(size_t j=0; j<registerCount; j++) {
+            s[j] = _mm_mul_ps(m, _mm_load_ps(lshVectorsSums + blockBegin + j*n));
+        }
+
+        // Add the contributions of the non-zero expression counts.
+        for(size_t i=0; i<nonZeroCount; i++) {
+            const float* v = lshVectors + size_t(geneIds[i])*lshStride + blockBegin;
+            const __m128 count = _mm_set1_ps(counts[i]);
+            for(size_t j=0; j<registerCount; j++) {
+                s[j] = _mm_add_ps(s[j], _mm_mul_ps(count, _mm_load_ps(v + j*n)));
+            }
+        }
+
+        // Store the scalar products, if requested.
+        if(scalarProducts) {
+            for(size_t j=0; j<registerCount; j++) {
+                _mm_storeu_ps(scalarProducts + blockBegin + j*n, s[j]);
+            }
+        }
+
+        // Pack the signs.
+        uint64_t mask = 0;
+        for(size_t j=0; j<registerCount; j++) {
+            mask |= uint64_t(_mm_movemask_ps(_mm_cmpgt_ps(s[j], zero))) << (j*n);
+        }
+        *signature++ = reverseBits(mask);
+    }
+}
+
+
+
+// AVX2 version.
+__attribute__((target("avx2")))
+void LshKernels::computeSignatureAvx2(
+    const float* lshVectors,
+    size_t lshStride,
+    const float* lshVectorsSums,
+    float negativeMean,
+    const GeneId* geneIds,
+    const float* counts,
+    size_t nonZeroCount,
+    uint64_t* signature,
+    float* scalarProducts)
+{
+    const size_t n = 8;                         // Floats per register.
+    const size_t registerCount = blockSize / n;
+    const __m256 m = _mm256_set1_ps(negativeMean);
+    const __m256 zero = _mm256_setzero_ps();
+
+    for(size_t blockBegin=0; blockBegin<lshStride; blockBegin+=blockSize) {
+
+        __m256 s[registerCount];
+        for(size_t j=0; j<registerCount; j++) {
+            s[j] = _mm256_mul_ps(m, _mm256_load_ps(lshVectorsSums + blockBegin + j*n));
+        }
+
+        for(size_t i=0; i<nonZeroCount; i++) {
+            const float* v = lshVectors + size_t(geneIds[i])*lshStride + blockBegin;
+            const __m256 count = _mm256_set1_ps(counts[i]);
+            for(size_t j=0; j<registerCount; j++) {
+                s[j] = _mm256_add_ps(s[j], _mm256_mul_ps(count, _mm256_load_ps(v + j*n)));
+            }
+        }
+
+        if(scalarProducts) {
+            for(size_t j=0; j<registerCount; j++) {
+                _mm256_storeu_ps(scalarProducts + blockBegin + j*n, s[j]);
+            }
+        }
+
+        uint64_t mask = 0;
+        for(size_t j=0; j<registerCount; j++) {
+            mask |= uint64_t(_mm256_movemask_ps(_mm256_cmp_ps(s[j], zero, _CMP_GT_OQ))) << (j*n);
+        }
+        *signature++ = reverseBits(mask);
+    }
+}
+
+
+
+// AVX-512 version.
+__attribute__((target("avx512f")))
+void LshKernels::computeSignatureAvx512(
+    const float* lshVectors,
+    size_t lshStride,
+    const float* lshVectorsSums,
+    float negativeMean,
+    const GeneId* geneIds,
+    const float* counts,
+    size_t nonZeroCount,
+    uint64_t* signature,
+    float* scalarProducts)
+{
+    const size_t n = 16;                        // Floats per register.
+    const size_t registerCount = blockSize / n;
+    const __m512 m = _mm512_set1_ps(negativeMean);
+    const __m512 zero = _mm512_setzero_ps();
+
+    for(size_t blockBegin=0; blockBegin<lshStride; blockBegin+=blockSize) {
+
+        __m512 s[registerCount];
+        for(size_t j=0; j<registerCount; j++) {
+            s[j] = _mm512_mul_ps(m, _mm512_load_ps(lshVectorsSums + blockBegin + j*n));
+        }
+
+        for(size_t i=0; i<nonZeroCount; i++) {
+            const float* v = lshVectors + size_t(geneIds[i])*lshStride + blockBegin;
+            const __m512 count = _mm512_set1_ps(counts[i]);
+            for(size_t j=0; j<registerCount; j++) {
+                s[j] = _mm512_add_ps(s[j], _mm512_mul_ps(count, _mm512_load_ps(v + j*n)));
+            }
+        }
+
+        if(scalarProducts) {
+            for(size_t j=0; j<registerCount; j++) {
+                _mm512_storeu_ps(scalarProducts + blockBegin + j*n, s[j]);
+            }
+        }
+
+        uint64_t mask = 0;
+        for(size_t j=0; j<registerCount; j++) {
+            mask |= uint64_t(_mm512_cmp_ps_mask(s[j], zero, _CMP_GT_OQ)) << (j*n);
+        }
+        *signature++ = reverseBits(mask);
+    }
+}
+
+
+
+SignatureKernel LshKernels::getSignatureKernel(string& instructionSetName)
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        instructionSetName = "AVX-512";
+        return computeSignatureAvx512;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        instructionSetName = "AVX2";
+        return computeSignatureAvx2;
+    }
+    instructionSetName = "SSE4.2";
+    return computeSignatureSse;
+}
+
+
+
+// Scalar version of the mismatch count kernel, using the popcount instruction
+// (always available because the build requires -msse4.2).
+void LshKernels::computeMismatchCountsPopcnt(
+    const uint64_t* signatures,
+    size_t wordCount,
+    CellId begin0,
+    CellId end0,
+    const CellId* cellIds1,
+    CellId begin1,
+    size_t n1,
+    uint32_t* mismatchCounts)
+{
+    for(CellId cellId0=begin0; cellId0!=end0; ++cellId0) {
+        const uint64_t* s0 = signatures + size_t(cellId0)*wordCount;
+        for(size_t j=0; j<n1; j++) {
+            const CellId cellId1 = cellIds1 ? cellIds1[j] : CellId(begin1 + j);
+            const uint64_t* s1 = signatures + size_t(cellId1)*wordCount;
+            uint64_t mismatchCount = 0;
+            for(size_t i=0; i<wordCount; i++) {
+                mismatchCount += __builtin_popcountll(s0[i] ^ s1[i]);
+            }
+            *mismatchCounts++ = uint32_t(mismatchCount);
+        }
+    }
+}
+
+
+
+// AVX2 version. AVX2 has no popcount instruction, so we use
+// the nibble lookup table method of W. Mula, N. Kurz, D. Lemire,
+// "Faster Population Counts Using AVX2 Instructions", 2016.
+// For the signature lengths we use (typically 16 words), the
+// Harley-Seal carry-save adders described in the same paper
+// don't have enough words to amortize their setup.
+__attribute__((target("avx2")))
+void LshKernels::computeMismatchCountsAvx2(
+    const uint64_t* signatures,
+    size_t wordCount,
+    CellId begin0,
+    CellId end0,
+    const CellId* cellIds1,
+    CellId begin1,
+    size_t n1,
+    uint32_t* mismatchCounts)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    const size_t vectorWordCount = wordCount & ~size_t(3);
+
+    for(CellId cellId0=begin0; cellId0!=end0; ++cellId0) {
+        const uint64_t* s0 = signatures + size_t(cellId0)*wordCount;
+        for(size_t j=0; j<n1; j++) {
+            const CellId cellId1 = cellIds1 ? cellIds1[j] : CellId(begin1 + j);
+            const uint64_t* s1 = signatures + size_t(cellId1)*wordCount;
+            __m256i sum = zero;
+            for(size_t i=0; i<vectorWordCount; i+=4) {
+                const __m256i x = _mm256_xor_si256(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s0 + i)),
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s1 + i)));
+                const __m256i lo = _mm256_and_si256(x, lowMask);
+                const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), lowMask);
+                const __m256i byteCounts = _mm256_add_epi8(
+                    _mm256_shuffle_epi8(lookup, lo),
+                    _mm256_shuffle_epi8(lookup, hi));
+                sum = _mm256_add_epi64(sum, _mm256_sad_epu8(byteCounts, zero));
+            }
+            uint64_t mismatchCount =
+                uint64_t(_mm256_extract_epi64(sum, 0)) + uint64_t(_mm256_extract_epi64(sum, 1)) +
+                uint64_t(_mm256_extract_epi64(sum, 2)) + uint64_t(_mm256_extract_epi64(sum, 3));
+            for(size_t i=vectorWordCount; i<wordCount; i++) {
+                mismatchCount += __builtin_popcountll(s0[i] ^ s1[i]);
+            }
+            *mismatchCounts++ = uint32_t(mismatchCount);
+        }
+    }
+}
+
+
+
+// AVX-512 version, using the VPOPCNTQ instruction.
+// The last partial group of 8 words is handled with a masked load.
+__attribute__((target("avx512f,avx512vpopcntdq")))
+void LshKernels::computeMismatchCountsAvx512(
+    const uint64_t* signatures,
+    size_t wordCount,
+    CellId begin0,
+    CellId end0,
+    const CellId* cellIds1,
+    CellId begin1,
+    size_t n1,
+    uint32_t* mismatchCounts)
+{
+    const size_t vectorWordCount = wordCount & ~size_t(7);
+    const __mmask8 tailMask = __mmask8((1U << (wordCount - vectorWordCount)) - 1U);
+
+    for(CellId cellId0=begin0; cellId0!=end0; ++cellId0) {
+        const uint64_t* s0 = signatures + size_t(cellId0)*wordCount;
+        for(size_t j=0; j<n1; j++) {
+            const CellId cellId1 = cellIds1 ? cellIds1[j] : CellId(begin1 + j);
+            const uint64_t* s1 = signatures + size_t(cellId1)*wordCount;
+            __m512i sum = _mm512_setzero_si512();
+            for(size_t i=0; i<vectorWordCount; i+=8) {
+                const __m512i x = _mm512_xor_si512(
+                    _mm512_loadu_si512(s0 + i),
+                    _mm512_loadu_si512(s1 + i));
+                sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+            }
+            if(tailMask) {
+                const __m512i x = _mm512_xor_si512(
+                    _mm512_maskz_loadu_epi64(tailMask, s0 + vectorWordCount),
+                    _mm512_maskz_loadu_epi64(tailMask, s1 + vectorWordCount));
+                sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+            }
+            // Horizontal sum (_mm512_reduce_add_epi64 triggers
+            // spurious gcc warnings).
+            uint64_t lanes[8];
+            _mm512_storeu_si512(lanes, sum);
+            *mismatchCounts++ = uint32_t(
+                lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+                lanes[4] + lanes[5] + lanes[6] + lanes[7]);
+        }
+    }
+}
+
+
+
+MismatchCountKernel LshKernels::getMismatchCountKernel(string& instructionSetName)
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512vpopcntdq")) {
+        instructionSetName = "AVX-512 VPOPCNTQ";
+        return computeMismatchCountsAvx512;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        instructionSetName = "AVX2";
+        return computeMismatchCountsAvx2;
+    }
+    instructionSetName = "POPCNT";
+    return computeMismatchCountsPopcnt;
+}
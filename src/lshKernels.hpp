@@ -0,0 +1,117 @@
+// Low level SIMD kernels used by class Lsh.
+
+#ifndef CZI_EXPRESSION_MATRIX2_LSH_KERNELS_HPP
+#define CZI_EXPRESSION_MATRIX2_LSH_KERNELS_HPP
+
+#include "Ids.hpp"
+
+#include "cstddef.hpp"
+#include "cstdint.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace LshKernels {
+
+            // The number of LSH hyperplanes processed together by the signature kernels.
+            // This is the number of bits in a signature word.
+            // The stride of the hyperplane matrix must be a multiple of this.
+            const size_t blockSize = 64;
+
+            // Kernel to compute the LSH signature of a single cell.
+            // The hyperplane matrix is stored contiguously and indexed by
+            // [localGeneId*lshStride + lshVectorId]. It must be 64-byte aligned,
+            // and lshStride must be a multiple of blockSize.
+            // Padding components beyond the number of hyperplanes must be zero,
+            // so the corresponding signature bits are always zero.
+            // Signature bit i is set if the scalar product of the shifted cell
+            // expression vector with hyperplane i is positive.
+            // Bits are stored most significant bit first,
+            // consistently with class BitSetPointer.
+            // If scalarProducts is not null, the lshStride scalar products
+            // are also stored there (this is used to compute the margins
+            // used by multi-probe LSH, see Lsh.hpp).
+            // All kernels use the same order of operations without fused
+            // multiply-add, so they all return identical signatures.
+            typedef void (*SignatureKernel)(
+                const float* lshVectors,                // The hyperplane matrix.
+                size_t lshStride,                       // The row stride of the hyperplane matrix.
+                const float* lshVectorsSums,            // The sum of the components of each hyperplane (64-byte aligned).
+                float negativeMean,                     // Minus the mean of the cell expression vector.
+                const GeneId* geneIds,                  // The non-zero expression counts for the cell,
+                const float* counts,                    // stored as separate arrays of GeneIds and counts
+                size_t nonZeroCount,                    // (see MemoryMapped::SplitVectorOfVectors).
+                uint64_t* signature,                    // The lshStride/blockSize signature words to be filled.
+                float* scalarProducts                   // The lshStride scalar products to be filled (can be null).
+                );
+
+            // Return the signature kernel for the best instruction set
+            // supported by the processor we are running on
+            // (AVX-512, AVX2, or SSE4.2), and store its name.
+            SignatureKernel getSignatureKernel(string& instructionSetName);
+
+            // The individual kernels.
+            void computeSignatureSse(const float*, size_t, const float*, float,
+                const GeneId*, const float*, size_t, uint64_t*, float*);
+            void computeSignatureAvx2(const float*, size_t, const float*, float,
+                const GeneId*, const float*, size_t, uint64_t*, float*);
+            void computeSignatureAvx512(const float*, size_t, const float*, float,
+                const GeneId*, const float*, size_t, uint64_t*, float*);
+
+
+
+
+            // Kernel to compute a tile of mismatch counts between LSH signatures.
+            // The signatures of all cells are stored contiguously,
+            // wordCount 64-bit words per cell.
+            // The first set of cells is the contiguous range [begin0, end0).
+            // The second set of cells consists of n1 cells,
+            // which are cellIds1[0] through cellIds1[n1-1] if cellIds1 is not null,
+            // and begin1 through begin1+n1-1 otherwise.
+            // On return, mismatchCounts[i*n1 + j] contains the number of
+            // mismatching bits between the signatures of cell begin0+i
+            // and cell j of the second set.
+            // Callers should choose tiles small enough that the signatures
+            // of both sets of cells stay in cache (for example 64 x 1024 cells).
+            typedef void (*MismatchCountKernel)(
+                const uint64_t* signatures,             // The signatures of all cells.
+                size_t wordCount,                       // The number of words in each signature.
+                CellId begin0,                          // The first set of cells.
+                CellId end0,
+                const CellId* cellIds1,                 // The second set of cells (can be null).
+                CellId begin1,
+                size_t n1,
+                uint32_t* mismatchCounts                // The (end0-begin0)*n1 mismatch counts to be filled.
+                );
+
+            // Return the mismatch count kernel for the best instruction set
+            // supported by the processor we are running on
+            // (AVX-512 with VPOPCNTQ, AVX2, or the scalar popcount instruction),
+            // and store its name.
+            MismatchCountKernel getMismatchCountKernel(string& instructionSetName);
+
+            // The individual kernels.
+            void computeMismatchCountsPopcnt(const uint64_t*, size_t, CellId, CellId,
+                const CellId*, CellId, size_t, uint32_t*);
+            void computeMismatchCountsAvx2(const uint64_t*, size_t, CellId, CellId,
+                const CellId*, CellId, size_t, uint32_t*);
+            void computeMismatchCountsAvx512(const uint64_t*, size_t, CellId, CellId,
+                const CellId*, CellId, size_t, uint32_t*);
+
+            // Reverse the order of the bits of a 64-bit word.
+            // Used to convert a SIMD comparison mask (first lane in the least
+            // significant bit) to signature bit order (first bit in the most
+            // significant bit).
+            inline uint64_t reverseBits(uint64_t x)
+            {
+                x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+                x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+                x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+                return __builtin_bswap64(x);
+            }
+        }
+    }
+}
+
+#endif
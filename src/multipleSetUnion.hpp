@@ -12,18 +12,21 @@
 
 namespace ChanZuckerberg {
     namespace ExpressionMatrix2 {
-        template<class Container> inline void multipleSetUnion(
-            const vector<const Container*>& inputSets,
+        // The input sets can be of a different container type than the output set
+        // (for example, MemoryAsContainer), as long as they have
+        // the same value type, possibly const qualified.
+        template<class InputContainer, class Container> inline void multipleSetUnion(
+            const vector<const InputContainer*>& inputSets,
             Container& outputSet);
 
-        template<class Container> class MultipleSetUnionHelper {
+        template<class InputContainer, class Container> class MultipleSetUnionHelper {
         public:
             size_t containerId;
-            typename Container::const_iterator it;
+            typename InputContainer::const_iterator it;
             typename Container::value_type value;
             MultipleSetUnionHelper(
                 size_t containerId,
-                typename Container::const_iterator it,
+                typename InputContainer::const_iterator it,
                 typename Container::value_type value
                 ) :
                 containerId(containerId), it(it), value(value)
@@ -41,31 +44,31 @@ namespace ChanZuckerberg {
 }
 
 
-template<class Container> inline void ChanZuckerberg::ExpressionMatrix2::multipleSetUnion(
-    const vector<const Container*>& inputSets,
+template<class InputContainer, class Container> inline void ChanZuckerberg::ExpressionMatrix2::multipleSetUnion(
+    const vector<const InputContainer*>& inputSets,
     Container& outputSet)
 {
     CZI_ASSERT(outputSet.empty());
 
     // We use a priority q in which the top element is the
     // iterator pointing to the next element to be inserted.
-    std::priority_queue< MultipleSetUnionHelper<Container> > q;
+    std::priority_queue< MultipleSetUnionHelper<InputContainer, Container> > q;
     for(size_t containerId=0; containerId<inputSets.size(); containerId++) {
-        const Container* p = inputSets[containerId];
+        const InputContainer* p = inputSets[containerId];
         CZI_ASSERT(p);
-        const Container& container = *p;
+        const InputContainer& container = *p;
         if(!container.empty()) {
-            q.push(MultipleSetUnionHelper<Container>(containerId, container.begin(), container.front()));
+            q.push(MultipleSetUnionHelper<InputContainer, Container>(containerId, container.begin(), container.front()));
         }
     }
 
     while(!q.empty()) {
-        MultipleSetUnionHelper<Container> m = q.top();
+        MultipleSetUnionHelper<InputContainer, Container> m = q.top();
         q.pop();
         if(outputSet.empty() || m.value != outputSet.back()) {
             outputSet.push_back(m.value);
         }
-        const Container& container = *(inputSets[m.containerId]);
+        const InputContainer& container = *(inputSets[m.containerId]);
         ++m.it;
         if(m.it != container.end()) {
             m.value = *(m.it);
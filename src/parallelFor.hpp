@@ -0,0 +1,126 @@
+#ifndef CZI_EXPRESSION_MATRIX2_PARALLEL_FOR_HPP
+#define CZI_EXPRESSION_MATRIX2_PARALLEL_FOR_HPP
+
+// Minimal functionality to run loops on multiple threads using std::thread.
+
+// Functions passed to runThreads and parallelFor must only write to
+// memory that is not touched by other threads (for example, per-thread
+// scratch storage, or slots indexed by the loop index).
+// This way results do not depend on the number of threads
+// or on how batches are assigned to threads.
+
+#include "algorithm.hpp"
+#include "cstddef.hpp"
+#include "vector.hpp"
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+
+        // Return the number of threads to use for a requested number of threads.
+        // If the requested number is zero, use the number of hardware threads.
+        inline size_t getThreadCount(size_t requestedThreadCount);
+
+        // Call a function on threadCount threads, passing it the thread id
+        // (0 through threadCount-1). If threadCount is 1 the function
+        // is called in the calling thread.
+        // If one or more threads throw, the first exception is rethrown
+        // after all threads complete.
+        template<class F> void runThreads(size_t threadCount, const F&);
+
+        // Loop over [0, n) in batches of at most batchSize, on threadCount threads.
+        // A threadCount of zero uses all hardware threads.
+        // Batches are assigned to threads dynamically, and
+        // the function is called as f(threadId, begin, end) for each batch.
+        template<class F> void parallelFor(
+            size_t n,
+            size_t batchSize,
+            size_t threadCount,
+            const F&);
+    }
+}
+
+
+
+inline size_t ChanZuckerberg::ExpressionMatrix2::getThreadCount(size_t requestedThreadCount)
+{
+    if(requestedThreadCount != 0) {
+        return requestedThreadCount;
+    }
+    const size_t hardwareThreadCount = std::thread::hardware_concurrency();
+    return hardwareThreadCount==0 ? 1 : hardwareThreadCount;
+}
+
+
+
+template<class F> void ChanZuckerberg::ExpressionMatrix2::runThreads(
+    size_t threadCount,
+    const F& f)
+{
+    if(threadCount <= 1) {
+        f(size_t(0));
+        return;
+    }
+
+    std::exception_ptr firstException;
+    std::mutex mutex;
+    vector<std::thread> threads;
+    threads.reserve(threadCount);
+    for(size_t threadId=0; threadId<threadCount; threadId++) {
+        threads.push_back(std::thread([&f, &firstException, &mutex, threadId]()
+        {
+            try {
+                f(threadId);
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(!firstException) {
+                    firstException = std::current_exception();
+                }
+            }
+        }));
+    }
+    for(std::thread& thread: threads) {
+        thread.join();
+    }
+    if(firstException) {
+        std::rethrow_exception(firstException);
+    }
+}
+
+
+
+template<class F> void ChanZuckerberg::ExpressionMatrix2::parallelFor(
+    size_t n,
+    size_t batchSize,
+    size_t threadCount,
+    const F& f)
+{
+    if(n == 0) {
+        return;
+    }
+    if(batchSize == 0) {
+        batchSize = 1;
+    }
+    const size_t batchCount = (n - 1) / batchSize + 1;
+    threadCount = min(getThreadCount(threadCount), batchCount);
+
+    std::atomic<size_t> nextBatch(0);
+    runThreads(threadCount, [&](size_t threadId)
+    {
+        while(true) {
+            const size_t batchId = nextBatch++;
+            if(batchId >= batchCount) {
+                break;
+            }
+            const size_t begin = batchId * batchSize;
+            const size_t end = min(begin + batchSize, n);
+            f(threadId, begin, end);
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,73 @@
+// Philox4x32-10 counter-based random number generator.
+// See J. K. Salmon, M. A. Moraes, R. O. Dror, D. E. Shaw,
+// "Parallel Random Numbers: As Easy as 1, 2, 3", SC11, 2011.
+
+// A counter-based generator computes the i-th random number
+// directly from the counter i and a key (the seed),
+// without any state. This allows us to regenerate any random number
+// on demand and in any order, for example on multiple threads.
+
+#ifndef CZI_EXPRESSION_MATRIX2_PHILOX_HPP
+#define CZI_EXPRESSION_MATRIX2_PHILOX_HPP
+
+#include "array.hpp"
+#include "cstdint.hpp"
+#include <cmath>
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace Philox {
+
+            using Counter = array<uint32_t, 4>;
+            using Key = array<uint32_t, 2>;
+
+            // Return the four 32-bit random words corresponding to a counter and a key.
+            inline Counter philox4x32(Counter, Key);
+
+            // Return a normally distributed random number (zero mean and unit variance)
+            // determined by a seed and two indexes.
+            inline double normal(uint32_t seed, uint32_t i, uint32_t j);
+        }
+    }
+}
+
+
+
+inline ChanZuckerberg::ExpressionMatrix2::Philox::Counter
+    ChanZuckerberg::ExpressionMatrix2::Philox::philox4x32(Counter c, Key k)
+{
+    const uint64_t m0 = 0xD2511F53ULL;
+    const uint64_t m1 = 0xCD9E8D57ULL;
+    const uint32_t w0 = 0x9E3779B9U;
+    const uint32_t w1 = 0xBB67AE85U;
+
+    for(int round=0; round<10; round++) {
+        const uint64_t p0 = m0 * c[0];
+        const uint64_t p1 = m1 * c[2];
+        const uint32_t hi0 = uint32_t(p0 >> 32);
+        const uint32_t lo0 = uint32_t(p0);
+        const uint32_t hi1 = uint32_t(p1 >> 32);
+        const uint32_t lo1 = uint32_t(p1);
+        c = Counter{{hi1 ^ c[1] ^ k[0], lo1, hi0 ^ c[3] ^ k[1], lo0}};
+        k[0] += w0;
+        k[1] += w1;
+    }
+    return c;
+}
+
+
+
+// Use the Box-Muller transform on two uniformly distributed
+// random numbers in (0,1), each constructed from 64 random bits.
+inline double ChanZuckerberg::ExpressionMatrix2::Philox::normal(
+    uint32_t seed, uint32_t i, uint32_t j)
+{
+    const Counter r = philox4x32(Counter{{i, j, 0, 0}}, Key{{seed, 0x43a9e2b1U}});
+    const double scale = 1. / 18446744073709551616.;   // 2^-64
+    const double u1 = (double((uint64_t(r[0]) << 32) | r[1]) + 0.5) * scale;
+    const double u2 = (double((uint64_t(r[2]) << 32) | r[3]) + 0.5) * scale;
+    const double twoPi = 6.283185307179586476925;
+    return std::sqrt(-2. * std::log(u1)) * std::cos(twoPi * u2);
+}
+
+#endif
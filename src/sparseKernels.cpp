@@ -0,0 +1,289 @@
+// Low level SIMD kernels for sparse expression vectors.
+
+#include "sparseKernels.hpp"
+using namespace ChanZuckerberg;
+using namespace ExpressionMatrix2;
+using namespace SparseKernels;
+
+#include <immintrin.h>
+
+// All kernels are implemented as templates on the stride (in 32-bit words)
+// between consecutive gene ids and between consecutive counts.
+// The stride is 2 for arrays of pairs (GeneId, count),
+// and 1 for separate arrays of GeneIds and counts.
+
+
+
+// Add to scalarProduct the products of the counts with matching gene ids
+// in a block of blockSize entries of each of the two vectors.
+// Bit i of masks[r] is set if gene id i of the first block
+// is equal to gene id (i+r)%blockSize of the second block.
+// Matches are processed in order of increasing gene id.
+template<int blockSize, int stride> static void accumulateMatches(
+    const int* masks,
+    const float* counts0,
+    const float* counts1,
+    double& scalarProduct)
+{
+    int matchingPositions[blockSize];
+    int allMatches = 0;
+    for(int r=0; r<blockSize; r++) {
+        int mask = masks[r];
+        allMatches |= mask;
+        while(mask) {
+            const int i = __builtin_ctz(mask);
+            matchingPositions[i] = (i + r) & (blockSize - 1);
+            mask &= mask - 1;
+        }
+    }
+    while(allMatches) {
+        const int i = __builtin_ctz(allMatches);
+        scalarProduct += counts0[i*stride] * counts1[matchingPositions[i]*stride];
+        allMatches &= allMatches - 1;
+    }
+}
+
+
+
+// Scalar merge, used for the entries left over after the last full blocks.
+template<int stride> static void accumulateMerge(
+    const GeneId* geneIds0, const float* counts0, size_t i0, size_t n0,
+    const GeneId* geneIds1, const float* counts1, size_t i1, size_t n1,
+    double& scalarProduct)
+{
+    while((i0 != n0) && (i1 != n1)) {
+        const GeneId geneId0 = geneIds0[i0*stride];
+        const GeneId geneId1 = geneIds1[i1*stride];
+        if(geneId0 < geneId1) {
+            ++i0;
+        } else if(geneId1 < geneId0) {
+            ++i1;
+        } else {
+            scalarProduct += counts0[i0*stride] * counts1[i1*stride];
+            ++i0;
+            ++i1;
+        }
+    }
+}
+
+
+
+// Load 4 consecutive gene ids.
+template<int stride> static __m128i loadGeneIdsSse(const GeneId*);
+template<> __m128i loadGeneIdsSse<1>(const GeneId* geneIds)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(geneIds));
+}
+template<> __m128i loadGeneIdsSse<2>(const GeneId* geneIds)
+{
+    const float* p = reinterpret_cast<const float*>(geneIds);
+    return _mm_castps_si128(_mm_shuffle_ps(
+        _mm_loadu_ps(p), _mm_loadu_ps(p + 4), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+
+
+// SSE4.2 version, processing blocks of 4 entries. This is always available
+// because the build requires -msse4.2.
+// The pcmpestrm string comparison instruction used by Schlegel et al.
+// only supports 8-bit and 16-bit elements, so for 32-bit gene ids
+// we use the four rotations of the second block instead.
+template<int stride> static double scalarProductSse(
+    const GeneId* geneIds0, const float* counts0, size_t n0,
+    const GeneId* geneIds1, const float* counts1, size_t n1)
+{
+    const int blockSize = 4;
+    size_t i0 = 0;
+    size_t i1 = 0;
+    double scalarProduct = 0.;
+
+    while((i0 + blockSize <= n0) && (i1 + blockSize <= n1)) {
+
+        // Gather the gene ids of the two blocks.
+        const __m128i g0 = loadGeneIdsSse<stride>(geneIds0 + i0*stride);
+        const __m128i g1 = loadGeneIdsSse<stride>(geneIds1 + i1*stride);
+
+        // Compare with all rotations of the second block.
+        int masks[blockSize];
+        masks[0] = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(g0, g1)));
+        masks[1] = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(g0,
+            _mm_shuffle_epi32(g1, _MM_SHUFFLE(0, 3, 2, 1)))));
+        masks[2] = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(g0,
+            _mm_shuffle_epi32(g1, _MM_SHUFFLE(1, 0, 3, 2)))));
+        masks[3] = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(g0,
+            _mm_shuffle_epi32(g1, _MM_SHUFFLE(2, 1, 0, 3)))));
+        if(masks[0] | masks[1] | masks[2] | masks[3]) {
+            accumulateMatches<blockSize, stride>(masks,
+                counts0 + i0*stride, counts1 + i1*stride, scalarProduct);
+        }
+
+        // Advance the block(s) with the smallest last gene id.
+        const GeneId last0 = geneIds0[(i0 + blockSize - 1)*stride];
+        const GeneId last1 = geneIds1[(i1 + blockSize - 1)*stride];
+        if(last0 <= last1) {
+            i0 += blockSize;
+        }
+        if(last1 <= last0) {
+            i1 += blockSize;
+        }
+    }
+
+    accumulateMerge<stride>(geneIds0, counts0, i0, n0, geneIds1, counts1, i1, n1, scalarProduct);
+    return scalarProduct;
+}
+
+
+
+// Load 8 consecutive gene ids.
+template<int stride> static __m256i loadGeneIdsAvx2(const GeneId*);
+template<> __attribute__((target("avx2"))) __m256i loadGeneIdsAvx2<1>(const GeneId* geneIds)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(geneIds));
+}
+template<> __attribute__((target("avx2"))) __m256i loadGeneIdsAvx2<2>(const GeneId* geneIds)
+{
+    // _mm256_shuffle_ps works within 128-bit lanes,
+    // so we have to restore the order of the gene ids.
+    const float* p = reinterpret_cast<const float*>(geneIds);
+    return _mm256_permutevar8x32_epi32(_mm256_castps_si256(_mm256_shuffle_ps(
+        _mm256_loadu_ps(p), _mm256_loadu_ps(p + 8), _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+}
+
+
+
+// AVX2 version, processing blocks of 8 entries.
+template<int stride> __attribute__((target("avx2"))) static double scalarProductAvx2(
+    const GeneId* geneIds0, const float* counts0, size_t n0,
+    const GeneId* geneIds1, const float* counts1, size_t n1)
+{
+    const int blockSize = 8;
+    size_t i0 = 0;
+    size_t i1 = 0;
+    double scalarProduct = 0.;
+
+    // The permutations that rotate a block.
+    __m256i rotations[blockSize];
+    for(int r=0; r<blockSize; r++) {
+        rotations[r] = _mm256_setr_epi32(
+            (r+0)&7, (r+1)&7, (r+2)&7, (r+3)&7, (r+4)&7, (r+5)&7, (r+6)&7, (r+7)&7);
+    }
+
+    while((i0 + blockSize <= n0) && (i1 + blockSize <= n1)) {
+
+        // Gather the gene ids of the two blocks.
+        const __m256i g0 = loadGeneIdsAvx2<stride>(geneIds0 + i0*stride);
+        const __m256i g1 = loadGeneIdsAvx2<stride>(geneIds1 + i1*stride);
+
+        // Compare with all rotations of the second block.
+        int masks[blockSize];
+        int anyMatch = 0;
+        for(int r=0; r<blockSize; r++) {
+            masks[r] = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(g0,
+                _mm256_permutevar8x32_epi32(g1, rotations[r]))));
+            anyMatch |= masks[r];
+        }
+        if(anyMatch) {
+            accumulateMatches<blockSize, stride>(masks,
+                counts0 + i0*stride, counts1 + i1*stride, scalarProduct);
+        }
+
+        // Advance the block(s) with the smallest last gene id.
+        const GeneId last0 = geneIds0[(i0 + blockSize - 1)*stride];
+        const GeneId last1 = geneIds1[(i1 + blockSize - 1)*stride];
+        if(last0 <= last1) {
+            i0 += blockSize;
+        }
+        if(last1 <= last0) {
+            i1 += blockSize;
+        }
+    }
+
+    accumulateMerge<stride>(geneIds0, counts0, i0, n0, geneIds1, counts1, i1, n1, scalarProduct);
+    return scalarProduct;
+}
+
+
+
+// Kernels for arrays of pairs (GeneId, count).
+double SparseKernels::computeScalarProductSse(
+    const pair<GeneId, float>* begin0,
+    const pair<GeneId, float>* end0,
+    const pair<GeneId, float>* begin1,
+    const pair<GeneId, float>* end1)
+{
+    return scalarProductSse<2>(
+        &begin0->first, &begin0->second, size_t(end0 - begin0),
+        &begin1->first, &begin1->second, size_t(end1 - begin1));
+}
+double SparseKernels::computeScalarProductAvx2(
+    const pair<GeneId, float>* begin0,
+    const pair<GeneId, float>* end0,
+    const pair<GeneId, float>* begin1,
+    const pair<GeneId, float>* end1)
+{
+    return scalarProductAvx2<2>(
+        &begin0->first, &begin0->second, size_t(end0 - begin0),
+        &begin1->first, &begin1->second, size_t(end1 - begin1));
+}
+
+
+
+// Kernels for separate arrays of GeneIds and counts.
+double SparseKernels::computeSplitScalarProductSse(
+    const GeneId* geneIds0, const float* counts0, size_t n0,
+    const GeneId* geneIds1, const float* counts1, size_t n1)
+{
+    return scalarProductSse<1>(geneIds0, counts0, n0, geneIds1, counts1, n1);
+}
+double SparseKernels::computeSplitScalarProductAvx2(
+    const GeneId* geneIds0, const float* counts0, size_t n0,
+    const GeneId* geneIds1, const float* counts1, size_t n1)
+{
+    return scalarProductAvx2<1>(geneIds0, counts0, n0, geneIds1, counts1, n1);
+}
+
+
+
+ScalarProductKernel SparseKernels::getScalarProductKernel(string& instructionSetName)
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        instructionSetName = "AVX2";
+        return computeScalarProductAvx2;
+    }
+    instructionSetName = "SSE4.2";
+    return computeScalarProductSse;
+}
+SplitScalarProductKernel SparseKernels::getSplitScalarProductKernel(string& instructionSetName)
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        instructionSetName = "AVX2";
+        return computeSplitScalarProductAvx2;
+    }
+    instructionSetName = "SSE4.2";
+    return computeSplitScalarProductSse;
+}
+
+
+
+// Function local statics are initialized once, in a thread safe way.
+double SparseKernels::computeScalarProduct(
+    const pair<GeneId, float>* begin0,
+    const pair<GeneId, float>* end0,
+    const pair<GeneId, float>* begin1,
+    const pair<GeneId, float>* end1)
+{
+    static string instructionSetName;
+    static const ScalarProductKernel kernel = getScalarProductKernel(instructionSetName);
+    return kernel(begin0, end0, begin1, end1);
+}
+double SparseKernels::computeScalarProduct(
+    const GeneId* geneIds0, const float* counts0, size_t n0,
+    const GeneId* geneIds1, const float* counts1, size_t n1)
+{
+    static string instructionSetName;
+    static const SplitScalarProductKernel kernel = getSplitScalarProductKernel(instructionSetName);
+    return kernel(geneIds0, counts0, n0, geneIds1, counts1, n1);
+}
@@ -0,0 +1,83 @@
+// Low level SIMD kernels for sparse expression vectors.
+
+#ifndef CZI_EXPRESSION_MATRIX2_SPARSE_KERNELS_HPP
+#define CZI_EXPRESSION_MATRIX2_SPARSE_KERNELS_HPP
+
+#include "Ids.hpp"
+
+#include "cstddef.hpp"
+#include "string.hpp"
+#include "utility.hpp"
+
+namespace ChanZuckerberg {
+    namespace ExpressionMatrix2 {
+        namespace SparseKernels {
+
+            // Kernels to compute the scalar product of two sparse expression vectors,
+            // each stored as (GeneId, count) sorted by increasing GeneId.
+            // The kernels find matching gene ids in blocks using a sorted set
+            // intersection, comparing all gene ids in a block of the first vector
+            // with all gene ids in a block of the second vector using SIMD rotations
+            // (see D. Lemire, N. Kurz, L. Boytsov, "SIMD Compression and the
+            // Intersection of Sorted Integers", 2016, and B. Schlegel, T. Willhalm,
+            // W. Lehner, "Fast Sorted-Set Intersection using SIMD Instructions", 2011).
+            // Products of matching counts are computed in single precision
+            // and accumulated in double precision in order of increasing GeneId,
+            // so all kernels return the same result as a scalar merge.
+            // There are two versions of each kernel:
+            // - For vectors stored as arrays of pairs (GeneId, count).
+            // - For vectors stored as separate arrays of GeneIds and counts
+            //   (see MemoryMapped::SplitVectorOfVectors).
+            typedef double (*ScalarProductKernel)(
+                const pair<GeneId, float>* begin0,
+                const pair<GeneId, float>* end0,
+                const pair<GeneId, float>* begin1,
+                const pair<GeneId, float>* end1);
+            typedef double (*SplitScalarProductKernel)(
+                const GeneId* geneIds0,
+                const float* counts0,
+                size_t n0,
+                const GeneId* geneIds1,
+                const float* counts1,
+                size_t n1);
+
+            // Return the scalar product kernels for the best instruction set
+            // supported by the processor we are running on
+            // (AVX2 or SSE4.2), and store its name.
+            ScalarProductKernel getScalarProductKernel(string& instructionSetName);
+            SplitScalarProductKernel getSplitScalarProductKernel(string& instructionSetName);
+
+            // Compute the scalar product using the kernels returned by
+            // getScalarProductKernel and getSplitScalarProductKernel,
+            // which are selected on the first call.
+            double computeScalarProduct(
+                const pair<GeneId, float>* begin0,
+                const pair<GeneId, float>* end0,
+                const pair<GeneId, float>* begin1,
+                const pair<GeneId, float>* end1);
+            double computeScalarProduct(
+                const GeneId* geneIds0,
+                const float* counts0,
+                size_t n0,
+                const GeneId* geneIds1,
+                const float* counts1,
+                size_t n1);
+
+            // The individual kernels.
+            double computeScalarProductSse(
+                const pair<GeneId, float>*, const pair<GeneId, float>*,
+                const pair<GeneId, float>*, const pair<GeneId, float>*);
+            double computeScalarProductAvx2(
+                const pair<GeneId, float>*, const pair<GeneId, float>*,
+                const pair<GeneId, float>*, const pair<GeneId, float>*);
+            double computeSplitScalarProductSse(
+                const GeneId*, const float*, size_t,
+                const GeneId*, const float*, size_t);
+            double computeSplitScalarProductAvx2(
+                const GeneId*, const float*, size_t,
+                const GeneId*, const float*, size_t);
+        }
+    }
+}
+
+#endif